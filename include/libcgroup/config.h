@@ -36,6 +36,102 @@ extern "C" {
  */
 int cgroup_config_load_config(const char *pathname);
 
+/**
+ * Load configuration file like cgroup_config_load_config(), creating the
+ * control groups with several threads.  A group is created once its parent
+ * group is, groups in different subtrees are created at the same time.  When
+ * a group fails, the groups left are not created and all the groups of the
+ * file are deleted, like with cgroup_config_load_config().
+ * @param pathname Name of the configuration file to load.
+ * @param jobs Number of threads creating the groups, 0 for the number of
+ *	online CPUs, 1 to create the groups one after another.
+ */
+int cgroup_config_load_config2(const char *pathname, int jobs);
+
+/**
+ * Flags for cgroup_config_reload_config().
+ */
+enum cgroup_reload_flag {
+	/**
+	 * Only report the operations of the reload, don't change anything.
+	 */
+	CGFLAG_RELOAD_DRY_RUN = 1,
+
+	/**
+	 * Delete the subgroups of the groups of the configuration file that
+	 * the file doesn't define.
+	 */
+	CGFLAG_RELOAD_PRUNE = 2,
+};
+
+/**
+ * Type of an operation of cgroup_config_reload_config().
+ */
+enum cgroup_reload_op_type {
+	CGROUP_RELOAD_CREATE,	/**< Create a group with all its settings */
+	CGROUP_RELOAD_SET,	/**< Write a setting of an existing group */
+	CGROUP_RELOAD_DELETE,	/**< Delete a group and its subgroups */
+};
+
+/**
+ * An operation of cgroup_config_reload_config().
+ */
+struct cgroup_reload_op {
+	enum cgroup_reload_op_type type;
+	/** Name of the group */
+	const char *cgroup;
+	/** Controller of the setting or of the deleted group, NULL on creation */
+	const char *controller;
+	/** Name of the setting, CGROUP_RELOAD_SET only */
+	const char *name;
+	/** Current value of the setting, NULL if it can't be read */
+	const char *old_value;
+	/** Value of the setting in the configuration file */
+	const char *value;
+};
+
+/**
+ * Callback of cgroup_config_reload_config(), called for each operation before
+ * it is done.
+ */
+typedef void (*cgroup_reload_cb)(const struct cgroup_reload_op *op, void *arg);
+
+/**
+ * Apply a configuration file to the groups already in place: create the
+ * groups that don't exist and write only the settings whose current value
+ * differs from the file.  The values are compared as strings, or as numbers
+ * of bytes when both are sizes like "1G".  The ownership and permissions of
+ * existing groups aren't changed.
+ *
+ * Unlike cgroup_config_load_config(), the hierarchies are not mounted and a
+ * failure doesn't delete the groups of the file, the operations done so far
+ * are kept.
+ *
+ * @param pathname Name of the configuration file to load.
+ * @param flags Combination of CGFLAG_RELOAD_* flags.
+ * @param cb Called for each operation, may be NULL.
+ * @param arg Passed to cb.
+ */
+int cgroup_config_reload_config(const char *pathname, int flags, cgroup_reload_cb cb,
+				void *arg);
+
+/**
+ * Apply several configuration files like cgroup_config_reload_config(), one
+ * after another.  With CGFLAG_RELOAD_PRUNE, the subgroups that none of the
+ * files defines are deleted once all the files are applied, and nothing is
+ * deleted if a file fails.  The files after a failed one are still applied.
+ *
+ * @param pathnames Names of the configuration files to load.
+ * @param cnt Number of files.
+ * @param flags Combination of CGFLAG_RELOAD_* flags.
+ * @param cb Called for each operation, may be NULL.
+ * @param arg Passed to cb.
+ * @param fileindex Set to the index of the first file that failed, -1 if
+ *	none did, may be NULL.
+ */
+int cgroup_config_reload_configs(const char * const *pathnames, int cnt, int flags,
+				 cgroup_reload_cb cb, void *arg, int *fileindex);
+
 /**
  * Delete all control groups and unmount all hierarchies.
  */
@@ -8,6 +8,7 @@
 
 #ifndef SWIG
 #include <sys/types.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <features.h>
 #endif
@@ -264,6 +265,273 @@ int cgroup_read_stats_next(void **handle, struct cgroup_stat *stat);
  */
 int cgroup_read_stats_end(void **handle);
 
+/**
+ * @}
+ *
+ * @name Poll control files
+ * The functions above open, parse and close the control file on every call.
+ * An application which reads the same files of a group again and again, e.g.
+ * memory.current or cpu.stat every second, can open them once with a
+ * cgroup handle and read their current content with pread(), without building
+ * the path or allocating memory.
+ * @par Example:
+ * @code
+ * struct cgroup_handle *handle;
+ * char buffer[4096];
+ * int current, stat;
+ * int ret;
+ * ret = cgroup_handle_open("memory", "foo", &handle);
+ * if (!ret)
+ *	ret = cgroup_handle_add_file(handle, "memory.current", &current);
+ * if (!ret)
+ *	ret = cgroup_handle_add_file(handle, "memory.stat", &stat);
+ * while (!ret) {
+ *	ret = cgroup_handle_read_file(handle, current, buffer, sizeof(buffer), NULL);
+ *	// process the value here and read the other files
+ *	sleep(1);
+ * }
+ * cgroup_handle_close(&handle);
+ * @endcode
+ * @{
+ */
+
+/**
+ * Opaque handle of a group whose control files are kept open.
+ */
+struct cgroup_handle;
+
+/**
+ * Open a control group to poll its control files.
+ * @param controller Name of the controller, the hierarchy of the group.
+ * @param path The path to control group, relative to hierarchy root.
+ * @param handle Returned handle, to be released with cgroup_handle_close().
+ * @return #ECGROUPNOTEXIST when the group does not exist.
+ */
+int cgroup_handle_open(const char * const controller, const char * const path,
+		       struct cgroup_handle **handle);
+
+/**
+ * Open a control file of the group and keep it open until the handle is
+ * closed.
+ * @param handle The handle returned by cgroup_handle_open().
+ * @param name Name of the control file, e.g. "cpu.stat".
+ * @param index Returned index of the file, for cgroup_handle_read_file().
+ * @return #ECGROUPVALUENOTEXIST when the group has no such file.
+ */
+int cgroup_handle_add_file(struct cgroup_handle *handle, const char * const name, int *index);
+
+/**
+ * Read the whole current content of a control file opened with
+ * cgroup_handle_add_file(). A content longer than max-1 characters is
+ * truncated. Different files of a handle can be read from different threads.
+ * @param handle The handle returned by cgroup_handle_open().
+ * @param index The index of the file.
+ * @param buffer The buffer to read the content into.
+ * The buffer is always zero-terminated.
+ * @param max Maximal length of the buffer.
+ * @param len Returned length of the content in the buffer, may be NULL.
+ */
+int cgroup_handle_read_file(struct cgroup_handle *handle, int index, char *buffer, int max,
+			    int *len);
+
+/**
+ * Close the control files of the handle and release it.
+ * @param handle The handle returned by cgroup_handle_open(), set to NULL.
+ */
+void cgroup_handle_close(struct cgroup_handle **handle);
+
+/**
+ * @}
+ *
+ * @name Parse stat files
+ * A cgroup_stat_parser turns the content of a flat keyed or nested keyed
+ * stat file into an array of typed values. The parser interns the key of
+ * each value and returns its id rather than its name, so that the values can
+ * be matched with a lookup table. A parser reuses its buffers, a file which
+ * was parsed once is parsed again without any allocation.
+ *
+ * The keys are named like the keys of cgroup_snapshot_subtree(), without
+ * the file name:
+ * - <tt>4096</tt> in memory.current is the empty key.
+ * - <tt>anon 4096</tt> in memory.stat is the key @c anon.
+ * - <tt>8:0 rbytes=4096 wbytes=0</tt> in io.stat are the keys
+ *   @c 8:0:rbytes and @c 8:0:wbytes.
+ *
+ * Values which are neither unsigned integers, @c max nor decimal numbers are
+ * left out.
+ * @{
+ */
+
+/**
+ * Type of a value of a stat file.
+ */
+enum cgroup_stat_type {
+	/** An unsigned integer */
+	CGROUP_STAT_TYPE_UINT,
+	/** @c max, the value is @c UINT64_MAX */
+	CGROUP_STAT_TYPE_MAX,
+	/** A decimal number, e.g. @c avg10=0.25 in the PSI files, in hundredths */
+	CGROUP_STAT_TYPE_DECIMAL,
+};
+
+/**
+ * One value of a stat file.
+ */
+struct cgroup_stat_value {
+	/** The id of the key, see cgroup_stat_parser_key_name() */
+	uint32_t key;
+	enum cgroup_stat_type type;
+	uint64_t value;
+};
+
+/**
+ * Opaque parser of stat files.
+ */
+struct cgroup_stat_parser;
+
+/**
+ * Allocate a stat parser. A parser must not be used by several threads at
+ * the same time.
+ * @param parser Returned parser, to be released with cgroup_stat_parser_free().
+ */
+int cgroup_stat_parser_new(struct cgroup_stat_parser **parser);
+
+/**
+ * Release a stat parser and the values and key names it returned.
+ * @param parser The parser, set to NULL.
+ */
+void cgroup_stat_parser_free(struct cgroup_stat_parser **parser);
+
+/**
+ * Get the id of a key, e.g. to look up the ids of the keys of interest
+ * before parsing. The ids of a parser never change.
+ * @param parser The parser.
+ * @param name Name of the key, e.g. "anon" or "8:0:rbytes".
+ * @param key Returned id of the key.
+ */
+int cgroup_stat_parser_key(struct cgroup_stat_parser *parser, const char * const name,
+			   uint32_t *key);
+
+/**
+ * Get the name of a key.
+ * @param parser The parser.
+ * @param key The id of the key.
+ * @return The name, valid until the parser is released, or NULL for an
+ * unknown id.
+ */
+const char *cgroup_stat_parser_key_name(const struct cgroup_stat_parser *parser, uint32_t key);
+
+/**
+ * Parse the content of a stat file.
+ * @param parser The parser.
+ * @param buf The content of the file, it does not need to be zero-terminated.
+ * @param len Length of the content.
+ * @param values Returned values, in the order of the file. They are valid
+ * until the parser is used again.
+ * @param cnt Returned number of values.
+ */
+int cgroup_stat_parse(struct cgroup_stat_parser *parser, const char *buf, size_t len,
+		      const struct cgroup_stat_value **values, int *cnt);
+
+/**
+ * Read and parse a stat file of a group. Unlike cgroup_read_stats_begin(),
+ * the file can be of any length.
+ * @param parser The parser.
+ * @param controller Name of the controller, the hierarchy of the group.
+ * @param path The path to control group, relative to hierarchy root.
+ * @param name Name of the stat file, e.g. "memory.stat".
+ * @param values Returned values, see cgroup_stat_parse().
+ * @param cnt Returned number of values.
+ * @return #ECGROUPVALUENOTEXIST when the group has no such file.
+ */
+int cgroup_stat_read(struct cgroup_stat_parser *parser, const char * const controller,
+		     const char * const path, const char * const name,
+		     const struct cgroup_stat_value **values, int *cnt);
+
+/**
+ * Read and parse a stat file opened with cgroup_handle_add_file().
+ * @param handle The handle returned by cgroup_handle_open().
+ * @param index The index of the file.
+ * @param parser The parser.
+ * @param values Returned values, see cgroup_stat_parse().
+ * @param cnt Returned number of values.
+ */
+int cgroup_handle_read_stat(struct cgroup_handle *handle, int index,
+			    struct cgroup_stat_parser *parser,
+			    const struct cgroup_stat_value **values, int *cnt);
+
+/**
+ * @}
+ *
+ * @name Snapshot the stats of a subtree
+ * cgroup_snapshot_subtree() reads a set of control files of every group of a
+ * subtree, e.g. memory.current and memory.stat, and returns their numeric
+ * values in one flat array. The tree is walked once and the files are read
+ * by a pool of threads.
+ *
+ * The content of each file is split in lines of space separated fields and
+ * each numeric value gets a key named after the file:
+ * - <tt>4096</tt> in memory.current is the key @c memory.current.
+ * - <tt>anon 4096</tt> in memory.stat is the key @c memory.stat:anon.
+ * - <tt>8:0 rbytes=4096 wbytes=0</tt> in io.stat are the keys
+ *   @c io.stat:8:0:rbytes and @c io.stat:8:0:wbytes.
+ *
+ * @c max is returned as @c UINT64_MAX, values which are not unsigned integers
+ * are left out.
+ * @{
+ */
+
+/**
+ * One value of a snapshot.
+ */
+struct cgroup_snapshot_record {
+	/** Index of the group in cgroup_snapshot.cgroups */
+	uint32_t cgroup;
+	/** Index of the key in cgroup_snapshot.keys */
+	uint32_t key;
+	uint64_t value;
+};
+
+/**
+ * The values of a subtree, returned by cgroup_snapshot_subtree().
+ */
+struct cgroup_snapshot {
+	/**
+	 * The groups, relative to the hierarchy root, in pre-order: the base
+	 * group first and every group before its children.
+	 */
+	char **cgroups;
+	int cgroup_cnt;
+	/** The names of the keys */
+	char **keys;
+	int key_cnt;
+	/** The values, ordered by group */
+	struct cgroup_snapshot_record *records;
+	int record_cnt;
+};
+
+/**
+ * Read the values of control files of a group and all its descendants.
+ * The files of groups which disappear while the snapshot is taken are left
+ * out.
+ * @param controller Name of the controller, the hierarchy of the subtree.
+ * @param base The path to the root of the subtree, relative to hierarchy root.
+ * @param files NULL terminated array of the control files to read.
+ * @param threads Number of threads reading the files, 0 for the number of
+ * online CPUs, up to 8.
+ * @param snapshot Returned snapshot, to be released with cgroup_snapshot_free().
+ * @return #ECGROUPNOTEXIST when the base group does not exist.
+ */
+int cgroup_snapshot_subtree(const char * const controller, const char * const base,
+			    const char * const files[], int threads,
+			    struct cgroup_snapshot **snapshot);
+
+/**
+ * Release a snapshot returned by cgroup_snapshot_subtree().
+ * @param snapshot The snapshot, set to NULL.
+ */
+void cgroup_snapshot_free(struct cgroup_snapshot **snapshot);
+
 /**
  * @}
  *
@@ -33,6 +33,81 @@ enum cgroup_daemon_type {
 	 */
 	CGROUP_DAEMON_UNCHANGE_CHILDREN       = 0x1,
 	CGROUP_DAEMON_CANCEL_UNCHANGE_PROCESS = 0x2,
+	/**
+	 * The daemon must not touch the next child of the given task, e.g.
+	 * the program cgroup_spawn() runs for it, unless the task runs a
+	 * program itself first.  The children of that child are moved by the
+	 * rules.
+	 */
+	CGROUP_DAEMON_UNCHANGE_SPAWNED        = 0x4,
+};
+
+/** Flags for cgroup_attach_tasks(). */
+enum cgroup_attach_flags {
+	/**
+	 * Write the PIDs to cgroup.procs, which moves all the threads of the
+	 * processes, instead of the task files of cgroup_attach_task_pid().
+	 */
+	CGROUP_ATTACH_PROCS = 0x1,
+};
+
+/** Statistics of cgroup_change_all_cgroups2(). */
+struct cgroup_sweep_stats {
+	/** The number of threads that matched the processes */
+	int threads;
+	/** The processes found in /proc that were still running */
+	unsigned long procs;
+	/** The moves of a process to the destination of a rule */
+	unsigned long moved;
+	/** The duration of the sweep in microseconds */
+	unsigned long long elapsed_us;
+};
+
+/** Flags for cgroup_spawn(). */
+enum cgroup_spawn_flags {
+	/**
+	 * Only run the program if the child can be created in its control
+	 * group with CLONE_INTO_CGROUP, else return ECGROUPUNSUPP without
+	 * creating it.
+	 */
+	CGROUP_SPAWN_CLONE_ONLY = 0x1,
+};
+
+/** A control group of cgroup_spawn(), with the controllers to use it for. */
+struct cgroup_spawn_dest {
+	/** The path of the control group */
+	const char *path;
+	/**
+	 * The controllers, "*" for all the mounted ones, NULL for the only
+	 * hierarchy of cgroup v2
+	 */
+	const char * const *controllers;
+};
+
+/** Options of cgroup_spawn(). */
+struct cgroup_spawn_opts {
+	/**
+	 * The control groups to run the program in, NULL to look them up in
+	 * the rules like cgroup_change_cgroup_flags() does
+	 */
+	const struct cgroup_spawn_dest *dests;
+	int dest_cnt;
+	/** The UID and GID matched against the rules */
+	uid_t uid;
+	gid_t gid;
+	/** Bit flags for the rules, as defined in enum #cgflags */
+	int flags;
+	/**
+	 * Called with @c arg and the PID of the child once it is in its
+	 * control groups, before it runs the program.  The child exits if it
+	 * returns an error, which cgroup_spawn() returns.  May be NULL.
+	 */
+	int (*prepare)(pid_t pid, void *arg);
+	void *arg;
+	/** Bit flags of the spawn, as defined in enum #cgroup_spawn_flags */
+	int spawn_flags;
+	/** The signal the child gets when the caller exits, 0 for none */
+	int pdeathsig;
 };
 
 /**
@@ -58,6 +133,24 @@ int cgroup_attach_task(struct cgroup *cgrp);
  */
 int cgroup_attach_task_pid(struct cgroup *cgrp, pid_t tid);
 
+/**
+ * Move given tasks to given control group.  The files of the group are
+ * opened once and the tasks are written to them one after the other,
+ * a failure of one task doesn't stop the others.
+ * @param cgrp Destination control group, NULL for the root group.
+ * @param pids The tasks to move.
+ * @param n The number of tasks.
+ * @param flags Bit flags to change the behavior, as defined in enum
+ *	#cgroup_attach_flags
+ * @param per_pid_err If not NULL, an array of @p n errors, set to 0 for
+ *	each task moved and to the errno of its failure otherwise (e.g.
+ *	ESRCH for a task that exited).
+ * @return 0 on success, #ECGOTHER if a task couldn't be written, or the
+ *	error opening a file of the group.
+ */
+int cgroup_attach_tasks(struct cgroup *cgrp, const pid_t * const pids, size_t n, int flags,
+			int * const per_pid_err);
+
 /**
  * Changes the cgroup of a task based on the path provided.  In this case,
  * the user must already know into which cgroup the task should be placed and
@@ -103,6 +196,23 @@ int cgroup_init_rules_cache(void);
  */
 int cgroup_reload_cached_rules(void);
 
+/**
+ * Initializes the rules cache like cgroup_init_rules_cache() and publishes
+ * the rules in a shared memory segment, published again by each
+ * cgroup_reload_cached_rules().  While the segment matches the configuration
+ * files, the other processes read the rules from it instead of parsing the
+ * files.  A failure to publish the rules is only logged.  Meant for
+ * cgrulesengd, the segment can be created by root only.
+ *	@return 0 on success, > 0 on error
+ */
+int cgroup_publish_cached_rules(void);
+
+/**
+ * Removes the segment published by cgroup_publish_cached_rules(), the other
+ * processes parse the files again.
+ */
+void cgroup_unpublish_cached_rules(void);
+
 /**
  * Print the cached rules table.  This function should be called only after
  * first calling cgroup_parse_config(), but it will work with an empty rule
@@ -132,6 +242,38 @@ void cgroup_print_rules_config(FILE *fp);
  */
 int cgroup_change_all_cgroups(void);
 
+/**
+ * Changes the cgroup of a list of processes based on the rules in the config
+ * file, like cgroup_change_cgroup_flags() does for each of them.  The rules
+ * are parsed and indexed once for the whole list, into the rules cache
+ * unless @c CGFLAG_USECACHE is set and the rules are already cached.  The
+ * processes moved to the same control group are written together to its
+ * cgroup.procs files, which moves all their threads.
+ *
+ *	@param pids The PIDs of the processes, NULL for all the processes in
+ *	/proc
+ *	@param pid_cnt The number of PIDs, 0 if @p pids is NULL
+ *	@param flags Bit flags to change the behavior, as defined in enum #cgflags
+ *	@return 0 on success, the first error otherwise.  The processes in /proc
+ *	that exit meanwhile are skipped.
+ */
+int cgroup_change_cgroups_batch(const pid_t * const pids, int pid_cnt, int flags);
+
+/**
+ * Changes the cgroup of all the processes in /proc based on the rules in the
+ * config file, like cgroup_change_cgroups_batch() with a NULL list does.  The
+ * processes are matched against the cached rules by a pool of threads, then
+ * the processes going to the same control group are moved together.
+ *
+ *	@param flags Bit flags to change the behavior, as defined in enum #cgflags
+ *	@param threads The number of threads, 0 or less for one per online CPU
+ *	@param stats Filled with the statistics of the sweep, even on error, if
+ *	not NULL
+ *	@return 0 on success, the first error otherwise.  The processes that exit
+ *	meanwhile are skipped.
+ */
+int cgroup_change_all_cgroups2(int flags, int threads, struct cgroup_sweep_stats * const stats);
+
 /**
  * Changes the cgroup of a program based on the rules in the config file.
  * If a rule exists for the given UID, GID or PROCESS NAME, then the given
@@ -179,6 +321,48 @@ int cgroup_change_cgroup_uid_gid_flags(uid_t uid, gid_t gid, pid_t pid, int flag
  */
 int cgroup_change_cgroup_uid_gid(uid_t uid, gid_t gid, pid_t pid);
 
+/**
+ * Get the effective UID and GID and the name of a process from /proc, as
+ * needed by cgroup_change_cgroup_flags(). The process name is the full
+ * path of its executable, or of the script it runs. This function is
+ * thread safe.
+ * @param pid The PID of the process.
+ * @param euid The effective UID of the process, may be NULL.
+ * @param egid The effective GID of the process, may be NULL.
+ * @param procname The name of the process, may be NULL. The caller must
+ *	free it.
+ * @return 0 on success, ECGROUPNOTEXIST if the process does not exist.
+ */
+int cgroup_get_proc_identity(pid_t pid, uid_t *euid, gid_t *egid, char **procname);
+
+/**
+ * Run a program in a new process placed in its control groups before it runs.
+ * On cgroup v2, the child is created in its control group with clone3() and
+ * CLONE_INTO_CGROUP, so it never runs anywhere else and isn't moved.  The
+ * control groups on cgroup v1, several control groups, a kernel without
+ * CLONE_INTO_CGROUP or a rule whose destination contains %P fall back to
+ * moving the child like cgroup_change_cgroup_path() or
+ * cgroup_change_cgroup_flags() do before it runs the program, unless
+ * CGROUP_SPAWN_CLONE_ONLY is set.
+ *
+ * The child searches the program in PATH like execvp() does.  The caller
+ * should be single threaded, or the child must not need the locks of the
+ * other threads: it only waits for the caller and runs the program.
+ *
+ * @param file The program to run, matched as the process name of the rules.
+ * @param argv The arguments of the program, terminated by NULL.
+ * @param opts The control groups, or the identity matched against the rules.
+ * @param pid The PID of the child, may be NULL.
+ * @param pidfd A PID file descriptor of the child, closed on exec, or -1 if
+ *	the kernel doesn't support them.  May be NULL.
+ * @return 0 once the child runs the program, ECGOTHER with the errno of the
+ *	child if it couldn't, ECGROUPUNSUPP with CGROUP_SPAWN_CLONE_ONLY if it
+ *	can't be created in its control group, the error of the control groups
+ *	otherwise.  The child has been reaped when an error is returned.
+ */
+int cgroup_spawn(const char *file, char * const argv[], const struct cgroup_spawn_opts * const opts,
+		 pid_t * const pid, int * const pidfd);
+
 /**
  * @}
  * @name Communication with cgrulesengd daemon
@@ -30,6 +30,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <libgen.h>
+#include <signal.h>
 #include <assert.h>
 #include <errno.h>
 #include <stdio.h>
@@ -37,14 +38,18 @@
 #include <ctype.h>
 #include <fts.h>
 #include <pwd.h>
+#include <poll.h>
 #include <grp.h>
 
 #include <sys/syscall.h>
 #include <sys/socket.h>
+#include <sys/prctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <sys/vfs.h>
 
+#include <linux/sched.h>
 #include <linux/un.h>
 
 const struct cgroup_library_version library_version = {
@@ -70,14 +75,20 @@ static __thread char errtext[MAXLEN];
 static int cgroup_initialized;
 
 /* List of configuration rules */
-static struct cgroup_rule_list rl;
+STATIC struct cgroup_rule_list rl;
 
 /* Temporary list of configuration rules (for non-cache apps) */
 static struct cgroup_rule_list trl;
 
-/* Lock for the list of rules (rl) */
+/* Index of the cached rules, rebuilt whenever rl is parsed */
+static struct cgroup_rule_index rl_index;
+
+/* Lock for the list of rules (rl) and its index (rl_index) */
 static pthread_rwlock_t rl_lock = PTHREAD_RWLOCK_INITIALIZER;
 
+/* Publish rl in CGRULES_SHM_NAME whenever it is parsed, under rl_lock */
+static bool rl_publish;
+
 /* Cgroup v2 mount path.  Null if v2 isn't mounted */
 char cg_cgroup_v2_mount_path[FILENAME_MAX];
 
@@ -90,6 +101,19 @@ struct cg_mount_table_s cg_mount_table[CG_CONTROLLER_MAX];
 /* Cgroup v2 mount paths, with empty controllers */
 struct cg_mount_point *cg_cgroup_v2_empty_mount_paths;
 
+/*
+ * Cached result of the "is any cgroup filesystem mounted" check, -1 when
+ * unknown, and the /proc/self/mounts fd polled for mount table changes.
+ * The fd is dropped in the child of a fork(), see cg_mounts_atfork_child().
+ */
+static pthread_mutex_t cg_mounted_fs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t cg_mounts_atfork_once = PTHREAD_ONCE_INIT;
+static int cg_mounted_fs = -1;
+static int cg_mounts_fd = -1;
+
+/* Updated with relaxed atomics, the unit tests check them */
+STATIC struct cg_attach_stats cg_attach_stats;
+
 #ifdef WITH_SYSTEMD
 /* Default systemd path name. Length: <name>.slice/<name>.scope */
 char systemd_default_cgroup[FILENAME_MAX * 2 + 1];
@@ -486,6 +510,255 @@ static void cgroup_free_rule_list(struct cgroup_rule_list *cg_rl)
 	cg_rl->tail = NULL;
 }
 
+/* A (UID or GID, rule position) pair, used while building an index */
+struct cg_rule_key {
+	unsigned int key;
+	int pos;
+};
+
+struct cg_rule_keys {
+	struct cg_rule_key *keys;
+	int cnt;
+	int alloc;
+};
+
+static int cg_rule_keys_add(struct cg_rule_keys * const keys, unsigned int key, int pos)
+{
+	struct cg_rule_key *tmp;
+	int alloc;
+
+	if (keys->cnt >= keys->alloc) {
+		alloc = keys->alloc ? keys->alloc * 2 : 64;
+		tmp = realloc(keys->keys, alloc * sizeof(*tmp));
+		if (!tmp) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+
+		keys->keys = tmp;
+		keys->alloc = alloc;
+	}
+
+	keys->keys[keys->cnt].key = key;
+	keys->keys[keys->cnt].pos = pos;
+	keys->cnt++;
+
+	return 0;
+}
+
+static int cg_rule_key_cmp(const void *p1, const void *p2)
+{
+	const struct cg_rule_key *k1 = p1, *k2 = p2;
+
+	if (k1->key != k2->key)
+		return k1->key < k2->key ? -1 : 1;
+
+	return k1->pos - k2->pos;
+}
+
+static void cg_free_rule_csr(struct cgroup_rule_csr * const csr)
+{
+	free(csr->keys);
+	free(csr->start);
+	free(csr->pos);
+	memset(csr, 0, sizeof(*csr));
+}
+
+/*
+ * Sort the pairs and pack them into csr, dropping duplicates so that a
+ * rule shows up at most once per key.
+ */
+static int cg_build_rule_csr(struct cg_rule_keys * const keys,
+			     struct cgroup_rule_csr * const csr)
+{
+	int i, pos_cnt = 0;
+
+	memset(csr, 0, sizeof(*csr));
+
+	qsort(keys->keys, keys->cnt, sizeof(*keys->keys), cg_rule_key_cmp);
+
+	csr->keys = malloc((keys->cnt + 1) * sizeof(*csr->keys));
+	csr->start = malloc((keys->cnt + 1) * sizeof(*csr->start));
+	csr->pos = malloc((keys->cnt + 1) * sizeof(*csr->pos));
+	if (!csr->keys || !csr->start || !csr->pos) {
+		last_errno = errno;
+		cg_free_rule_csr(csr);
+		return ECGOTHER;
+	}
+
+	for (i = 0; i < keys->cnt; i++) {
+		if (i && keys->keys[i].key == keys->keys[i - 1].key) {
+			if (keys->keys[i].pos == keys->keys[i - 1].pos)
+				continue;
+		} else {
+			csr->keys[csr->key_cnt] = keys->keys[i].key;
+			csr->start[csr->key_cnt] = pos_cnt;
+			csr->key_cnt++;
+		}
+
+		csr->pos[pos_cnt++] = keys->keys[i].pos;
+	}
+	csr->start[csr->key_cnt] = pos_cnt;
+
+	return 0;
+}
+
+/* Find the positions of the rules of key, returns their count */
+static int cg_rule_csr_find(const struct cgroup_rule_csr * const csr, unsigned int key,
+			    const int **pos)
+{
+	int lo = 0, hi = csr->key_cnt, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+
+		if (csr->keys[mid] < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == csr->key_cnt || csr->keys[lo] != key)
+		return 0;
+
+	*pos = &csr->pos[csr->start[lo]];
+
+	return csr->start[lo + 1] - csr->start[lo];
+}
+
+/*
+ * Add the members of the group of a @group rule to the UID keys. A member
+ * matches only if it is the name getpwuid() returns for its UID, the same
+ * as cgroup_find_matching_rule_uid_gid() does.
+ */
+static int cg_rule_index_group_members(const struct cgroup_rule * const rule, int pos,
+				       struct cg_rule_keys * const uid_keys)
+{
+	struct passwd *usr;
+	struct group *grp;
+	uid_t uid;
+	int i, ret;
+
+	grp = getgrnam(&rule->username[1]);
+	if (!grp)
+		return 0;
+
+	for (i = 0; grp->gr_mem[i]; i++) {
+		usr = getpwnam(grp->gr_mem[i]);
+		if (!usr)
+			continue;
+
+		uid = usr->pw_uid;
+		usr = getpwuid(uid);
+		if (!usr || strcmp(usr->pw_name, grp->gr_mem[i]))
+			continue;
+
+		ret = cg_rule_keys_add(uid_keys, uid, pos);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * Free an index built by cgroup_build_rule_index(). The rules themselves
+ * are owned by the list and left alone.
+ *	@param idx The index to free
+ */
+STATIC void cgroup_free_rule_index(struct cgroup_rule_index * const idx)
+{
+	free(idx->rules);
+	cg_free_rule_csr(&idx->uid);
+	cg_free_rule_csr(&idx->gid);
+	free(idx->wild);
+	memset(idx, 0, sizeof(*idx));
+}
+
+/**
+ * Compile a list of rules into an index, so that the rules matching a
+ * UID/GID pair can be found without walking the whole list. Membership of
+ * @group rules is resolved here, once, instead of on every lookup. Rules
+ * keep their list position in the index, so the first match is the same
+ * as with cgroup_find_matching_rule_uid_gid().
+ *	@param lst The list of rules to index
+ *	@param idx The index to fill, empty on failure
+ *	@return 0 on success, ECGOTHER on failure
+ */
+STATIC int cgroup_build_rule_index(const struct cgroup_rule_list * const lst,
+				   struct cgroup_rule_index * const idx)
+{
+	struct cg_rule_keys uid_keys = { 0 }, gid_keys = { 0 };
+	struct cgroup_rule *rule;
+	int cnt = 0, pos;
+	int ret = 0;
+
+	memset(idx, 0, sizeof(*idx));
+
+	for (rule = lst->head; rule; rule = rule->next)
+		cnt++;
+
+	idx->rules = malloc((cnt + 1) * sizeof(*idx->rules));
+	idx->wild = malloc((cnt + 1) * sizeof(*idx->wild));
+	if (!idx->rules || !idx->wild) {
+		last_errno = errno;
+		ret = ECGOTHER;
+		goto err;
+	}
+
+	for (pos = 0, rule = lst->head; rule; pos++, rule = rule->next) {
+		idx->rules[pos] = rule;
+
+		/* "%" rules are continuations and never match on their own */
+		if (rule->username[0] == '%')
+			continue;
+
+		if (rule->uid == CGRULE_WILD && rule->gid == CGRULE_WILD) {
+			idx->wild[idx->wild_cnt++] = pos;
+			continue;
+		}
+
+		if (rule->uid != CGRULE_INVALID && rule->uid != CGRULE_WILD) {
+			ret = cg_rule_keys_add(&uid_keys, rule->uid, pos);
+			if (ret)
+				goto err;
+		}
+
+		if (rule->gid != CGRULE_INVALID && rule->gid != CGRULE_WILD) {
+			ret = cg_rule_keys_add(&gid_keys, rule->gid, pos);
+			if (ret)
+				goto err;
+		}
+
+		if (rule->username[0] == '@') {
+			ret = cg_rule_index_group_members(rule, pos, &uid_keys);
+			if (ret)
+				goto err;
+		}
+	}
+	idx->rule_cnt = cnt;
+
+	ret = cg_build_rule_csr(&uid_keys, &idx->uid);
+	if (ret)
+		goto err;
+
+	ret = cg_build_rule_csr(&gid_keys, &idx->gid);
+	if (ret)
+		goto err;
+
+	cgroup_dbg("Indexed %d rules: %d UIDs, %d GIDs, %d wildcard rules\n",
+		   idx->rule_cnt, idx->uid.key_cnt, idx->gid.key_cnt, idx->wild_cnt);
+	goto out;
+
+err:
+	cgroup_free_rule_index(idx);
+out:
+	free(uid_keys.keys);
+	free(gid_keys.keys);
+
+	return ret;
+}
+
 static char *cg_skip_unused_charactors_in_rule(char *rule)
 {
 	char *itr;
@@ -624,6 +897,97 @@ STATIC int get_next_rule_field(char *rule, char *field, size_t field_len, bool e
 	return len;
 }
 
+static void cgroup_publish_rules_image(const void * const image, size_t size)
+{
+	if (cg_rules_shm_publish(image, size))
+		cgroup_warn("failed to publish the rules in %s: %s\n", CGRULES_SHM_NAME,
+			    strerror(last_errno));
+}
+
+/* Write the rules parsed from srcs to CGRULES_CACHE_FILE and publish them */
+static void cgroup_store_rules_cache(const struct cgroup_rule_list * const lst,
+				     const struct cg_rules_cache_sources * const srcs)
+{
+	size_t size;
+	void *image;
+
+	if (cg_rules_cache_build(lst, srcs, &image, &size)) {
+		cgroup_dbg("failed to compile the rules: %s\n", strerror(last_errno));
+		return;
+	}
+
+	if (geteuid() == 0 && cg_rules_cache_write(CGRULES_CACHE_FILE, image, size))
+		cgroup_dbg("failed to write %s: %s\n", CGRULES_CACHE_FILE, strerror(last_errno));
+
+	if (rl_publish)
+		cgroup_publish_rules_image(image, size);
+
+	free(image);
+}
+
+/*
+ * Resolve the user field of a rule through NSS: the UID of a user, the GID
+ * of an @group, CGRULE_WILD for *.  A % rule keeps the IDs of the rule it
+ * continues.  grp is set to the group of an @group rule, NULL otherwise.
+ *	@return false if the user or group doesn't exist
+ */
+static bool cgroup_resolve_rule_user(const char * const user, uid_t * const uid,
+				     gid_t * const gid, struct group ** const grp)
+{
+	struct passwd *pwd;
+
+	*grp = NULL;
+
+	if (user[0] == '@') {
+		*grp = getgrnam(&user[1]);
+		if (!*grp)
+			return false;
+
+		*uid = CGRULE_INVALID;
+		*gid = (*grp)->gr_gid;
+	} else if (user[0] == '*') {
+		*uid = CGRULE_WILD;
+		*gid = CGRULE_WILD;
+	} else if (user[0] != '%') {
+		pwd = getpwnam(user);
+		if (!pwd)
+			return false;
+
+		*uid = pwd->pw_uid;
+		*gid = CGRULE_INVALID;
+	}
+
+	return true;
+}
+
+/*
+ * Remove the rules of the users and groups that don't exist, and their %
+ * children, kept by a full parse for the compiled cache.  A resolved rule
+ * always has a valid or wildcard UID or GID.
+ */
+static void cgroup_drop_unresolved_rules(struct cgroup_rule_list * const lst)
+{
+	struct cgroup_rule *rule, *prev = NULL, *next;
+
+	for (rule = lst->head; rule; rule = next) {
+		next = rule->next;
+
+		if (rule->uid != CGRULE_INVALID || rule->gid != CGRULE_INVALID) {
+			prev = rule;
+			continue;
+		}
+
+		if (prev)
+			prev->next = next;
+		else
+			lst->head = next;
+		if (lst->tail == rule)
+			lst->tail = prev;
+
+		cgroup_free_rule(rule);
+	}
+}
+
 /**
  * Parse the configuration file that maps UID/GIDs to cgroups.  If ever the
  * configuration file is modified, applications should call this function to
@@ -637,6 +1001,8 @@ STATIC int get_next_rule_field(char *rule, char *field, size_t field_len, bool e
  * rl (global rules list).  If false, this function will only parse until it
  * finds a rule matching the given UID or GID.  It will store this rule in
  * trl, as well as any children rules (rules that begin with a %) that it has.
+ * When caching, the rules of the users and groups that don't exist are kept
+ * with an invalid UID and GID, see cgroup_drop_unresolved_rules().
  *
  * This function is NOT thread safe!
  *	@param filename configuration file to parse
@@ -735,7 +1101,10 @@ static int cgroup_parse_rules_file(char *filename, bool cache, uid_t muid, gid_t
 		 */
 		if (skipped && *itr == '%') {
 			cgroup_warn("skipped child of invalid rule, line %d.\n", linenum);
-			continue;
+			if (!cache)
+				continue;
+		} else {
+			skipped = false;
 		}
 
 		/* clear the buffer. */
@@ -746,7 +1115,6 @@ static int cgroup_parse_rules_file(char *filename, bool cache, uid_t muid, gid_t
 		 * If there is something left, it should be a rule.  Otherwise,
 		 * there's an error in the configuration file.
 		 */
-		skipped = false;
 
 		ret = get_next_rule_field(itr, key, CGRP_RULE_MAXKEY, true);
 		if (!ret) {
@@ -810,36 +1178,17 @@ static int cgroup_parse_rules_file(char *filename, bool cache, uid_t muid, gid_t
 			ret = -1;
 			goto close;
 		}
-		if (strncmp(user, "@", 1) == 0) {
-			/* New GID rule. */
-			itr = &(user[1]);
-			grp = getgrnam(itr);
-			if (grp) {
-				uid = CGRULE_INVALID;
-				gid = grp->gr_gid;
-			} else {
-				cgroup_warn("Entry for %s not found. Skipping rule on line %d.\n",
-					    itr, linenum);
-				skipped = true;
-				continue;
-			}
-		} else if (strncmp(user, "*", 1) == 0) {
-			/* Special wildcard rule. */
-			uid = CGRULE_WILD;
-			gid = CGRULE_WILD;
-		} else if (*itr != '%') {
-			/* New UID rule. */
-			pwd = getpwnam(user);
-			if (pwd) {
-				uid = pwd->pw_uid;
-				gid = CGRULE_INVALID;
-			} else {
-				cgroup_warn("Entry for %s not found. Skipping rule on line %d.\n",
-					    user, linenum);
-				skipped = true;
+		if (!cgroup_resolve_rule_user(user, &uid, &gid, &grp)) {
+			cgroup_warn("Entry for %s not found. Skipping rule on line %d.\n",
+				    user[0] == '@' ? &user[1] : user, linenum);
+			skipped = true;
+			if (!cache)
 				continue;
-			}
-		} /* Else, we're continuing another rule (UID/GID are okay). */
+
+			/* Cached for when the user or group exists */
+			uid = CGRULE_INVALID;
+			gid = CGRULE_INVALID;
+		}
 
 		/*
 		 * If we are not caching rules, then we need to check for a
@@ -996,6 +1345,112 @@ finish:
 	return ret;
 }
 
+/*
+ * Fill the rule list from a compiled cache of the configuration files, the
+ * same way cgroup_parse_rules_file() fills it parsing them: the user and
+ * group names are resolved here.  The return values are those of
+ * cgroup_parse_rules_file().
+ */
+static int cgroup_parse_rules_cache(const struct cg_rules_cache * const rcache, bool cache,
+				    uid_t muid, gid_t mgid, const char *mprocname)
+{
+	char muser[LOGIN_NAME_MAX] = { '\0' };
+	struct cgroup_rule_list *lst;
+	uid_t uid = CGRULE_INVALID;
+	gid_t gid = CGRULE_INVALID;
+	struct cgroup_rule *rule;
+	bool muser_found = false;
+	bool skipped = false;
+	const char *username;
+	const char *procname;
+	bool matched = false;
+	struct passwd *pwd;
+	struct group *grp;
+	char *mproc_base;
+	int i, j, cnt;
+
+	lst = cache ? &rl : &trl;
+	cnt = cg_rules_cache_rule_cnt(rcache);
+
+	for (i = 0; i < cnt; i++) {
+		username = cg_rules_cache_rule_username(rcache, i);
+
+		/* The matching rule and its children are in trl */
+		if (!cache && matched && username[0] != '%')
+			return -1;
+
+		/* The children of a skipped rule are skipped too */
+		if (skipped && username[0] == '%')
+			continue;
+		skipped = false;
+
+		if (!cgroup_resolve_rule_user(username, &uid, &gid, &grp)) {
+			cgroup_warn("Entry for %s not found. Skipping rule.\n",
+				    username[0] == '@' ? &username[1] : username);
+			skipped = true;
+			continue;
+		}
+
+		if (!cache) {
+			if (grp && muid != CGRULE_INVALID) {
+				/* The rules resolved next overwrite pwd */
+				if (!muser_found) {
+					pwd = getpwuid(muid);
+					if (!pwd)
+						continue;
+
+					snprintf(muser, sizeof(muser), "%s", pwd->pw_name);
+					muser_found = true;
+				}
+
+				for (j = 0; grp->gr_mem[j]; j++) {
+					if (!strcmp(muser, grp->gr_mem[j]))
+						matched = true;
+				}
+			}
+
+			if (uid == muid || gid == mgid || uid == CGRULE_WILD)
+				matched = true;
+
+			if (!matched)
+				continue;
+
+			procname = cg_rules_cache_rule_procname(rcache, i);
+			if (procname) {
+				mproc_base = mprocname ? cgroup_basename(mprocname) : NULL;
+				if (!mprocname || (strcmp(mprocname, procname) &&
+				    (!mproc_base || strcmp(mproc_base, procname)))) {
+					uid = CGRULE_INVALID;
+					gid = CGRULE_INVALID;
+					matched = false;
+					free(mproc_base);
+					continue;
+				}
+				free(mproc_base);
+			}
+		}
+
+		rule = cg_rules_cache_rule(rcache, i);
+		if (!rule)
+			return ECGOTHER;
+
+		rule->uid = uid;
+		rule->gid = gid;
+
+		if (lst->head == NULL) {
+			lst->head = rule;
+			lst->tail = rule;
+		} else {
+			lst->tail->next = rule;
+			lst->tail = rule;
+		}
+	}
+
+	cgroup_dbg("Read %d rules from %s.\n", cnt, CGRULES_CACHE_FILE);
+
+	return (matched && !cache) ? -1 : 0;
+}
+
 /**
  * Parse CGRULES_CONF_FILE and all files in CGRULES_CONF_FILE_DIR.
  * If CGRULES_CONF_FILE_DIR does not exists or can not be read, parse only
@@ -1020,6 +1475,11 @@ finish:
  * dependent on it. Thus construct the rules the way not to break this
  * assumption.
  *
+ * The rules are read from the image published by cgrulesengd, or else from
+ * CGRULES_CACHE_FILE, instead when they are up to date with the files.  A
+ * full parse as root writes the cache.  Either way, the user and group names
+ * are resolved through NSS as the rules are loaded.
+ *
  * This function is NOT thread safe!
  *	@param cache True to cache rules, else false
  *	@param muid If cache is false, the UID to match against
@@ -1032,6 +1492,11 @@ static int cgroup_parse_rules(bool cache, uid_t muid, gid_t mgid, const char *mp
 	/* Pointer to the list that we're using */
 	struct cgroup_rule_list *lst = NULL;
 
+	/* Compiled cache of the files */
+	struct cg_rules_cache_sources srcs = { 0 };
+	struct cg_rules_cache rcache;
+	bool store_cache = false;
+
 	/* Directory variables */
 	const char *dirname = CGRULES_CONF_DIR;
 	struct dirent *item;
@@ -1047,11 +1512,32 @@ static int cgroup_parse_rules(bool cache, uid_t muid, gid_t mgid, const char *mp
 	else
 		lst = &trl;
 
+	pthread_rwlock_wrlock(&rl_lock);
+
 	/* If our list already exists, clean it. */
+	if (cache)
+		cgroup_free_rule_index(&rl_index);
 	if (lst->head)
 		cgroup_free_rule_list(lst);
 
-	pthread_rwlock_wrlock(&rl_lock);
+	/* The daemon doesn't read back its own image */
+	if (!rl_publish && !cg_rules_shm_open(&rcache)) {
+		ret = cgroup_parse_rules_cache(&rcache, cache, muid, mgid, mprocname);
+		cg_rules_cache_close(&rcache);
+		goto build_index;
+	}
+
+	if (!cg_rules_cache_open(CGRULES_CACHE_FILE, &rcache)) {
+		ret = cgroup_parse_rules_cache(&rcache, cache, muid, mgid, mprocname);
+		if (cache && !ret && rl_publish)
+			cgroup_publish_rules_image(rcache.map, rcache.size);
+		cg_rules_cache_close(&rcache);
+		goto build_index;
+	}
+
+	/* The files are recorded before they are parsed */
+	if (cache && (geteuid() == 0 || rl_publish))
+		store_cache = !cg_rules_cache_stat_sources(CGRULES_CONF_FILE, dirname, &srcs);
 
 	/* Parse CGRULES_CONF_FILE configuration file (back compatibility). */
 	ret = cgroup_parse_rules_file(CGRULES_CONF_FILE, cache, muid, mgid, mprocname);
@@ -1060,10 +1546,8 @@ static int cgroup_parse_rules(bool cache, uid_t muid, gid_t mgid, const char *mp
 	 * if match (ret = -1), stop parsing other files,
 	 * just return or ret > 0 => error
 	 */
-	if (ret != 0) {
-		pthread_rwlock_unlock(&rl_lock);
-		return ret;
-	}
+	if (ret != 0)
+		goto build_index;
 
 	/* Continue parsing */
 	d = opendir(dirname);
@@ -1074,9 +1558,8 @@ static int cgroup_parse_rules(bool cache, uid_t muid, gid_t mgid, const char *mp
 		 * successfully parsed. Thus return as a success for back
 		 * compatibility.
 		 */
-		pthread_rwlock_unlock(&rl_lock);
-
-		return 0;
+		ret = 0;
+		goto build_index;
 	}
 
 	/* Read all files from CGRULES_CONF_FILE_DIR */
@@ -1120,6 +1603,21 @@ static int cgroup_parse_rules(bool cache, uid_t muid, gid_t mgid, const char *mp
 
 unlock_list:
 	closedir(d);
+
+build_index:
+	if (store_cache) {
+		if (!ret)
+			cgroup_store_rules_cache(lst, &srcs);
+		cg_rules_cache_free_sources(&srcs);
+	}
+
+	if (cache)
+		cgroup_drop_unresolved_rules(lst);
+
+	/* Without the index the rules are still matched by walking rl */
+	if (cache && !ret && cgroup_build_rule_index(lst, &rl_index))
+		cgroup_warn("failed to index the rules, falling back to a list walk\n");
+
 	pthread_rwlock_unlock(&rl_lock);
 
 	return ret;
@@ -1437,6 +1935,8 @@ static void cgroup_free_cg_mount_table(void)
 	memset(&cg_mount_table, 0, sizeof(cg_mount_table));
 	memset(&cg_cgroup_v2_mount_path, 0, sizeof(cg_cgroup_v2_mount_path));
 	memset(&cg_cgroup_v2_empty_mount_paths, 0, sizeof(cg_cgroup_v2_empty_mount_paths));
+
+	cg_free_path_prefix_table();
 }
 
 /*
@@ -1678,6 +2178,145 @@ err:
 	return ret;
 }
 
+static int cg_scan_mounted_fs(void)
+{
+	char mntent_buff[4 * FILENAME_MAX];
+	struct mntent *temp_ent = NULL;
+	struct mntent *ent = NULL;
+	FILE *proc_mount = NULL;
+	int ret = 1;
+
+	proc_mount = fopen("/proc/self/mounts", "re");
+	if (proc_mount == NULL)
+		return 0;
+
+	temp_ent = (struct mntent *) malloc(sizeof(struct mntent));
+	if (!temp_ent) {
+		/* We just fail at the moment. */
+		fclose(proc_mount);
+		return 0;
+	}
+
+	ent = getmntent_r(proc_mount, temp_ent, mntent_buff, sizeof(mntent_buff));
+	if (!ent) {
+		ret = 0;
+		goto done;
+	}
+
+	while (strcmp(ent->mnt_type, "cgroup") != 0 &&
+	       strcmp(ent->mnt_type, "cgroup2") != 0) {
+		ent = getmntent_r(proc_mount, temp_ent, mntent_buff, sizeof(mntent_buff));
+		if (ent == NULL) {
+			ret = 0;
+			goto done;
+		}
+	}
+done:
+	fclose(proc_mount);
+	free(temp_ent);
+
+	return ret;
+}
+
+/*
+ * The parent and the child of a fork() share the open file of the mounts
+ * fd, so a change is reported by poll() to only one of them. The lock is
+ * held across the fork, and the child drops the inherited fd and the cached
+ * result, so that it opens its own fd the next time it needs the check.
+ */
+static void cg_mounts_atfork_prepare(void)
+{
+	pthread_mutex_lock(&cg_mounted_fs_lock);
+}
+
+static void cg_mounts_atfork_parent(void)
+{
+	pthread_mutex_unlock(&cg_mounted_fs_lock);
+}
+
+static void cg_mounts_atfork_child(void)
+{
+	if (cg_mounts_fd >= 0)
+		close(cg_mounts_fd);
+
+	cg_mounts_fd = -1;
+	cg_mounted_fs = -1;
+	pthread_mutex_unlock(&cg_mounted_fs_lock);
+}
+
+static void cg_mounts_atfork_register(void)
+{
+	pthread_atfork(cg_mounts_atfork_prepare, cg_mounts_atfork_parent,
+		       cg_mounts_atfork_child);
+}
+
+/*
+ * Must be called with cg_mounted_fs_lock held. The mounts fd is opened
+ * before the scan, so that a mount/umount racing with the scan is reported
+ * by the next poll() and not lost.
+ */
+static void cg_refresh_mounted_fs_locked(void)
+{
+	if (cg_mounts_fd < 0) {
+		pthread_once(&cg_mounts_atfork_once, cg_mounts_atfork_register);
+		cg_mounts_fd = open("/proc/self/mounts", O_RDONLY | O_CLOEXEC);
+	}
+
+	cg_mounted_fs = cg_scan_mounted_fs();
+}
+
+int cgroup_refresh_mount_cache(void)
+{
+	int mounted;
+
+	pthread_mutex_lock(&cg_mounted_fs_lock);
+	/*
+	 * The fd keeps describing the mount namespace it was opened in, re-open
+	 * it for the callers that have moved to another one with setns().
+	 */
+	if (cg_mounts_fd >= 0) {
+		close(cg_mounts_fd);
+		cg_mounts_fd = -1;
+	}
+	cg_refresh_mounted_fs_locked();
+	mounted = cg_mounted_fs;
+	pthread_mutex_unlock(&cg_mounted_fs_lock);
+
+	return mounted ? 0 : ECGROUPNOTMOUNTED;
+}
+
+/*
+ * Returns 1 if a cgroup or cgroup2 filesystem is mounted, 0 otherwise.
+ * The answer is cached; the kernel flags POLLPRI on /proc/self/mounts
+ * whenever the mount table of the namespace changes, so the file is only
+ * re-parsed after a mount/umount (or the first time it is needed).
+ */
+static int cg_test_mounted_fs(void)
+{
+	struct pollfd pfd;
+	int mounted;
+
+	pthread_mutex_lock(&cg_mounted_fs_lock);
+
+	if (cg_mounted_fs < 0 || cg_mounts_fd < 0) {
+		cg_refresh_mounted_fs_locked();
+		goto out;
+	}
+
+	pfd.fd = cg_mounts_fd;
+	pfd.events = POLLPRI;
+	pfd.revents = 0;
+
+	if (poll(&pfd, 1, 0) != 0)
+		cg_refresh_mounted_fs_locked();
+
+out:
+	mounted = cg_mounted_fs;
+	pthread_mutex_unlock(&cg_mounted_fs_lock);
+
+	return mounted;
+}
+
 /**
  * cgroup_init(), initializes the MOUNT_POINT.
  *
@@ -1706,6 +2345,13 @@ int cgroup_init(void)
 	if (ret)
 		goto unlock_exit;
 
+	/* failure only disables the fast path in cg_build_path_locked() */
+	cg_build_path_prefix_table();
+
+	pthread_mutex_lock(&cg_mounted_fs_lock);
+	cg_refresh_mounted_fs_locked();
+	pthread_mutex_unlock(&cg_mounted_fs_lock);
+
 	cgroup_initialized = 1;
 
 unlock_exit:
@@ -1719,187 +2365,259 @@ unlock_exit:
 	return ret;
 }
 
-static int cg_test_mounted_fs(void)
+static inline pid_t cg_gettid(void)
 {
-	char mntent_buff[4 * FILENAME_MAX];
-	struct mntent *temp_ent = NULL;
-	struct mntent *ent = NULL;
-	FILE *proc_mount = NULL;
-	int ret = 1;
-
-	proc_mount = fopen("/proc/self/mounts", "re");
-	if (proc_mount == NULL)
-		return 0;
+	return syscall(__NR_gettid);
+}
 
-	temp_ent = (struct mntent *) malloc(sizeof(struct mntent));
-	if (!temp_ent) {
-		/* We just fail at the moment. */
-		fclose(proc_mount);
-		return 0;
-	}
+/*
+ * Per-controller path prefixes, "<mount>/<systemd_default_cgroup>/", and a
+ * controller name -> cg_mount_table index hash. They are rebuilt by
+ * cgroup_init() and whenever systemd_default_cgroup changes, so that
+ * cg_build_path_locked() neither allocates nor scans cg_mount_table.
+ * Protected by cg_mount_table_lock.
+ */
+struct cg_path_prefix {
+	char *path;
+	int len;		/* strlen(path) */
+	int mnt_len;		/* strlen("<mount>/"), when the name overrides systemd */
+};
 
-	ent = getmntent_r(proc_mount, temp_ent, mntent_buff, sizeof(mntent_buff));
-	if (!ent) {
-		ret = 0;
-		goto done;
-	}
+#define CG_PATH_HASH_SIZE	256	/* power of two, > 2 * CG_CONTROLLER_MAX */
 
-	while (strcmp(ent->mnt_type, "cgroup") != 0 &&
-	       strcmp(ent->mnt_type, "cgroup2") != 0) {
-		ent = getmntent_r(proc_mount, temp_ent, mntent_buff, sizeof(mntent_buff));
-		if (ent == NULL) {
-			ret = 0;
-			goto done;
-		}
-	}
-done:
-	fclose(proc_mount);
-	free(temp_ent);
+static struct cg_path_prefix cg_path_prefix_table[CG_CONTROLLER_MAX];
+static struct cg_path_prefix cg_v2_path_prefix;
+static short cg_path_hash[CG_PATH_HASH_SIZE];	/* cg_mount_table index + 1 */
+static int cg_path_v2_index;			/* first cgroup v2 controller + 1 */
+static int cg_path_prefix_valid;
 
-	return ret;
+static const char *cg_path_systemd_default(void)
+{
+#ifdef WITH_SYSTEMD
+	return systemd_default_cgroup;
+#else
+	return NULL;
+#endif
 }
 
-static inline pid_t cg_gettid(void)
+static int cg_path_prefix_init(struct cg_path_prefix * const prefix, const char * const mnt)
 {
-	return syscall(__NR_gettid);
+	const char *systemd_cgrp = cg_path_systemd_default();
+	int ret;
+
+	if (systemd_cgrp)
+		ret = asprintf(&prefix->path, "%s/%s/", mnt, systemd_cgrp);
+	else
+		ret = asprintf(&prefix->path, "%s/", mnt);
+	if (ret < 0) {
+		prefix->path = NULL;
+		return ECGOTHER;
+	}
+
+	prefix->len = ret;
+	prefix->mnt_len = strlen(mnt) + 1;
+
+	return 0;
 }
 
-static char *cg_concat_path(const char *pref, const char *suf, char *path)
+/* Call with cg_mount_table_lock taken for writing */
+void cg_free_path_prefix_table(void)
 {
-	if ((suf[strlen(suf)-1] == '/') || ((strlen(suf) == 0) && (pref[strlen(pref)-1] == '/')))
-		snprintf(path, FILENAME_MAX, "%s%s", pref, suf+((suf[0] == '/') ? 1 : 0));
-	else
-		snprintf(path, FILENAME_MAX, "%s%s/", pref, suf+((suf[0] == '/') ? 1 : 0));
+	int i;
 
-	path[FILENAME_MAX-1] = '\0';
+	cg_path_prefix_valid = 0;
 
-	return path;
+	for (i = 0; i < CG_CONTROLLER_MAX; i++) {
+		free(cg_path_prefix_table[i].path);
+		cg_path_prefix_table[i].path = NULL;
+	}
+	free(cg_v2_path_prefix.path);
+	cg_v2_path_prefix.path = NULL;
+
+	memset(cg_path_hash, 0, sizeof(cg_path_hash));
+	cg_path_v2_index = 0;
 }
 
-/* Call with cg_mount_table_lock taken */
-/* path value have to have size at least FILENAME_MAX */
-char *cg_build_path_locked(const char *name, char *path, const char *type)
+/* Call with cg_mount_table_lock taken for writing */
+int cg_build_path_prefix_table(void)
 {
-	char *tmp_systemd_default_cgrp, *_path = NULL;
-	/*
-	 * len is the allocation size for path, that stores:
-	 * cg_mount_table[i].mount.path + '/' + cg_namespace_table[i] + '/'
-	 */
-	int i, ret, len = (FILENAME_MAX * 2) + 2;
+	unsigned int slot;
+	int i, ret;
 
-	/*
-	 * systemd_default_cgroup can't be clobbered.   The user may pass
-	 * multiple cgroups, hence use temporary variable for manipulations
-	 * for example:
-	 * cgget -g cpu:/ -g cpu:cgrp1 -g cpu:/cgrp2
-	 */
-	tmp_systemd_default_cgrp = calloc(1, (sizeof(char) * len));
-	if (!tmp_systemd_default_cgrp) {
-		cgroup_err("Failed to allocate memory for tmp_systemd_default_cgroup\n");
-		goto out;
+	cg_free_path_prefix_table();
+
+	if (cg_cgroup_v2_mount_path[0] != '\0') {
+		ret = cg_path_prefix_init(&cg_v2_path_prefix, cg_cgroup_v2_mount_path);
+		if (ret)
+			goto err;
 	}
 
-#ifdef WITH_SYSTEMD
-	/*
-	 * If the user specifies the name as /<cgroup-name>, they are
-	 * effectively overriding the systemd_default_cgroup but if the name
-	 * is "/", the cgroup root path is systemd_default_cgroup
-	 */
-	if (strlen(systemd_default_cgroup) && name && name[0] == '/' && name[1] != '\0')
-		tmp_systemd_default_cgrp[0] = '\0';
-	else
-		snprintf(tmp_systemd_default_cgrp, len, "%s/", systemd_default_cgroup);
+	for (i = 0; i < CG_CONTROLLER_MAX && cg_mount_table[i].name[0] != '\0'; i++) {
+		ret = cg_path_prefix_init(&cg_path_prefix_table[i], cg_mount_table[i].mount.path);
+		if (ret)
+			goto err;
 
-	/* allocate more space for systemd_default_cgroup + '/' */
-	len += (FILENAME_MAX + 1);
-#endif
-	/*
-	 * Recent gcc are unhappy when sizeof(dest) <= sizeof(src) with
-	 * snprintf()'s.  Alternative is to use multiple strncpy()/strcat(),
-	 * work around it by allocating large temporary buffer _path and
-	 * copying the constructed _path into path.
-	 */
-	_path = malloc(len);
-	if (!_path) {
-		cgroup_err("Failed to allocate memory for _path\n");
-		goto out;
+		if (!cg_path_v2_index && cg_mount_table[i].version == CGROUP_V2)
+			cg_path_v2_index = i + 1;
+
+		slot = cg_hash_string(cg_mount_table[i].name) & (CG_PATH_HASH_SIZE - 1);
+		while (cg_path_hash[slot]) {
+			/* keep the first entry, as the linear scan would find it */
+			if (!strcmp(cg_mount_table[cg_path_hash[slot] - 1].name,
+				    cg_mount_table[i].name))
+				break;
+			slot = (slot + 1) & (CG_PATH_HASH_SIZE - 1);
+		}
+		if (!cg_path_hash[slot])
+			cg_path_hash[slot] = i + 1;
 	}
 
-	/*
-	 * If no type is specified, and there's a valid cgroup v2 mount, then
-	 * build up a path to this mount (and cgroup name if supplied).
-	 * This can be used to create a cgroup v2 cgroup that's not attached to
-	 * any controller.
-	 */
-	if (!type && strlen(cg_cgroup_v2_mount_path) > 0) {
-		ret = snprintf(_path, len, "%s/%s", cg_cgroup_v2_mount_path,
-			       tmp_systemd_default_cgrp);
-		if (ret >= FILENAME_MAX)
-			cgroup_dbg("filename too long: %s", _path);
+	cg_path_prefix_valid = 1;
 
-		strncpy(path, _path, FILENAME_MAX - 1);
-		path[FILENAME_MAX - 1] = '\0';
+	return 0;
 
-		if (name) {
-			char *tmp;
+err:
+	cgroup_warn("failed to build the cgroup path prefixes, falling back to slow path\n");
+	cg_free_path_prefix_table();
 
-			tmp = strdup(path);
-			if (tmp == NULL) {
-				path = NULL;
-				goto out;
-			}
+	return ret;
+}
 
-			cg_concat_path(tmp, name, path);
-			free(tmp);
+int cg_refresh_path_prefix_table(void)
+{
+	int ret;
+
+	pthread_rwlock_wrlock(&cg_mount_table_lock);
+	ret = cg_build_path_prefix_table();
+	pthread_rwlock_unlock(&cg_mount_table_lock);
+
+	return ret;
+}
+
+/* Returns the cg_mount_table index of the controller "type", or -1 */
+static int cg_path_find_controller(const char * const type)
+{
+	unsigned int slot;
+	int i;
+
+	if (cg_path_prefix_valid) {
+		if (strcmp(type, CGRP_FILE_PREFIX) == 0 && cg_path_v2_index)
+			return cg_path_v2_index - 1;
+
+		slot = cg_hash_string(type) & (CG_PATH_HASH_SIZE - 1);
+		while (cg_path_hash[slot]) {
+			i = cg_path_hash[slot] - 1;
+			if (strcmp(cg_mount_table[i].name, type) == 0)
+				return i;
+			slot = (slot + 1) & (CG_PATH_HASH_SIZE - 1);
 		}
-		goto out;
+		return -1;
 	}
 
-	for (i = 0; cg_mount_table[i].name[0] != '\0'; i++) {
+	for (i = 0; i < CG_CONTROLLER_MAX && cg_mount_table[i].name[0] != '\0'; i++) {
 		/* Two ways to successfully move forward here:
 		 * 1. The "type" controller matches the name of a mounted
 		 *    controller
 		 * 2. The "type" controller requested is "cgroup" and there's
 		 *    a "real" controller mounted as cgroup v2
 		 */
-		if ((type && strcmp(cg_mount_table[i].name, type) == 0) ||
-		    (type && strcmp(type, CGRP_FILE_PREFIX) == 0 &&
-		     cg_mount_table[i].version == CGROUP_V2)) {
+		if (strcmp(cg_mount_table[i].name, type) == 0 ||
+		    (strcmp(type, CGRP_FILE_PREFIX) == 0 && cg_mount_table[i].version == CGROUP_V2))
+			return i;
+	}
 
-			if (cg_namespace_table[i])
-				ret = snprintf(_path, len, "%s/%s%s/", cg_mount_table[i].mount.path,
-					       tmp_systemd_default_cgrp, cg_namespace_table[i]);
-			else
-				ret = snprintf(_path, len, "%s/%s", cg_mount_table[i].mount.path,
-					       tmp_systemd_default_cgrp);
+	return -1;
+}
 
-			if (ret >= FILENAME_MAX)
-				cgroup_dbg("filename too long: %s", _path);
+/*
+ * Append at most len bytes of str to path, which holds path_len bytes.
+ * Like the snprintf()s it replaces, the result is truncated to
+ * FILENAME_MAX - 1 bytes.
+ */
+static int cg_path_append(char * const path, int path_len, const char * const str, size_t len)
+{
+	if (path_len + len > FILENAME_MAX - 1) {
+		cgroup_dbg("filename too long: %s%s", path, str);
+		len = FILENAME_MAX - 1 - path_len;
+	}
 
-			strncpy(path, _path, FILENAME_MAX - 1);
-			path[FILENAME_MAX - 1] = '\0';
+	memcpy(path + path_len, str, len);
+	path_len += len;
+	path[path_len] = '\0';
 
-			if (name) {
-				char *tmp;
+	return path_len;
+}
 
-				tmp = strdup(path);
-				if (tmp == NULL)
-					break;
+/* Call with cg_mount_table_lock taken */
+/* path value have to have size at least FILENAME_MAX */
+char *cg_build_path_locked(const char *name, char *path, const char *type)
+{
+	struct cg_path_prefix tmp_prefix = { NULL, };
+	const struct cg_path_prefix *prefix;
+	const char *systemd_cgrp;
+	const char *mnt;
+	int len = 0, i = -1;
+	size_t name_len;
 
-				cg_concat_path(tmp, name, path);
-				free(tmp);
-			}
-			goto out;
+	/*
+	 * If no type is specified, and there's a valid cgroup v2 mount, then
+	 * build up a path to this mount (and cgroup name if supplied).
+	 * This can be used to create a cgroup v2 cgroup that's not attached to
+	 * any controller.
+	 */
+	if (!type && strlen(cg_cgroup_v2_mount_path) > 0) {
+		mnt = cg_cgroup_v2_mount_path;
+		prefix = &cg_v2_path_prefix;
+	} else if (type) {
+		i = cg_path_find_controller(type);
+		if (i < 0)
+			return NULL;
+		mnt = cg_mount_table[i].mount.path;
+		prefix = &cg_path_prefix_table[i];
+	} else {
+		return NULL;
+	}
+
+	if (!cg_path_prefix_valid) {
+		if (cg_path_prefix_init(&tmp_prefix, mnt)) {
+			cgroup_err("Failed to allocate memory for the cgroup path\n");
+			return NULL;
 		}
+		prefix = &tmp_prefix;
 	}
-	path = NULL;
 
-out:
-	if (_path)
-		free(_path);
+	/*
+	 * If the user specifies the name as /<cgroup-name>, they are
+	 * effectively overriding the systemd_default_cgroup but if the name
+	 * is "/", the cgroup root path is systemd_default_cgroup
+	 */
+	systemd_cgrp = cg_path_systemd_default();
+	if (systemd_cgrp && strlen(systemd_cgrp) && name && name[0] == '/' && name[1] != '\0')
+		len = cg_path_append(path, 0, prefix->path, prefix->mnt_len);
+	else
+		len = cg_path_append(path, 0, prefix->path, prefix->len);
+
+	free(tmp_prefix.path);
+
+	if (i >= 0 && cg_namespace_table[i]) {
+		len = cg_path_append(path, len, cg_namespace_table[i],
+				     strlen(cg_namespace_table[i]));
+		len = cg_path_append(path, len, "/", 1);
+	}
+
+	if (!name)
+		return path;
+
+	/* add a trailing "/", unless the name already ends with one */
+	name_len = strlen(name);
+	if (name[0] == '/')
+		len = cg_path_append(path, len, name + 1, name_len - 1);
+	else
+		len = cg_path_append(path, len, name, name_len);
 
-	if (tmp_systemd_default_cgrp)
-		free(tmp_systemd_default_cgrp);
+	if ((name_len && name[name_len - 1] != '/') ||
+	    (!name_len && len && path[len - 1] != '/'))
+		cg_path_append(path, len, "/", 1);
 
 	return path;
 }
@@ -2014,9 +2732,68 @@ error:
 	return err;
 }
 
-STATIC int cgroupv2_controller_enabled(const char * const cg_name, const char * const ctrl_name)
+/*
+ * The cgroup.subtree_control file of a directory, read once for all the
+ * controllers a task is attached with.  It isn't kept across calls, the
+ * file can change at any time.
+ */
+struct cg_subtree_cache {
+	char dir[FILENAME_MAX];
+	char ctrls[FILENAME_MAX];
+	int error;
+};
+
+static int cg_subtree_cache_lookup(struct cg_subtree_cache * const cache,
+				   const char * const dir, const char * const ctrl_name)
 {
-	char path[FILENAME_MAX] = {0};
+	char path[FILENAME_MAX];
+	size_t len;
+	FILE *fp;
+	char *p;
+
+	if (strcmp(cache->dir, dir) != 0) {
+		snprintf(cache->dir, sizeof(cache->dir), "%s", dir);
+		cache->ctrls[0] = '\0';
+		cache->error = 0;
+
+		__atomic_add_fetch(&cg_attach_stats.subtree_reads, 1, __ATOMIC_RELAXED);
+
+		snprintf(path, sizeof(path), "%s/%s", dir, CGV2_SUBTREE_CTRL_FILE);
+		fp = fopen(path, "re");
+		if (!fp) {
+			cgroup_warn("fopen failed\n");
+			last_errno = errno;
+			cache->error = ECGOTHER;
+		} else {
+			if (!fgets(cache->ctrls, sizeof(cache->ctrls), fp))
+				/* The subtree control file is empty */
+				cache->ctrls[0] = '\0';
+			cache->ctrls[strcspn(cache->ctrls, "\n")] = '\0';
+			fclose(fp);
+		}
+	}
+
+	if (cache->error)
+		return cache->error;
+
+	/* The enabled controllers are separated by " " */
+	len = strlen(ctrl_name);
+	for (p = cache->ctrls; (p = strstr(p, ctrl_name)) != NULL; p += len) {
+		if ((p == cache->ctrls || p[-1] == ' ') && (p[len] == '\0' || p[len] == ' '))
+			return 0;
+	}
+
+	return ECGROUPNOTMOUNTED;
+}
+
+/*
+ * Check that a cgroup v2 controller is enabled in the cgroup.subtree_control
+ * file of the parent of cg_name, read through cache when it isn't NULL
+ */
+static int __cgroupv2_controller_enabled(const char * const cg_name, const char * const ctrl_name,
+					 struct cg_subtree_cache * const cache)
+{
+	char path[FILENAME_MAX] = {0};
 	char *parent = NULL, *dname;
 	enum cg_version_t version;
 	bool enabled;
@@ -2051,6 +2828,11 @@ STATIC int cgroupv2_controller_enabled(const char * const cg_name, const char *
 
 	dname = dirname(parent);
 
+	if (cache) {
+		error = cg_subtree_cache_lookup(cache, dname, ctrl_name);
+		goto err;
+	}
+
 	error = cgroupv2_get_subtree_control(dname, ctrl_name, &enabled);
 	if (error)
 		goto err;
@@ -2064,6 +2846,24 @@ err:
 	return error;
 }
 
+STATIC int cgroupv2_controller_enabled(const char * const cg_name, const char * const ctrl_name)
+{
+	return __cgroupv2_controller_enabled(cg_name, ctrl_name, NULL);
+}
+
+/* The error of a task file that can't be opened */
+static int cg_attach_open_error(int err)
+{
+	switch (err) {
+	case EPERM:
+		return ECGROUPNOTOWNER;
+	case ENOENT:
+		return ECGROUPNOTEXIST;
+	default:
+		return ECGROUPNOTALLOWED;
+	}
+}
+
 static int __cgroup_attach_task_pid(char *path, pid_t tid)
 {
 	FILE *tasks = NULL;
@@ -2071,16 +2871,7 @@ static int __cgroup_attach_task_pid(char *path, pid_t tid)
 
 	tasks = fopen(path, "we");
 	if (!tasks) {
-		switch (errno) {
-		case EPERM:
-			ret = ECGROUPNOTOWNER;
-			break;
-		case ENOENT:
-			ret = ECGROUPNOTEXIST;
-			break;
-		default:
-			ret = ECGROUPNOTALLOWED;
-		}
+		ret = cg_attach_open_error(errno);
 		goto err;
 	}
 	ret = fprintf(tasks, "%d", tid);
@@ -2096,6 +2887,7 @@ static int __cgroup_attach_task_pid(char *path, pid_t tid)
 		goto err;
 	}
 	fclose(tasks);
+	__atomic_add_fetch(&cg_attach_stats.writes, 1, __ATOMIC_RELAXED);
 	return 0;
 err:
 	cgroup_warn("cannot write tid %d to %s:%s\n", tid, path, strerror(errno));
@@ -2147,83 +2939,201 @@ static int cgroup_build_tid_path(const char * const ctrl_name, char *path)
 	return ret;
 }
 
-static int cgroup_attach_task_tid(struct cgroup *cgrp, pid_t tid, bool move_tids)
+/* The file of a hierarchy a task is written to */
+enum cg_attach_file {
+	/* tasks on cgroup v1, cgroup.procs or cgroup.threads on cgroup v2 */
+	CG_ATTACH_TASK,
+	/* The file of cgroup_attach_thread_tid(), see cgroup_build_tid_path() */
+	CG_ATTACH_TID,
+	/* cgroup.procs, which moves all the threads of a process */
+	CG_ATTACH_PROCS,
+};
+
+/*
+ * The files a task is written to, one per hierarchy directory: all the
+ * controllers of a hierarchy share its files
+ */
+struct cg_attach_files {
+	char *paths[CG_CONTROLLER_MAX];
+	/* The file moves a single thread instead of all the threads of a process */
+	bool per_thread[CG_CONTROLLER_MAX];
+	int cnt;
+};
+
+static void cg_attach_files_free(struct cg_attach_files * const files)
+{
+	int i;
+
+	for (i = 0; i < files->cnt; i++)
+		free(files->paths[i]);
+	files->cnt = 0;
+}
+
+/* Check if the file of the hierarchy directory dir is already in files */
+static bool cg_attach_files_has_dir(const struct cg_attach_files * const files,
+				    const char * const dir)
+{
+	size_t len = strlen(dir);
+	int i;
+
+	for (i = 0; i < files->cnt; i++) {
+		if (strncmp(files->paths[i], dir, len) == 0 && !strchr(files->paths[i] + len, '/'))
+			return true;
+	}
+
+	return false;
+}
+
+static int cg_attach_files_add(struct cg_attach_files * const files, const char * const path)
+{
+	const char *name;
+
+	files->paths[files->cnt] = strdup(path);
+	if (!files->paths[files->cnt]) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+
+	/* tasks on cgroup v1 and cgroup.threads on cgroup v2 */
+	name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+	files->per_thread[files->cnt] = strcmp(name, "cgroup.procs") != 0;
+	files->cnt++;
+
+	return 0;
+}
+
+/* Build the path of the file of the hierarchy directory dir */
+static int cg_attach_file_path(const char * const cg_name, const char * const ctrl_name,
+			       const char * const dir, enum cg_attach_file file, char * const path)
+{
+	int ret;
+
+	if (file == CG_ATTACH_PROCS) {
+		snprintf(path, FILENAME_MAX, "%scgroup.procs", dir);
+		return 0;
+	}
+
+	ret = cgroup_build_tasks_procs_path(path, FILENAME_MAX, cg_name, ctrl_name);
+	if (!ret && file == CG_ATTACH_TID)
+		ret = cgroup_build_tid_path(ctrl_name, path);
+
+	return ret;
+}
+
+/*
+ * Build the files to write a task to for attaching it to cgrp, or to the
+ * root cgroups when cgrp is NULL.  The controllers sharing a hierarchy get
+ * one file, and the cgroup v2 controllers are checked against one read of
+ * the cgroup.subtree_control file of the parent.
+ */
+static int cg_attach_files_build(const struct cgroup * const cgrp, enum cg_attach_file file,
+				 struct cg_attach_files * const files)
 {
+	struct cg_subtree_cache cache;
 	char path[FILENAME_MAX] = {0};
-	char *controller_name = NULL;
-	int empty_cgrp = 0;
+	char dir[FILENAME_MAX];
+	const char *ctrl_name;
 	int i, ret = 0;
 
-	if (!cgroup_initialized) {
-		cgroup_warn("libcgroup is not initialized\n");
-		return ECGROUPNOTINITIALIZED;
-	}
+	files->cnt = 0;
 
-	/* if the cgroup is NULL, attach the task to the root cgroup. */
 	if (!cgrp) {
 		pthread_rwlock_rdlock(&cg_mount_table_lock);
-		for (i = 0; i < CG_CONTROLLER_MAX && cg_mount_table[i].name[0] != '\0'; i++) {
-			ret = cgroup_build_tasks_procs_path(path, sizeof(path), NULL,
-							    cg_mount_table[i].name);
-			if (ret)
-				return ret;
+		for (i = 0; !ret && i < CG_CONTROLLER_MAX && cg_mount_table[i].name[0] != '\0';
+		     i++) {
+			ctrl_name = cg_mount_table[i].name;
 
-			if (move_tids) {
-				ret = cgroup_build_tid_path(controller_name, path);
-				if (ret)
-					return ret;
+			if (!cg_build_path_locked(NULL, dir, ctrl_name)) {
+				ret = ECGOTHER;
+				break;
 			}
+			if (cg_attach_files_has_dir(files, dir))
+				continue;
 
-			ret = __cgroup_attach_task_pid(path, tid);
-			if (ret) {
-				pthread_rwlock_unlock(&cg_mount_table_lock);
-				return ret;
-			}
+			ret = cg_attach_file_path(NULL, ctrl_name, dir, file, path);
+			if (!ret)
+				ret = cg_attach_files_add(files, path);
 		}
 		pthread_rwlock_unlock(&cg_mount_table_lock);
-	} else {
-		for (i = 0; i < cgrp->index; i++) {
-			if (!cgroup_test_subsys_mounted(cgrp->controller[i]->name)) {
-				cgroup_warn("subsystem %s is not mounted\n",
-					    cgrp->controller[i]->name);
-				return ECGROUPSUBSYSNOTMOUNTED;
-			}
+		goto out;
+	}
+
+	for (i = 0; i < cgrp->index; i++) {
+		if (!cgroup_test_subsys_mounted(cgrp->controller[i]->name)) {
+			cgroup_warn("subsystem %s is not mounted\n", cgrp->controller[i]->name);
+			return ECGROUPSUBSYSNOTMOUNTED;
 		}
+	}
 
-		if (cgrp->index == 0)
-			/* Valid empty cgroup v2 with no controllers added. */
-			empty_cgrp = 1;
+	cache.dir[0] = '\0';
 
-		for (i = 0, controller_name = NULL;
-		     empty_cgrp > 0 || i < cgrp->index;
-		     i++, empty_cgrp--) {
+	/* A valid empty cgroup v2 has no controller */
+	for (i = 0; !ret && i < max(cgrp->index, 1); i++) {
+		ctrl_name = cgrp->index ? cgrp->controller[i]->name : NULL;
 
-			if (cgrp->controller[i])
-				controller_name = cgrp->controller[i]->name;
+		ret = __cgroupv2_controller_enabled(cgrp->name, ctrl_name, &cache);
+		if (ret)
+			break;
 
-			ret = cgroupv2_controller_enabled(cgrp->name, controller_name);
-			if (ret)
-				return ret;
+		if (!cg_build_path(cgrp->name, dir, ctrl_name)) {
+			ret = ECGOTHER;
+			break;
+		}
+		if (cg_attach_files_has_dir(files, dir))
+			continue;
 
-			ret = cgroup_build_tasks_procs_path(path, sizeof(path), cgrp->name,
-							    controller_name);
-			if (ret)
-				return ret;
+		ret = cg_attach_file_path(cgrp->name, ctrl_name, dir, file, path);
+		if (!ret)
+			ret = cg_attach_files_add(files, path);
+	}
 
-			if (move_tids) {
-				ret = cgroup_build_tid_path(controller_name, path);
-				if (ret)
-					return ret;
-			}
+out:
+	if (ret)
+		cg_attach_files_free(files);
 
-			ret = __cgroup_attach_task_pid(path, tid);
-			if (ret)
-				return ret;
-		}
+	return ret;
+}
+
+/* Write tid to the files, only to those moving a single thread if per_thread */
+static int cg_attach_files_write(const struct cg_attach_files * const files, pid_t tid,
+				 bool per_thread)
+{
+	int i, ret;
+
+	for (i = 0; i < files->cnt; i++) {
+		if (per_thread && !files->per_thread[i])
+			continue;
+
+		ret = __cgroup_attach_task_pid(files->paths[i], tid);
+		if (ret)
+			return ret;
 	}
+
 	return 0;
 }
 
+static int cgroup_attach_task_tid(struct cgroup *cgrp, pid_t tid, bool move_tids)
+{
+	struct cg_attach_files files;
+	int ret;
+
+	if (!cgroup_initialized) {
+		cgroup_warn("libcgroup is not initialized\n");
+		return ECGROUPNOTINITIALIZED;
+	}
+
+	/* if the cgroup is NULL, attach the task to the root cgroup. */
+	ret = cg_attach_files_build(cgrp, move_tids ? CG_ATTACH_TID : CG_ATTACH_TASK, &files);
+	if (ret)
+		return ret;
+
+	ret = cg_attach_files_write(&files, tid, false);
+	cg_attach_files_free(&files);
+
+	return ret;
+}
+
 /**
  *  cgroup_attach_task_pid is used to assign tasks to a cgroup.
  *  struct cgroup *cgroup: The cgroup to assign the thread to.
@@ -2265,6 +3175,70 @@ int cgroup_attach_thread_tid(struct cgroup *cgroup, pid_t tid)
 	return cgroup_attach_task_tid(cgroup, tid, 1);
 }
 
+int cgroup_attach_tasks(struct cgroup *cgroup, const pid_t * const pids, size_t n, int flags,
+			int * const per_pid_err)
+{
+	struct cg_attach_files files;
+	int i, len, fd, err;
+	char buf[16];
+	int ret = 0;
+	size_t j;
+
+	if (!cgroup_initialized) {
+		cgroup_warn("libcgroup is not initialized\n");
+		return ECGROUPNOTINITIALIZED;
+	}
+
+	if ((!pids && n) || (flags & ~CGROUP_ATTACH_PROCS))
+		return ECGINVAL;
+
+	if (per_pid_err)
+		memset(per_pid_err, 0, n * sizeof(*per_pid_err));
+
+	/* if the cgroup is NULL, attach the tasks to the root cgroup. */
+	ret = cg_attach_files_build(cgroup, flags & CGROUP_ATTACH_PROCS ?
+				    CG_ATTACH_PROCS : CG_ATTACH_TASK, &files);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < files.cnt; i++) {
+		fd = open(files.paths[i], O_WRONLY | O_CLOEXEC);
+		if (fd < 0) {
+			err = errno;
+			cgroup_warn("cannot open %s: %s\n", files.paths[i], strerror(err));
+			for (j = 0; per_pid_err && j < n; j++) {
+				if (!per_pid_err[j])
+					per_pid_err[j] = err;
+			}
+			if (!ret)
+				ret = cg_attach_open_error(err);
+			continue;
+		}
+
+		/* The kernel takes one task per write */
+		for (j = 0; j < n; j++) {
+			len = snprintf(buf, sizeof(buf), "%d", pids[j]);
+			if (write(fd, buf, len) == len) {
+				__atomic_add_fetch(&cg_attach_stats.writes, 1, __ATOMIC_RELAXED);
+				continue;
+			}
+
+			last_errno = errno;
+			cgroup_dbg("cannot write tid %d to %s: %s\n", pids[j], files.paths[i],
+				   strerror(errno));
+			if (per_pid_err && !per_pid_err[j])
+				per_pid_err[j] = errno;
+			if (!ret)
+				ret = ECGOTHER;
+		}
+		close(fd);
+	}
+
+	cg_attach_files_free(&files);
+
+	return ret;
+}
+
 /**
  * cg_mkdir_p, emulate the mkdir -p command (recursively creating paths)
  * @path: path to create
@@ -2347,12 +3321,51 @@ static int cg_create_control_group(const char *path)
 	return error;
 }
 
+int cg_dir_open(struct cg_dir * const dir, const char * const path)
+{
+	dir->fd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (dir->fd < 0) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+
+	snprintf(dir->path, sizeof(dir->path), "%s", path);
+
+	return 0;
+}
+
+DIR *cg_dir_opendir(const struct cg_dir * const dir)
+{
+	DIR *stream;
+	int fd;
+
+	/* An O_PATH descriptor can't be read, reopen the directory for reading */
+	fd = openat(dir->fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	stream = fdopendir(fd);
+	if (!stream)
+		close(fd);
+
+	return stream;
+}
+
+void cg_dir_close(struct cg_dir * const dir)
+{
+	if (dir->fd >= 0)
+		close(dir->fd);
+	dir->fd = -1;
+}
+
 /*
  * set_control_value()
  * This is the low level function for putting in a value in a control file.
- * This function takes in the complete path and sets the value in val in that file.
+ * The file name is relative to dir_fd, or the complete path with AT_FDCWD,
+ * and dir_path is the path of dir_fd.
  */
-static int cg_set_control_value(char *path, const char *val)
+static int __cg_set_control_value(int dir_fd, const char *dir_path, const char *name,
+				  const char *val)
 {
 	char *str_val_start;
 	char *str_val;
@@ -2363,7 +3376,7 @@ static int cg_set_control_value(char *path, const char *val)
 	if (!cg_test_mounted_fs())
 		return ECGROUPNOTMOUNTED;
 
-	ctl_file = open(path, O_RDWR | O_CLOEXEC);
+	ctl_file = openat(dir_fd, name, O_RDWR | O_CLOEXEC);
 
 	if (ctl_file == -1) {
 		if (errno == EPERM) {
@@ -2374,22 +3387,17 @@ static int cg_set_control_value(char *path, const char *val)
 			 * So we check if the tasks file exist. Before that, we
 			 * need to extract the path.
 			 */
-			char *path_dir_end;
 			FILE *control_file;
 			char *tasks_path;
 
-			path_dir_end = strrchr(path, '/');
-			if (path_dir_end == NULL)
+			if (!strchr(dir_path, '/') && !strchr(name, '/'))
 				return ECGROUPVALUENOTEXIST;
 
 			/* task_path contain: $path/tasks */
-			tasks_path = (char *)malloc(strlen(path) + 6 + 1);
-			if (tasks_path == NULL) {
+			if (asprintf(&tasks_path, "%s%s/tasks", dir_path, name) < 0) {
 				last_errno = errno;
 				return ECGOTHER;
 			}
-			strcpy(tasks_path, path);
-			strcat(tasks_path, "/tasks");
 
 			/* Test tasks file for read flag */
 			control_file = fopen(tasks_path, "re");
@@ -2440,7 +3448,7 @@ static int cg_set_control_value(char *path, const char *val)
 				return ECGOTHER;
 			}
 		} else
-			cgroup_warn("skipping empty line for %s\n", path);
+			cgroup_warn("skipping empty line for %s%s\n", dir_path, name);
 	} while (pos);
 
 	if (close(ctl_file)) {
@@ -2453,6 +3461,22 @@ static int cg_set_control_value(char *path, const char *val)
 	return 0;
 }
 
+/*
+ * This function takes in the complete path and sets the value in val in that file.
+ */
+static int cg_set_control_value(char *path, const char *val)
+{
+	return __cg_set_control_value(AT_FDCWD, "", path, val);
+}
+
+/*
+ * Sets the value in val in the control file name of the cgroup directory dir.
+ */
+static int cg_dir_write_value(const struct cg_dir * const dir, const char *name, const char *val)
+{
+	return __cg_set_control_value(dir->fd, dir->path, name, val);
+}
+
 /**
  * Walk the settings in controller and write their values to disk
  *
@@ -2466,8 +3490,10 @@ STATIC int cgroup_set_values_recursive(const char * const base,
 {
 	struct control_value *cv;
 	struct stat path_stat;
-	int ret, j, error = 0;
-	char *path = NULL;
+	int j, error = 0;
+	struct cg_dir dir;
+
+	dir.fd = -1;
 
 	for (j = 0; j < controller->index; j++) {
 		cv = controller->values[j];
@@ -2492,34 +3518,26 @@ STATIC int cgroup_set_values_recursive(const char * const base,
 		if (strcspn(cv->value, "\n")  < (strlen(cv->value) - 1))
 			continue;
 
-		ret = asprintf(&path, "%s%s", base, cv->name);
-		if (ret < 0) {
-			last_errno = errno;
-			error = ECGOTHER;
+		/* The settings are written relative to the base directory */
+		if (dir.fd < 0 && cg_dir_open(&dir, base)) {
+			error = ECGROUPVALUENOTEXIST;
 			goto err;
 		}
 
 		/* skip read-only settings */
-		ret = (stat(path, &path_stat));
-		if (ret < 0) {
+		if (fstatat(dir.fd, cv->name, &path_stat, 0) < 0) {
 			last_errno = errno;
 			error = ECGROUPVALUENOTEXIST;
 			goto err;
 		}
 
 		/* 0200 == S_IWUSR */
-		if (!(path_stat.st_mode & 0200)) {
-			free(path);
-			path = NULL;
+		if (!(path_stat.st_mode & 0200))
 			continue;
-		}
 
-		cgroup_dbg("setting %s to \"%s\", pathlen %d\n", path, cv->value, ret);
-
-		error = cg_set_control_value(path, cv->value);
-		free(path);
-		path = NULL;
+		cgroup_dbg("setting %s%s to \"%s\"\n", base, cv->name, cv->value);
 
+		error = cg_dir_write_value(&dir, cv->name, cv->value);
 		if (error) {
 			/* Ignore the errors on deprecated settings */
 			if (last_errno == EOPNOTSUPP) {
@@ -2532,13 +3550,7 @@ STATIC int cgroup_set_values_recursive(const char * const base,
 	}
 
 err:
-	/*
-	 * As currently written, path should always be null as we are\
-	 * exiting this function, but let's check just in case, and free it
-	 * if it's non-null
-	 */
-	if (path)
-		free(path);
+	cg_dir_close(&dir);
 
 	return error;
 }
@@ -2862,23 +3874,21 @@ int cgroup_copy_controller_values(struct cgroup_controller * const dst,
 	strncpy(dst->name, src->name, CONTROL_NAMELEN_MAX);
 	dst->name[CONTROL_NAMELEN_MAX - 1] = '\0';
 
-	for (i = 0; i < src->index; i++, dst->index++) {
+	for (i = 0; i < src->index; i++) {
 		struct control_value *src_val = src->values[i];
 		struct control_value *dst_val;
 
-		dst->values[i] = calloc(1, sizeof(struct control_value));
-		if (!dst->values[i]) {
-			last_errno = errno;
+		dst_val = cgroup_alloc_value(src_val->name, src_val->value);
+		if (!dst_val) {
 			ret = ECGOTHER;
 			goto err;
 		}
 
-		dst_val = dst->values[i];
-		strncpy(dst_val->value, src_val->value, CG_CONTROL_VALUE_MAX);
-		dst_val->value[CG_CONTROL_VALUE_MAX - 1] = '\0';
-
-		strncpy(dst_val->name, src_val->name, FILENAME_MAX);
-		dst_val->name[FILENAME_MAX - 1] = '\0';
+		if (cgroup_append_value(dst, dst_val)) {
+			cgroup_free_value(dst_val);
+			ret = ECGOTHER;
+			goto err;
+		}
 
 		if (src_val->multiline_value) {
 			dst_val->multiline_value = strdup(src_val->multiline_value);
@@ -2911,18 +3921,12 @@ int cgroup_copy_controller_values(struct cgroup_controller * const dst,
 	return ret;
 
 err:
-	dst->index = 0;
-	for (i = 0; i < src->index; i++) {
-		if (dst->values[i]) {
-			if (dst->values[i]->multiline_value)
-				free(dst->values[i]->multiline_value);
-
-			if (dst->values[i]->prev_name)
-				free(dst->values[i]->prev_name);
-
-			free(dst->values[i]);
-		}
+	for (i = 0; i < dst->index; i++) {
+		cgroup_free_value(dst->values[i]);
+		dst->values[i] = NULL;
 	}
+	dst->index = 0;
+	cgroup_reindex_values(dst);
 
 	return ret;
 }
@@ -2947,18 +3951,23 @@ int cgroup_copy_cgroup(struct cgroup *dst, struct cgroup *src)
 
 	cgroup_free_controllers(dst);
 
-	for (i = 0; i < src->index; i++, dst->index++) {
+	for (i = 0; i < src->index; i++) {
 		struct cgroup_controller *src_ctlr = src->controller[i];
 		struct cgroup_controller *dst_ctlr;
 
-		dst->controller[i] = calloc(1, sizeof(struct cgroup_controller));
-		if (!dst->controller[i]) {
+		dst_ctlr = calloc(1, sizeof(struct cgroup_controller));
+		if (!dst_ctlr) {
 			last_errno = errno;
 			ret = ECGOTHER;
 			goto err;
 		}
 
-		dst_ctlr = dst->controller[i];
+		ret = cgroup_append_controller(dst, dst_ctlr);
+		if (ret) {
+			free(dst_ctlr);
+			goto err;
+		}
+
 		ret = cgroup_copy_controller_values(dst_ctlr, src_ctlr);
 		if (ret)
 			goto err;
@@ -3598,7 +4607,7 @@ int cgroup_delete_cgroup_ext(struct cgroup *cgrp, int flags)
 		ret = 0;
 		controller_name = NULL;
 
-		if (cgrp->controller[i])
+		if (i < cgrp->index)
 			controller_name = cgrp->controller[i]->name;
 
 		/* Find parent, it can be different for each controller */
@@ -3716,43 +4725,27 @@ int cgroup_delete_cgroup_ext(struct cgroup *cgrp, int flags)
 	return first_error;
 }
 
-/*
- * This function should really have more checks, but this version will assume
- * that the callers have taken care of everything. Including the locking.
- */
-static int cg_rd_ctrl_file(const char *subsys, const char *cgrp, const char *file, char **value)
+int cg_rd_ctrl_file_at(int dir_fd, const char *name, char *value)
 {
-	char path[FILENAME_MAX];
-	FILE *ctrl_file = NULL;
-	int ret;
+	ssize_t len, ret;
+	int fd;
 
-	if (!cg_build_path_locked(cgrp, path, subsys))
-		return ECGFAIL;
-
-	strncat(path, file, sizeof(path) - strlen(path) - 1);
-	ctrl_file = fopen(path, "re");
-	if (!ctrl_file)
+	fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
 		return ECGROUPVALUENOTEXIST;
 
-	*value = calloc(CG_CONTROL_VALUE_MAX, 1);
-	if (!*value) {
-		fclose(ctrl_file);
-		last_errno = errno;
-		return ECGOTHER;
-	}
-
 	/* Using %as crashes when we try to read from files like memory.stat */
-	ret = fread(*value, 1, CG_CONTROL_VALUE_MAX-1, ctrl_file);
-	if (ret < 0) {
-		free(*value);
-		*value = NULL;
-	} else {
-		/* Remove trailing \n */
-		if (ret > 0 && (*value)[ret-1] == '\n')
-			(*value)[ret-1] = '\0';
+	for (len = 0; len < CG_CONTROL_VALUE_MAX - 1; len += ret) {
+		ret = read(fd, value + len, CG_CONTROL_VALUE_MAX - 1 - len);
+		if (ret <= 0)
+			break;
 	}
+	close(fd);
 
-	fclose(ctrl_file);
+	/* Remove trailing \n */
+	if (len > 0 && value[len - 1] == '\n')
+		len--;
+	value[len] = '\0';
 
 	return 0;
 }
@@ -3760,45 +4753,22 @@ static int cg_rd_ctrl_file(const char *subsys, const char *cgrp, const char *fil
 /*
  * Call this function with required locks taken.
  */
-int cgroup_fill_cgc(struct dirent *ctrl_dir, struct cgroup *cgrp, struct cgroup_controller *cgc,
-		    int cg_index)
+int cgroup_fill_cgc_at(const struct cg_dir * const dir, struct dirent *ctrl_dir,
+		       struct cgroup *cgrp, struct cgroup_controller *cgc, int cg_index)
 {
-	char path[FILENAME_MAX+1];
+	const char *ctrl_name = cg_mount_table[cg_index].name;
+	const char *d_name = ctrl_dir->d_name;
+	char ctrl_value[CG_CONTROL_VALUE_MAX];
 	struct stat stat_buffer;
-	char *ctrl_value = NULL;
-	char *ctrl_name = NULL;
-	char *ctrl_file = NULL;
-	char *tmp_path = NULL;
-	char *d_name = NULL;
-	char *buffer = NULL;
-	int tmp_len = 0;
-	int error = 0;
-
-	d_name = strdup(ctrl_dir->d_name);
-
-	if (!d_name) {
-		error = ECGOTHER;
-		cgroup_err("strdup failed to allocate memory: %s\n", strerror(errno));
-		goto fill_error;
-	}
-
-	if (!strcmp(d_name, ".") || !strcmp(d_name, "..")) {
-		error = ECGINVAL;
-		goto fill_error;
-	}
+	const char *ctrl_file;
+	size_t len;
+	int error;
 
-	/*
-	 * This part really needs to be optimized out. Probably use some
-	 * sort of a flag, but this is fine for now.
-	 */
-	cg_build_path_locked(cgrp->name, path, cg_mount_table[cg_index].name);
-	strncat(path, d_name, sizeof(path) - strlen(path) - 1);
+	if (!strcmp(d_name, ".") || !strcmp(d_name, ".."))
+		return ECGINVAL;
 
-	error = stat(path, &stat_buffer);
-	if (error) {
-		error = ECGFAIL;
-		goto fill_error;
-	}
+	if (fstatat(dir->fd, d_name, &stat_buffer, 0))
+		return ECGFAIL;
 
 	/*
 	 * We have already stored the tasks_uid & tasks_gid. This check is
@@ -3807,52 +4777,229 @@ int cgroup_fill_cgc(struct dirent *ctrl_dir, struct cgroup *cgrp, struct cgroup_
 	 * the user who is capable of putting a task to this cgroup.
 	 * control_uid and control_gid is meant for the users who are capable
 	 * of managing the cgroup shares.
-	 *
-	 * The strstr() function will return the pointer to the
-	 * beginning of the sub string "/tasks".
-	 */
-	tmp_len = strlen(path) - strlen("/tasks");
-
-	/* tmp_path would be pointing to the last six characters */
-	tmp_path = (char *)path + tmp_len;
-
-	/*
-	 * Checking to see, if this is actually a 'tasks' file We need to
-	 * compare the last 6 bytes
 	 */
-	if (strcmp(tmp_path, "/tasks")) {
+	if (strcmp(d_name, "tasks")) {
 		cgrp->control_uid = stat_buffer.st_uid;
 		cgrp->control_gid = stat_buffer.st_gid;
 	}
 
-	ctrl_name = strtok_r(d_name, ".", &buffer);
-	if (!ctrl_name) {
-		error = ECGFAIL;
-		goto fill_error;
+	/* The setting is named <controller>.<file> */
+	ctrl_file = strchr(d_name, '.');
+	if (!ctrl_file || !ctrl_file[strspn(ctrl_file, ".")])
+		return ECGINVAL;
+
+	len = ctrl_file - d_name;
+	if (strncmp(d_name, ctrl_name, len) || ctrl_name[len] != '\0')
+		return 0;
+
+	error = cg_rd_ctrl_file_at(dir->fd, d_name, ctrl_value);
+	if (error)
+		return error;
+
+	if (cgroup_add_value_string(cgc, d_name, ctrl_value))
+		return ECGFAIL;
+
+	return 0;
+}
+
+/*
+ * Call this function with required locks taken.
+ */
+int cgroup_fill_cgc(struct dirent *ctrl_dir, struct cgroup *cgrp, struct cgroup_controller *cgc,
+		    int cg_index)
+{
+	char path[FILENAME_MAX];
+	struct cg_dir dir;
+	int error;
+
+	if (!cg_build_path_locked(cgrp->name, path, cg_mount_table[cg_index].name))
+		return ECGFAIL;
+
+	if (cg_dir_open(&dir, path))
+		return ECGFAIL;
+
+	error = cgroup_fill_cgc_at(&dir, ctrl_dir, cgrp, cgc, cg_index);
+	cg_dir_close(&dir);
+
+	return error;
+}
+
+/*
+ * On cgroup v2 every controller of a cgroup shares its directory.
+ * cgroup_get_cgroup() checks the directory and reads its cgroup.controllers
+ * file once, then reads the values of all these controllers in a single
+ * pass over the directory.
+ */
+struct cg_v2_dir {
+	/* The cgroup directory, empty until the first v2 controller */
+	char path[FILENAME_MAX];
+	/* The content of its cgroup.controllers file */
+	char controllers[FILENAME_MAX];
+	/* The controllers to read the values of */
+	struct cgroup_controller *cgc[CG_CONTROLLER_MAX];
+	int cgc_cnt;
+};
+
+/*
+ * Same as cgroupv2_get_controllers(), from the cgroup.controllers file
+ * read by the first call for the directory.
+ */
+static int cg_v2_dir_get_controllers(struct cg_v2_dir *v2_dir, const char *path,
+				     const char *ctrl_name, bool * const enabled)
+{
+	char file[FILENAME_MAX + sizeof(CGV2_CONTROLLERS_FILE)];
+	const char *token;
+	size_t name_len;
+	ssize_t len;
+	int fd;
+
+	*enabled = false;
+
+	if (!v2_dir->path[0]) {
+		snprintf(file, sizeof(file), "%s/%s", path, CGV2_CONTROLLERS_FILE);
+		fd = open(file, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			cgroup_warn("fopen failed\n");
+			last_errno = errno;
+			return ECGOTHER;
+		}
+
+		len = read(fd, v2_dir->controllers, sizeof(v2_dir->controllers) - 1);
+		close(fd);
+		if (len < 0) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+		v2_dir->controllers[len] = '\0';
+
+		snprintf(v2_dir->path, sizeof(v2_dir->path), "%s", path);
+	}
+
+	name_len = strlen(ctrl_name);
+	for (token = v2_dir->controllers; *token; token += strcspn(token, " \n")) {
+		token += strspn(token, " \n");
+		if (!strncmp(token, ctrl_name, name_len) &&
+		    (token[name_len] == ' ' || token[name_len] == '\n' || !token[name_len])) {
+			*enabled = true;
+			return 0;
+		}
+	}
+
+	return ECGROUPNOTMOUNTED;
+}
+
+/*
+ * Clear the dirty flags of the values read from the filesystem, and
+ * make sure that memory.limit_in_bytes is placed before
+ * memory.memsw.limit_in_bytes in the list of values.
+ */
+static void cg_get_cgroup_finish_cgc(struct cgroup_controller *cgc)
+{
+	int memsw_limit, mem_limit;
+	struct control_value *val;
+	int j;
+
+	for (j = 0; j < cgc->index; j++)
+		cgc->values[j]->dirty = false;
+
+	if (strcmp(cgc->name, "memory"))
+		return;
+
+	memsw_limit = cgroup_find_value(cgc, "memory.memsw.limit_in_bytes");
+	mem_limit = cgroup_find_value(cgc, "memory.limit_in_bytes");
+
+	if (memsw_limit >= 0 && memsw_limit < mem_limit) {
+		val = cgc->values[memsw_limit];
+		cgc->values[memsw_limit] = cgc->values[mem_limit];
+		cgc->values[mem_limit] = val;
+		cgroup_reindex_values(cgc);
 	}
+}
+
+/*
+ * Read the values of all the v2 controllers of cg_v2_dir with one walk
+ * over the directory. Every file goes to the controller named by its
+ * prefix and only one file is stat()ed for the ownership: as for
+ * cgroup_fill_cgc(), control_uid and control_gid are the owner of the
+ * last regular file.
+ */
+static int cg_v2_dir_read_values(struct cgroup *cgrp, struct cg_v2_dir *v2_dir)
+{
+	char value[CG_CONTROL_VALUE_MAX];
+	char last[NAME_MAX + 1] = "";
+	struct cgroup_controller *cgc;
+	char dents[8192] __attribute__((aligned(8)));
+	struct stat stat_buffer;
+	struct dirent64 *dent;
+	int error = 0;
+	size_t len;
+	ssize_t cnt;
+	char *dot;
+	int dir_fd;
+	int i, off;
 
-	ctrl_file = strtok_r(NULL, ".", &buffer);
-	if (!ctrl_file) {
-		error = ECGINVAL;
-		goto fill_error;
+	dir_fd = open(v2_dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd < 0) {
+		last_errno = errno;
+		return ECGOTHER;
 	}
 
-	if (strcmp(ctrl_name, cg_mount_table[cg_index].name) == 0) {
-		error = cg_rd_ctrl_file(cg_mount_table[cg_index].name, cgrp->name,
-					ctrl_dir->d_name, &ctrl_value);
-		if (error || !ctrl_value)
-			goto fill_error;
+	while ((cnt = getdents64(dir_fd, dents, sizeof(dents))) > 0) {
+		for (off = 0; off < cnt; off += dent->d_reclen) {
+			dent = (struct dirent64 *)(dents + off);
+
+			/* Skip over non regular files */
+			if (dent->d_type != DT_REG)
+				continue;
+
+			snprintf(last, sizeof(last), "%s", dent->d_name);
+
+			dot = strchr(dent->d_name, '.');
+			if (!dot || !dot[1])
+				continue;
+			len = dot - dent->d_name;
+
+			cgc = NULL;
+			for (i = 0; i < v2_dir->cgc_cnt; i++) {
+				if (!strncmp(v2_dir->cgc[i]->name, dent->d_name, len) &&
+				    v2_dir->cgc[i]->name[len] == '\0') {
+					cgc = v2_dir->cgc[i];
+					break;
+				}
+			}
+			if (!cgc)
+				continue;
+
+			if (cg_rd_ctrl_file_at(dir_fd, dent->d_name, value))
+				continue;
+
+			if (cgroup_add_value_string(cgc, dent->d_name, value)) {
+				error = ECGFAIL;
+				goto out;
+			}
+		}
+	}
+	if (cnt < 0) {
+		last_errno = errno;
+		error = ECGOTHER;
+		goto out;
+	}
 
-		if (cgroup_add_value_string(cgc, ctrl_dir->d_name, ctrl_value)) {
+	if (last[0]) {
+		if (fstatat(dir_fd, last, &stat_buffer, 0)) {
 			error = ECGFAIL;
-			goto fill_error;
+			goto out;
 		}
+
+		cgrp->control_uid = stat_buffer.st_uid;
+		cgrp->control_gid = stat_buffer.st_gid;
 	}
-fill_error:
-	if (ctrl_value)
-		free(ctrl_value);
-	if (d_name)
-		free(d_name);
+
+	for (i = 0; i < v2_dir->cgc_cnt; i++)
+		cg_get_cgroup_finish_cgc(v2_dir->cgc[i]);
+
+out:
+	close(dir_fd);
 
 	return error;
 }
@@ -3868,13 +5015,14 @@ int cgroup_get_cgroup(struct cgroup *cgrp)
 	char cgrp_ctrl_path[FILENAME_MAX];
 	struct dirent *ctrl_dir = NULL;
 	char mnt_path[FILENAME_MAX];
+	struct cg_v2_dir *v2_dir;
 	int initial_controller_cnt;
-	char *control_path = NULL;
 	int controller_cnt = 0;
+	struct cg_dir cgrp_dir;
+	bool shared_v2_dir;
 	DIR *dir = NULL;
 	int error;
 	int i, j;
-	int ret;
 
 	if (!cgroup_initialized) {
 		/* ECGROUPNOTINITIALIZED */
@@ -3888,6 +5036,15 @@ int cgroup_get_cgroup(struct cgroup *cgrp)
 
 	initial_controller_cnt = cgrp->index;
 
+	v2_dir = malloc(sizeof(*v2_dir));
+	if (!v2_dir) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+	v2_dir->path[0] = '\0';
+	v2_dir->cgc_cnt = 0;
+	cgrp_dir.fd = -1;
+
 	pthread_rwlock_rdlock(&cg_mount_table_lock);
 	for (i = 0; i < CG_CONTROLLER_MAX && cg_mount_table[i].name[0] != '\0'; i++) {
 		struct cgroup_controller *cgc;
@@ -3911,47 +5068,54 @@ int cgroup_get_cgroup(struct cgroup *cgrp)
 				continue;
 		}
 
-		if (!cg_build_path_locked(NULL, mnt_path, cg_mount_table[i].name))
-			continue;
-
-		mnt_path_len = strlen(mnt_path);
-		strncat(mnt_path, cgrp->name, FILENAME_MAX - mnt_path_len - 1);
-		mnt_path[sizeof(mnt_path) - 1] = '\0';
-
-		if (access(mnt_path, F_OK))
-			continue;
-
 		if (!cg_build_path_locked(cgrp->name, cgrp_ctrl_path, cg_mount_table[i].name)) {
 			/* This fails when the cgroup does not exist for that controller. */
 			continue;
 		}
 
-		/* Get the uid and gid information. */
-		if (cg_mount_table[i].version == CGROUP_V1) {
-			ret = asprintf(&control_path, "%s/tasks", cgrp_ctrl_path);
+		/* The v2 controllers in the directory of the first one are read in one pass */
+		shared_v2_dir = cg_mount_table[i].version == CGROUP_V2 &&
+			(!v2_dir->path[0] || !strcmp(cgrp_ctrl_path, v2_dir->path));
 
-			if (ret < 0) {
-				last_errno = errno;
-				error = ECGOTHER;
+		/* The directory of the first v2 controller has been checked already */
+		if (!shared_v2_dir || !v2_dir->path[0]) {
+			if (!cg_build_path_locked(NULL, mnt_path, cg_mount_table[i].name))
+				continue;
+
+			mnt_path_len = strlen(mnt_path);
+			strncat(mnt_path, cgrp->name, FILENAME_MAX - mnt_path_len - 1);
+			mnt_path[sizeof(mnt_path) - 1] = '\0';
+
+			if (access(mnt_path, F_OK))
+				continue;
+		}
+
+		/* The files of the directory are read relative to it */
+		if (!shared_v2_dir) {
+			error = cg_dir_open(&cgrp_dir, cgrp_ctrl_path);
+			if (error)
 				goto unlock_error;
-			}
+		}
 
-			if (stat(control_path, &stat_buffer)) {
+		/* Get the uid and gid information. */
+		if (cg_mount_table[i].version == CGROUP_V1) {
+			if (fstatat(cgrp_dir.fd, "tasks", &stat_buffer, 0)) {
 				last_errno = errno;
-				free(control_path);
 				error = ECGOTHER;
 				goto unlock_error;
 			}
 
 			cgrp->tasks_uid = stat_buffer.st_uid;
 			cgrp->tasks_gid = stat_buffer.st_gid;
-
-			free(control_path);
 		} else { /* cgroup v2 */
 			bool enabled;
 
-			error = cgroupv2_get_controllers(cgrp_ctrl_path, cg_mount_table[i].name,
-							 &enabled);
+			if (shared_v2_dir)
+				error = cg_v2_dir_get_controllers(v2_dir, cgrp_ctrl_path,
+								  cg_mount_table[i].name, &enabled);
+			else
+				error = cgroupv2_get_controllers(cgrp_ctrl_path,
+								 cg_mount_table[i].name, &enabled);
 			if (error == ECGROUPNOTMOUNTED) {
 				/*
 				 * This controller isn't enabled.  Only hide it from the
@@ -3962,6 +5126,7 @@ int cgroup_get_cgroup(struct cgroup *cgrp)
 				 * interested in this controller and we should not remove it.
 				 */
 				if (initial_controller_cnt == 0) {
+					cg_dir_close(&cgrp_dir);
 					controller_cnt++;
 					continue;
 				}
@@ -3979,7 +5144,13 @@ int cgroup_get_cgroup(struct cgroup *cgrp)
 			goto unlock_error;
 		}
 
-		dir = opendir(cgrp_ctrl_path);
+		if (shared_v2_dir) {
+			v2_dir->cgc[v2_dir->cgc_cnt++] = cgc;
+			controller_cnt++;
+			continue;
+		}
+
+		dir = cg_dir_opendir(&cgrp_dir);
 		if (!dir) {
 			last_errno = errno;
 			error = ECGOTHER;
@@ -3993,39 +5164,22 @@ int cgroup_get_cgroup(struct cgroup *cgrp)
 			if (ctrl_dir->d_type != DT_REG)
 				continue;
 
-			error = cgroup_fill_cgc(ctrl_dir, cgrp, cgc, i);
-			for (j = 0; j < cgc->index; j++)
-				cgc->values[j]->dirty = false;
-
+			error = cgroup_fill_cgc_at(&cgrp_dir, ctrl_dir, cgrp, cgc, i);
 			if (error == ECGFAIL) {
 				closedir(dir);
 				goto unlock_error;
 			}
 		}
 		closedir(dir);
+		cg_dir_close(&cgrp_dir);
 
-		if (!strcmp(cgc->name, "memory")) {
-			/*
-			 * Make sure that memory.limit_in_bytes is placed before
-			 * memory.memsw.limit_in_bytes in the list of values
-			 */
-			int memsw_limit = -1;
-			int mem_limit = -1;
-
-			for (j = 0; j < cgc->index; j++) {
-				if (!strcmp(cgc->values[j]->name, "memory.memsw.limit_in_bytes"))
-					memsw_limit = j;
-				else if (!strcmp(cgc->values[j]->name, "memory.limit_in_bytes"))
-					mem_limit = j;
-			}
-
-			if (memsw_limit >= 0 && memsw_limit < mem_limit) {
-				struct control_value *val = cgc->values[memsw_limit];
+		cg_get_cgroup_finish_cgc(cgc);
+	}
 
-				cgc->values[memsw_limit] = cgc->values[mem_limit];
-				cgc->values[mem_limit] = val;
-			}
-		}
+	if (v2_dir->cgc_cnt) {
+		error = cg_v2_dir_read_values(cgrp, v2_dir);
+		if (error)
+			goto unlock_error;
 	}
 
 	/*
@@ -4041,11 +5195,14 @@ int cgroup_get_cgroup(struct cgroup *cgrp)
 	}
 
 	pthread_rwlock_unlock(&cg_mount_table_lock);
+	free(v2_dir);
 
 	return 0;
 
 unlock_error:
 	pthread_rwlock_unlock(&cg_mount_table_lock);
+	cg_dir_close(&cgrp_dir);
+	free(v2_dir);
 	/*
 	 * XX: Need to figure out how to cleanup? Cleanup just the stuff
 	 * we added, or the whole structure.
@@ -4401,6 +5558,112 @@ static struct cgroup_rule *cgroup_find_matching_rule_uid_gid(uid_t uid, gid_t gi
 	return NULL;
 }
 
+/*
+ * Check the rest of a rule, once its UID/GID matched. Returns true if the
+ * rule is the one to apply, which may be an ignore rule matching the pid.
+ */
+static bool cgroup_rule_matches_proc(const struct cgroup_rule * const rule, pid_t pid,
+				     const char *procname, const char *base)
+{
+	if (cgroup_compare_ignore_rule(rule, pid, procname))
+		/*
+		 * This pid matched a rule that instructs the
+		 * cgrules daemon to ignore this process.
+		 */
+		return true;
+	if (rule->is_ignore)
+		/*
+		 * The rule currently being examined is an ignore
+		 * rule, but it didn't match this pid. Move on to
+		 * the next rule
+		 */
+		return false;
+	if (!procname)
+		/* If procname is NULL, return a rule matching UID or GID. */
+		return true;
+	if (!rule->procname)
+		/* If no process name in a rule, that means wildcard */
+		return true;
+	if (!strcmp(rule->procname, procname))
+		return true;
+	if (base && !strcmp(rule->procname, base))
+		/* Check a rule of basename. */
+		return true;
+	if (cgroup_compare_wildcard_procname(rule->procname, procname))
+		return true;
+
+	return false;
+}
+
+/**
+ * Finds the first rule matching the given UID, GID and process name by
+ * walking a list of rules.
+ *	@param rule The first rule of the list
+ *	@param base The basename of procname, may be NULL
+ *	@return Pointer to the first matching rule, or NULL if no match
+ */
+STATIC struct cgroup_rule *cgroup_find_rule_in_list(struct cgroup_rule *rule, uid_t uid,
+						    gid_t gid, pid_t pid, const char *procname,
+						    const char *base)
+{
+	while (rule) {
+		rule = cgroup_find_matching_rule_uid_gid(uid, gid, rule);
+		if (!rule)
+			break;
+		if (cgroup_rule_matches_proc(rule, pid, procname, base))
+			break;
+		rule = rule->next;
+	}
+
+	return rule;
+}
+
+/**
+ * Finds the first rule matching the given UID, GID and process name in an
+ * index built by cgroup_build_rule_index(). The rules of the UID, of the GID
+ * and the wildcard rules are merged by their position in the list, so the
+ * result is the same as cgroup_find_rule_in_list() on the indexed list.
+ * CGRULE_INVALID and CGRULE_WILD are not indexed, the caller has to walk
+ * the list for them.
+ *	@param idx The index to search
+ *	@param base The basename of procname, may be NULL
+ *	@return Pointer to the first matching rule, or NULL if no match
+ */
+STATIC struct cgroup_rule *cgroup_find_rule_in_index(const struct cgroup_rule_index * const idx,
+						     uid_t uid, gid_t gid, pid_t pid,
+						     const char *procname, const char *base)
+{
+	const int *pos[3] = { NULL, NULL, idx->wild };
+	int cnt[3] = { 0, 0, idx->wild_cnt };
+	int itr[3] = { 0, 0, 0 };
+	struct cgroup_rule *rule;
+	int i, next;
+
+	cnt[0] = cg_rule_csr_find(&idx->uid, uid, &pos[0]);
+	cnt[1] = cg_rule_csr_find(&idx->gid, gid, &pos[1]);
+
+	while (1) {
+		/* The earliest rule of the three lists is the next candidate */
+		next = idx->rule_cnt;
+		for (i = 0; i < 3; i++) {
+			if (itr[i] < cnt[i] && pos[i][itr[i]] < next)
+				next = pos[i][itr[i]];
+		}
+
+		if (next == idx->rule_cnt)
+			return NULL;
+
+		for (i = 0; i < 3; i++) {
+			if (itr[i] < cnt[i] && pos[i][itr[i]] == next)
+				itr[i]++;
+		}
+
+		rule = idx->rules[next];
+		if (cgroup_rule_matches_proc(rule, pid, procname, base))
+			return rule;
+	}
+}
+
 /**
  * Finds the first rule in the cached list that matches the given UID, GID
  * or PROCESS NAME, and returns a pointer to that rule.
@@ -4417,50 +5680,32 @@ static struct cgroup_rule *cgroup_find_matching_rule(uid_t uid, gid_t gid, pid_t
 						     const char *procname)
 {
 	/* Return value */
-	struct cgroup_rule *ret = rl.head;
+	struct cgroup_rule *ret;
 	char *base = NULL;
 
-	pthread_rwlock_wrlock(&rl_lock);
-	while (ret) {
-		ret = cgroup_find_matching_rule_uid_gid(uid, gid, ret);
-		if (!ret)
-			break;
-		if (cgroup_compare_ignore_rule(ret, pid, procname))
-			/*
-			 * This pid matched a rule that instructs the
-			 * cgrules daemon to ignore this process.
-			 */
-			break;
-		if (ret->is_ignore) {
-			/*
-			 * The rule currently being examined is an ignore
-			 * rule, but it didn't match this pid. Move on to
-			 * the next rule
-			 */
-			ret = ret->next;
-			continue;
-		}
-		if (!procname)
-			/* If procname is NULL, return a rule matching UID or GID. */
-			break;
-		if (!ret->procname)
-			/* If no process name in a rule, that means wildcard */
-			break;
-		if (!strcmp(ret->procname, procname))
-			break;
-
+	if (procname)
 		base = cgroup_basename(procname);
-		if (!strcmp(ret->procname, base))
-			/* Check a rule of basename. */
-			break;
-		if (cgroup_compare_wildcard_procname(ret->procname, procname))
-			break;
-		ret = ret->next;
-		free(base);
-		base = NULL;
+
+	/*
+	 * The index is only read, the threads can search it together.  The
+	 * walk of the list calls getpwuid() and getgrgid(), one at a time.
+	 */
+	if (uid != CGRULE_INVALID && uid != CGRULE_WILD &&
+	    gid != CGRULE_INVALID && gid != CGRULE_WILD) {
+		pthread_rwlock_rdlock(&rl_lock);
+		if (rl_index.rules) {
+			ret = cgroup_find_rule_in_index(&rl_index, uid, gid, pid, procname, base);
+			pthread_rwlock_unlock(&rl_lock);
+			goto out;
+		}
+		pthread_rwlock_unlock(&rl_lock);
 	}
+
+	pthread_rwlock_wrlock(&rl_lock);
+	ret = cgroup_find_rule_in_list(rl.head, uid, gid, pid, procname, base);
 	pthread_rwlock_unlock(&rl_lock);
 
+out:
 	if (base)
 		free(base);
 
@@ -4656,41 +5901,133 @@ end:
 	return ret;
 }
 
-int cgroup_change_cgroup_flags(uid_t uid, gid_t gid, const char *procname, pid_t pid, int flags)
+/*
+ * Substitute the %U, %u, %G, %g, %P and %p tags in the destination of a rule
+ * for the values of a process
+ */
+static void cgroup_rule_destination(const struct cgroup_rule * const rule, uid_t uid, gid_t gid,
+				    pid_t pid, const char * const procname, char * const newdest)
 {
-	/* Temporary pointer to a rule */
-	struct cgroup_rule *tmp = NULL;
-
-	/* Temporary variables for destination substitution */
-	char newdest[FILENAME_MAX];
 	struct passwd *user_info;
 	struct group *group_info;
+	struct passwd user_buf;
+	struct group group_buf;
+	char name_buf[4096];
 	int available;
 	int written;
 	int i, j;
 
-	/* Return codes */
-	int ret = 0;
-
-	/* We need to check this before doing anything else! */
-	if (!cgroup_initialized) {
-		cgroup_warn("libcgroup is not initialized\n");
-		ret = ECGROUPNOTINITIALIZED;
-		goto finished;
+	for (j = i = 0; i < strlen(rule->destination) && (j < FILENAME_MAX - 2); ++i, ++j) {
+		if (rule->destination[i] == '%') {
+			/* How many bytes did we write / error check */
+			written = 0;
+			/* How many bytes can we write */
+			available = FILENAME_MAX - j - 2;
+			/* Substitution */
+			switch (rule->destination[++i]) {
+			case 'U':
+				written = snprintf(newdest+j, available, "%d", uid);
+				break;
+			case 'u':
+				/* The reentrant variants, the daemon classifies in threads */
+				if (getpwuid_r(uid, &user_buf, name_buf, sizeof(name_buf),
+					       &user_info))
+					user_info = NULL;
+				if (user_info) {
+					written = snprintf(newdest + j, available, "%s",
+							   user_info->pw_name);
+				} else {
+					written = snprintf(newdest + j, available, "%d",
+							   uid);
+				}
+				break;
+			case 'G':
+				written = snprintf(newdest + j,	available, "%d", gid);
+				break;
+			case 'g':
+				if (getgrgid_r(gid, &group_buf, name_buf, sizeof(name_buf),
+					       &group_info))
+					group_info = NULL;
+				if (group_info) {
+					written = snprintf(newdest + j,	available, "%s",
+							   group_info->gr_name);
+				} else {
+					written = snprintf(newdest + j,	available, "%d",
+							   gid);
+				}
+				break;
+			case 'P':
+				written = snprintf(newdest + j,	available, "%d", pid);
+				break;
+			case 'p':
+				if (procname) {
+					written = snprintf(newdest + j,	available, "%s",
+							   procname);
+				} else {
+					written = snprintf(newdest + j,	available, "%d",
+							   pid);
+				}
+				break;
+			}
+			written = min(written, available);
+			/*
+			 * written<1 only when either error occurred
+			 * during snprintf or if no substitution was made
+			 * at all. In both cases, we want to just copy
+			 * input string.
+			 */
+			if (written < 1) {
+				newdest[j] = '%';
+				if (available > 1)
+					newdest[++j] = rule->destination[i];
+			} else {
+				/*
+				 * In next iteration, we will write just
+				 * after the substitution, but j will get
+				 * incremented in the meantime.
+				 */
+				j += written - 1;
+			}
+		} else {
+			if (rule->destination[i] == '\\')
+				++i;
+			newdest[j] = rule->destination[i];
+		}
 	}
 
+	newdest[j] = 0;
+}
+
+/*
+ * Find the rule matching a process, in the cached rules or in the rules
+ * parsed for it, as the flags ask.  rule is NULL when none matches.
+ */
+static int cg_find_rule(uid_t uid, gid_t gid, const char *procname, pid_t pid, int * const flags,
+			struct cgroup_rule **rule)
+{
+	int ret;
+
+	*rule = NULL;
+
 	/*
 	 * User had asked to find the matching rule (if one exist) in the
 	 * cached rules but the list might be empty due to the inactive
 	 * cgrulesengd. Lets emulate its behaviour of caching the rules by
-	 * reloading the rules from the configuration file.
+	 * reloading the rules from the configuration file.  If cgrulesengd
+	 * publishes its rules, match in them instead: only the matching rule
+	 * is copied out.
 	 */
-	if ((flags & CGFLAG_USECACHE) && (rl.head == NULL)) {
-		cgroup_warn("no cached rules found, trying to reload from %s.\n",
-			    CGRULES_CONF_FILE);
-		ret = cgroup_reload_cached_rules();
-		if (ret != 0)
-			goto finished;
+	if ((*flags & CGFLAG_USECACHE) && (rl.head == NULL)) {
+		if (!rl_publish && cg_rules_shm_published()) {
+			cgroup_dbg("matching the rules published in %s\n", CGRULES_SHM_NAME);
+			*flags &= ~CGFLAG_USECACHE;
+		} else {
+			cgroup_warn("no cached rules found, trying to reload from %s.\n",
+				    CGRULES_CONF_FILE);
+			ret = cgroup_reload_cached_rules();
+			if (ret != 0)
+				return ret;
+		}
 	}
 
 	/*
@@ -4698,35 +6035,58 @@ int cgroup_change_cgroup_flags(uid_t uid, gid_t gid, const char *procname, pid_t
 	 * configuration to find a matching rule (if one exists).
 	 * Else, we'll find the first match in the cached list (rl).
 	 */
-	if (!(flags & CGFLAG_USECACHE)) {
+	if (!(*flags & CGFLAG_USECACHE)) {
 		cgroup_dbg("Not using cached rules for PID %d.\n", pid);
 		ret = cgroup_parse_rules(false, uid, gid, procname);
 
 		/* The configuration file has an error!  We must exit now. */
 		if (ret != -1 && ret != 0) {
 			cgroup_err("failed to parse the configuration rules\n");
-			goto finished;
+			return ret;
 		}
 
 		/* We did not find a matching rule, so we're done. */
 		if (ret == 0) {
 			cgroup_dbg("No rule found to match PID: %d, UID: %d, GID: %d\n",
 				   pid, uid, gid);
-			goto finished;
+			return 0;
 		}
 
 		/* Otherwise, we did match a rule and it's in trl. */
-		tmp = trl.head;
+		*rule = trl.head;
 	} else {
 		/* Find the first matching rule in the cached list. */
-		tmp = cgroup_find_matching_rule(uid, gid, pid, procname);
-		if (!tmp) {
+		*rule = cgroup_find_matching_rule(uid, gid, pid, procname);
+		if (!*rule)
 			cgroup_dbg("No rule found to match PID: %d, UID: %d, GID: %d\n",
 				   pid, uid, gid);
-			ret = 0;
-			goto finished;
-		}
 	}
+
+	return 0;
+}
+
+int cgroup_change_cgroup_flags(uid_t uid, gid_t gid, const char *procname, pid_t pid, int flags)
+{
+	/* Temporary pointer to a rule */
+	struct cgroup_rule *tmp = NULL;
+
+	/* Destination after substitution */
+	char newdest[FILENAME_MAX];
+
+	/* Return codes */
+	int ret = 0;
+
+	/* We need to check this before doing anything else! */
+	if (!cgroup_initialized) {
+		cgroup_warn("libcgroup is not initialized\n");
+		ret = ECGROUPNOTINITIALIZED;
+		goto finished;
+	}
+
+	ret = cg_find_rule(uid, gid, procname, pid, &flags, &tmp);
+	if (ret || !tmp)
+		goto finished;
+
 	cgroup_dbg("Found matching rule %s for PID: %d, UID: %d, GID: %d\n",
 		   tmp->username, pid, uid, gid);
 
@@ -4744,82 +6104,7 @@ int cgroup_change_cgroup_flags(uid_t uid, gid_t gid, const char *procname, pid_t
 	do {
 		cgroup_dbg("Executing rule %s for PID %d... ", tmp->username, pid);
 
-		/* Destination substitutions */
-		for (j = i = 0; i < strlen(tmp->destination) &&
-			(j < FILENAME_MAX - 2); ++i, ++j) {
-			if (tmp->destination[i] == '%') {
-				/* How many bytes did we write / error check */
-				written = 0;
-				/* How many bytes can we write */
-				available = FILENAME_MAX - j - 2;
-				/* Substitution */
-				switch (tmp->destination[++i]) {
-				case 'U':
-					written = snprintf(newdest+j, available, "%d", uid);
-					break;
-				case 'u':
-					user_info = getpwuid(uid);
-					if (user_info) {
-						written = snprintf(newdest + j, available, "%s",
-								   user_info->pw_name);
-					} else {
-						written = snprintf(newdest + j, available, "%d",
-								   uid);
-					}
-					break;
-				case 'G':
-					written = snprintf(newdest + j,	available, "%d", gid);
-					break;
-				case 'g':
-					group_info = getgrgid(gid);
-					if (group_info) {
-						written = snprintf(newdest + j,	available, "%s",
-								   group_info->gr_name);
-					} else {
-						written = snprintf(newdest + j,	available, "%d",
-								   gid);
-					}
-					break;
-				case 'P':
-					written = snprintf(newdest + j,	available, "%d", pid);
-					break;
-				case 'p':
-					if (procname) {
-						written = snprintf(newdest + j,	available, "%s",
-								   procname);
-					} else {
-						written = snprintf(newdest + j,	available, "%d",
-								   pid);
-					}
-					break;
-				}
-				written = min(written, available);
-				/*
-				 * written<1 only when either error occurred
-				 * during snprintf or if no substitution was made
-				 * at all. In both cases, we want to just copy
-				 * input string.
-				 */
-				if (written < 1) {
-					newdest[j] = '%';
-					if (available > 1)
-						newdest[++j] = tmp->destination[i];
-				} else {
-					/*
-					 * In next iteration, we will write just
-					 * after the substitution, but j will get
-					 * incremented in the meantime.
-					 */
-					j += written - 1;
-				}
-			} else {
-				if (tmp->destination[i] == '\\')
-					++i;
-				newdest[j] = tmp->destination[i];
-			}
-		}
-
-		newdest[j] = 0;
+		cgroup_rule_destination(tmp, uid, gid, pid, procname, newdest);
 		if (strcmp(newdest, tmp->destination) != 0) {
 			/* Destination tag contains templates */
 
@@ -4882,10 +6167,11 @@ int cgroup_change_cgroup_uid_gid(uid_t uid, gid_t gid, pid_t pid)
  */
 int cgroup_change_cgroup_path(const char *dest, pid_t pid, const char *const controllers[])
 {
+	struct cg_attach_files files = { .cnt = 0 };
 	struct dirent *task_dir = NULL;
 	char path[FILENAME_MAX];
 	struct cgroup cgrp;
-	int nr, ret;
+	int nr, ret, i;
 	pid_t tid;
 	DIR *dir;
 
@@ -4913,13 +6199,30 @@ int cgroup_change_cgroup_path(const char *dest, pid_t pid, const char *const con
 			return ret;
 	}
 
+	/* The files of the cgroup are built once for the process and its threads */
+	ret = cg_attach_files_build(&cgrp, CG_ATTACH_TASK, &files);
+	if (ret) {
+		cgroup_warn("cgroup_attach_task_pid failed: %d\n", ret);
+		goto finished;
+	}
+
 	/* Add process to cgroup */
-	ret = cgroup_attach_task_pid(&cgrp, pid);
+	ret = cg_attach_files_write(&files, pid, false);
 	if (ret) {
 		cgroup_warn("cgroup_attach_task_pid failed: %d\n", ret);
 		goto finished;
 	}
 
+	/*
+	 * cgroup.procs moves all the threads of the process, only the tasks
+	 * files of cgroup v1 and the cgroup.threads files of threaded cgroups
+	 * need every thread written.
+	 */
+	for (i = 0; i < files.cnt && !files.per_thread[i]; i++)
+		;
+	if (i == files.cnt)
+		goto finished;
+
 	/* Add all threads to cgroup */
 	snprintf(path, FILENAME_MAX, "/proc/%d/task/", pid);
 	dir = opendir(path);
@@ -4937,7 +6240,7 @@ int cgroup_change_cgroup_path(const char *dest, pid_t pid, const char *const con
 		if (tid == pid)
 			continue;
 
-		ret = cgroup_attach_task_pid(&cgrp, tid);
+		ret = cg_attach_files_write(&files, tid, true);
 		if (ret) {
 			cgroup_warn("cgroup_attach_task_pid failed: %d\n", ret);
 			break;
@@ -4947,704 +6250,2634 @@ int cgroup_change_cgroup_path(const char *dest, pid_t pid, const char *const con
 	closedir(dir);
 
 finished:
+	cg_attach_files_free(&files);
 	cgroup_free_controllers(&cgrp);
 
 	return ret;
 }
 
-/**
- * Changes the cgroup of all running PIDs based on the rules in the config file.
- * If a rules exists for a PID, then the PID is placed in the correct group.
- *
- * This function may be called after creating new control groups to move
- * running PIDs into the newly created control groups.
- *	@return 0 on success, < 0 on error
+/*
+ * cgroup_spawn() creates the child in its cgroup v2 control group with
+ * clone3() and CLONE_INTO_CGROUP.  Otherwise, or to run the prepare callback,
+ * the child waits for a byte on a pipe while the parent moves it, and exits
+ * on the end of the file if the parent fails.  A second pipe, closed by the
+ * exec, returns the errno of the child when the program can't be run.
  */
-int cgroup_change_all_cgroups(void)
+
+/* Set when the kernel has no clone3(), the child is moved */
+STATIC int cg_clone3_unsupported;
+
+/*
+ * Open the directory of the control group the child can be created in.
+ * cgroup_fd is left at -1 when the child must be moved instead: several
+ * control groups, a hierarchy of cgroup v1, or a destination depending on
+ * the PID of the child.  move is false when no rule applies to the child.
+ */
+static int cg_spawn_resolve(const char * const file, const struct cgroup_spawn_opts * const opts,
+			    int * const cgroup_fd, bool * const move)
 {
-	struct dirent *pid_dir = NULL;
-	char *path = "/proc/";
-	DIR *dir;
+	struct cg_attach_files files = { .cnt = 0 };
+	const char * const *controllers;
+	enum cg_version_t version;
+	char dest[FILENAME_MAX];
+	struct cgroup_rule *rule;
+	int flags = opts->flags;
+	struct cgroup cgrp;
+	char *name;
+	int ret, i;
 
-	dir = opendir(path);
-	if (!dir)
-		return -ECGOTHER;
+	*cgroup_fd = -1;
+	*move = true;
+	memset(&cgrp, 0, sizeof(cgrp));
 
-	while ((pid_dir = readdir(dir)) != NULL) {
-		int err, pid;
-		uid_t euid;
-		gid_t egid;
-		char *procname = NULL;
+	if (opts->dests) {
+		if (opts->dest_cnt != 1)
+			return 0;
 
-		err = sscanf(pid_dir->d_name, "%i", &pid);
-		if (err < 1)
-			continue;
+		snprintf(dest, sizeof(dest), "%s", opts->dests[0].path);
+		controllers = opts->dests[0].controllers;
+	} else {
+		ret = cg_find_rule(opts->uid, opts->gid, file, getpid(), &flags, &rule);
+		if (ret)
+			return ret;
 
-		err = cgroup_get_uid_gid_from_procfs(pid, &euid, &egid);
-		if (err)
-			continue;
+		if (!rule || rule->is_ignore) {
+			*move = false;
+			return 0;
+		}
 
-		err = cgroup_get_procname_from_procfs(pid, &procname);
-		if (err)
-			continue;
+		if ((rule->next && rule->next->username[0] == '%') ||
+		    strstr(rule->destination, "%P"))
+			return 0;
 
-		err = cgroup_change_cgroup_flags(euid, egid, procname, pid, CGFLAG_USECACHE);
-		if (err)
-			cgroup_dbg("cgroup change pid %i failed\n", pid);
+		cgroup_rule_destination(rule, opts->uid, opts->gid, getpid(), file, dest);
+		if (strcmp(dest, rule->destination) != 0) {
+			ret = cgroup_create_template_group(dest, rule, flags);
+			if (ret) {
+				cgroup_warn("failed to create cgroup based on template %s\n", dest);
+				return ret;
+			}
+		}
+		controllers = (const char * const *)rule->controllers;
+	}
 
-		free(procname);
+	if (is_cgroup_mode_unified() && !controllers) {
+		snprintf(cgrp.name, FILENAME_MAX, "%s", dest);
+	} else {
+		if (!controllers)
+			return ECGINVAL;
+
+		ret = cg_prepare_cgroup(&cgrp, getpid(), dest, controllers);
+		if (ret)
+			return ret;
 	}
 
-	closedir(dir);
-	return 0;
+	/* All the controllers in the single hierarchy of cgroup v2 */
+	for (i = 0; i < cgrp.index; i++) {
+		ret = cgroup_get_controller_version(cgrp.controller[i]->name, &version);
+		if (ret || version != CGROUP_V2) {
+			ret = 0;
+			goto out;
+		}
+	}
+
+	ret = cg_attach_files_build(&cgrp, CG_ATTACH_PROCS, &files);
+	if (ret || files.cnt != 1)
+		goto out;
+
+	/* The directory of the cgroup.procs file */
+	name = strrchr(files.paths[0], '/');
+	if (name)
+		name[1] = '\0';
+
+	*cgroup_fd = open(files.paths[0], O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (*cgroup_fd < 0) {
+		last_errno = errno;
+		ret = cg_attach_open_error(errno);
+	}
+
+out:
+	cg_attach_files_free(&files);
+	cgroup_free_controllers(&cgrp);
+
+	return ret;
 }
 
-/**
- * Print the cached rules table.  This function should be called only after
- * first calling cgroup_parse_config(), but it will work with an empty rule
- * list.
- *	@param fp The file stream to print to
- */
-void cgroup_print_rules_config(FILE *fp)
+/* Create the child in the control group of cgroup_fd, if not -1 */
+static pid_t cg_spawn_clone3(int cgroup_fd, int * const pidfd)
 {
-	/* Iterator */
-	struct cgroup_rule *itr = NULL;
+#ifdef CLONE_INTO_CGROUP
+	struct clone_args args;
+	pid_t pid;
 
-	/* Loop variable */
-	int i = 0;
+	memset(&args, 0, sizeof(args));
+	args.flags = CLONE_PIDFD;
+	args.pidfd = (uintptr_t)pidfd;
+	args.exit_signal = SIGCHLD;
+	if (cgroup_fd >= 0) {
+		args.flags |= CLONE_INTO_CGROUP;
+		args.cgroup = cgroup_fd;
+	}
 
-	pthread_rwlock_rdlock(&rl_lock);
+	pid = syscall(__NR_clone3, &args, sizeof(args));
+	if (pid >= 0)
+		return pid;
 
-	if (!(rl.head)) {
-		fprintf(fp, "The rules table is empty.\n\n");
-		pthread_rwlock_unlock(&rl_lock);
-		return;
+	/*
+	 * CLONE_INTO_CGROUP is unknown before Linux 5.7, which can't be told
+	 * apart from a control group the child can't be created in: only this
+	 * child is moved, the move reports the error of the control group.
+	 */
+	if (errno == EINVAL && cgroup_fd >= 0) {
+		errno = ENOSYS;
+		return -1;
 	}
 
-	itr = rl.head;
-	while (itr) {
-		fprintf(fp, "Rule: %s", itr->username);
-		if (itr->procname)
-			fprintf(fp, ":%s", itr->procname);
-		fprintf(fp, "\n");
+	/* Unknown before Linux 5.3 */
+	if (errno != ENOSYS && errno != E2BIG)
+		return -1;
+#endif
+	__atomic_store_n(&cg_clone3_unsupported, 1, __ATOMIC_RELAXED);
+	errno = ENOSYS;
 
-		if (itr->uid == CGRULE_WILD)
-			fprintf(fp, "  UID: any\n");
-		else if (itr->uid == CGRULE_INVALID)
-			fprintf(fp, "  UID: N/A\n");
-		else
-			fprintf(fp, "  UID: %d\n", itr->uid);
+	return -1;
+}
 
-		if (itr->gid == CGRULE_WILD)
-			fprintf(fp, "  GID: any\n");
-		else if (itr->gid == CGRULE_INVALID)
-			fprintf(fp, "  GID: N/A\n");
-		else
-			fprintf(fp, "  GID: %d\n", itr->gid);
+/* Wait for the parent if asked, then run the program */
+static void cg_spawn_child(bool wait, const int go[2], const int exec_err[2], pid_t parent,
+			   const struct cgroup_spawn_opts * const opts, const char * const file,
+			   char * const argv[])
+{
+	ssize_t len;
+	char byte;
+	int err;
 
-		fprintf(fp, "  DEST: %s\n", itr->destination);
+	/* Only the parent holds the ends it writes to or reads */
+	close(go[1]);
+	close(exec_err[0]);
 
-		fprintf(fp, "  CONTROLLERS:\n");
-		for (i = 0; i < MAX_MNT_ELEMENTS; i++) {
-			if (itr->controllers[i])
-				fprintf(fp, "    %s\n", itr->controllers[i]);
-		}
-		fprintf(fp, "  OPTIONS:\n");
-		if (itr->is_ignore)
-			fprintf(fp, "    IS_IGNORE: True\n");
-		else
-			fprintf(fp, "    IS_IGNORE: False\n");
-		fprintf(fp, "\n");
-		itr = itr->next;
+	if (opts->pdeathsig) {
+		prctl(PR_SET_PDEATHSIG, opts->pdeathsig);
+		/* The parent exited before the signal was set */
+		if (getppid() != parent)
+			_exit(127);
 	}
-	pthread_rwlock_unlock(&rl_lock);
-}
 
-/**
- * Reloads the rules list, using the given configuration file.
- * This function is probably NOT thread safe (calls cgroup_parse_rules()).
- *	@return 0 on success, > 0 on failure
- */
-int cgroup_reload_cached_rules(void)
-{
-	/* Return codes */
-	int ret = 0;
+	if (wait) {
+		do {
+			len = read(go[0], &byte, 1);
+		} while (len < 0 && errno == EINTR);
 
-	cgroup_dbg("Reloading cached rules from %s.\n", CGRULES_CONF_FILE);
-	ret = cgroup_parse_rules(true, CGRULE_INVALID, CGRULE_INVALID, NULL);
-	if (ret) {
-		cgroup_warn("error parsing configuration file '%s': %d\n", CGRULES_CONF_FILE, ret);
-		ret = ECGRULESPARSEFAIL;
-		goto finished;
+		/* The parent failed */
+		if (len != 1)
+			_exit(127);
 	}
 
-	#ifdef CGROUP_DEBUG
-	cgroup_print_rules_config(stdout);
-	#endif
-finished:
-	return ret;
+	execvp(file, argv);
+
+	/* The parent gets the end of the file if the errno can't be written */
+	err = errno;
+	if (write(exec_err[1], &err, sizeof(err)) != sizeof(err))
+		_exit(126);
+	_exit(127);
 }
 
-/**
- * Initializes the rules cache.
- *	@return 0 on success, > 0 on error
- */
-int cgroup_init_rules_cache(void)
+int cgroup_spawn(const char *file, char * const argv[], const struct cgroup_spawn_opts * const opts,
+		 pid_t * const pid, int * const pidfd)
 {
-	/* Return codes */
-	int ret = 0;
-
-	/* Attempt to read the configuration file and cache the rules. */
-	ret = cgroup_parse_rules(true, CGRULE_INVALID, CGRULE_INVALID, NULL);
-	if (ret)
-		cgroup_dbg("Could not initialize rule cache, error was: %d\n", ret);
-
-	return ret;
-}
-
-/**
- * cgroup_get_current_controller_path
- * @pid: pid of the current process for which the path is to be determined
- * @controller: name of the controller for which to determine current path
- * @current_path: a pointer that is filled with the value of the current
- *		path as seen in /proc/<pid>/cgroup
- */
-int cgroup_get_current_controller_path(pid_t pid, const char *controller, char **current_path)
-{
-	enum cg_version_t version;
-	enum cg_setup_mode_t mode;
-	FILE *pid_cgrp_fd = NULL;
-	bool unified = false;
-	char *path = NULL;
-	int ret;
+	int exec_err[2] = { -1, -1 };
+	int go[2] = { -1, -1 };
+	int child_pidfd = -1;
+	int cgroup_fd = -1;
+	bool move = true;
+	int child_errno;
+	pid_t parent;
+	bool wait;
+	ssize_t len;
+	pid_t child;
+	int ret, i;
 
 	if (!cgroup_initialized) {
 		cgroup_warn("libcgroup is not initialized\n");
 		return ECGROUPNOTINITIALIZED;
 	}
 
-	if (!current_path)
-		return ECGOTHER;
+	if (!file || !argv || !opts || (opts->dests && opts->dest_cnt < 1))
+		return ECGINVAL;
 
-	mode = cgroup_setup_mode();
-	if (mode == CGROUP_MODE_LEGACY && !controller)
-		return ECGOTHER;
+	if (!__atomic_load_n(&cg_clone3_unsupported, __ATOMIC_RELAXED)) {
+		ret = cg_spawn_resolve(file, opts, &cgroup_fd, &move);
+		if (ret)
+			return ret;
+	}
 
-	/*
-	 * both unified/hybrid can have the controller mounted as
-	 * cgroup v2 version.
-	 */
-	if  (!controller) {
-		unified = true;
-	} else {
-		ret = cgroup_get_controller_version(controller, &version);
-		if (ret) {
-			cgroup_warn("Failed to get version of the controller: %s\n", controller);
-			ret = ECGINVAL;
-			goto cleanup_path;
-		}
-		unified = (version == CGROUP_V2);
+	if ((opts->spawn_flags & CGROUP_SPAWN_CLONE_ONLY) && cgroup_fd < 0)
+		return ECGROUPUNSUPP;
+
+	if (pipe2(exec_err, O_CLOEXEC) || pipe2(go, O_CLOEXEC)) {
+		last_errno = errno;
+		ret = ECGOTHER;
+		goto out;
 	}
 
-	ret = asprintf(&path, "/proc/%d/cgroup", pid);
-	if (ret <= 0) {
-		cgroup_warn("cannot allocate memory (/proc/pid/cgroup) ret %d\n", ret);
-		return ret;
+	/* The child created in its control group isn't moved */
+	if (cgroup_fd >= 0)
+		move = false;
+	wait = move || opts->prepare;
+	parent = getpid();
+
+	child = cg_spawn_clone3(cgroup_fd, &child_pidfd);
+	if (child < 0 && errno != ENOSYS) {
+		last_errno = errno;
+		ret = cgroup_fd >= 0 ? cg_attach_open_error(errno) : ECGOTHER;
+		goto out;
 	}
 
-	ret = ECGROUPNOTEXIST;
-	pid_cgrp_fd = fopen(path, "re");
-	if (!pid_cgrp_fd)
-		goto cleanup_path;
+	if (child < 0 && (opts->spawn_flags & CGROUP_SPAWN_CLONE_ONLY)) {
+		ret = ECGROUPUNSUPP;
+		goto out;
+	}
 
-	/*
-	 * Why do we grab the cg_mount_table_lock?, the reason is that the
-	 * cgroup of a pid can change via the cgroup_attach_task_pid() call.
-	 * To make sure, we return consistent and safe results, we acquire the
-	 * lock upfront. We can optimize by acquiring and releasing
-	 * the lock in the while loop, but that will be more expensive.
-	 */
-	pthread_rwlock_rdlock(&cg_mount_table_lock);
-	while (!feof(pid_cgrp_fd)) {
-		char controllers[FILENAME_MAX];
-		char cgrp_path[FILENAME_MAX];
-		char *savedptr;
-		char *token;
-		int num;
+	if (child < 0) {
+		if (cgroup_fd >= 0)
+			move = true;
+		wait = move || opts->prepare;
 
-		/*
-		 * with unified mode, the /proc/pid/cgroup the output is
-		 * similar to that of cgroup legacy and hybrid modes:
-		 * hierarchy-ID:controller-list:cgroup-path
-		 *
-		 * the difference is that in cgroup v2:
-		 * - hierarchy-ID is always 0 (one hierarchy allowed)
-		 * - controller-list is empty
-		 */
-		if (mode == CGROUP_MODE_UNIFIED || unified) {
-			ret = fscanf(pid_cgrp_fd, "%d::%4095s\n", &num, cgrp_path);
-			if (ret != 2) {
-				/*
-				 * we are interested only in unified format
-				 * line, skip this line.
-				 */
-				if (unified) {
-					ret = fscanf(pid_cgrp_fd, "%*[^\n]\n");
-					if (ret == 0)
-						continue;
+		child = fork();
+		if (child < 0) {
+			last_errno = errno;
+			ret = ECGOTHER;
+			goto out;
+		}
+#ifdef __NR_pidfd_open
+		if (child > 0)
+			child_pidfd = syscall(__NR_pidfd_open, child, 0);
+#endif
+	}
 
-					if (ret == EOF) {
-						last_errno = errno;
-						ret = ECGEOF;
-						goto done;
-					}
-				}
+	if (child == 0)
+		cg_spawn_child(wait, go, exec_err, parent, opts, file, argv);
 
-				cgroup_warn("read failed for pid_cgroup_fd ret %d\n", ret);
-				last_errno = errno;
-				ret = ECGOTHER;
-				goto done;
-			}
+	close(exec_err[1]);
+	exec_err[1] = -1;
+	close(go[0]);
+	go[0] = -1;
 
-			/* check if the controller is enabled in cgroup v2 */
-			if (controller) {
-				ret = cgroupv2_controller_enabled(cgrp_path, controller);
-				if (ret)
-					goto done;
-			}
+	ret = 0;
+	if (move && opts->dests) {
+		for (i = 0; !ret && i < opts->dest_cnt; i++)
+			ret = cgroup_change_cgroup_path(opts->dests[i].path, child,
+							opts->dests[i].controllers);
+	} else if (move) {
+		ret = cgroup_change_cgroup_flags(opts->uid, opts->gid, file, child, opts->flags);
+	}
 
-			*current_path = strdup(cgrp_path);
-			if (!*current_path) {
-				last_errno = errno;
-				ret = ECGOTHER;
-				goto done;
-			}
-			ret = 0;
-			goto done;
-		}
+	if (!ret && opts->prepare)
+		ret = opts->prepare(child, opts->arg);
 
-		/*
-		 * 4095 == FILENAME_MAX - 1, keeping coverity happy with precision
-		 * for the cgrp_path.
-		 */
-		ret = fscanf(pid_cgrp_fd, "%d:%[^:]:%4095s\n", &num, controllers, cgrp_path);
-		/*
-		 * Magic numbers like "3" seem to be integrating into my daily
-		 * life, I need some magic to help make them disappear :)
-		 */
-		if (ret != 3) {
-			cgroup_warn("read failed for pid_cgrp_fd ret %d\n", ret);
-			last_errno = errno;
+	/* Let the child run the program, or exit on the end of the file */
+	if (!ret && wait && write(go[1], "", 1) != 1) {
+		last_errno = errno;
+		ret = ECGOTHER;
+	}
+	close(go[1]);
+	go[1] = -1;
+
+	if (!ret) {
+		do {
+			len = read(exec_err[0], &child_errno, sizeof(child_errno));
+		} while (len < 0 && errno == EINTR);
+
+		if (len == sizeof(child_errno)) {
+			last_errno = child_errno;
 			ret = ECGOTHER;
-			goto done;
 		}
+	}
 
-		token = strtok_r(controllers, ",", &savedptr);
-		while (token) {
-			if (strncmp(controller, token, strlen(controller) + 1) == 0) {
-				*current_path = strdup(cgrp_path);
-				if (!*current_path) {
-					last_errno = errno;
-					ret = ECGOTHER;
-					goto done;
-				}
-				ret = 0;
-				goto done;
-			}
-			token = strtok_r(NULL, ",", &savedptr);
-		}
+	if (ret) {
+		waitpid(child, NULL, 0);
+		if (child_pidfd >= 0)
+			close(child_pidfd);
+		goto out;
 	}
 
-done:
-	pthread_rwlock_unlock(&cg_mount_table_lock);
-	fclose(pid_cgrp_fd);
-cleanup_path:
-	free(path);
+	if (pid)
+		*pid = child;
+	if (pidfd)
+		*pidfd = child_pidfd;
+	else if (child_pidfd >= 0)
+		close(child_pidfd);
+
+out:
+	for (i = 0; i < 2; i++) {
+		if (exec_err[i] >= 0)
+			close(exec_err[i]);
+		if (go[i] >= 0)
+			close(go[i]);
+	}
+	if (cgroup_fd >= 0)
+		close(cgroup_fd);
 
 	return ret;
 }
 
-const char *cgroup_strerror(int code)
+/**
+ * Changes the cgroup of all running PIDs based on the rules in the config file.
+ * If a rules exists for a PID, then the PID is placed in the correct group.
+ *
+ * This function may be called after creating new control groups to move
+ * running PIDs into the newly created control groups.
+ *	@return 0 on success, < 0 on error
+ */
+int cgroup_change_all_cgroups(void)
 {
-	int idx = code % ECGROUPNOTCOMPILED;
+	int ret;
 
-	if (code == ECGOTHER) {
-#ifdef STRERROR_R_CHAR_P
-		return strerror_r(cgroup_get_last_errno(), errtext, MAXLEN);
-#else
-		return strerror_r(cgroup_get_last_errno(), errtext, sizeof(errtext)) ?
-			"unknown error" : errtext;
-#endif
+	/*
+	 * The rules are cached once rather than matched for each process in
+	 * the published ones, a thread per online CPU matches the processes,
+	 * and the processes going to the same cgroup are moved together.
+	 */
+	ret = cgroup_change_all_cgroups2(CGFLAG_USECACHE, 0, NULL);
+	if (ret)
+		/* A process that can't be moved doesn't fail the others */
+		cgroup_dbg("cgroup change of the processes failed: %d\n", ret);
+
+	return 0;
+}
+
+static int cg_batch_add(struct cg_batch * const batch, struct cgroup_rule * const rule,
+			const char * const dest, pid_t pid)
+{
+	struct cg_batch_entry *entries;
+	struct cg_batch_entry *entry;
+
+	if (batch->cnt == batch->max) {
+		entries = realloc(batch->entries, (batch->max * 2 + 64) * sizeof(*entries));
+		if (!entries) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+		batch->entries = entries;
+		batch->max = batch->max * 2 + 64;
 	}
-	if (idx >= ARRAY_SIZE(cgroup_strerror_codes))
-		return "Invalid error code";
 
-	return cgroup_strerror_codes[idx];
+	entry = &batch->entries[batch->cnt];
+	entry->dest = strdup(dest);
+	if (!entry->dest) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+	entry->rule = rule;
+	entry->pid = pid;
+	entry->pos = batch->cnt++;
+
+	return 0;
 }
 
-/**
- * Return last errno, which caused ECGOTHER error.
- */
-int cgroup_get_last_errno(void)
+static void cg_batch_free(struct cg_batch * const batch)
 {
-	return last_errno;
+	int i;
+
+	for (i = 0; i < batch->cnt; i++)
+		free(batch->entries[i].dest);
+	free(batch->entries);
+	memset(batch, 0, sizeof(*batch));
 }
 
-static int cg_walk_node(FTS *fts, FTSENT *ent, const int depth, struct cgroup_file_info *info,
-			int dir)
+/* Add a process to the batch once per destination of the rule it matches */
+static int cg_batch_add_proc(struct cg_batch * const batch, pid_t pid, uid_t uid, gid_t gid,
+			     const char * const procname)
 {
+	char dest[FILENAME_MAX];
+	struct cgroup_rule *rule;
 	int ret = 0;
 
-	if (!cgroup_initialized)
-		return ECGROUPNOTINITIALIZED;
+	rule = cgroup_find_matching_rule(uid, gid, pid, procname);
+	if (!rule || rule->is_ignore) {
+		cgroup_dbg("No rule to apply to PID: %d, UID: %d, GID: %d\n", pid, uid, gid);
+		return 0;
+	}
 
-	cgroup_dbg("seeing file %s\n", ent->fts_path);
+	do {
+		cgroup_rule_destination(rule, uid, gid, pid, procname, dest);
+		ret = cg_batch_add(batch, rule, dest, pid);
+		rule = rule->next;
+	} while (!ret && rule && rule->username[0] == '%');
 
-	info->path = ent->fts_name;
-	info->parent = ent->fts_parent->fts_name;
-	info->full_path = ent->fts_path;
-	info->depth = ent->fts_level;
-	info->type = CGROUP_FILE_TYPE_OTHER;
+	return ret;
+}
+
+/* Compare the destinations of two entries, then their controllers */
+static int cg_batch_dest_cmp(const struct cg_batch_entry * const a,
+			     const struct cg_batch_entry * const b)
+{
+	const char *ctrl_a, *ctrl_b;
+	int ret, i;
+
+	ret = strcmp(a->dest, b->dest);
+	if (ret || a->rule == b->rule)
+		return ret;
+
+	for (i = 0; i < MAX_MNT_ELEMENTS; i++) {
+		ctrl_a = a->rule->controllers[i];
+		ctrl_b = b->rule->controllers[i];
+		if (!ctrl_a || !ctrl_b)
+			return !!ctrl_a - !!ctrl_b;
+
+		ret = strcmp(ctrl_a, ctrl_b);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int cg_batch_entry_cmp(const void *a, const void *b)
+{
+	const struct cg_batch_entry *entry_a = a, *entry_b = b;
+	int ret;
+
+	ret = cg_batch_dest_cmp(entry_a, entry_b);
+	if (ret)
+		return ret;
+
+	return entry_a->pos - entry_b->pos;
+}
+
+/*
+ * Move the processes of a batch, sorted by destination, with one write of
+ * each cgroup.procs file for all the processes going to the same cgroup
+ */
+STATIC int cg_batch_apply(struct cg_batch * const batch, int flags)
+{
+	struct cg_batch_entry *entry;
+	struct cgroup cgrp;
+	int first, last;
+	int *pid_errs;
+	int ret = 0;
+	pid_t *pids;
+	int error;
+	int i;
+
+	qsort(batch->entries, batch->cnt, sizeof(*batch->entries), cg_batch_entry_cmp);
+
+	pids = malloc(max(batch->cnt, 1) * sizeof(*pids));
+	pid_errs = malloc(max(batch->cnt, 1) * sizeof(*pid_errs));
+	if (!pids || !pid_errs) {
+		last_errno = errno;
+		free(pids);
+		free(pid_errs);
+		return ECGOTHER;
+	}
+
+	for (first = 0; first < batch->cnt; first = last) {
+		entry = &batch->entries[first];
+		for (last = first; last < batch->cnt &&
+		     !cg_batch_dest_cmp(entry, &batch->entries[last]); last++)
+			pids[last - first] = batch->entries[last].pid;
+
+		if (strcmp(entry->dest, entry->rule->destination) != 0) {
+			cgroup_dbg("control group %s is template\n", entry->dest);
+			error = cgroup_create_template_group(entry->dest, entry->rule, flags);
+			if (error) {
+				cgroup_warn("failed to create cgroup based on template %s\n",
+					    entry->dest);
+				goto next;
+			}
+		}
+
+		memset(&cgrp, 0, sizeof(cgrp));
+		error = cg_prepare_cgroup(&cgrp, entry->pid, entry->dest,
+					  (const char * const *)entry->rule->controllers);
+		if (error)
+			goto next;
+
+		error = cgroup_attach_tasks(&cgrp, pids, last - first, CGROUP_ATTACH_PROCS,
+					    pid_errs);
+		cgroup_free_controllers(&cgrp);
+
+		/* The processes that exited meanwhile are skipped */
+		for (i = 0; error == ECGOTHER && i < last - first; i++) {
+			if (pid_errs[i] && pid_errs[i] != ESRCH)
+				break;
+		}
+		if (error == ECGOTHER && i == last - first)
+			error = 0;
+		cgroup_dbg("Moved %d processes to %s\n", last - first, entry->dest);
+next:
+		if (error && !ret)
+			ret = error;
+	}
+
+	free(pids);
+	free(pid_errs);
+
+	return ret;
+}
+
+/*
+ * cgroup_change_all_cgroups2() lists the processes of /proc first, then a
+ * pool of workers matches them against the cached rules.  Each worker takes
+ * the next chunk of PIDs, reads the identity of the processes and appends
+ * their destinations to its own batch.  The batches are merged and applied
+ * once, so the processes going to the same cgroup are still moved together.
+ */
+#define CG_SWEEP_THREADS_MAX	16
+#define CG_SWEEP_CHUNK		64
+
+struct cg_sweep_ctx {
+	const pid_t *pids;
+	int pid_cnt;
+	/* The first PID not taken by a worker */
+	int next_pid;
+	/* The first error of a worker */
+	int error;
+};
+
+struct cg_sweep_worker {
+	struct cg_sweep_ctx *ctx;
+	pthread_t thread;
+	struct cg_batch batch;
+	/* The processes whose identity could be read */
+	unsigned long procs;
+};
+
+/* PF_KTHREAD of include/linux/sched.h */
+#define CG_PF_KTHREAD		0x00200000
+
+/* Whether the process is a kernel thread, which can't be moved */
+static bool cg_sweep_is_kthread(pid_t pid)
+{
+	char path[FILENAME_MAX];
+	unsigned int flags;
+	char buf[1024];
+	ssize_t len;
+	char *p;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len < 0)
+		return false;
+	buf[len] = '\0';
+
+	/* The flags are the sixth field after the name, which may contain ')' */
+	p = strrchr(buf, ')');
+	if (!p || sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %u", &flags) != 1)
+		return false;
+
+	return flags & CG_PF_KTHREAD;
+}
+
+static void *cg_sweep_worker(void *arg)
+{
+	struct cg_sweep_worker *w = arg;
+	struct cg_sweep_ctx *ctx = w->ctx;
+	int first, i, cnt, error = 0;
+	int no_error = 0;
+	char *procname;
+	uid_t euid;
+	gid_t egid;
+
+	while (!error && !__atomic_load_n(&ctx->error, __ATOMIC_RELAXED)) {
+		first = __atomic_fetch_add(&ctx->next_pid, CG_SWEEP_CHUNK, __ATOMIC_RELAXED);
+		if (first >= ctx->pid_cnt)
+			break;
+
+		for (i = first; i < first + CG_SWEEP_CHUNK && i < ctx->pid_cnt; i++) {
+			/* The processes of /proc may exit meanwhile */
+			if (cgroup_get_proc_identity(ctx->pids[i], &euid, &egid, &procname))
+				continue;
+
+			w->procs++;
+			cnt = w->batch.cnt;
+			error = cg_batch_add_proc(&w->batch, ctx->pids[i], euid, egid, procname);
+			free(procname);
+			if (error)
+				break;
+
+			/*
+			 * A catch-all rule matches the kernel threads too, only
+			 * the processes matching a rule are checked
+			 */
+			if (w->batch.cnt > cnt && cg_sweep_is_kthread(ctx->pids[i])) {
+				while (w->batch.cnt > cnt)
+					free(w->batch.entries[--w->batch.cnt].dest);
+			}
+		}
+	}
+
+	if (error)
+		__atomic_compare_exchange_n(&ctx->error, &no_error, error, false,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+
+	return NULL;
+}
+
+/* List the PIDs of /proc */
+static int cg_sweep_list(pid_t **pids, int * const pid_cnt)
+{
+	struct dirent *pid_dir;
+	int pid_max = 0;
+	pid_t *tmp;
+	DIR *dir;
+	pid_t pid;
+
+	*pids = NULL;
+	*pid_cnt = 0;
+
+	dir = opendir("/proc/");
+	if (!dir) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+
+	while ((pid_dir = readdir(dir)) != NULL) {
+		if (sscanf(pid_dir->d_name, "%i", &pid) < 1)
+			continue;
+
+		if (*pid_cnt == pid_max) {
+			tmp = realloc(*pids, (pid_max * 2 + 256) * sizeof(*tmp));
+			if (!tmp) {
+				last_errno = errno;
+				closedir(dir);
+				free(*pids);
+				*pids = NULL;
+				return ECGOTHER;
+			}
+			*pids = tmp;
+			pid_max = pid_max * 2 + 256;
+		}
+		(*pids)[(*pid_cnt)++] = pid;
+	}
+	closedir(dir);
+
+	return 0;
+}
+
+/*
+ * Match the processes on up to threads workers, all the online CPUs when
+ * threads <= 0, and merge the batches of the workers into batch.  The
+ * processes that exited are skipped.
+ */
+STATIC int cg_sweep_match(const pid_t * const pids, int pid_cnt, int threads,
+			  struct cg_batch * const batch, struct cgroup_sweep_stats * const stats)
+{
+	struct cg_sweep_ctx ctx = { .pids = pids, .pid_cnt = pid_cnt };
+	struct cg_sweep_worker *workers;
+	struct cg_batch_entry *entries;
+	int started, i, cnt = 0;
+	int error;
+
+	if (threads <= 0)
+		threads = min(max(sysconf(_SC_NPROCESSORS_ONLN), 1), CG_SWEEP_THREADS_MAX);
+	threads = max(min(threads, (pid_cnt + CG_SWEEP_CHUNK - 1) / CG_SWEEP_CHUNK), 1);
+
+	workers = calloc(threads, sizeof(*workers));
+	if (!workers) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+
+	for (i = 0; i < threads; i++)
+		workers[i].ctx = &ctx;
+
+	/* The calling thread is the first worker */
+	for (started = 1; started < threads; started++) {
+		if (pthread_create(&workers[started].thread, NULL, cg_sweep_worker,
+				   &workers[started])) {
+			cgroup_warn("failed to start a sweep worker\n");
+			break;
+		}
+	}
+	cg_sweep_worker(&workers[0]);
+	for (i = 1; i < started; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	stats->threads = started;
+	for (i = 0; i < started; i++) {
+		stats->procs += workers[i].procs;
+		cnt += workers[i].batch.cnt;
+	}
+
+	error = ctx.error;
+	if (error)
+		goto out;
+
+	entries = malloc((cnt ? cnt : 1) * sizeof(*entries));
+	if (!entries) {
+		last_errno = errno;
+		error = ECGOTHER;
+		goto out;
+	}
+
+	/* The destinations are handed over to batch with the entries */
+	batch->entries = entries;
+	batch->max = cnt;
+	batch->cnt = 0;
+	for (i = 0; i < started; i++) {
+		memcpy(&entries[batch->cnt], workers[i].batch.entries,
+		       workers[i].batch.cnt * sizeof(*entries));
+		batch->cnt += workers[i].batch.cnt;
+		workers[i].batch.cnt = 0;
+	}
+	for (i = 0; i < batch->cnt; i++)
+		entries[i].pos = i;
+
+out:
+	for (i = 0; i < threads; i++)
+		cg_batch_free(&workers[i].batch);
+	free(workers);
+
+	return error;
+}
+
+int cgroup_change_all_cgroups2(int flags, int threads, struct cgroup_sweep_stats * const stats)
+{
+	struct cgroup_sweep_stats st = { 0 };
+	struct cg_batch batch = { 0 };
+	struct timespec start, end;
+	pid_t *pids = NULL;
+	int pid_cnt = 0;
+	int ret;
+
+	if (stats)
+		memset(stats, 0, sizeof(*stats));
+
+	if (!cgroup_initialized) {
+		cgroup_warn("libcgroup is not initialized\n");
+		return ECGROUPNOTINITIALIZED;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* Parse and index the rules once for the whole sweep */
+	if (!(flags & CGFLAG_USECACHE) || rl.head == NULL) {
+		ret = cgroup_reload_cached_rules();
+		if (ret)
+			goto out;
+	}
+
+	ret = cg_sweep_list(&pids, &pid_cnt);
+	if (ret)
+		goto out;
+
+	ret = cg_sweep_match(pids, pid_cnt, threads, &batch, &st);
+	if (ret)
+		goto out;
+
+	st.moved = batch.cnt;
+	ret = cg_batch_apply(&batch, flags);
+
+out:
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	st.elapsed_us = (end.tv_sec - start.tv_sec) * 1000000ULL +
+			(end.tv_nsec - start.tv_nsec) / 1000;
+	cgroup_dbg("Matched %lu processes in %llu us on %d threads\n", st.procs,
+		   st.elapsed_us, st.threads);
+	if (stats)
+		*stats = st;
+
+	free(pids);
+	cg_batch_free(&batch);
+
+	return ret;
+}
+
+int cgroup_change_cgroups_batch(const pid_t * const pids, int pid_cnt, int flags)
+{
+	struct cg_batch batch = { 0 };
+	char *procname;
+	int error, i;
+	int ret = 0;
+	uid_t euid;
+	gid_t egid;
+
+	if (!cgroup_initialized) {
+		cgroup_warn("libcgroup is not initialized\n");
+		return ECGROUPNOTINITIALIZED;
+	}
+
+	if (pid_cnt < 0 || (!pids && pid_cnt))
+		return ECGINVAL;
+
+	/* All the processes of /proc */
+	if (!pids)
+		return cgroup_change_all_cgroups2(flags, 0, NULL);
+
+	/* Parse and index the rules once for the whole batch */
+	if (!(flags & CGFLAG_USECACHE) || rl.head == NULL) {
+		ret = cgroup_reload_cached_rules();
+		if (ret)
+			return ret;
+	}
+
+	for (i = 0; i < pid_cnt; i++) {
+		error = cgroup_get_proc_identity(pids[i], &euid, &egid, &procname);
+		if (error) {
+			cgroup_warn("cannot read the identity of pid %d\n", pids[i]);
+			if (!ret)
+				ret = error;
+			continue;
+		}
+
+		error = cg_batch_add_proc(&batch, pids[i], euid, egid, procname);
+		free(procname);
+		if (error) {
+			ret = error;
+			goto out;
+		}
+	}
+
+	error = cg_batch_apply(&batch, flags);
+	if (!ret)
+		ret = error;
+
+out:
+	cg_batch_free(&batch);
+
+	return ret;
+}
+
+/**
+ * Print the cached rules table.  This function should be called only after
+ * first calling cgroup_parse_config(), but it will work with an empty rule
+ * list.
+ *	@param fp The file stream to print to
+ */
+void cgroup_print_rules_config(FILE *fp)
+{
+	/* Iterator */
+	struct cgroup_rule *itr = NULL;
+
+	/* Loop variable */
+	int i = 0;
+
+	pthread_rwlock_rdlock(&rl_lock);
+
+	if (!(rl.head)) {
+		fprintf(fp, "The rules table is empty.\n\n");
+		pthread_rwlock_unlock(&rl_lock);
+		return;
+	}
+
+	itr = rl.head;
+	while (itr) {
+		fprintf(fp, "Rule: %s", itr->username);
+		if (itr->procname)
+			fprintf(fp, ":%s", itr->procname);
+		fprintf(fp, "\n");
+
+		if (itr->uid == CGRULE_WILD)
+			fprintf(fp, "  UID: any\n");
+		else if (itr->uid == CGRULE_INVALID)
+			fprintf(fp, "  UID: N/A\n");
+		else
+			fprintf(fp, "  UID: %d\n", itr->uid);
+
+		if (itr->gid == CGRULE_WILD)
+			fprintf(fp, "  GID: any\n");
+		else if (itr->gid == CGRULE_INVALID)
+			fprintf(fp, "  GID: N/A\n");
+		else
+			fprintf(fp, "  GID: %d\n", itr->gid);
+
+		fprintf(fp, "  DEST: %s\n", itr->destination);
+
+		fprintf(fp, "  CONTROLLERS:\n");
+		for (i = 0; i < MAX_MNT_ELEMENTS; i++) {
+			if (itr->controllers[i])
+				fprintf(fp, "    %s\n", itr->controllers[i]);
+		}
+		fprintf(fp, "  OPTIONS:\n");
+		if (itr->is_ignore)
+			fprintf(fp, "    IS_IGNORE: True\n");
+		else
+			fprintf(fp, "    IS_IGNORE: False\n");
+		fprintf(fp, "\n");
+		itr = itr->next;
+	}
+	pthread_rwlock_unlock(&rl_lock);
+}
+
+/**
+ * Reloads the rules list, using the given configuration file.
+ * This function is probably NOT thread safe (calls cgroup_parse_rules()).
+ *	@return 0 on success, > 0 on failure
+ */
+int cgroup_reload_cached_rules(void)
+{
+	/* Return codes */
+	int ret = 0;
+
+	cgroup_dbg("Reloading cached rules from %s.\n", CGRULES_CONF_FILE);
+	ret = cgroup_parse_rules(true, CGRULE_INVALID, CGRULE_INVALID, NULL);
+	if (ret) {
+		cgroup_warn("error parsing configuration file '%s': %d\n", CGRULES_CONF_FILE, ret);
+		ret = ECGRULESPARSEFAIL;
+		goto finished;
+	}
+
+	#ifdef CGROUP_DEBUG
+	cgroup_print_rules_config(stdout);
+	#endif
+finished:
+	return ret;
+}
+
+/**
+ * Initializes the rules cache.
+ *	@return 0 on success, > 0 on error
+ */
+int cgroup_init_rules_cache(void)
+{
+	/* Return codes */
+	int ret = 0;
+
+	/* Attempt to read the configuration file and cache the rules. */
+	ret = cgroup_parse_rules(true, CGRULE_INVALID, CGRULE_INVALID, NULL);
+	if (ret)
+		cgroup_dbg("Could not initialize rule cache, error was: %d\n", ret);
+
+	return ret;
+}
+
+int cgroup_publish_cached_rules(void)
+{
+	pthread_rwlock_wrlock(&rl_lock);
+	rl_publish = true;
+	pthread_rwlock_unlock(&rl_lock);
+
+	return cgroup_init_rules_cache();
+}
+
+void cgroup_unpublish_cached_rules(void)
+{
+	pthread_rwlock_wrlock(&rl_lock);
+	rl_publish = false;
+	cg_rules_shm_unpublish();
+	pthread_rwlock_unlock(&rl_lock);
+}
+
+/**
+ * cgroup_get_current_controller_path
+ * @pid: pid of the current process for which the path is to be determined
+ * @controller: name of the controller for which to determine current path
+ * @current_path: a pointer that is filled with the value of the current
+ *		path as seen in /proc/<pid>/cgroup
+ */
+int cgroup_get_current_controller_path(pid_t pid, const char *controller, char **current_path)
+{
+	enum cg_version_t version;
+	enum cg_setup_mode_t mode;
+	FILE *pid_cgrp_fd = NULL;
+	bool unified = false;
+	char *path = NULL;
+	int ret;
+
+	if (!cgroup_initialized) {
+		cgroup_warn("libcgroup is not initialized\n");
+		return ECGROUPNOTINITIALIZED;
+	}
+
+	if (!current_path)
+		return ECGOTHER;
+
+	mode = cgroup_setup_mode();
+	if (mode == CGROUP_MODE_LEGACY && !controller)
+		return ECGOTHER;
+
+	/*
+	 * both unified/hybrid can have the controller mounted as
+	 * cgroup v2 version.
+	 */
+	if  (!controller) {
+		unified = true;
+	} else {
+		ret = cgroup_get_controller_version(controller, &version);
+		if (ret) {
+			cgroup_warn("Failed to get version of the controller: %s\n", controller);
+			ret = ECGINVAL;
+			goto cleanup_path;
+		}
+		unified = (version == CGROUP_V2);
+	}
+
+	ret = asprintf(&path, "/proc/%d/cgroup", pid);
+	if (ret <= 0) {
+		cgroup_warn("cannot allocate memory (/proc/pid/cgroup) ret %d\n", ret);
+		return ret;
+	}
+
+	ret = ECGROUPNOTEXIST;
+	pid_cgrp_fd = fopen(path, "re");
+	if (!pid_cgrp_fd)
+		goto cleanup_path;
+
+	/*
+	 * Why do we grab the cg_mount_table_lock?, the reason is that the
+	 * cgroup of a pid can change via the cgroup_attach_task_pid() call.
+	 * To make sure, we return consistent and safe results, we acquire the
+	 * lock upfront. We can optimize by acquiring and releasing
+	 * the lock in the while loop, but that will be more expensive.
+	 */
+	pthread_rwlock_rdlock(&cg_mount_table_lock);
+	while (!feof(pid_cgrp_fd)) {
+		char controllers[FILENAME_MAX];
+		char cgrp_path[FILENAME_MAX];
+		char *savedptr;
+		char *token;
+		int num;
+
+		/*
+		 * with unified mode, the /proc/pid/cgroup the output is
+		 * similar to that of cgroup legacy and hybrid modes:
+		 * hierarchy-ID:controller-list:cgroup-path
+		 *
+		 * the difference is that in cgroup v2:
+		 * - hierarchy-ID is always 0 (one hierarchy allowed)
+		 * - controller-list is empty
+		 */
+		if (mode == CGROUP_MODE_UNIFIED || unified) {
+			ret = fscanf(pid_cgrp_fd, "%d::%4095s\n", &num, cgrp_path);
+			if (ret != 2) {
+				/*
+				 * we are interested only in unified format
+				 * line, skip this line.
+				 */
+				if (unified) {
+					ret = fscanf(pid_cgrp_fd, "%*[^\n]\n");
+					if (ret == 0)
+						continue;
+
+					if (ret == EOF) {
+						last_errno = errno;
+						ret = ECGEOF;
+						goto done;
+					}
+				}
+
+				cgroup_warn("read failed for pid_cgroup_fd ret %d\n", ret);
+				last_errno = errno;
+				ret = ECGOTHER;
+				goto done;
+			}
+
+			/* check if the controller is enabled in cgroup v2 */
+			if (controller) {
+				ret = cgroupv2_controller_enabled(cgrp_path, controller);
+				if (ret)
+					goto done;
+			}
+
+			*current_path = strdup(cgrp_path);
+			if (!*current_path) {
+				last_errno = errno;
+				ret = ECGOTHER;
+				goto done;
+			}
+			ret = 0;
+			goto done;
+		}
+
+		/*
+		 * 4095 == FILENAME_MAX - 1, keeping coverity happy with precision
+		 * for the cgrp_path.
+		 */
+		ret = fscanf(pid_cgrp_fd, "%d:%[^:]:%4095s\n", &num, controllers, cgrp_path);
+		/*
+		 * Magic numbers like "3" seem to be integrating into my daily
+		 * life, I need some magic to help make them disappear :)
+		 */
+		if (ret != 3) {
+			cgroup_warn("read failed for pid_cgrp_fd ret %d\n", ret);
+			last_errno = errno;
+			ret = ECGOTHER;
+			goto done;
+		}
+
+		token = strtok_r(controllers, ",", &savedptr);
+		while (token) {
+			if (strncmp(controller, token, strlen(controller) + 1) == 0) {
+				*current_path = strdup(cgrp_path);
+				if (!*current_path) {
+					last_errno = errno;
+					ret = ECGOTHER;
+					goto done;
+				}
+				ret = 0;
+				goto done;
+			}
+			token = strtok_r(NULL, ",", &savedptr);
+		}
+	}
+
+done:
+	pthread_rwlock_unlock(&cg_mount_table_lock);
+	fclose(pid_cgrp_fd);
+cleanup_path:
+	free(path);
+
+	return ret;
+}
+
+const char *cgroup_strerror(int code)
+{
+	int idx = code % ECGROUPNOTCOMPILED;
+
+	if (code == ECGOTHER) {
+#ifdef STRERROR_R_CHAR_P
+		return strerror_r(cgroup_get_last_errno(), errtext, MAXLEN);
+#else
+		return strerror_r(cgroup_get_last_errno(), errtext, sizeof(errtext)) ?
+			"unknown error" : errtext;
+#endif
+	}
+	if (idx >= ARRAY_SIZE(cgroup_strerror_codes))
+		return "Invalid error code";
+
+	return cgroup_strerror_codes[idx];
+}
+
+/**
+ * Return last errno, which caused ECGOTHER error.
+ */
+int cgroup_get_last_errno(void)
+{
+	return last_errno;
+}
+
+static int cg_walk_node(FTS *fts, FTSENT *ent, const int depth, struct cgroup_file_info *info,
+			int dir)
+{
+	int ret = 0;
+
+	if (!cgroup_initialized)
+		return ECGROUPNOTINITIALIZED;
+
+	cgroup_dbg("seeing file %s\n", ent->fts_path);
+
+	info->path = ent->fts_name;
+	info->parent = ent->fts_parent->fts_name;
+	info->full_path = ent->fts_path;
+	info->depth = ent->fts_level;
+	info->type = CGROUP_FILE_TYPE_OTHER;
+
+	if (depth && (info->depth > depth))
+		return 0;
+
+	switch (ent->fts_info) {
+	case FTS_DNR:
+	case FTS_ERR:
+		errno = ent->fts_errno;
+		break;
+	case FTS_D:
+		if (dir & CGROUP_WALK_TYPE_PRE_DIR)
+			info->type = CGROUP_FILE_TYPE_DIR;
+		break;
+	case FTS_DC:
+	case FTS_NSOK:
+	case FTS_NS:
+	case FTS_DP:
+		if (dir & CGROUP_WALK_TYPE_POST_DIR)
+			info->type = CGROUP_FILE_TYPE_DIR;
+		break;
+	case FTS_F:
+		info->type = CGROUP_FILE_TYPE_FILE;
+		break;
+	case FTS_DEFAULT:
+		break;
+	}
+	return ret;
+}
+
+int cgroup_walk_tree_next(int depth, void **handle, struct cgroup_file_info *info, int base_level)
+{
+	struct cgroup_tree_handle *entry;
+	FTSENT *ent;
+	int ret = 0;
+
+	if (!cgroup_initialized)
+		return ECGROUPNOTINITIALIZED;
+
+	if (!handle)
+		return ECGINVAL;
+
+	entry = (struct cgroup_tree_handle *) *handle;
+
+	ent = fts_read(entry->fts);
+	if (!ent)
+		return ECGEOF;
+	if (!base_level && depth)
+		base_level = ent->fts_level + depth;
+
+	ret = cg_walk_node(entry->fts, ent, base_level, info, entry->flags);
+
+	*handle = entry;
+	return ret;
+}
+
+int cgroup_walk_tree_end(void **handle)
+{
+	struct cgroup_tree_handle *entry;
+
+	if (!cgroup_initialized)
+		return ECGROUPNOTINITIALIZED;
+
+	if (!handle)
+		return ECGINVAL;
+
+	entry = (struct cgroup_tree_handle *) *handle;
+
+	fts_close(entry->fts);
+	free(entry);
+	*handle = NULL;
+
+	return 0;
+}
+
+/* TODO: Need to decide a better place to put this function. */
+int cgroup_walk_tree_begin(const char *controller, const char *base_path, int depth, void **handle,
+			   struct cgroup_file_info *info, int *base_level)
+{
+	struct cgroup_tree_handle *entry;
+	char full_path[FILENAME_MAX];
+	char *cg_path[2];
+	FTSENT *ent;
+	int ret = 0;
+
+	if (!cgroup_initialized)
+		return ECGROUPNOTINITIALIZED;
+
+	if (!handle)
+		return ECGINVAL;
+
+	cgroup_dbg("path is %s\n", base_path);
+
+	if (!cg_build_path(base_path, full_path, controller))
+		return ECGOTHER;
+
+	entry = calloc(1, sizeof(struct cgroup_tree_handle));
+
+	if (!entry) {
+		last_errno = errno;
+		*handle = NULL;
+		return ECGOTHER;
+	}
+
+	entry->flags |= CGROUP_WALK_TYPE_PRE_DIR;
+
+	*base_level = 0;
+	cg_path[0] = full_path;
+	cg_path[1] = NULL;
+
+	entry->fts = fts_open(cg_path, FTS_LOGICAL | FTS_NOCHDIR | FTS_NOSTAT, NULL);
+	if (entry->fts == NULL) {
+		free(entry);
+		last_errno = errno;
+		*handle = NULL;
+		return ECGOTHER;
+	}
+	ent = fts_read(entry->fts);
+	if (!ent) {
+		cgroup_warn("fts_read failed\n");
+		fts_close(entry->fts);
+		free(entry);
+		*handle = NULL;
+		return ECGINVAL;
+	}
+	if (!*base_level && depth)
+		*base_level = ent->fts_level + depth;
+
+	ret = cg_walk_node(entry->fts, ent, *base_level, info, entry->flags);
+	if (ret != 0) {
+		fts_close(entry->fts);
+		free(entry);
+		*handle = NULL;
+	} else {
+		*handle = entry;
+	}
+	return ret;
+}
+
+int cgroup_walk_tree_set_flags(void **handle, int flags)
+{
+	struct cgroup_tree_handle *entry;
+
+	if (!cgroup_initialized)
+		return ECGROUPNOTINITIALIZED;
+
+	if (!handle)
+		return ECGINVAL;
+
+	if ((flags & CGROUP_WALK_TYPE_PRE_DIR) &&
+	    (flags & CGROUP_WALK_TYPE_POST_DIR))
+		return ECGINVAL;
+
+	entry = (struct cgroup_tree_handle *) *handle;
+	entry->flags = flags;
+
+	*handle = entry;
+	return 0;
+}
+
+/*
+ * This parses a stat line which is in the form of (name value) pair
+ * separated by a space.
+ */
+static int cg_read_stat(FILE *fp, struct cgroup_stat *cgrp_stat)
+{
+	char *saveptr = NULL;
+	ssize_t read_bytes;
+	char *line = NULL;
+	size_t len = 0;
+	char *token;
+	int ret = 0;
+
+	read_bytes = getline(&line, &len, fp);
+	if (read_bytes == -1) {
+		ret = ECGEOF;
+		goto out_free;
+	}
+
+	token = strtok_r(line, " ", &saveptr);
+	if (!token) {
+		ret = ECGINVAL;
+		goto out_free;
+	}
+	strncpy(cgrp_stat->name, token, FILENAME_MAX - 1);
+	cgrp_stat->name[FILENAME_MAX - 1] = '\0';
+
+	token = strtok_r(NULL, " ", &saveptr);
+	if (!token) {
+		ret = ECGINVAL;
+		goto out_free;
+	}
+	strncpy(cgrp_stat->value, token, CG_VALUE_MAX - 1);
+	cgrp_stat->value[CG_VALUE_MAX - 1] = '\0';
+
+out_free:
+	free(line);
+
+	return ret;
+}
+
+int cgroup_read_value_end(void **handle)
+{
+	FILE *fp;
+
+	if (!cgroup_initialized)
+		return ECGROUPNOTINITIALIZED;
+
+	if (!handle)
+		return ECGINVAL;
+
+	fp = (FILE *)*handle;
+	fclose(fp);
+	*handle = NULL;
+
+	return 0;
+}
+
+int cgroup_read_value_next(void **handle, char *buffer, int max)
+{
+	char *ret_c;
+	int ret = 0;
+	FILE *fp;
+
+	if (!cgroup_initialized)
+		return ECGROUPNOTINITIALIZED;
+
+	if (!buffer || !handle)
+		return ECGINVAL;
+
+	fp = (FILE *)*handle;
+	ret_c = fgets(buffer, max, fp);
+	if (ret_c == NULL)
+		ret = ECGEOF;
+
+	return ret;
+}
+
+int cgroup_read_value_begin(const char * const controller, const char *path,
+			    const char * const name, void **handle, char *buffer, int max)
+{
+	char stat_file[FILENAME_MAX + sizeof(name)];
+	char stat_path[FILENAME_MAX];
+	char *ret_c = NULL;
+	int ret = 0;
+	FILE *fp;
+
+	if (!cgroup_initialized)
+		return ECGROUPNOTINITIALIZED;
+
+	if (!buffer || !handle)
+		return ECGINVAL;
+
+	if (!cg_build_path(path, stat_path, controller))
+		return ECGOTHER;
+
+	snprintf(stat_file, sizeof(stat_file), "%s/%s", stat_path, name);
+	fp = fopen(stat_file, "re");
+	if (!fp) {
+		cgroup_warn("fopen failed\n");
+		last_errno = errno;
+		*handle = NULL;
+		return ECGOTHER;
+	}
+
+	ret_c = fgets(buffer, max, fp);
+	if (ret_c == NULL)
+		ret = ECGEOF;
+
+	*handle = fp;
+
+	return ret;
+}
+
+int cgroup_read_stats_end(void **handle)
+{
+	FILE *fp;
+
+	if (!cgroup_initialized)
+		return ECGROUPNOTINITIALIZED;
+
+	if (!handle)
+		return ECGINVAL;
+
+	fp = (FILE *)*handle;
+	if (fp == NULL)
+		return ECGINVAL;
+
+	fclose(fp);
+
+	return 0;
+}
+
+int cgroup_read_stats_next(void **handle, struct cgroup_stat *cgrp_stat)
+{
+	FILE *fp;
+	int ret = 0;
+
+	if (!cgroup_initialized)
+		return ECGROUPNOTINITIALIZED;
+
+	if (!handle || !cgrp_stat)
+		return ECGINVAL;
+
+	fp = (FILE *)*handle;
+	ret = cg_read_stat(fp, cgrp_stat);
+	*handle = fp;
+
+	return ret;
+}
+
+/* TODO: Need to decide a better place to put this function. */
+int cgroup_read_stats_begin(const char *controller, const char *path, void **handle,
+			    struct cgroup_stat *cgrp_stat)
+{
+	char stat_file[FILENAME_MAX + sizeof(".stat")];
+	char stat_path[FILENAME_MAX];
+	int ret = 0;
+	FILE *fp;
+
+	if (!cgroup_initialized)
+		return ECGROUPNOTINITIALIZED;
+
+	if (!cgrp_stat || !handle)
+		return ECGINVAL;
+
+	if (!cg_build_path(path, stat_path, controller))
+		return ECGOTHER;
+
+	snprintf(stat_file, sizeof(stat_file), "%s/%s.stat", stat_path, controller);
+
+	fp = fopen(stat_file, "re");
+	if (!fp) {
+		cgroup_warn("fopen failed\n");
+		return ECGINVAL;
+	}
+
+	ret = cg_read_stat(fp, cgrp_stat);
+	*handle = fp;
+
+	return ret;
+}
+
+int cgroup_handle_open(const char * const controller, const char * const path,
+		       struct cgroup_handle **handle)
+{
+	char cgrp_path[FILENAME_MAX];
+	struct cgroup_handle *h;
+
+	if (!cgroup_initialized)
+		return ECGROUPNOTINITIALIZED;
+
+	if (!controller || !path || !handle)
+		return ECGINVAL;
+
+	*handle = NULL;
+
+	if (!cg_build_path(path, cgrp_path, controller))
+		return ECGOTHER;
+
+	h = calloc(1, sizeof(*h));
+	if (!h) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+
+	if (cg_dir_open(&h->dir, cgrp_path)) {
+		free(h);
+		return last_errno == ENOENT ? ECGROUPNOTEXIST : ECGOTHER;
+	}
+
+	*handle = h;
+
+	return 0;
+}
+
+int cgroup_handle_add_file(struct cgroup_handle *handle, const char * const name, int *index)
+{
+	int *fds;
+	int fd;
+
+	if (!cgroup_initialized)
+		return ECGROUPNOTINITIALIZED;
+
+	if (!handle || !name || !index)
+		return ECGINVAL;
+
+	if (handle->fd_cnt == handle->fd_max) {
+		fds = realloc(handle->fds, (handle->fd_max * 2 + 4) * sizeof(*fds));
+		if (!fds) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+		handle->fds = fds;
+		handle->fd_max = handle->fd_max * 2 + 4;
+	}
+
+	fd = openat(handle->dir.fd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		last_errno = errno;
+		if (errno == ENOENT)
+			return ECGROUPVALUENOTEXIST;
+		cgroup_warn("failed to open %s%s: %s\n", handle->dir.path, name, strerror(errno));
+		return ECGOTHER;
+	}
+
+	handle->fds[handle->fd_cnt] = fd;
+	*index = handle->fd_cnt++;
+
+	return 0;
+}
+
+int cgroup_handle_read_file(struct cgroup_handle *handle, int index, char *buffer, int max,
+			    int *len)
+{
+	ssize_t ret;
+	int off;
+
+	if (!cgroup_initialized)
+		return ECGROUPNOTINITIALIZED;
+
+	if (!handle || index < 0 || index >= handle->fd_cnt || !buffer || max <= 0)
+		return ECGINVAL;
+
+	/*
+	 * Control files generate their content when they are read from
+	 * the beginning, and return it whole to a large enough read.  The
+	 * second read only sees the end of the file.
+	 */
+	for (off = 0; off < max - 1; off += ret) {
+		ret = pread(handle->fds[index], buffer + off, max - 1 - off, off);
+		if (ret < 0) {
+			last_errno = errno;
+			buffer[off] = '\0';
+			return ECGOTHER;
+		}
+		if (ret == 0)
+			break;
+	}
+	buffer[off] = '\0';
+
+	if (len)
+		*len = off;
+
+	return 0;
+}
+
+void cgroup_handle_close(struct cgroup_handle **handle)
+{
+	int i;
+
+	if (!handle || !*handle)
+		return;
+
+	for (i = 0; i < (*handle)->fd_cnt; i++)
+		close((*handle)->fds[i]);
+	free((*handle)->fds);
+
+	cg_dir_close(&(*handle)->dir);
+	free(*handle);
+	*handle = NULL;
+}
+
+/* FNV-1a hash of len bytes, see cg_hash_string() */
+static unsigned int cg_hash_mem(const char *str, size_t len)
+{
+	unsigned int hash = 2166136261u;
+
+	while (len--) {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static struct cg_key_slot *cg_key_table_find(const struct cg_key_table * const table,
+					     const char * const name, size_t len, unsigned int hash)
+{
+	struct cg_key_slot *slot;
+	unsigned int i;
+
+	for (i = hash & (table->size - 1); ; i = (i + 1) & (table->size - 1)) {
+		slot = &table->slots[i];
+		if (!slot->name ||
+		    (slot->hash == hash && slot->len == len && !memcmp(slot->name, name, len)))
+			return slot;
+	}
+}
+
+static int cg_key_table_insert(struct cg_key_table * const table, const char * const name,
+			       size_t len, unsigned int hash, uint32_t id)
+{
+	struct cg_key_table grown;
+	struct cg_key_slot *slot;
+	unsigned int i;
+
+	/* Keep the table at most half full */
+	if ((table->cnt + 1) * 2 > table->size) {
+		grown.size = table->size ? table->size * 2 : 64;
+		grown.cnt = 0;
+		grown.slots = calloc(grown.size, sizeof(*grown.slots));
+		if (!grown.slots) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+
+		for (i = 0; i < table->size; i++) {
+			slot = &table->slots[i];
+			if (!slot->name)
+				continue;
+
+			*cg_key_table_find(&grown, slot->name, slot->len, slot->hash) = *slot;
+			grown.cnt++;
+		}
+
+		free(table->slots);
+		*table = grown;
+	}
+
+	slot = cg_key_table_find(table, name, len, hash);
+	slot->name = name;
+	slot->len = len;
+	slot->hash = hash;
+	slot->id = id;
+	table->cnt++;
+
+	return 0;
+}
+
+/* Look up the id of a key, interning it the first time it's seen */
+static int cg_stat_parser_intern(struct cgroup_stat_parser *parser, const char * const name,
+				 size_t len, uint32_t *id)
+{
+	unsigned int hash = cg_hash_mem(name, len);
+	struct cg_key_slot *slot;
+	char **key_names;
+	char *key_name;
+	int error;
+
+	if (parser->keys.size) {
+		slot = cg_key_table_find(&parser->keys, name, len, hash);
+		if (slot->name) {
+			*id = slot->id;
+			return 0;
+		}
+	}
+
+	if (parser->key_cnt == parser->key_max) {
+		key_names = realloc(parser->key_names,
+				    (parser->key_max * 2 + 64) * sizeof(*key_names));
+		if (!key_names) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+		parser->key_names = key_names;
+		parser->key_max = parser->key_max * 2 + 64;
+	}
+
+	key_name = strndup(name, len);
+	if (!key_name) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+
+	error = cg_key_table_insert(&parser->keys, key_name, len, hash, parser->key_cnt);
+	if (error) {
+		free(key_name);
+		return error;
+	}
+
+	*id = parser->key_cnt;
+	parser->key_names[parser->key_cnt++] = key_name;
+
+	return 0;
+}
+
+/*
+ * Parse an unsigned integer, "max", or a decimal number with up to two
+ * decimal places as printed by the PSI files.
+ */
+static bool cg_stat_parse_value(const char *str, size_t len, struct cgroup_stat_value *value)
+{
+	uint64_t val = 0;
+	size_t i, j;
+
+	if (len == 3 && !memcmp(str, "max", 3)) {
+		value->type = CGROUP_STAT_TYPE_MAX;
+		value->value = UINT64_MAX;
+		return true;
+	}
+
+	for (i = 0; i < len && isdigit((unsigned char)str[i]); i++) {
+		if (val > (UINT64_MAX - (str[i] - '0')) / 10)
+			return false;
+		val = val * 10 + (str[i] - '0');
+	}
+	if (i == 0)
+		return false;
+
+	if (i == len) {
+		value->type = CGROUP_STAT_TYPE_UINT;
+		value->value = val;
+		return true;
+	}
+
+	if (str[i] != '.' || i + 1 == len)
+		return false;
+
+	/* The value in hundredths, further decimal places are dropped */
+	for (j = 1; i + j < len; j++) {
+		if (!isdigit((unsigned char)str[i + j]))
+			return false;
+		if (j > 2)
+			continue;
+		if (val > (UINT64_MAX - (str[i + j] - '0')) / 10)
+			return false;
+		val = val * 10 + (str[i + j] - '0');
+	}
+	for (; j <= 2; j++) {
+		if (val > UINT64_MAX / 10)
+			return false;
+		val *= 10;
+	}
+
+	value->type = CGROUP_STAT_TYPE_DECIMAL;
+	value->value = val;
+
+	return true;
+}
+
+static int cg_stat_parser_add(struct cgroup_stat_parser *parser, const char * const key,
+			      size_t key_len, const char * const str, size_t len)
+{
+	struct cgroup_stat_value value, *values;
+	int error;
+
+	if (!cg_stat_parse_value(str, len, &value))
+		return 0;
+
+	error = cg_stat_parser_intern(parser, key, key_len, &value.key);
+	if (error)
+		return error;
+
+	if (parser->value_cnt == parser->value_max) {
+		values = realloc(parser->values, (parser->value_max * 2 + 64) * sizeof(*values));
+		if (!values) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+		parser->values = values;
+		parser->value_max = parser->value_max * 2 + 64;
+	}
+
+	parser->values[parser->value_cnt++] = value;
+
+	return 0;
+}
+
+/* The next space separated token of [*pos, end), false at the end of the line */
+static bool cg_stat_token(const char **pos, const char * const end, const char **token,
+			  size_t *len)
+{
+	const char *p = *pos;
+
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+	if (p == end)
+		return false;
+
+	*token = p;
+	while (p < end && *p != ' ' && *p != '\t')
+		p++;
+	*len = p - *token;
+	*pos = p;
+
+	return true;
+}
+
+static int cg_stat_parse_line(struct cgroup_stat_parser *parser, const char *pos,
+			      const char * const end)
+{
+	char key[CG_STAT_KEY_MAX];
+	const char *first, *token;
+	size_t first_len, len;
+	const char *eq;
+	int error = 0;
+	int i;
+
+	if (!cg_stat_token(&pos, end, &first, &first_len))
+		return 0;
+
+	/* A single value, e.g. memory.current */
+	if (!cg_stat_token(&pos, end, &token, &len))
+		return cg_stat_parser_add(parser, "", 0, first, first_len);
+
+	for (i = 1; !error; i++) {
+		eq = memchr(token, '=', len);
+		if (eq) {
+			/* Nested keyed, e.g. "8:0 rbytes=4096 wbytes=0" in io.stat */
+			if (first_len + 1 + (eq - token) <= sizeof(key)) {
+				memcpy(key, first, first_len);
+				key[first_len] = ':';
+				memcpy(key + first_len + 1, token, eq - token);
+				error = cg_stat_parser_add(parser, key,
+							   first_len + 1 + (eq - token), eq + 1,
+							   len - (eq - token) - 1);
+			}
+		} else if (i == 1) {
+			/* Flat keyed, e.g. "anon 4096" in memory.stat */
+			error = cg_stat_parser_add(parser, first, first_len, token, len);
+		}
+
+		if (!cg_stat_token(&pos, end, &token, &len))
+			break;
+	}
+
+	return error;
+}
+
+/* Read the whole file from its beginning into the buffer of the parser */
+static int cg_stat_parser_read_fd(struct cgroup_stat_parser *parser, int fd, size_t *len)
+{
+	size_t size;
+	ssize_t ret;
+	char *buf;
+
+	for (*len = 0; ; *len += ret) {
+		if (*len == parser->buf_size) {
+			size = parser->buf_size ? parser->buf_size * 2 : CG_CONTROL_VALUE_MAX;
+			buf = realloc(parser->buf, size);
+			if (!buf) {
+				last_errno = errno;
+				return ECGOTHER;
+			}
+			parser->buf = buf;
+			parser->buf_size = size;
+		}
+
+		ret = pread(fd, parser->buf + *len, parser->buf_size - *len, *len);
+		if (ret < 0) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+		if (ret == 0)
+			return 0;
+	}
+}
+
+int cgroup_stat_parser_new(struct cgroup_stat_parser **parser)
+{
+	if (!parser)
+		return ECGINVAL;
+
+	*parser = calloc(1, sizeof(**parser));
+	if (!*parser) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+
+	return 0;
+}
+
+/* Free the keys, values and buffer of a parser, but not the parser */
+static void cg_stat_parser_release(struct cgroup_stat_parser *parser)
+{
+	uint32_t i;
+
+	for (i = 0; i < parser->key_cnt; i++)
+		free(parser->key_names[i]);
+	free(parser->key_names);
+	free(parser->keys.slots);
+	free(parser->values);
+	free(parser->buf);
+}
+
+void cgroup_stat_parser_free(struct cgroup_stat_parser **parser)
+{
+	if (!parser || !*parser)
+		return;
+
+	cg_stat_parser_release(*parser);
+	free(*parser);
+	*parser = NULL;
+}
+
+int cgroup_stat_parser_key(struct cgroup_stat_parser *parser, const char * const name,
+			   uint32_t *key)
+{
+	if (!parser || !name || !key)
+		return ECGINVAL;
+
+	return cg_stat_parser_intern(parser, name, strlen(name), key);
+}
+
+const char *cgroup_stat_parser_key_name(const struct cgroup_stat_parser *parser, uint32_t key)
+{
+	if (!parser || key >= parser->key_cnt)
+		return NULL;
+
+	return parser->key_names[key];
+}
+
+int cgroup_stat_parse(struct cgroup_stat_parser *parser, const char *buf, size_t len,
+		      const struct cgroup_stat_value **values, int *cnt)
+{
+	const char *end = buf + len;
+	const char *eol;
+	int error;
+
+	if (!parser || (!buf && len) || !values || !cnt)
+		return ECGINVAL;
+
+	parser->value_cnt = 0;
+
+	while (buf < end) {
+		eol = memchr(buf, '\n', end - buf);
+		if (!eol)
+			eol = end;
+
+		error = cg_stat_parse_line(parser, buf, eol);
+		if (error)
+			return error;
+
+		buf = eol + 1;
+	}
+
+	*values = parser->values;
+	*cnt = parser->value_cnt;
+
+	return 0;
+}
+
+int cgroup_stat_read(struct cgroup_stat_parser *parser, const char * const controller,
+		     const char * const path, const char * const name,
+		     const struct cgroup_stat_value **values, int *cnt)
+{
+	char file[FILENAME_MAX + NAME_MAX + 1];
+	char cgrp_path[FILENAME_MAX];
+	size_t len;
+	int error;
+	int fd;
+
+	if (!cgroup_initialized)
+		return ECGROUPNOTINITIALIZED;
+
+	if (!parser || !controller || !path || !name)
+		return ECGINVAL;
+
+	if (!cg_build_path(path, cgrp_path, controller))
+		return ECGOTHER;
+
+	snprintf(file, sizeof(file), "%s/%s", cgrp_path, name);
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		last_errno = errno;
+		return errno == ENOENT ? ECGROUPVALUENOTEXIST : ECGOTHER;
+	}
+
+	error = cg_stat_parser_read_fd(parser, fd, &len);
+	close(fd);
+	if (error)
+		return error;
+
+	return cgroup_stat_parse(parser, parser->buf, len, values, cnt);
+}
+
+int cgroup_handle_read_stat(struct cgroup_handle *handle, int index,
+			    struct cgroup_stat_parser *parser,
+			    const struct cgroup_stat_value **values, int *cnt)
+{
+	size_t len;
+	int error;
+
+	if (!cgroup_initialized)
+		return ECGROUPNOTINITIALIZED;
+
+	if (!handle || index < 0 || index >= handle->fd_cnt || !parser)
+		return ECGINVAL;
+
+	error = cg_stat_parser_read_fd(parser, handle->fds[index], &len);
+	if (error)
+		return error;
+
+	return cgroup_stat_parse(parser, parser->buf, len, values, cnt);
+}
+
+/*
+ * cgroup_snapshot_subtree() collects the groups of the subtree first, then
+ * a pool of workers reads their files.  Each worker takes the next chunk of
+ * groups and appends their values to its own array of records, the arrays
+ * are merged in the order of the groups at the end.  A worker parses each
+ * file with its own cgroup_stat_parser and maps the keys of the parser to
+ * the keys of the snapshot, which are interned in a table shared by the
+ * workers.
+ */
+#define CG_SNAPSHOT_THREADS_MAX	8
+#define CG_SNAPSHOT_CHUNK	16
+
+struct cg_snapshot_group {
+	/* Path relative to the base of the snapshot, "." for the base */
+	char *path;
+	/* The records of the group in the array of a worker */
+	int worker;
+	size_t rec_off;
+	size_t rec_cnt;
+};
+
+struct cg_snapshot_ctx {
+	/* The directory of the base of the snapshot */
+	int base_fd;
+	const char * const *files;
+	int file_cnt;
+
+	struct cg_snapshot_group *groups;
+	int group_cnt;
+	int group_max;
+	/* The first group not taken by a worker */
+	int next_group;
+	/* The first error of a worker, and its errno */
+	int error;
+	int error_errno;
+
+	pthread_mutex_t keys_lock;
+	struct cg_key_table keys;
+	char **key_names;
+	int key_cnt;
+	int key_max;
+};
+
+/* A file read by a worker */
+struct cg_snapshot_file {
+	struct cgroup_stat_parser parser;
+	/* The snapshot keys of the parser keys, UINT32_MAX until looked up */
+	uint32_t *key_ids;
+	uint32_t key_id_cnt;
+};
+
+struct cg_snapshot_worker {
+	struct cg_snapshot_ctx *ctx;
+	pthread_t thread;
+	int index;
+
+	struct cgroup_snapshot_record *records;
+	size_t rec_cnt;
+	size_t rec_max;
+
+	struct cg_snapshot_file *files;
+};
+
+/*
+ * Get the snapshot key of a key of a file, "<file>:<key>" or "<file>" for
+ * the empty key, adding it the first time it's seen.
+ */
+static int cg_snapshot_key(struct cg_snapshot_worker *w, int file, uint32_t parser_key,
+			   uint32_t *id)
+{
+	struct cg_snapshot_file *f = &w->files[file];
+	struct cg_snapshot_ctx *ctx = w->ctx;
+	char key[FILENAME_MAX + CG_STAT_KEY_MAX];
+	const char *parser_name;
+	struct cg_key_slot *slot;
+	char **key_names;
+	char *key_name;
+	unsigned int hash;
+	uint32_t *key_ids;
+	int error = 0;
+	size_t len;
 
-	if (depth && (info->depth > depth))
+	if (parser_key < f->key_id_cnt && f->key_ids[parser_key] != UINT32_MAX) {
+		*id = f->key_ids[parser_key];
 		return 0;
+	}
 
-	switch (ent->fts_info) {
-	case FTS_DNR:
-	case FTS_ERR:
-		errno = ent->fts_errno;
-		break;
-	case FTS_D:
-		if (dir & CGROUP_WALK_TYPE_PRE_DIR)
-			info->type = CGROUP_FILE_TYPE_DIR;
-		break;
-	case FTS_DC:
-	case FTS_NSOK:
-	case FTS_NS:
-	case FTS_DP:
-		if (dir & CGROUP_WALK_TYPE_POST_DIR)
-			info->type = CGROUP_FILE_TYPE_DIR;
-		break;
-	case FTS_F:
-		info->type = CGROUP_FILE_TYPE_FILE;
-		break;
-	case FTS_DEFAULT:
-		break;
+	if (parser_key >= f->key_id_cnt) {
+		key_ids = realloc(f->key_ids, f->parser.key_cnt * sizeof(*key_ids));
+		if (!key_ids) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+		memset(key_ids + f->key_id_cnt, 0xff,
+		       (f->parser.key_cnt - f->key_id_cnt) * sizeof(*key_ids));
+		f->key_ids = key_ids;
+		f->key_id_cnt = f->parser.key_cnt;
 	}
-	return ret;
-}
 
-int cgroup_walk_tree_next(int depth, void **handle, struct cgroup_file_info *info, int base_level)
-{
-	struct cgroup_tree_handle *entry;
-	FTSENT *ent;
-	int ret = 0;
+	parser_name = f->parser.key_names[parser_key];
+	if (parser_name[0])
+		snprintf(key, sizeof(key), "%s:%s", ctx->files[file], parser_name);
+	else
+		snprintf(key, sizeof(key), "%s", ctx->files[file]);
+	len = strlen(key);
+	hash = cg_hash_mem(key, len);
 
-	if (!cgroup_initialized)
-		return ECGROUPNOTINITIALIZED;
+	pthread_mutex_lock(&ctx->keys_lock);
 
-	if (!handle)
-		return ECGINVAL;
+	slot = ctx->keys.size ? cg_key_table_find(&ctx->keys, key, len, hash) : NULL;
+	if (slot && slot->name) {
+		*id = slot->id;
+		goto unlock;
+	}
 
-	entry = (struct cgroup_tree_handle *) *handle;
+	if (ctx->key_cnt == ctx->key_max) {
+		key_names = realloc(ctx->key_names,
+				    (ctx->key_max * 2 + 64) * sizeof(*key_names));
+		if (!key_names) {
+			last_errno = errno;
+			error = ECGOTHER;
+			goto unlock;
+		}
+		ctx->key_names = key_names;
+		ctx->key_max = ctx->key_max * 2 + 64;
+	}
 
-	ent = fts_read(entry->fts);
-	if (!ent)
-		return ECGEOF;
-	if (!base_level && depth)
-		base_level = ent->fts_level + depth;
+	key_name = strdup(key);
+	if (!key_name) {
+		last_errno = errno;
+		error = ECGOTHER;
+		goto unlock;
+	}
 
-	ret = cg_walk_node(entry->fts, ent, base_level, info, entry->flags);
+	error = cg_key_table_insert(&ctx->keys, key_name, len, hash, ctx->key_cnt);
+	if (error) {
+		free(key_name);
+		goto unlock;
+	}
 
-	*handle = entry;
-	return ret;
+	*id = ctx->key_cnt;
+	ctx->key_names[ctx->key_cnt++] = key_name;
+
+unlock:
+	pthread_mutex_unlock(&ctx->keys_lock);
+	if (!error)
+		f->key_ids[parser_key] = *id;
+
+	return error;
 }
 
-int cgroup_walk_tree_end(void **handle)
+static int cg_snapshot_add(struct cg_snapshot_worker *w, uint32_t cgroup, int file,
+			   const struct cgroup_stat_value * const value)
 {
-	struct cgroup_tree_handle *entry;
+	struct cgroup_snapshot_record *records;
+	uint32_t id;
+	int error;
 
-	if (!cgroup_initialized)
-		return ECGROUPNOTINITIALIZED;
+	/* The snapshot only has integers */
+	if (value->type == CGROUP_STAT_TYPE_DECIMAL)
+		return 0;
 
-	if (!handle)
-		return ECGINVAL;
+	error = cg_snapshot_key(w, file, value->key, &id);
+	if (error)
+		return error;
 
-	entry = (struct cgroup_tree_handle *) *handle;
+	if (w->rec_cnt == w->rec_max) {
+		records = realloc(w->records, (w->rec_max * 2 + 1024) * sizeof(*records));
+		if (!records) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+		w->records = records;
+		w->rec_max = w->rec_max * 2 + 1024;
+	}
 
-	fts_close(entry->fts);
-	free(entry);
-	*handle = NULL;
+	w->records[w->rec_cnt].cgroup = cgroup;
+	w->records[w->rec_cnt].key = id;
+	w->records[w->rec_cnt].value = value->value;
+	w->rec_cnt++;
 
 	return 0;
 }
 
-/* TODO: Need to decide a better place to put this function. */
-int cgroup_walk_tree_begin(const char *controller, const char *base_path, int depth, void **handle,
-			   struct cgroup_file_info *info, int *base_level)
+static int cg_snapshot_read_group(struct cg_snapshot_worker *w, int index)
 {
-	struct cgroup_tree_handle *entry;
-	char full_path[FILENAME_MAX];
-	char *cg_path[2];
-	FTSENT *ent;
-	int ret = 0;
+	struct cg_snapshot_group *group = &w->ctx->groups[index];
+	const struct cgroup_stat_value *values;
+	struct cgroup_stat_parser *parser;
+	char path[FILENAME_MAX];
+	int error, cnt;
+	size_t len;
+	int fd;
+	int i, j;
 
-	if (!cgroup_initialized)
-		return ECGROUPNOTINITIALIZED;
+	group->worker = w->index;
+	group->rec_off = w->rec_cnt;
 
-	if (!handle)
-		return ECGINVAL;
+	for (i = 0; i < w->ctx->file_cnt; i++) {
+		snprintf(path, sizeof(path), "%s/%s", group->path, w->ctx->files[i]);
 
-	cgroup_dbg("path is %s\n", base_path);
+		fd = openat(w->ctx->base_fd, path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			/* The group or the file is gone */
+			if (errno == ENOENT || errno == ENODEV)
+				continue;
+			last_errno = errno;
+			return ECGOTHER;
+		}
 
-	if (!cg_build_path(base_path, full_path, controller))
-		return ECGOTHER;
+		parser = &w->files[i].parser;
+		error = cg_stat_parser_read_fd(parser, fd, &len);
+		close(fd);
 
-	entry = calloc(1, sizeof(struct cgroup_tree_handle));
+		/* The group has been removed while it was read */
+		if (error == ECGOTHER && (last_errno == ENOENT || last_errno == ENODEV))
+			continue;
+		if (error)
+			return error;
 
-	if (!entry) {
-		last_errno = errno;
-		*handle = NULL;
-		return ECGOTHER;
+		error = cgroup_stat_parse(parser, parser->buf, len, &values, &cnt);
+		if (error)
+			return error;
+
+		for (j = 0; j < cnt; j++) {
+			error = cg_snapshot_add(w, index, i, &values[j]);
+			if (error)
+				return error;
+		}
 	}
 
-	entry->flags |= CGROUP_WALK_TYPE_PRE_DIR;
+	group->rec_cnt = w->rec_cnt - group->rec_off;
 
-	*base_level = 0;
-	cg_path[0] = full_path;
-	cg_path[1] = NULL;
+	return 0;
+}
 
-	entry->fts = fts_open(cg_path, FTS_LOGICAL | FTS_NOCHDIR | FTS_NOSTAT, NULL);
-	if (entry->fts == NULL) {
-		free(entry);
-		last_errno = errno;
-		*handle = NULL;
-		return ECGOTHER;
-	}
-	ent = fts_read(entry->fts);
-	if (!ent) {
-		cgroup_warn("fts_read failed\n");
-		fts_close(entry->fts);
-		free(entry);
-		*handle = NULL;
-		return ECGINVAL;
-	}
-	if (!*base_level && depth)
-		*base_level = ent->fts_level + depth;
+static void *cg_snapshot_worker(void *arg)
+{
+	struct cg_snapshot_worker *w = arg;
+	struct cg_snapshot_ctx *ctx = w->ctx;
+	int first, i, error = 0;
+	int no_error = 0;
 
-	ret = cg_walk_node(entry->fts, ent, *base_level, info, entry->flags);
-	if (ret != 0) {
-		fts_close(entry->fts);
-		free(entry);
-		*handle = NULL;
-	} else {
-		*handle = entry;
+	while (!error && !__atomic_load_n(&ctx->error, __ATOMIC_RELAXED)) {
+		first = __atomic_fetch_add(&ctx->next_group, CG_SNAPSHOT_CHUNK, __ATOMIC_RELAXED);
+		if (first >= ctx->group_cnt)
+			break;
+
+		for (i = first; i < first + CG_SNAPSHOT_CHUNK && i < ctx->group_cnt; i++) {
+			error = cg_snapshot_read_group(w, i);
+			if (error)
+				break;
+		}
 	}
-	return ret;
-}
 
-int cgroup_walk_tree_set_flags(void **handle, int flags)
-{
-	struct cgroup_tree_handle *entry;
+	/* last_errno is per thread, the caller gets the one of the error */
+	if (error && __atomic_compare_exchange_n(&ctx->error, &no_error, error, false,
+						 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		ctx->error_errno = last_errno;
 
-	if (!cgroup_initialized)
-		return ECGROUPNOTINITIALIZED;
+	return NULL;
+}
 
-	if (!handle)
-		return ECGINVAL;
+static int cg_snapshot_add_group(struct cg_snapshot_ctx *ctx, char *path)
+{
+	struct cg_snapshot_group *groups;
 
-	if ((flags & CGROUP_WALK_TYPE_PRE_DIR) &&
-	    (flags & CGROUP_WALK_TYPE_POST_DIR))
-		return ECGINVAL;
+	if (ctx->group_cnt == ctx->group_max) {
+		groups = realloc(ctx->groups, (ctx->group_max * 2 + 256) * sizeof(*groups));
+		if (!groups) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+		ctx->groups = groups;
+		ctx->group_max = ctx->group_max * 2 + 256;
+	}
 
-	entry = (struct cgroup_tree_handle *) *handle;
-	entry->flags = flags;
+	memset(&ctx->groups[ctx->group_cnt], 0, sizeof(*groups));
+	ctx->groups[ctx->group_cnt++].path = path;
 
-	*handle = entry;
 	return 0;
 }
 
-/*
- * This parses a stat line which is in the form of (name value) pair
- * separated by a space.
- */
-static int cg_read_stat(FILE *fp, struct cgroup_stat *cgrp_stat)
+/* Add the group at path and its descendants, in pre-order */
+static int cg_snapshot_walk(struct cg_snapshot_ctx *ctx, char *path)
 {
-	char *saveptr = NULL;
-	ssize_t read_bytes;
-	char *line = NULL;
-	size_t len = 0;
-	char *token;
-	int ret = 0;
+	struct dirent *dent;
+	struct stat st;
+	char *child;
+	int error;
+	DIR *dir;
+	int fd;
 
-	read_bytes = getline(&line, &len, fp);
-	if (read_bytes == -1) {
-		ret = ECGEOF;
-		goto out_free;
+	error = cg_snapshot_add_group(ctx, path);
+	if (error) {
+		free(path);
+		return error;
 	}
 
-	token = strtok_r(line, " ", &saveptr);
-	if (!token) {
-		ret = ECGINVAL;
-		goto out_free;
+	fd = openat(ctx->base_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		/* The group is gone */
+		if (errno == ENOENT && ctx->group_cnt > 1) {
+			free(ctx->groups[--ctx->group_cnt].path);
+			return 0;
+		}
+		last_errno = errno;
+		return ECGOTHER;
 	}
-	strncpy(cgrp_stat->name, token, FILENAME_MAX - 1);
-	cgrp_stat->name[FILENAME_MAX - 1] = '\0';
 
-	token = strtok_r(NULL, " ", &saveptr);
-	if (!token) {
-		ret = ECGINVAL;
-		goto out_free;
+	dir = fdopendir(fd);
+	if (!dir) {
+		last_errno = errno;
+		close(fd);
+		return ECGOTHER;
 	}
-	strncpy(cgrp_stat->value, token, CG_VALUE_MAX - 1);
-	cgrp_stat->value[CG_VALUE_MAX - 1] = '\0';
-
-out_free:
-	free(line);
 
-	return ret;
-}
+	while ((dent = readdir(dir)) != NULL) {
+		if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, ".."))
+			continue;
 
-int cgroup_read_value_end(void **handle)
-{
-	FILE *fp;
+		if (dent->d_type == DT_UNKNOWN) {
+			if (fstatat(fd, dent->d_name, &st, AT_SYMLINK_NOFOLLOW) ||
+			    !S_ISDIR(st.st_mode))
+				continue;
+		} else if (dent->d_type != DT_DIR) {
+			continue;
+		}
 
-	if (!cgroup_initialized)
-		return ECGROUPNOTINITIALIZED;
+		if (strcmp(path, ".") == 0)
+			child = strdup(dent->d_name);
+		else if (asprintf(&child, "%s/%s", path, dent->d_name) < 0)
+			child = NULL;
+		if (!child) {
+			last_errno = errno;
+			error = ECGOTHER;
+			break;
+		}
 
-	if (!handle)
-		return ECGINVAL;
+		error = cg_snapshot_walk(ctx, child);
+		if (error)
+			break;
+	}
 
-	fp = (FILE *)*handle;
-	fclose(fp);
-	*handle = NULL;
+	closedir(dir);
 
-	return 0;
+	return error;
 }
 
-int cgroup_read_value_next(void **handle, char *buffer, int max)
+/* Name the groups relative to the hierarchy root and merge the records of the workers */
+static int cg_snapshot_build(struct cg_snapshot_ctx *ctx, struct cg_snapshot_worker *workers,
+			     const char *base, struct cgroup_snapshot *snap)
 {
-	char *ret_c;
-	int ret = 0;
-	FILE *fp;
+	struct cg_snapshot_group *group;
+	size_t base_len, rec_cnt = 0;
+	int i, ret;
+
+	/* The base without its leading and trailing slashes */
+	base += strspn(base, "/");
+	base_len = strlen(base);
+	while (base_len && base[base_len - 1] == '/')
+		base_len--;
+
+	snap->cgroups = calloc(ctx->group_cnt, sizeof(*snap->cgroups));
+	if (!snap->cgroups)
+		goto oom;
+
+	for (i = 0; i < ctx->group_cnt; i++) {
+		group = &ctx->groups[i];
+		if (strcmp(group->path, ".") == 0) {
+			if (base_len)
+				ret = asprintf(&snap->cgroups[i], "%.*s", (int)base_len, base);
+			else
+				ret = asprintf(&snap->cgroups[i], "/");
+		} else if (base_len) {
+			ret = asprintf(&snap->cgroups[i], "%.*s/%s", (int)base_len, base,
+				       group->path);
+		} else {
+			ret = asprintf(&snap->cgroups[i], "%s", group->path);
+		}
+		if (ret < 0) {
+			snap->cgroups[i] = NULL;
+			goto oom;
+		}
+		snap->cgroup_cnt++;
+
+		rec_cnt += group->rec_cnt;
+	}
 
-	if (!cgroup_initialized)
-		return ECGROUPNOTINITIALIZED;
+	snap->records = malloc((rec_cnt ? rec_cnt : 1) * sizeof(*snap->records));
+	if (!snap->records)
+		goto oom;
 
-	if (!buffer || !handle)
-		return ECGINVAL;
+	for (i = 0; i < ctx->group_cnt; i++) {
+		group = &ctx->groups[i];
+		memcpy(&snap->records[snap->record_cnt],
+		       &workers[group->worker].records[group->rec_off],
+		       group->rec_cnt * sizeof(*snap->records));
+		snap->record_cnt += group->rec_cnt;
+	}
 
-	fp = (FILE *)*handle;
-	ret_c = fgets(buffer, max, fp);
-	if (ret_c == NULL)
-		ret = ECGEOF;
+	/* The names are handed over to the snapshot */
+	snap->keys = ctx->key_names;
+	snap->key_cnt = ctx->key_cnt;
+	ctx->key_names = NULL;
+	ctx->key_cnt = 0;
 
-	return ret;
+	return 0;
+
+oom:
+	last_errno = errno;
+	return ECGOTHER;
 }
 
-int cgroup_read_value_begin(const char * const controller, const char *path,
-			    const char * const name, void **handle, char *buffer, int max)
+int cgroup_snapshot_subtree(const char * const controller, const char * const base,
+			    const char * const files[], int threads,
+			    struct cgroup_snapshot **snapshot)
 {
-	char stat_file[FILENAME_MAX + sizeof(name)];
-	char stat_path[FILENAME_MAX];
-	char *ret_c = NULL;
-	int ret = 0;
-	FILE *fp;
+	struct cg_snapshot_worker *workers = NULL;
+	struct cgroup_snapshot *snap = NULL;
+	struct cg_snapshot_ctx ctx = { 0 };
+	char base_path[FILENAME_MAX];
+	int started = 0;
+	int error = 0;
+	char *path;
+	int i, j;
 
 	if (!cgroup_initialized)
 		return ECGROUPNOTINITIALIZED;
 
-	if (!buffer || !handle)
+	if (!controller || !base || !files || !snapshot)
 		return ECGINVAL;
 
-	if (!cg_build_path(path, stat_path, controller))
+	*snapshot = NULL;
+
+	if (!cg_build_path(base, base_path, controller))
 		return ECGOTHER;
 
-	snprintf(stat_file, sizeof(stat_file), "%s/%s", stat_path, name);
-	fp = fopen(stat_file, "re");
-	if (!fp) {
-		cgroup_warn("fopen failed\n");
+	ctx.files = files;
+	while (files[ctx.file_cnt])
+		ctx.file_cnt++;
+	ctx.base_fd = open(base_path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (ctx.base_fd < 0) {
 		last_errno = errno;
-		*handle = NULL;
-		return ECGOTHER;
+		return errno == ENOENT ? ECGROUPNOTEXIST : ECGOTHER;
 	}
+	pthread_mutex_init(&ctx.keys_lock, NULL);
 
-	ret_c = fgets(buffer, max, fp);
-	if (ret_c == NULL)
-		ret = ECGEOF;
+	path = strdup(".");
+	if (!path) {
+		last_errno = errno;
+		error = ECGOTHER;
+		goto out;
+	}
 
-	*handle = fp;
+	error = cg_snapshot_walk(&ctx, path);
+	if (error)
+		goto out;
 
-	return ret;
-}
+	if (threads <= 0)
+		threads = min(max(sysconf(_SC_NPROCESSORS_ONLN), 1), CG_SNAPSHOT_THREADS_MAX);
+	threads = min(threads, (ctx.group_cnt + CG_SNAPSHOT_CHUNK - 1) / CG_SNAPSHOT_CHUNK);
 
-int cgroup_read_stats_end(void **handle)
-{
-	FILE *fp;
+	workers = calloc(threads, sizeof(*workers));
+	if (!workers) {
+		last_errno = errno;
+		error = ECGOTHER;
+		goto out;
+	}
 
-	if (!cgroup_initialized)
-		return ECGROUPNOTINITIALIZED;
+	for (i = 0; i < threads; i++) {
+		workers[i].ctx = &ctx;
+		workers[i].index = i;
+		workers[i].files = calloc(ctx.file_cnt ? ctx.file_cnt : 1,
+					  sizeof(*workers[i].files));
+		if (!workers[i].files) {
+			last_errno = errno;
+			error = ECGOTHER;
+			goto out;
+		}
+	}
 
-	if (!handle)
-		return ECGINVAL;
+	/* The calling thread is the first worker */
+	for (started = 1; started < threads; started++) {
+		if (pthread_create(&workers[started].thread, NULL, cg_snapshot_worker,
+				   &workers[started])) {
+			cgroup_warn("failed to start a snapshot worker\n");
+			break;
+		}
+	}
+	cg_snapshot_worker(&workers[0]);
+	for (i = 1; i < started; i++)
+		pthread_join(workers[i].thread, NULL);
 
-	fp = (FILE *)*handle;
-	if (fp == NULL)
-		return ECGINVAL;
+	error = ctx.error;
+	if (error) {
+		last_errno = ctx.error_errno;
+		goto out;
+	}
 
-	fclose(fp);
+	snap = calloc(1, sizeof(*snap));
+	if (!snap) {
+		last_errno = errno;
+		error = ECGOTHER;
+		goto out;
+	}
 
-	return 0;
-}
+	error = cg_snapshot_build(&ctx, workers, base, snap);
+	if (error) {
+		cgroup_snapshot_free(&snap);
+		goto out;
+	}
 
-int cgroup_read_stats_next(void **handle, struct cgroup_stat *cgrp_stat)
-{
-	FILE *fp;
-	int ret = 0;
+	*snapshot = snap;
 
-	if (!cgroup_initialized)
-		return ECGROUPNOTINITIALIZED;
+out:
+	if (workers) {
+		for (i = 0; i < threads; i++) {
+			free(workers[i].records);
+			for (j = 0; workers[i].files && j < ctx.file_cnt; j++) {
+				cg_stat_parser_release(&workers[i].files[j].parser);
+				free(workers[i].files[j].key_ids);
+			}
+			free(workers[i].files);
+		}
+		free(workers);
+	}
 
-	if (!handle || !cgrp_stat)
-		return ECGINVAL;
+	for (i = 0; i < ctx.group_cnt; i++)
+		free(ctx.groups[i].path);
+	free(ctx.groups);
 
-	fp = (FILE *)*handle;
-	ret = cg_read_stat(fp, cgrp_stat);
-	*handle = fp;
+	for (i = 0; i < ctx.key_cnt; i++)
+		free(ctx.key_names[i]);
+	free(ctx.key_names);
+	free(ctx.keys.slots);
 
-	return ret;
+	pthread_mutex_destroy(&ctx.keys_lock);
+	close(ctx.base_fd);
+
+	return error;
 }
 
-/* TODO: Need to decide a better place to put this function. */
-int cgroup_read_stats_begin(const char *controller, const char *path, void **handle,
-			    struct cgroup_stat *cgrp_stat)
+void cgroup_snapshot_free(struct cgroup_snapshot **snapshot)
 {
-	char stat_file[FILENAME_MAX + sizeof(".stat")];
-	char stat_path[FILENAME_MAX];
-	int ret = 0;
-	FILE *fp;
-
-	if (!cgroup_initialized)
-		return ECGROUPNOTINITIALIZED;
-
-	if (!cgrp_stat || !handle)
-		return ECGINVAL;
+	struct cgroup_snapshot *snap;
+	int i;
 
-	if (!cg_build_path(path, stat_path, controller))
-		return ECGOTHER;
+	if (!snapshot || !*snapshot)
+		return;
 
-	snprintf(stat_file, sizeof(stat_file), "%s/%s.stat", stat_path, controller);
+	snap = *snapshot;
 
-	fp = fopen(stat_file, "re");
-	if (!fp) {
-		cgroup_warn("fopen failed\n");
-		return ECGINVAL;
-	}
+	for (i = 0; i < snap->cgroup_cnt; i++)
+		free(snap->cgroups[i]);
+	free(snap->cgroups);
 
-	ret = cg_read_stat(fp, cgrp_stat);
-	*handle = fp;
+	for (i = 0; i < snap->key_cnt; i++)
+		free(snap->keys[i]);
+	free(snap->keys);
 
-	return ret;
+	free(snap->records);
+	free(snap);
+	*snapshot = NULL;
 }
 
 int cgroup_get_task_end(void **handle)
@@ -5875,6 +9108,7 @@ STATIC int cg_get_cgroups_from_proc_cgroups(pid_t pid, char *cgrp_list[],
 {
 	char path[FILENAME_MAX];
 	char *stok_buff = NULL;
+	char *saveptr = NULL;
 	size_t buff_len;
 	char buf[4092];
 	int ret = 0;
@@ -5901,9 +9135,9 @@ STATIC int cg_get_cgroups_from_proc_cgroups(pid_t pid, char *cgrp_list[],
 		 */
 
 		/* Read in the cgroup number.  We don't care about it */
-		stok_buff = strtok(buf, ":");
+		stok_buff = strtok_r(buf, ":", &saveptr);
 		/* Read in the controller name */
-		stok_buff = strtok(NULL, ":");
+		stok_buff = strtok_r(NULL, ":", &saveptr);
 
 		/*
 		 * After this point, we have allocated memory.  If we return
@@ -5913,7 +9147,7 @@ STATIC int cg_get_cgroups_from_proc_cgroups(pid_t pid, char *cgrp_list[],
 		controller_list[idx] = strndup(stok_buff, strlen(stok_buff) + 1);
 
 		/* Read in the cgroup name */
-		stok_buff = strtok(NULL, ":");
+		stok_buff = strtok_r(NULL, ":", &saveptr);
 
 		if (stok_buff == NULL) {
 			/*
@@ -6166,6 +9400,254 @@ int cgroup_get_procname_from_procfs(pid_t pid, char **procname)
 	return 0;
 }
 
+/**
+ * Read a file of /proc/<pid> with a single read() and NUL terminate it.
+ * @param dir_fd: The /proc/<pid> directory
+ * @param name: The file name
+ * @param buf: The buffer, the content is cut to its size - 1
+ * @param size: The size of the buffer
+ * @return the number of bytes read, -1 on error.
+ */
+static ssize_t cg_read_proc_file(int dir_fd, const char *name, char *buf, size_t size)
+{
+	ssize_t len;
+	int fd;
+
+	fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	len = read(fd, buf, size - 1);
+	close(fd);
+	if (len < 0)
+		return -1;
+
+	buf[len] = '\0';
+
+	return len;
+}
+
+/**
+ * Parse the effective ID, the second field, of a Uid: or Gid: line of
+ * /proc/<pid>/status.
+ * @return 0 on success, -1 if the line is malformed.
+ */
+static int cg_scan_proc_status_id(const char *p, unsigned long *id)
+{
+	unsigned long val = 0;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		while (*p == ' ' || *p == '\t')
+			p++;
+
+		if (*p < '0' || *p > '9')
+			return -1;
+
+		for (val = 0; *p >= '0' && *p <= '9'; p++)
+			val = val * 10 + (*p - '0');
+	}
+
+	*id = val;
+
+	return 0;
+}
+
+/**
+ * Get the process name and the effective UID and GID from the content of
+ * /proc/<pid>/status, scanning the Name:, Uid: and Gid: lines only.
+ * @return 0 on success, ECGFAIL if a line is missing or malformed.
+ */
+static int cg_parse_proc_status(const char *buf, char *name, size_t name_len, uid_t *euid,
+				gid_t *egid)
+{
+	bool found_name = false, found_euid = false, found_egid = false;
+	const char *line, *end;
+	unsigned long id;
+	size_t len;
+
+	for (line = buf; *line; line = end + 1) {
+		end = strchrnul(line, '\n');
+
+		if (!strncmp(line, "Name:", 5)) {
+			line += 5;
+			while (*line == ' ' || *line == '\t')
+				line++;
+
+			len = min((size_t)(end - line), name_len - 1);
+			memcpy(name, line, len);
+			name[len] = '\0';
+			found_name = true;
+		} else if (!strncmp(line, "Uid:", 4)) {
+			if (cg_scan_proc_status_id(line + 4, &id))
+				break;
+			*euid = id;
+			found_euid = true;
+		} else if (!strncmp(line, "Gid:", 4)) {
+			if (cg_scan_proc_status_id(line + 4, &id))
+				break;
+			*egid = id;
+			found_egid = true;
+		}
+
+		if ((found_name && found_euid && found_egid) || !*end)
+			break;
+	}
+
+	if (!found_name || !found_euid || !found_egid)
+		return ECGFAIL;
+
+	return 0;
+}
+
+/**
+ * Same as cg_get_procname_from_proc_cmdline(), reading the files relative
+ * to the /proc/<pid> directory.
+ * @param dir_fd: The /proc/<pid> directory
+ * @param pname_status : The process name taken from /proc/<pid>/status
+ * @param pname_cmdline: The process name taken from /proc/<pid>/cmdline
+ * @return 0 on success, > 0 on error.
+ */
+static int cg_get_procname_from_cmdline_at(int dir_fd, const char *pname_status,
+					   char **pname_cmdline)
+{
+	char path[FILENAME_MAX * 2];
+	char real[FILENAME_MAX];
+	char cwd[FILENAME_MAX];
+	char buf[FILENAME_MAX];
+	char *arg, *end;
+	ssize_t len;
+
+	len = readlinkat(dir_fd, "cwd", cwd, sizeof(cwd) - 1);
+	if (len < 0)
+		return ECGROUPNOTEXIST;
+	cwd[len] = '\0';
+
+	len = cg_read_proc_file(dir_fd, "cmdline", buf, sizeof(buf));
+	if (len < 0)
+		return ECGROUPNOTEXIST;
+
+	for (arg = buf, end = buf + len; arg < end; arg += strlen(arg) + 1) {
+		/*
+		 * The taken process name from /proc/<pid>/status is
+		 * shortened to 15 characters if it is over. So the name
+		 * should be compared by its length.
+		 */
+		if (strncmp(pname_status, basename(arg), TASK_COMM_LEN - 1))
+			continue;
+
+		if (arg[0] == '/') {
+			*pname_cmdline = strdup(arg);
+		} else {
+			snprintf(path, sizeof(path), "%s/%s", cwd, arg);
+			if (!realpath(path, real)) {
+				last_errno = errno;
+				return ECGOTHER;
+			}
+			*pname_cmdline = strdup(real);
+		}
+
+		if (*pname_cmdline == NULL) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+
+		return 0;
+	}
+
+	return ECGFAIL;
+}
+
+/**
+ * Get the effective UID and GID and the name of a process, as
+ * cgroup_get_uid_gid_from_procfs() and cgroup_get_procname_from_procfs()
+ * do, at a fraction of the system calls. The files are opened relative to
+ * the /proc/<pid> directory, so they all describe the same process even if
+ * it exits and its PID is reused meanwhile, and each of them is read with
+ * a single read() into a stack buffer.
+ * @param pid: The process id
+ * @param euid: The effective UID of the process, may be NULL
+ * @param egid: The effective GID of the process, may be NULL
+ * @param procname: The process name, the caller frees it, may be NULL
+ * @return 0 on success, ECGROUPNOTEXIST if the process doesn't exist
+ * (anymore), > 0 on other errors.
+ */
+int cgroup_get_proc_identity(pid_t pid, uid_t *euid, gid_t *egid, char **procname)
+{
+	char name[TASK_COMM_LEN * 4];
+	char path[FILENAME_MAX];
+	char exe[FILENAME_MAX];
+	char *pname_cmdline;
+	char buf[4096];
+	uid_t uid = 0;
+	gid_t gid = 0;
+	ssize_t len;
+	int dir_fd;
+	int ret;
+
+	snprintf(path, sizeof(path), "/proc/%d", pid);
+	dir_fd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd < 0)
+		return ECGROUPNOTEXIST;
+
+	/* The Name:, Uid: and Gid: lines are at the beginning of the file */
+	if (cg_read_proc_file(dir_fd, "status", buf, sizeof(buf)) < 0) {
+		ret = ECGROUPNOTEXIST;
+		goto out;
+	}
+
+	ret = cg_parse_proc_status(buf, name, sizeof(name), &uid, &gid);
+	if (ret) {
+		cgroup_warn("invalid file format of /proc/%d/status\n", pid);
+		goto out;
+	}
+
+	if (euid)
+		*euid = uid;
+	if (egid)
+		*egid = gid;
+
+	if (!procname)
+		goto out;
+
+	len = readlinkat(dir_fd, "exe", exe, sizeof(exe) - 1);
+	if (len < 0) {
+		/*
+		 * readlink() fails if a kernel thread, and a process name
+		 * is taken from /proc/<pid>/status.
+		 */
+		*procname = strdup(name);
+		goto strdup_check;
+	}
+	exe[len] = '\0';
+
+	/*
+	 * If the executable name doesn't match, this is a script or a
+	 * symbolic link, see cgroup_get_procname_from_procfs().
+	 */
+	if (strncmp(name, basename(exe), TASK_COMM_LEN - 1)) {
+		ret = cg_get_procname_from_cmdline_at(dir_fd, name, &pname_cmdline);
+		if (!ret) {
+			*procname = pname_cmdline;
+			goto out;
+		}
+		ret = 0;
+	}
+
+	*procname = strdup(exe);
+
+strdup_check:
+	if (*procname == NULL) {
+		last_errno = errno;
+		ret = ECGOTHER;
+	}
+
+out:
+	close(dir_fd);
+
+	return ret;
+}
+
 int cgroup_register_unchanged_process(pid_t pid, int flags)
 {
 	char buff[sizeof(CGRULE_SUCCESS_STORE_PID)];
@@ -15,6 +15,10 @@
  * by Dhaval Giani. All faults will still be Balbir's mistake :)
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "tools/tools-common.h"
 
 #include <libcgroup.h>
@@ -22,6 +26,7 @@
 
 #include <pthread.h>
 #include <assert.h>
+#include <ctype.h>
 #include <dirent.h>
 #include <limits.h>
 #include <search.h>
@@ -894,43 +899,288 @@ err:
 	cgroup_free(&cgrp_cpy);
 	return ret;
 }
+/* Create one group of the config */
+static int cgroup_config_create_group(struct cgroup *cgroup)
+{
+	int error;
+
+	error = cgroup_create_cgroup(cgroup, 0);
+	cgroup_dbg("creating group %s, error %d\n", cgroup->name, error);
+	if (error)
+		/*
+		 * Attempt to convert the controller version
+		 * and retry.
+		 */
+		error = convert_controller_versions(cgroup);
+
+	return error;
+}
+
+/* The name of a group without its leading slashes, "" for the root group */
+static const char *cgroup_config_group_path(const struct cgroup * const cgroup)
+{
+	const char *name = cgroup->name + strspn(cgroup->name, "/");
+
+	return strcmp(name, ".") ? name : "";
+}
+
+static int cgroup_config_compare_indexes(const void *p1, const void *p2, void *arg)
+{
+	int i1 = *(const int *)p1, i2 = *(const int *)p2;
+	const struct cgroup *groups = arg;
+	int ret;
+
+	ret = strcmp(cgroup_config_group_path(&groups[i1]),
+		     cgroup_config_group_path(&groups[i2]));
+
+	return ret ? ret : i1 - i2;
+}
+
 /*
- * Actually create the groups once the parsing has been finished
+ * The last group of sorted[] named after the len first characters of name,
+ * or -1
  */
-static int cgroup_config_create_groups(void)
+static int cgroup_config_find_group(const struct cgroup * const groups, const int * const sorted,
+				    int cnt, const char * const name, size_t len)
 {
-	int error = 0;
+	int low = 0, high = cnt, mid, ret;
+	const char *path;
+
+	/* The first group after name */
+	while (low < high) {
+		mid = (low + high) / 2;
+		path = cgroup_config_group_path(&groups[sorted[mid]]);
+		ret = strncmp(path, name, len);
+		if (ret < 0 || (ret == 0 && path[len] == '\0'))
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	if (low == 0)
+		return -1;
+
+	path = cgroup_config_group_path(&groups[sorted[low - 1]]);
+	if (strncmp(path, name, len) || path[len] != '\0')
+		return -1;
+
+	return sorted[low - 1];
+}
+
+/**
+ * Find the group each group of the config must be created after: the same
+ * group defined earlier in the config, or else the last definition of its
+ * closest ancestor in the config.  The parents of all the groups form a forest, two groups
+ * in different subtrees can be created at the same time.
+ *
+ * @param groups The groups of the config
+ * @param cnt Number of groups
+ * @param parents The index of the parent of each group, -1 for none
+ */
+STATIC int cgroup_config_group_parents(const struct cgroup * const groups, int cnt,
+				       int * const parents)
+{
+	const char *path;
+	int *sorted;
+	size_t len;
 	int i;
 
-	for (i = 0; i < cgroup_table_index; i++) {
-		struct cgroup *cgroup = &config_cgrp_table[i];
+	sorted = malloc((cnt ? cnt : 1) * sizeof(*sorted));
+	if (!sorted) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+
+	for (i = 0; i < cnt; i++)
+		sorted[i] = i;
+
+	qsort_r(sorted, cnt, sizeof(*sorted), cgroup_config_compare_indexes, (void *)groups);
+
+	for (i = 0; i < cnt; i++) {
+		path = cgroup_config_group_path(&groups[sorted[i]]);
+
+		/* The group is defined more than once */
+		if (i > 0 && !strcmp(path, cgroup_config_group_path(&groups[sorted[i - 1]]))) {
+			parents[sorted[i]] = sorted[i - 1];
+			continue;
+		}
+
+		parents[sorted[i]] = -1;
+		if (path[0] == '\0')
+			continue;
+
+		/* The ancestors, up to the root group */
+		len = strlen(path);
+		do {
+			while (len > 0 && path[len - 1] != '/')
+				len--;
+			while (len > 0 && path[len - 1] == '/')
+				len--;
+
+			parents[sorted[i]] = cgroup_config_find_group(groups, sorted, cnt, path,
+								      len);
+		} while (parents[sorted[i]] < 0 && len > 0);
+	}
+
+	free(sorted);
+
+	return 0;
+}
+
+/* The groups of the config, created by a pool of threads */
+struct cg_config_dag {
+	struct cgroup *groups;
+
+	/* The children of each group, in the order of the config */
+	int *first_child;
+	int *next_sibling;
+
+	/* The groups that can be created, in the order they became ready */
+	int *ready;
+	int ready_head;
+	int ready_tail;
+	/* Number of groups being created */
+	int running;
+
+	/* The failed group with the lowest index */
+	int error;
+	int error_index;
+	int error_errno;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void *cgroup_config_create_worker(void *arg)
+{
+	struct cg_config_dag *dag = arg;
+	int error, i, child;
+
+	pthread_mutex_lock(&dag->lock);
+
+	/* Once a group failed, the groups left are not created */
+	while (!dag->error && (dag->ready_head < dag->ready_tail || dag->running)) {
+		if (dag->ready_head == dag->ready_tail) {
+			pthread_cond_wait(&dag->cond, &dag->lock);
+			continue;
+		}
+
+		i = dag->ready[dag->ready_head++];
+		dag->running++;
+		pthread_mutex_unlock(&dag->lock);
+
+		error = cgroup_config_create_group(&dag->groups[i]);
+
+		pthread_mutex_lock(&dag->lock);
+		dag->running--;
 
-		error = cgroup_create_cgroup(cgroup, 0);
-		cgroup_dbg("creating group %s, error %d\n", cgroup->name, error);
 		if (error) {
-			/*
-			 * Attempt to convert the controller version
-			 * and retry.
-			 */
-			error = convert_controller_versions(cgroup);
-			if (error)
-				return error;
+			if (!dag->error || i < dag->error_index) {
+				dag->error = error;
+				dag->error_index = i;
+				dag->error_errno = last_errno;
+			}
+		} else {
+			for (child = dag->first_child[i]; child >= 0;
+			     child = dag->next_sibling[child])
+				dag->ready[dag->ready_tail++] = child;
 		}
+
+		pthread_cond_broadcast(&dag->cond);
+	}
+
+	pthread_mutex_unlock(&dag->lock);
+
+	return NULL;
+}
+
+/*
+ * Create the groups with jobs threads.  A group is created once the group
+ * it depends on, see cgroup_config_group_parents(), is created: the parent
+ * directory exists and the parent's subtree_control is written before a
+ * child and its settings.
+ */
+static int cgroup_config_create_groups_parallel(struct cgroup * const groups, int cnt, int jobs)
+{
+	struct cg_config_dag dag = { 0 };
+	pthread_t *threads = NULL;
+	int *parents = NULL;
+	int started = 1;
+	int error, i;
+
+	dag.groups = groups;
+	pthread_mutex_init(&dag.lock, NULL);
+	pthread_cond_init(&dag.cond, NULL);
+
+	parents = malloc(cnt * sizeof(*parents));
+	dag.first_child = malloc(cnt * sizeof(*dag.first_child));
+	dag.next_sibling = malloc(cnt * sizeof(*dag.next_sibling));
+	dag.ready = malloc(cnt * sizeof(*dag.ready));
+	threads = calloc(jobs, sizeof(*threads));
+	if (!parents || !dag.first_child || !dag.next_sibling || !dag.ready || !threads) {
+		last_errno = errno;
+		error = ECGOTHER;
+		goto out;
+	}
+
+	error = cgroup_config_group_parents(groups, cnt, parents);
+	if (error)
+		goto out;
+
+	for (i = 0; i < cnt; i++)
+		dag.first_child[i] = -1;
+
+	/* Prepend from the end, the children stay in the order of the config */
+	for (i = cnt - 1; i >= 0; i--) {
+		if (parents[i] < 0)
+			continue;
+		dag.next_sibling[i] = dag.first_child[parents[i]];
+		dag.first_child[parents[i]] = i;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		if (parents[i] < 0)
+			dag.ready[dag.ready_tail++] = i;
 	}
 
+	/* The calling thread is the first worker */
+	for (started = 1; started < jobs; started++) {
+		if (pthread_create(&threads[started], NULL, cgroup_config_create_worker, &dag)) {
+			cgroup_warn("failed to start a thread, creating the groups with %d\n",
+				    started);
+			break;
+		}
+	}
+	cgroup_config_create_worker(&dag);
+	for (i = 1; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	error = dag.error;
+	if (error)
+		last_errno = dag.error_errno;
+
+out:
+	free(threads);
+	free(dag.ready);
+	free(dag.next_sibling);
+	free(dag.first_child);
+	free(parents);
+	pthread_cond_destroy(&dag.cond);
+	pthread_mutex_destroy(&dag.lock);
+
 	return error;
 }
 
 /*
  * Destroy the cgroups
  */
-static int cgroup_config_destroy_groups(void)
+static int cgroup_config_destroy_groups(struct cgroup * const groups, int cnt)
 {
 	int error = 0, ret = 0;
 	int i;
 
-	for (i = 0; i < cgroup_table_index; i++) {
-		struct cgroup *cgroup = &config_cgrp_table[i];
+	for (i = 0; i < cnt; i++) {
+		struct cgroup *cgroup = &groups[i];
 
 		error = cgroup_delete_cgroup_ext(cgroup, CGFLAG_DELETE_RECURSIVE |
 							 CGFLAG_DELETE_IGNORE_MIGRATION);
@@ -942,6 +1192,43 @@ static int cgroup_config_destroy_groups(void)
 	return ret;
 }
 
+/*
+ * Actually create the groups once the parsing has been finished.  If a group
+ * fails, the groups of the config are destroyed.
+ */
+STATIC int cgroup_config_create_groups(struct cgroup * const groups, int cnt, int jobs)
+{
+	int error = 0;
+	int tmp_errno;
+	int i;
+
+	if (jobs <= 0)
+		jobs = max(sysconf(_SC_NPROCESSORS_ONLN), 1);
+	jobs = min(jobs, cnt);
+	if (jobs > 1) {
+		error = cgroup_config_create_groups_parallel(groups, cnt, jobs);
+	} else {
+		for (i = 0; i < cnt; i++) {
+			error = cgroup_config_create_group(&groups[i]);
+			if (error)
+				break;
+		}
+	}
+
+	if (error) {
+		/*
+		 * Save off the error that has already occurred.  The errno from
+		 * cgroup_config_destroy_groups() is secondary to the original error that
+		 * was reported, and thus can be discarded;
+		 */
+		tmp_errno = last_errno;
+		cgroup_config_destroy_groups(groups, cnt);
+		last_errno = tmp_errno;
+	}
+
+	return error;
+}
+
 /*
  * Unmount the controllers
  */
@@ -1263,6 +1550,11 @@ static void cgroup_config_sort_groups(void)
  * cgroups
  */
 int cgroup_config_load_config(const char *pathname)
+{
+	return cgroup_config_load_config2(pathname, 1);
+}
+
+int cgroup_config_load_config2(const char *pathname, int jobs)
 {
 #ifdef WITH_SYSTEMD
 	/* slice[FILENAME_MAX] + '/' + scope[FILENAME_MAX] */
@@ -1270,7 +1562,6 @@ int cgroup_config_load_config(const char *pathname)
 #endif
 	int namespace_enabled = 0;
 	int mount_enabled = 0;
-	int tmp_errno;
 	int error;
 	int ret;
 
@@ -1323,10 +1614,10 @@ int cgroup_config_load_config(const char *pathname)
 #endif
 
 	cgroup_config_apply_default();
-	error = cgroup_config_create_groups();
+	error = cgroup_config_create_groups(config_cgrp_table, cgroup_table_index, jobs);
 	cgroup_dbg("creating all cgroups now, error=%d\n", error);
 	if (error)
-		goto err_grp;
+		goto err_mnt;
 
 #ifdef WITH_SYSTEMD
 	/*
@@ -1338,23 +1629,16 @@ int cgroup_config_load_config(const char *pathname)
 	 * delegate settings, in that case the last parsed one overwrites
 	 * the systemd_default_cgroup.
 	 */
-	if (strlen(tmp_systemd_default_cgroup))
+	if (strlen(tmp_systemd_default_cgroup)) {
 		snprintf(systemd_default_cgroup, sizeof(systemd_default_cgroup),
 			 "%s", tmp_systemd_default_cgroup);
+		cg_refresh_path_prefix_table();
+	}
 #endif
 
 	cgroup_free_config();
 
 	return 0;
-err_grp:
-	/*
-	 * Save off the error that has already occurred.  The errno from
-	 * cgroup_config_destroy_groups() is secondary to the original error that was reported,
-	 * and thus can be discarded;
-	 */
-	tmp_errno = last_errno;
-	cgroup_config_destroy_groups();
-	last_errno = tmp_errno;
 err_mnt:
 	cgroup_config_unmount_controllers();
 	cgroup_free_config();
@@ -1362,6 +1646,570 @@ err_mnt:
 	return error;
 }
 
+static void cgroup_config_reload_report(cgroup_reload_cb cb, void *arg,
+					enum cgroup_reload_op_type type, const char *cgroup,
+					const char *controller, const char *name,
+					const char *old_value, const char *value)
+{
+	struct cgroup_reload_op op = {
+		.type = type,
+		.cgroup = cgroup,
+		.controller = controller,
+		.name = name,
+		.old_value = old_value,
+		.value = value,
+	};
+
+	if (cb)
+		cb(&op, arg);
+}
+
+/* Whether every directory of the group exists */
+static bool cgroup_config_group_exists(const struct cgroup * const cgroup)
+{
+	char path[FILENAME_MAX];
+	struct stat st;
+	int i;
+
+	for (i = 0; i < cgroup->index; i++) {
+		if (!cg_build_path(cgroup->name, path, cgroup->controller[i]->name))
+			return false;
+		if (stat(path, &st) || !S_ISDIR(st.st_mode))
+			return false;
+	}
+
+	return true;
+}
+
+/* A number with an optional K, M, G, T, P or E suffix, as the kernel parses sizes */
+static bool cgroup_config_parse_size(const char *value, unsigned long long *size)
+{
+	static const char suffixes[] = "kmgtpe";
+	const char *suffix;
+	char *end;
+
+	if (!isdigit((unsigned char)value[0]))
+		return false;
+
+	errno = 0;
+	*size = strtoull(value, &end, 10);
+	if (errno)
+		return false;
+
+	if (*end != '\0' && (suffix = strchr(suffixes, tolower((unsigned char)*end)))) {
+		*size <<= 10 * (suffix - suffixes + 1);
+		end++;
+	}
+
+	return *end == '\0';
+}
+
+/*
+ * Whether the live value of a setting is the value of the config.  The kernel
+ * reports sizes in bytes, "1G" in the config is the same as "1073741824".
+ */
+static bool cgroup_config_same_value(const char *live, const char *value)
+{
+	unsigned long long live_size, size;
+
+	if (!strcmp(live, value))
+		return true;
+
+	return cgroup_config_parse_size(live, &live_size) &&
+	       cgroup_config_parse_size(value, &size) && live_size == size;
+}
+
+/*
+ * Mark dirty the settings of an existing group that differ from the live
+ * values, and the others clean.  *dirty is the number of dirty settings.
+ */
+static int cgroup_config_diff_group(struct cgroup *cgroup, cgroup_reload_cb cb, void *arg,
+				    int *dirty)
+{
+	char value[CG_CONTROL_VALUE_MAX];
+	char path[FILENAME_MAX];
+	struct cgroup_controller *cgc;
+	struct control_value *cv;
+	struct cg_dir dir;
+	int error, i, j;
+
+	*dirty = 0;
+
+	for (i = 0; i < cgroup->index; i++) {
+		cgc = cgroup->controller[i];
+
+		if (!cg_build_path(cgroup->name, path, cgc->name))
+			return ECGROUPSUBSYSNOTMOUNTED;
+
+		error = cg_dir_open(&dir, path);
+		if (error)
+			return error;
+
+		for (j = 0; j < cgc->index; j++) {
+			cv = cgc->values[j];
+
+			/* A file that can't be read is written, its errors reported */
+			if (cg_rd_ctrl_file_at(dir.fd, cv->name, value)) {
+				cv->dirty = true;
+				cgroup_config_reload_report(cb, arg, CGROUP_RELOAD_SET,
+							    cgroup->name, cgc->name, cv->name,
+							    NULL, cv->value);
+			} else {
+				cv->dirty = !cgroup_config_same_value(value, cv->value);
+				if (cv->dirty)
+					cgroup_config_reload_report(cb, arg, CGROUP_RELOAD_SET,
+								    cgroup->name, cgc->name,
+								    cv->name, value, cv->value);
+			}
+
+			if (cv->dirty)
+				(*dirty)++;
+		}
+
+		cg_dir_close(&dir);
+	}
+
+	return 0;
+}
+
+/*
+ * Convert the settings of the controllers of an existing group that are
+ * named after the other version of the controller, like a load does when
+ * it fails to create the group.  A setting without a file in the directory
+ * of the group marks its controller as such.
+ */
+static int cgroup_config_convert_group(struct cgroup *cgroup)
+{
+	enum cg_version_t in_version;
+	struct cgroup_controller *cgc, *in_cgc;
+	struct cgroup *in = NULL, *out = NULL;
+	char path[FILENAME_MAX];
+	struct cg_dir dir;
+	int error = 0;
+	int i, j;
+
+	for (i = 0; i < cgroup->index && !error; i++) {
+		cgc = cgroup->controller[i];
+
+		if (!cg_build_path(cgroup->name, path, cgc->name))
+			return ECGROUPSUBSYSNOTMOUNTED;
+
+		error = cg_dir_open(&dir, path);
+		if (error)
+			return error;
+
+		for (j = 0; j < cgc->index; j++) {
+			if (faccessat(dir.fd, cgc->values[j]->name, F_OK, 0))
+				break;
+		}
+		cg_dir_close(&dir);
+		if (j == cgc->index)
+			continue;
+
+		in = cgroup_new_cgroup(cgroup->name);
+		out = cgroup_new_cgroup(cgroup->name);
+		if (!in || !out) {
+			error = ECGFAIL;
+			break;
+		}
+
+		in_cgc = cgroup_add_controller(in, cgc->name);
+		if (!in_cgc) {
+			error = ECGFAIL;
+			break;
+		}
+
+		error = cgroup_copy_controller_values(in_cgc, cgc);
+		if (error)
+			break;
+
+		in_version = cgc->version == CGROUP_V1 ? CGROUP_V2 : CGROUP_V1;
+		error = cgroup_convert_cgroup(out, cgc->version, in, in_version);
+		if (error) {
+			cgroup_err("Conversion of controller %s failed.\n", cgc->name);
+			break;
+		}
+
+		/* The original settings are freed with out */
+		cgroup->controller[i] = out->controller[0];
+		cgroup->controller[i]->cgroup = cgroup;
+		out->controller[0] = cgc;
+		cgc->cgroup = out;
+
+		cgroup_free(&in);
+		cgroup_free(&out);
+	}
+
+	cgroup_free(&in);
+	cgroup_free(&out);
+
+	return error;
+}
+
+static int cgroup_config_compare_paths(const void *p1, const void *p2)
+{
+	return strcmp(*(const char * const *)p1, *(const char * const *)p2);
+}
+
+/* Whether name is a group of the config or an ancestor of one */
+static bool cgroup_config_keep_group(const char * const *paths, int cnt, const char *name)
+{
+	size_t len = strlen(name);
+	int low = 0, high = cnt, mid;
+
+	while (low < high) {
+		mid = (low + high) / 2;
+		if (strcmp(paths[mid], name) < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	/* The paths starting with name follow, "name-x" sorts before "name/x" */
+	for (; low < cnt && !strncmp(paths[low], name, len); low++) {
+		if (paths[low][len] == '\0' || paths[low][len] == '/')
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Delete the subgroups of name in the hierarchy of controller that aren't
+ * groups of the config or ancestors of one
+ */
+static int cgroup_config_prune_group(const char * const *paths, int cnt, const char *controller,
+				     const char *name, int flags, cgroup_reload_cb cb, void *arg)
+{
+	char child[FILENAME_MAX];
+	char path[FILENAME_MAX];
+	struct cgroup *cgroup;
+	struct dirent *dent;
+	char **stale = NULL;
+	int stale_cnt = 0;
+	struct cg_dir dir;
+	int error = 0;
+	DIR *stream;
+	void *tmp;
+	int i;
+
+	if (!cg_build_path(name, path, controller))
+		return ECGROUPSUBSYSNOTMOUNTED;
+
+	/* Not created yet, on a dry run */
+	if (cg_dir_open(&dir, path))
+		return 0;
+
+	stream = cg_dir_opendir(&dir);
+	if (!stream) {
+		last_errno = errno;
+		cg_dir_close(&dir);
+		return ECGOTHER;
+	}
+
+	while ((dent = readdir(stream)) != NULL) {
+		if (dent->d_type != DT_DIR || !strcmp(dent->d_name, ".") ||
+		    !strcmp(dent->d_name, ".."))
+			continue;
+
+		snprintf(child, sizeof(child), "%s%s%s", name, name[0] ? "/" : "",
+			 dent->d_name);
+
+		if (cgroup_config_keep_group(paths, cnt, child)) {
+			error = cgroup_config_prune_group(paths, cnt, controller, child, flags,
+							  cb, arg);
+			if (error)
+				break;
+			continue;
+		}
+
+		/* Deleted once the directory is read */
+		tmp = realloc(stale, (stale_cnt + 1) * sizeof(*stale));
+		if (!tmp) {
+			last_errno = errno;
+			error = ECGOTHER;
+			break;
+		}
+		stale = tmp;
+
+		stale[stale_cnt] = strdup(child);
+		if (!stale[stale_cnt]) {
+			last_errno = errno;
+			error = ECGOTHER;
+			break;
+		}
+		stale_cnt++;
+	}
+
+	closedir(stream);
+	cg_dir_close(&dir);
+
+	for (i = 0; i < stale_cnt && !error; i++) {
+		cgroup_config_reload_report(cb, arg, CGROUP_RELOAD_DELETE, stale[i], controller,
+					    NULL, NULL, NULL);
+		if (flags & CGFLAG_RELOAD_DRY_RUN)
+			continue;
+
+		cgroup = cgroup_new_cgroup(stale[i]);
+		if (!cgroup) {
+			error = ECGFAIL;
+			break;
+		}
+
+		if (!cgroup_add_controller(cgroup, controller))
+			error = ECGFAIL;
+		else
+			error = cgroup_delete_cgroup_ext(cgroup, CGFLAG_DELETE_RECURSIVE |
+								 CGFLAG_DELETE_IGNORE_MIGRATION);
+		cgroup_free(&cgroup);
+	}
+
+	for (i = 0; i < stale_cnt; i++)
+		free(stale[i]);
+	free(stale);
+
+	return error;
+}
+
+/*
+ * Delete the live groups below the given groups that none of them defines.
+ * The subtrees of the root group are left alone.
+ */
+static int cgroup_config_prune_groups(const struct cgroup * const groups, int cnt, int flags,
+				      cgroup_reload_cb cb, void *arg)
+{
+	char path[FILENAME_MAX];
+	const char **paths = NULL;
+	char **roots = NULL;
+	int *parents = NULL;
+	int root_cnt = 0;
+	const struct cgroup *cgroup;
+	int error, i, j, k;
+	const char *name;
+
+	paths = malloc((cnt ? cnt : 1) * sizeof(*paths));
+	parents = malloc((cnt ? cnt : 1) * sizeof(*parents));
+	/* A walked directory per controller of each group at most */
+	roots = calloc(cnt * CG_CONTROLLER_MAX + 1, sizeof(*roots));
+	if (!paths || !parents || !roots) {
+		last_errno = errno;
+		error = ECGOTHER;
+		goto out;
+	}
+
+	error = cgroup_config_group_parents(groups, cnt, parents);
+	if (error)
+		goto out;
+
+	for (i = 0; i < cnt; i++)
+		paths[i] = cgroup_config_group_path(&groups[i]);
+	qsort(paths, cnt, sizeof(*paths), cgroup_config_compare_paths);
+
+	for (i = 0; i < cnt && !error; i++) {
+		cgroup = &groups[i];
+		name = cgroup_config_group_path(cgroup);
+		if (name[0] == '\0')
+			continue;
+
+		/* Walk from the groups without an ancestor in the config */
+		for (k = parents[i]; k >= 0; k = parents[k]) {
+			if (strcmp(cgroup_config_group_path(&groups[k]), name))
+				break;
+		}
+		if (k >= 0 && cgroup_config_group_path(&groups[k])[0] != '\0')
+			continue;
+
+		for (j = 0; j < cgroup->index && !error; j++) {
+			if (!cg_build_path(name, path, cgroup->controller[j]->name))
+				continue;
+
+			/* The controllers of a cgroup v2 group share its directory */
+			for (k = 0; k < root_cnt; k++) {
+				if (!strcmp(roots[k], path))
+					break;
+			}
+			if (k < root_cnt)
+				continue;
+
+			roots[root_cnt] = strdup(path);
+			if (!roots[root_cnt]) {
+				last_errno = errno;
+				error = ECGOTHER;
+				break;
+			}
+			root_cnt++;
+
+			error = cgroup_config_prune_group(paths, cnt, cgroup->controller[j]->name,
+							  name, flags, cb, arg);
+		}
+	}
+
+out:
+	for (i = 0; i < root_cnt; i++)
+		free(roots[i]);
+	free(roots);
+	free(parents);
+	free(paths);
+
+	return error;
+}
+
+/* The groups of the files of a reload, the prune keeps all of them */
+struct cg_reload_groups {
+	struct cgroup *groups;
+	int cnt;
+	int alloc;
+};
+
+/* Remember the names and the controllers of the groups of the config */
+static int cgroup_config_keep_groups(struct cg_reload_groups * const kept)
+{
+	struct cgroup *cgroup, *config;
+	void *tmp;
+	int i, j;
+
+	if (kept->cnt + cgroup_table_index > kept->alloc) {
+		tmp = realloc(kept->groups, (kept->cnt + cgroup_table_index) *
+				    sizeof(*kept->groups));
+		if (!tmp) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+		kept->groups = tmp;
+		kept->alloc = kept->cnt + cgroup_table_index;
+	}
+
+	for (i = 0; i < cgroup_table_index; i++) {
+		config = &config_cgrp_table[i];
+		cgroup = &kept->groups[kept->cnt];
+		memset(cgroup, 0, sizeof(*cgroup));
+		kept->cnt++;
+
+		memcpy(cgroup->name, config->name, sizeof(cgroup->name));
+		for (j = 0; j < config->index; j++) {
+			if (!cgroup_add_controller(cgroup, config->controller[j]->name))
+				return ECGFAIL;
+		}
+	}
+
+	return 0;
+}
+
+static void cgroup_config_free_kept_groups(struct cg_reload_groups * const kept)
+{
+	int i;
+
+	for (i = 0; i < kept->cnt; i++)
+		cgroup_free_controllers(&kept->groups[i]);
+	free(kept->groups);
+}
+
+static int cgroup_config_reload_file(const char *pathname, int flags, cgroup_reload_cb cb,
+				     void *arg, struct cg_reload_groups * const kept)
+{
+	struct cgroup *cgroup;
+	int error, dirty, i;
+
+	error = cgroup_parse_config(pathname);
+	if (error)
+		return error;
+
+	/* The configuration should have namespace or mount, not both. */
+	if (config_namespace_table[0].name[0] != '\0' && config_mount_table[0].name[0] != '\0') {
+		error = ECGMOUNTNAMESPACE;
+		goto out;
+	}
+
+	/* The hierarchies are expected to be mounted already */
+	error = cgroup_init();
+	if (error)
+		goto out;
+
+	error = config_order_namespace_table();
+	if (error)
+		goto out;
+
+	error = config_validate_namespaces();
+	if (error)
+		goto out;
+
+	cgroup_config_apply_default();
+
+	if (flags & CGFLAG_RELOAD_PRUNE) {
+		error = cgroup_config_keep_groups(kept);
+		if (error)
+			goto out;
+	}
+
+	for (i = 0; i < cgroup_table_index; i++) {
+		cgroup = &config_cgrp_table[i];
+
+		if (!cgroup_config_group_exists(cgroup)) {
+			cgroup_config_reload_report(cb, arg, CGROUP_RELOAD_CREATE, cgroup->name,
+						    NULL, NULL, NULL, NULL);
+			if (flags & CGFLAG_RELOAD_DRY_RUN)
+				continue;
+
+			error = cgroup_config_create_group(cgroup);
+			if (error)
+				goto out;
+			continue;
+		}
+
+		error = cgroup_config_convert_group(cgroup);
+		if (error)
+			goto out;
+
+		error = cgroup_config_diff_group(cgroup, cb, arg, &dirty);
+		if (error)
+			goto out;
+		if (!dirty || flags & CGFLAG_RELOAD_DRY_RUN)
+			continue;
+
+		error = cgroup_modify_cgroup(cgroup);
+		if (error)
+			goto out;
+	}
+
+out:
+	cgroup_free_config();
+
+	return error;
+}
+
+int cgroup_config_reload_configs(const char * const *pathnames, int cnt, int flags,
+				 cgroup_reload_cb cb, void *arg, int *fileindex)
+{
+	struct cg_reload_groups kept = { 0 };
+	int error = 0, ret, i;
+
+	if (fileindex)
+		*fileindex = -1;
+
+	for (i = 0; i < cnt; i++) {
+		ret = cgroup_config_reload_file(pathnames[i], flags, cb, arg, &kept);
+		if (ret && !error) {
+			error = ret;
+			if (fileindex)
+				*fileindex = i;
+		}
+	}
+
+	/* The groups of a file that failed are unknown, they would be deleted */
+	if (!error && flags & CGFLAG_RELOAD_PRUNE)
+		error = cgroup_config_prune_groups(kept.groups, kept.cnt, flags, cb, arg);
+
+	cgroup_config_free_kept_groups(&kept);
+
+	return error;
+}
+
+int cgroup_config_reload_config(const char *pathname, int flags, cgroup_reload_cb cb,
+				void *arg)
+{
+	return cgroup_config_reload_configs(&pathname, 1, flags, cb, arg, NULL);
+}
+
 /* unmounts given mount, but only if it is empty */
 static int cgroup_config_try_unmount(struct cg_mount_table_s *mount_info)
 {
@@ -1809,16 +2657,14 @@ int cgroup_add_cgroup_templates(int offset)
  */
 int cgroup_expand_template_table(void)
 {
-	int i;
-
 	template_table = realloc(template_table,
 				 (template_table_index + config_template_table_index)
 				 *sizeof(struct cgroup));
 	if (template_table == NULL)
 		return -ECGOTHER;
 
-	for (i = 0; i < config_template_table_index; i++)
-		template_table[i + template_table_index].index = 0;
+	memset(&template_table[template_table_index], 0,
+	       config_template_table_index * sizeof(struct cgroup));
 
 	template_table_index += config_template_table_index;
 
@@ -1943,7 +2789,7 @@ int cgroup_config_create_template_group(struct cgroup *cgroup, char *template_na
 		}
 	}
 
-	for (i = 0; cgroup->controller[i] != NULL; i++) {
+	for (i = 0; i < cgroup->index; i++) {
 		/*
 		 * for each controller we have to add to cgroup structure
 		 * either template cgroup or empty controller.
@@ -2317,6 +3163,9 @@ int cgroup_set_default_systemd_cgroup(void)
 		goto err;
 	}
 
+	/* systemd_default_cgroup_exists() builds paths with the new default */
+	cg_refresh_path_prefix_table();
+
 	if (systemd_default_cgroup_exists()) {
 		pthread_rwlock_unlock(&systemd_default_cgroup_lock);
 		return 1;
@@ -2325,6 +3174,7 @@ err:
 	pthread_rwlock_unlock(&systemd_default_cgroup_lock);
 	cgroup_dbg(", continuing without systemd default cgroup.\n", systemd_default_cgroup);
 	systemd_default_cgroup[0] = '\0';
+	cg_refresh_path_prefix_table();
 
 	return 0;
 }
@@ -29,7 +29,10 @@
 #include "cgrulesengd.h"
 #include "libcgroup.h"
 
+#include <semaphore.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
@@ -39,21 +42,28 @@
 #include <errno.h>
 #include <stdio.h>
 #include <time.h>
+#include <poll.h>
 
 #include <pwd.h>
 #include <grp.h>
 
 #include <sys/socket.h>
 #include <sys/syslog.h>
+#include <sys/epoll.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
 
 #include <linux/connector.h>
 #include <linux/cn_proc.h>
 #include <linux/netlink.h>
+#include <linux/filter.h>
 #include <linux/un.h>
 
-#define NUM_PER_REALLOCATIOM	(100)
+/* Initial sizes of the PID tables and the parent info ring, powers of two */
+#define PID_TABLE_MIN_SIZE	(256)
+#define RING_PI_MIN_SIZE	(128)
 
 /* list of config files from CGCONFIG_CONF_FILE and CGCONFIG_CONF_DIR */
 static struct cgroup_string_list template_files;
@@ -73,6 +83,12 @@ uid_t socket_user = -1;
 /* Owner of the socket, -1 means no change */
 gid_t socket_group = -1;
 
+/* Receive buffer size of the netlink socket, 0 keeps the kernel default */
+int netlink_rcvbuf = CGRE_DEFAULT_RCVBUF;
+
+/* Number of classification workers, 0 classifies in the receiving thread */
+int worker_cnt = -1;
+
 /**
  * Prints the usage information for this program and, optionally, an error
  * message.  This function uses vfprintf.
@@ -105,6 +121,10 @@ static void usage(FILE *fd, const char *msg, ...)
 	fprintf(fd, " " CGRULE_CGRED_SOCKET_PATH " socket user\n");
 	fprintf(fd, "    -g <group>   | --socket-group=<group> set");
 	fprintf(fd, " "	CGRULE_CGRED_SOCKET_PATH " socket group\n");
+	fprintf(fd, "    -b <bytes>   | --rcvbuf=<bytes>\t  netlink receive buffer size,");
+	fprintf(fd, " 0 for the kernel default\n");
+	fprintf(fd, "    -w <count>   | --workers=<count>\t  number of classification");
+	fprintf(fd, " threads, 0 for none\n");
 	fprintf(fd, "    -h           | --help\t\t  show this help\n\n");
 	va_end(ap);
 }
@@ -195,24 +215,158 @@ void flog_cgroup(void *userdata, int cgrp_level, const char *format, va_list ap)
 	flog_write(level, format, ap);
 }
 
+/*
+ * PID keyed hash table used for the unchanged processes and the parent
+ * info. Open addressing with linear probing, pid 0 marks a free slot and
+ * removal shifts the following entries back so no tombstones are needed.
+ */
+struct pid_slot {
+	pid_t pid;
+	int val;
+};
+
+struct pid_table {
+	struct pid_slot *slot;
+	int size;	/* power of two */
+	int cnt;
+};
+
+static inline unsigned int pid_table_hash(const struct pid_table *table, pid_t pid)
+{
+	/* Fibonacci hashing spreads the sequential PIDs over the table */
+	return ((unsigned int)pid * 2654435761U) & (table->size - 1);
+}
+
+static struct pid_slot *pid_table_find(const struct pid_table *table, pid_t pid)
+{
+	unsigned int i;
+
+	if (!table->cnt)
+		return NULL;
+
+	for (i = pid_table_hash(table, pid); table->slot[i].pid;
+	     i = (i + 1) & (table->size - 1)) {
+		if (table->slot[i].pid == pid)
+			return &table->slot[i];
+	}
+
+	return NULL;
+}
+
+static int pid_table_grow(struct pid_table *table)
+{
+	struct pid_slot *old = table->slot;
+	int old_size = table->size;
+	struct pid_slot *new_slot;
+	unsigned int j;
+	int size, i;
+
+	size = old_size ? old_size * 2 : PID_TABLE_MIN_SIZE;
+	new_slot = calloc(size, sizeof(*new_slot));
+	if (!new_slot)
+		return 1;
+
+	table->slot = new_slot;
+	table->size = size;
+
+	for (i = 0; i < old_size; i++) {
+		if (!old[i].pid)
+			continue;
+
+		for (j = pid_table_hash(table, old[i].pid); table->slot[j].pid;
+		     j = (j + 1) & (size - 1))
+			;
+		table->slot[j] = old[i];
+	}
+	free(old);
+
+	return 0;
+}
+
+/*
+ * Returns the slot of pid, adding it with val 0 if it is not present yet.
+ * Returns NULL if the table couldn't be grown.
+ */
+static struct pid_slot *pid_table_insert(struct pid_table *table, pid_t pid)
+{
+	unsigned int i;
+
+	if ((table->cnt + 1) * 2 > table->size && pid_table_grow(table))
+		return NULL;
+
+	for (i = pid_table_hash(table, pid); table->slot[i].pid;
+	     i = (i + 1) & (table->size - 1)) {
+		if (table->slot[i].pid == pid)
+			return &table->slot[i];
+	}
+
+	table->slot[i].pid = pid;
+	table->slot[i].val = 0;
+	table->cnt++;
+
+	return &table->slot[i];
+}
+
+static void pid_table_remove(struct pid_table *table, struct pid_slot *slot)
+{
+	unsigned int mask = table->size - 1;
+	unsigned int i, j, home;
+
+	i = slot - table->slot;
+	j = i;
+
+	while (1) {
+		j = (j + 1) & mask;
+		if (!table->slot[j].pid)
+			break;
+
+		/* Move the entry back if its home slot isn't in (i, j] */
+		home = pid_table_hash(table, table->slot[j].pid);
+		if (((j - home) & mask) < ((j - i) & mask))
+			continue;
+
+		table->slot[i] = table->slot[j];
+		i = j;
+	}
+
+	table->slot[i].pid = 0;
+	table->slot[i].val = 0;
+	table->cnt--;
+}
+
+/*
+ * The parent info is kept in a ring ordered by timestamp, entries are
+ * stored with CLOCK_MONOTONIC so new ones always go to the tail and the
+ * old ones are dropped from the head. pi_table counts the ring entries
+ * of every PID, so a FORK event only needs a single lookup.
+ *
+ * The events of a parent and its FORK events go to the same worker, so
+ * every worker keeps the parent info it stores and prunes it by the time
+ * of its own events, which it classifies in order. The workers don't see
+ * each other's entries and the ring needs no lock.
+ */
 struct parent_info {
 	__u64 timestamp;
 	pid_t pid;
 };
 
-struct array_parent_info {
-	int index;
-	int num_allocation;
-	struct parent_info **parent_info;
+struct ring_parent_info {
+	int head;
+	int cnt;
+	int num_allocation;	/* power of two */
+	struct parent_info *parent_info;
 };
 
-struct array_parent_info array_pi;
+static __thread struct ring_parent_info ring_pi;
+static __thread struct pid_table pi_table;
 
 static int cgre_store_parent_info(pid_t pid)
 {
 	struct parent_info *info;
+	struct pid_slot *slot;
 	struct timespec tp;
 	__u64 uptime_ns;
+	int i, tail;
 
 	if (clock_gettime(CLOCK_MONOTONIC, &tp) < 0) {
 		flog(LOG_WARNING, "Failed to get time\n");
@@ -220,112 +374,99 @@ static int cgre_store_parent_info(pid_t pid)
 	}
 	uptime_ns = ((__u64)tp.tv_sec * 1000 * 1000 * 1000) + tp.tv_nsec;
 
-	if (array_pi.index >= array_pi.num_allocation) {
-		int alloc = array_pi.num_allocation + NUM_PER_REALLOCATIOM;
-		void *new_array = realloc(array_pi.parent_info, sizeof(info) * alloc);
+	if (ring_pi.cnt >= ring_pi.num_allocation) {
+		int alloc = ring_pi.num_allocation ? ring_pi.num_allocation * 2 :
+						     RING_PI_MIN_SIZE;
+		struct parent_info *new_ring;
 
-		if (!new_array) {
+		new_ring = malloc(sizeof(*new_ring) * alloc);
+		if (!new_ring) {
 			flog(LOG_WARNING, "Failed to allocate memory\n");
 			return 1;
 		}
-		array_pi.parent_info = new_array;
-		array_pi.num_allocation = alloc;
+
+		for (i = 0; i < ring_pi.cnt; i++)
+			new_ring[i] = ring_pi.parent_info[(ring_pi.head + i) &
+							  (ring_pi.num_allocation - 1)];
+
+		free(ring_pi.parent_info);
+		ring_pi.parent_info = new_ring;
+		ring_pi.num_allocation = alloc;
+		ring_pi.head = 0;
 	}
 
-	info = calloc(1, sizeof(struct parent_info));
-	if (!info) {
+	slot = pid_table_insert(&pi_table, pid);
+	if (!slot) {
 		flog(LOG_WARNING, "Failed to allocate memory\n");
 		return 1;
 	}
+	slot->val++;
+
+	tail = (ring_pi.head + ring_pi.cnt) & (ring_pi.num_allocation - 1);
+	info = &ring_pi.parent_info[tail];
 	info->timestamp = uptime_ns;
 	info->pid = pid;
-
-	array_pi.parent_info[array_pi.index] = info;
-	array_pi.index++;
+	ring_pi.cnt++;
 
 	return 0;
 }
 
 static void cgre_remove_old_parent_info(__u64 key_timestamp)
 {
-	int i, j;
+	struct parent_info *info;
+	struct pid_slot *slot;
 
-	for (i = 0; i < array_pi.index; i++) {
-		if (key_timestamp < array_pi.parent_info[i]->timestamp)
-			continue;
+	while (ring_pi.cnt) {
+		info = &ring_pi.parent_info[ring_pi.head];
+		if (key_timestamp < info->timestamp)
+			break;
 
-		free(array_pi.parent_info[i]);
-		for (j = i; j < array_pi.index - 1; j++)
-			array_pi.parent_info[j] = array_pi.parent_info[j + 1];
-		array_pi.index--;
-		i--;
+		slot = pid_table_find(&pi_table, info->pid);
+		if (slot && --slot->val <= 0)
+			pid_table_remove(&pi_table, slot);
+
+		ring_pi.head = (ring_pi.head + 1) & (ring_pi.num_allocation - 1);
+		ring_pi.cnt--;
 	}
 }
 
 static int cgre_was_parent_changed_when_forking(const struct proc_event *ev)
 {
-	__u64 timestamp_parent;
 	__u64 timestamp_child;
 	pid_t parent_pid;
-	int i;
 
 	parent_pid = ev->event_data.fork.parent_pid;
 	timestamp_child = ev->timestamp_ns;
 
+	/*
+	 * Every entry left in the ring after this is newer than the child,
+	 * so the parent was changed while forking if it has any entry.
+	 */
 	cgre_remove_old_parent_info(timestamp_child);
 
-	for (i = 0; i < array_pi.index; i++) {
-		if (parent_pid != array_pi.parent_info[i]->pid)
-			continue;
-
-		timestamp_parent = array_pi.parent_info[i]->timestamp;
-		if (timestamp_child > timestamp_parent)
-			continue;
-
-		return 1;
-	}
-
-	return 0;
+	return pid_table_find(&pi_table, parent_pid) != NULL;
 }
 
-struct unchanged_pid {
-	pid_t pid;
-	int flags;
-} unchanged_pid_t;
-
-struct array_unchanged {
-	int index;
-	int num_allocation;
-	struct unchanged_pid *proc;
-};
-
-struct array_unchanged array_unch;
+/*
+ * Unchanged processes, the slot value holds the flags of the PID. Only the
+ * receiving thread uses this table, in the order of the events.
+ */
+static struct pid_table unchanged_table;
 
 static int cgre_store_unchanged_process(pid_t pid, int flags)
 {
-	int i;
+	struct pid_slot *slot;
 
-	for (i = 0; i < array_unch.index; i++) {
-		if (array_unch.proc[i].pid != pid)
-			continue;
-		/* pid is stored already. */
+	/* pid is stored already. */
+	if (pid_table_find(&unchanged_table, pid))
 		return 0;
-	}
 
-	if (array_unch.index >= array_unch.num_allocation) {
-		int alloc = array_unch.num_allocation + NUM_PER_REALLOCATIOM;
-		void *new_array = realloc(array_unch.proc, sizeof(unchanged_pid_t) * alloc);
-
-		if (!new_array) {
-			flog(LOG_WARNING, "Failed to allocate memory\n");
-			return 1;
-		}
-		array_unch.proc = new_array;
-		array_unch.num_allocation = alloc;
+	slot = pid_table_insert(&unchanged_table, pid);
+	if (!slot) {
+		flog(LOG_WARNING, "Failed to allocate memory\n");
+		return 1;
 	}
-	array_unch.proc[array_unch.index].pid = pid;
-	array_unch.proc[array_unch.index].flags = flags;
-	array_unch.index++;
+	slot->val = flags;
 
 	flog(LOG_DEBUG, "Store the unchanged process (PID: %d, FLAGS: %d)\n", pid, flags);
 
@@ -334,47 +475,44 @@ static int cgre_store_unchanged_process(pid_t pid, int flags)
 
 static void cgre_remove_unchanged_process(pid_t pid)
 {
-	int i, j;
+	struct pid_slot *slot;
 
-	for (i = 0; i < array_unch.index; i++) {
-		if (array_unch.proc[i].pid != pid)
-			continue;
-
-		for (j = i; j < array_unch.index - 1; j++)
-			memcpy(&array_unch.proc[j], &array_unch.proc[j + 1],
-			       sizeof(struct unchanged_pid));
-		array_unch.index--;
-		flog(LOG_DEBUG, "Remove the unchanged process (PID: %d)\n", pid);
+	slot = pid_table_find(&unchanged_table, pid);
+	if (!slot)
 		return;
-	}
+
+	pid_table_remove(&unchanged_table, slot);
+	flog(LOG_DEBUG, "Remove the unchanged process (PID: %d)\n", pid);
 }
 
 static int cgre_is_unchanged_process(pid_t pid)
 {
-	int i;
+	return pid_table_find(&unchanged_table, pid) != NULL;
+}
 
-	for (i = 0; i < array_unch.index; i++) {
-		if (array_unch.proc[i].pid != pid)
-			continue;
+static int cgre_is_unchanged_child(pid_t pid)
+{
+	struct pid_slot *slot;
+
+	slot = pid_table_find(&unchanged_table, pid);
+	if (slot && (slot->val & CGROUP_DAEMON_UNCHANGE_CHILDREN))
 		return 1;
-	}
 
 	return 0;
 }
 
-static int cgre_is_unchanged_child(pid_t pid)
+/* Check if the next child of pid is unchanged, only this one is */
+static int cgre_take_unchanged_spawned(pid_t pid)
 {
-	int i;
+	struct pid_slot *slot;
 
-	for (i = 0; i < array_unch.index; i++) {
-		if (array_unch.proc[i].pid != pid)
-			continue;
-		if (array_unch.proc[i].flags & CGROUP_DAEMON_UNCHANGE_CHILDREN)
-			return 1;
-		break;
-	}
+	slot = pid_table_find(&unchanged_table, pid);
+	if (!slot || !(slot->val & CGROUP_DAEMON_UNCHANGE_SPAWNED))
+		return 0;
 
-	return 0;
+	slot->val &= ~CGROUP_DAEMON_UNCHANGE_SPAWNED;
+
+	return 1;
 }
 
 /**
@@ -390,30 +528,17 @@ int cgre_process_event(const struct proc_event *ev, const int type)
 	pid_t pid = 0, log_pid = 0;
 	uid_t euid, log_uid = 0;
 	gid_t egid, log_gid = 0;
-	pid_t ppid, cpid;
 	char *procname;
 
 	int ret = 0;
 
+	/* The unchanged processes are filtered out by cgre_handle_msg() */
 	switch (type) {
 	case PROC_EVENT_UID:
 	case PROC_EVENT_GID:
-		/*
-		 * If the unchanged process, the daemon should not change
-		 * the cgroup of the process.
-		 */
-		if (cgre_is_unchanged_process(ev->event_data.id.process_pid))
-			return 0;
 		pid = ev->event_data.id.process_pid;
 		break;
 	case PROC_EVENT_FORK:
-		ppid = ev->event_data.fork.parent_pid;
-		cpid = ev->event_data.fork.child_pid;
-		if (cgre_is_unchanged_child(ppid)) {
-			if (cgre_store_unchanged_process(cpid, CGROUP_DAEMON_UNCHANGE_CHILDREN))
-				return 1;
-		}
-
 		/*
 		 * If this process was forked while changing parent's
 		 * cgroup, this process's cgroup also should be changed.
@@ -422,38 +547,23 @@ int cgre_process_event(const struct proc_event *ev, const int type)
 			return 0;
 		pid = ev->event_data.fork.child_pid;
 		break;
-	case PROC_EVENT_EXIT:
-		cgre_remove_unchanged_process(ev->event_data.exit.process_pid);
-		return 0;
 	case PROC_EVENT_EXEC:
-		/*
-		 * If the unchanged process, the daemon should not change
-		 * the cgroup of the process.
-		 */
-		if (cgre_is_unchanged_process(ev->event_data.exec.process_pid))
-			return 0;
 		pid = ev->event_data.exec.process_pid;
 		break;
 	default:
-		break;
+		return 0;
 	}
 
-	ret = cgroup_get_uid_gid_from_procfs(pid, &euid, &egid);
+	ret = cgroup_get_proc_identity(pid, &euid, &egid, &procname);
 	if (ret == ECGROUPNOTEXIST)
 		/*
-		 * cgroup_get_uid_gid_from_procfs() returns ECGROUPNOTEXIST
+		 * cgroup_get_proc_identity() returns ECGROUPNOTEXIST
 		 * if a process finished and that is not a problem.
 		 */
 		return 0;
 	else if (ret)
 		return ret;
 
-	ret = cgroup_get_procname_from_procfs(pid, &procname);
-	if (ret == ECGROUPNOTEXIST)
-		return 0;
-	else if (ret)
-		return ret;
-
 	/*
 	 * Now that we have the UID, the GID, and the PID, we can make a
 	 * call to libcgroup to change the cgroup for this PID.
@@ -482,7 +592,12 @@ int cgre_process_event(const struct proc_event *ev, const int type)
 		break;
 	}
 
-	ret = cgroup_change_cgroup_flags(euid, egid, procname, pid, CGFLAG_USECACHE);
+	/*
+	 * The templates are reloaded by the receiving thread only, under the
+	 * write lock of rules_lock, so the workers must use the cached ones.
+	 */
+	ret = cgroup_change_cgroup_flags(euid, egid, procname, pid,
+					 CGFLAG_USECACHE | CGFLAG_USE_TEMPLATE_CACHE);
 	if (ret == ECGOTHER) {
 		/*
 		 * A process finished already but we may have missed
@@ -506,10 +621,227 @@ int cgre_process_event(const struct proc_event *ev, const int type)
 	return ret;
 }
 
+/* Netlink socket statistics, logged on overruns and at exit */
+struct cgre_netlink_stats {
+	/* Datagrams received */
+	unsigned long long msgs;
+	/* Receive buffer overruns, reported by the kernel with ENOBUFS */
+	unsigned long long overruns;
+	/* Events lost, counted from the gaps in the per CPU sequence numbers */
+	unsigned long long lost;
+	/* Datagrams not sent by the kernel proc connector */
+	unsigned long long bad;
+	/* Times the receiver waited for a worker to drain its full queue */
+	unsigned long long queue_full;
+};
+
+static struct cgre_netlink_stats netlink_stats;
+
+/*
+ * The kernel or a socket filter drops the events the daemon doesn't need,
+ * these leave gaps in the sequence numbers so the lost events can't be
+ * counted.
+ */
+static bool netlink_filtered;
+
+/* Next expected proc connector sequence number of every CPU, 0 if unknown */
+static __u64 *netlink_cpu_seq;
+static unsigned int netlink_cpu_cnt;
+
+static void cgre_log_netlink_stats(int level)
+{
+	flog(level, "Netlink: %llu messages, %llu overruns, %llu bad messages, ",
+	     netlink_stats.msgs, netlink_stats.overruns, netlink_stats.bad);
+	if (!netlink_filtered)
+		flog(level, "%llu events lost, ", netlink_stats.lost);
+	flog(level, "%llu waits on full worker queues\n", netlink_stats.queue_full);
+}
+
+/*
+ * The proc connector numbers the events it sends per CPU, a gap in these
+ * numbers means that the events in between were dropped.
+ */
+static void cgre_account_netlink_seq(const struct cn_msg *cn_hdr)
+{
+	const struct proc_event *ev = (const struct proc_event *)cn_hdr->data;
+	unsigned int cpu = ev->cpu;
+	unsigned int alloc;
+	__u64 *new_seq;
+
+	/* Replies to our own requests are not numbered */
+	if (ev->what == PROC_EVENT_NONE)
+		return;
+
+	if (cpu >= netlink_cpu_cnt) {
+		alloc = max(cpu + 1, netlink_cpu_cnt * 2);
+		new_seq = realloc(netlink_cpu_seq, sizeof(*new_seq) * alloc);
+		if (!new_seq)
+			return;
+
+		memset(&new_seq[netlink_cpu_cnt], 0,
+		       sizeof(*new_seq) * (alloc - netlink_cpu_cnt));
+		netlink_cpu_seq = new_seq;
+		netlink_cpu_cnt = alloc;
+	}
+
+	if (netlink_cpu_seq[cpu] && cn_hdr->seq > netlink_cpu_seq[cpu] - 1)
+		netlink_stats.lost += cn_hdr->seq - (netlink_cpu_seq[cpu] - 1);
+
+	netlink_cpu_seq[cpu] = (__u64)cn_hdr->seq + 2;
+}
+
+/*
+ * Bounded single producer, single consumer ring between the receiving
+ * thread and a worker. Only the receiver moves tail and only the worker
+ * moves head, so neither side takes a lock. The items semaphore counts
+ * the queued events, the worker sleeps on it while the ring is empty, and
+ * the slots semaphore counts the free entries, the receiver sleeps on it
+ * while the ring is full.
+ */
+struct cgre_queue {
+	unsigned int head __attribute__((aligned(64)));
+	unsigned int tail __attribute__((aligned(64)));
+	sem_t items;
+	sem_t slots;
+	struct proc_event ev[CGRE_QUEUE_SIZE];
+};
+
+struct cgre_worker {
+	pthread_t thread;
+	struct cgre_queue queue;
+};
+
+static struct cgre_worker *workers;
+
+/*
+ * Held for reading while an event is classified and for writing while the
+ * rules and templates are reloaded, so that no worker uses a freed rule.
+ */
+static pthread_rwlock_t rules_lock;
+
+/*
+ * Queue an event, waiting for the worker to free an entry if the ring is
+ * full. The receiver doesn't read the netlink socket meanwhile, the events
+ * wait in its buffer and the kernel reports the ones it has to drop.
+ */
+static void cgre_queue_push(struct cgre_queue *queue, const struct proc_event *ev)
+{
+	unsigned int tail = queue->tail;
+
+	if (sem_trywait(&queue->slots) < 0) {
+		netlink_stats.queue_full++;
+		flog(LOG_DEBUG, "Worker queue full, waiting for it to drain\n");
+		while (sem_wait(&queue->slots) < 0)
+			;	/* EINTR */
+	}
+
+	queue->ev[tail & (CGRE_QUEUE_SIZE - 1)] = *ev;
+	__atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+	sem_post(&queue->items);
+}
+
+static void cgre_queue_pop(struct cgre_queue *queue, struct proc_event *ev)
+{
+	unsigned int head = queue->head;
+
+	/* The receiver posts after moving tail, so the event is there */
+	while (sem_wait(&queue->items) < 0)
+		;	/* EINTR */
+
+	*ev = queue->ev[head & (CGRE_QUEUE_SIZE - 1)];
+	__atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+	sem_post(&queue->slots);
+}
+
+static void *cgre_worker(void *arg)
+{
+	struct cgre_worker *worker = arg;
+	struct proc_event ev;
+
+	for (;;) {
+		cgre_queue_pop(&worker->queue, &ev);
+
+		pthread_rwlock_rdlock(&rules_lock);
+		cgre_process_event(&ev, ev.what);
+		pthread_rwlock_unlock(&rules_lock);
+	}
+
+	return NULL;
+}
+
+/**
+ * Start the classification workers. If some of them can't be started, the
+ * daemon goes on with the ones that did, or without workers at all.
+ */
+static void cgre_start_workers(void)
+{
+	pthread_rwlockattr_t attr;
+	sigset_t sigset, oldset;
+	int i, ret = 0;
+
+	/* A steady stream of events must not hold off a reload */
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&rules_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+
+	if (!worker_cnt)
+		return;
+
+	ret = posix_memalign((void **)&workers, __alignof__(struct cgre_worker),
+			     sizeof(*workers) * worker_cnt);
+	if (ret) {
+		flog(LOG_ERR, "Failed to allocate the workers: %s\n", strerror(ret));
+		worker_cnt = 0;
+		return;
+	}
+	memset(workers, 0, sizeof(*workers) * worker_cnt);
+
+	/* The signals are handled by the receiving thread only */
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_BLOCK, &sigset, &oldset);
+
+	for (i = 0; i < worker_cnt; i++) {
+		sem_init(&workers[i].queue.items, 0, 0);
+		sem_init(&workers[i].queue.slots, 0, CGRE_QUEUE_SIZE);
+
+		ret = pthread_create(&workers[i].thread, NULL, cgre_worker, &workers[i]);
+		if (ret) {
+			flog(LOG_ERR, "Failed to start worker %d: %s\n", i, strerror(ret));
+			sem_destroy(&workers[i].queue.items);
+			sem_destroy(&workers[i].queue.slots);
+			worker_cnt = i;
+			break;
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+	flog(LOG_INFO, "Started %d classification workers\n", worker_cnt);
+}
+
+/*
+ * Pass an event to the worker of pid. All the events of a PID go to the
+ * same worker, so they are classified in order.
+ */
+static int cgre_queue_event(const struct proc_event *ev, pid_t pid)
+{
+	struct cgre_queue *queue;
+
+	if (!worker_cnt)
+		return cgre_process_event(ev, ev->what);
+
+	queue = &workers[(unsigned int)pid % worker_cnt].queue;
+	cgre_queue_push(queue, ev);
+
+	return 0;
+}
+
 /**
  * Handle a netlink message.
- * In the event of PROC_EVENT_UID or PROC_EVENT_GID, we pass the event along
- * to cgre_process_event for further processing.  All other events are ignored.
+ * The unchanged processes are tracked here, in the order of the events.
+ * The events that may move a process to another cgroup are then passed
+ * to cgre_process_event(), through the worker of the process.
  *	@param cn_hdr The netlink message
  *	@return 0 on success, > 0 on error
  */
@@ -517,71 +849,83 @@ static int cgre_handle_msg(struct cn_msg *cn_hdr)
 {
 	/* The event to consider */
 	struct proc_event *ev;
+	pid_t pid;
 
-	/* Return codes */
-	int ret = 0;
-
-	/* Get the event data.  We only care about two event types. */
+	/* Get the event data.  We only care about these event types. */
 	ev = (struct proc_event *)cn_hdr->data;
 	switch (ev->what) {
 	case PROC_EVENT_UID:
 		flog(LOG_DEBUG, "UID Event: PID = %d, tGID = %d, rUID = %d, eUID = %d\n",
 		     ev->event_data.id.process_pid, ev->event_data.id.process_tgid,
 		     ev->event_data.id.r.ruid, ev->event_data.id.e.euid);
-		ret = cgre_process_event(ev, PROC_EVENT_UID);
+		pid = ev->event_data.id.process_pid;
 		break;
 	case PROC_EVENT_GID:
 		flog(LOG_DEBUG, "GID Event: PID = %d, tGID = %d, rGID = %d, eGID = %d\n",
 		     ev->event_data.id.process_pid, ev->event_data.id.process_tgid,
 		     ev->event_data.id.r.rgid, ev->event_data.id.e.egid);
-		ret = cgre_process_event(ev, PROC_EVENT_GID);
+		pid = ev->event_data.id.process_pid;
 		break;
 	case PROC_EVENT_FORK:
-		ret = cgre_process_event(ev, PROC_EVENT_FORK);
-		break;
+		if (cgre_is_unchanged_child(ev->event_data.fork.parent_pid) &&
+		    cgre_store_unchanged_process(ev->event_data.fork.child_pid,
+						 CGROUP_DAEMON_UNCHANGE_CHILDREN))
+			return 1;
+
+		/* The program run by cgexec, its own children are moved */
+		if (cgre_take_unchanged_spawned(ev->event_data.fork.parent_pid) &&
+		    cgre_store_unchanged_process(ev->event_data.fork.child_pid, 0))
+			return 1;
+
+		/*
+		 * Whether the child is moved depends on the changes of its
+		 * parent, so it is classified after the parent's events.
+		 */
+		return cgre_queue_event(ev, ev->event_data.fork.parent_pid);
 	case PROC_EVENT_EXIT:
-		ret = cgre_process_event(ev, PROC_EVENT_EXIT);
-		break;
+		cgre_remove_unchanged_process(ev->event_data.exit.process_pid);
+		return 0;
 	case PROC_EVENT_EXEC:
 		flog(LOG_DEBUG, "EXEC Event: PID = %d, tGID = %d\n",
 		     ev->event_data.exec.process_pid, ev->event_data.exec.process_tgid);
-		ret = cgre_process_event(ev, PROC_EVENT_EXEC);
+		pid = ev->event_data.exec.process_pid;
+		/* cgexec runs the program itself, the children of it are moved */
+		cgre_take_unchanged_spawned(pid);
 		break;
 	default:
-		break;
+		return 0;
 	}
 
-	return ret;
+	/*
+	 * If the unchanged process, the daemon should not change
+	 * the cgroup of the process.
+	 */
+	if (cgre_is_unchanged_process(pid))
+		return 0;
+
+	return cgre_queue_event(ev, pid);
 }
 
-static int cgre_receive_netlink_msg(int sk_nl)
+static int cgre_handle_netlink_datagram(char *buff, size_t recv_len,
+					const struct sockaddr_nl *from_nla,
+					socklen_t from_nla_len)
 {
-	struct sockaddr_nl from_nla;
-	socklen_t from_nla_len;
 	struct cn_msg *cn_hdr;
 	struct nlmsghdr *nlh;
-	char buff[BUFF_SIZE];
-	size_t recv_len;
-
-	memset(buff, 0, sizeof(buff));
-	from_nla_len = sizeof(from_nla);
-	recv_len = recvfrom(sk_nl, buff, sizeof(buff), 0, (struct sockaddr *)&from_nla,
-			    &from_nla_len);
-	if (recv_len == -1 && errno == ENOBUFS) {
-		flog(LOG_ERR, "ERROR: NETLINK BUFFER FULL, MESSAGE DROPPED!\n");
-		return 0;
-	}
 
 	if (recv_len < 1)
 		return 0;
 
-	if (from_nla_len != sizeof(from_nla)) {
+	if (from_nla_len != sizeof(*from_nla)) {
 		flog(LOG_ERR, "Bad address size reading netlink socket\n");
+		netlink_stats.bad++;
 		return 0;
 	}
 
-	if (from_nla.nl_groups != CN_IDX_PROC || from_nla.nl_pid != 0)
+	if (from_nla->nl_groups != CN_IDX_PROC || from_nla->nl_pid != 0) {
+		netlink_stats.bad++;
 		return 0;
+	}
 
 	nlh = (struct nlmsghdr *)buff;
 	while (NLMSG_OK(nlh, recv_len)) {
@@ -593,6 +937,8 @@ static int cgre_receive_netlink_msg(int sk_nl)
 		}
 		if ((nlh->nlmsg_type == NLMSG_ERROR) || (nlh->nlmsg_type == NLMSG_OVERRUN))
 			break;
+		if (!netlink_filtered)
+			cgre_account_netlink_seq(cn_hdr);
 		if (cgre_handle_msg(cn_hdr) < 0)
 			return 1;
 		if (nlh->nlmsg_type == NLMSG_DONE)
@@ -603,6 +949,58 @@ static int cgre_receive_netlink_msg(int sk_nl)
 	return 0;
 }
 
+/*
+ * Drain the netlink socket, CGRE_RECV_BATCH datagrams per recvmmsg() call.
+ * The socket is non-blocking, this returns once it is empty or after
+ * CGRE_RECV_BATCHES_MAX batches, so that the unix socket is not starved.
+ */
+static int cgre_receive_netlink_msg(int sk_nl)
+{
+	static struct sockaddr_nl from_nla[CGRE_RECV_BATCH];
+	static char buff[CGRE_RECV_BATCH][BUFF_SIZE];
+	struct mmsghdr msgs[CGRE_RECV_BATCH];
+	struct iovec iov[CGRE_RECV_BATCH];
+	int batch, cnt, i;
+
+	for (batch = 0; batch < CGRE_RECV_BATCHES_MAX; batch++) {
+		memset(msgs, 0, sizeof(msgs));
+		for (i = 0; i < CGRE_RECV_BATCH; i++) {
+			iov[i].iov_base = buff[i];
+			iov[i].iov_len = sizeof(buff[i]);
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_name = &from_nla[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(from_nla[i]);
+		}
+
+		cnt = recvmmsg(sk_nl, msgs, CGRE_RECV_BATCH, MSG_DONTWAIT, NULL);
+		if (cnt < 0) {
+			if (errno == ENOBUFS) {
+				netlink_stats.overruns++;
+				flog(LOG_ERR, "ERROR: NETLINK BUFFER FULL, MESSAGE DROPPED!\n");
+				cgre_log_netlink_stats(LOG_ERR);
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				flog(LOG_WARNING, "Warning: error reading netlink socket: %s\n",
+				     strerror(errno));
+			break;
+		}
+
+		netlink_stats.msgs += cnt;
+		for (i = 0; i < cnt; i++) {
+			if (cgre_handle_netlink_datagram(buff[i], msgs[i].msg_len, &from_nla[i],
+							 msgs[i].msg_hdr.msg_namelen))
+				return 1;
+		}
+
+		if (cnt < CGRE_RECV_BATCH)
+			break;
+	}
+
+	return 0;
+}
+
 static void cgre_receive_unix_domain_msg(int sk_unix)
 {
 	struct sockaddr_un caddr;
@@ -653,49 +1051,91 @@ close:
 	close(fd_client);
 }
 
-static int cgre_create_netlink_socket_process_msg(void)
+/* Signals caught and not handled yet, see cgre_handle_signals() */
+static volatile sig_atomic_t reload_rules_pending;
+static volatile sig_atomic_t reload_templates_pending;
+static volatile sig_atomic_t term_signal_pending;
+
+/**
+ * Catch SIGUSR1, SIGUSR2, SIGINT and SIGTERM. The handlers only flag the
+ * signal, it is acted on by the main loop in cgre_handle_signals().
+ *	@param signum The signal that we caught
+ */
+static void cgre_catch_signal(int signum)
 {
-	int sk_nl = 0, sk_unix = 0, sk_max;
-	enum proc_cn_mcast_op *mcop_msg;
-	struct sockaddr_nl my_nla;
-	struct sockaddr_un saddr;
-	struct nlmsghdr *nl_hdr;
-	struct cn_msg *cn_hdr;
-	char buff[BUFF_SIZE];
-	fd_set fds, readfds;
-	sigset_t sigset;
-	int rc = -1;
+	switch (signum) {
+	case SIGUSR2:
+		reload_rules_pending = 1;
+		break;
+	case SIGUSR1:
+		reload_templates_pending = 1;
+		break;
+	default:
+		term_signal_pending = signum;
+		break;
+	}
+}
 
-	/*
-	 * Create an endpoint for communication. Use the kernel user interface
-	 * device (PF_NETLINK) which is a datagram oriented service (SOCK_DGRAM).
-	 * The protocol used is the connector protocol (NETLINK_CONNECTOR)
-	 */
-	sk_nl = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_CONNECTOR);
-	if (sk_nl == -1) {
-		flog(LOG_ERR, "Error: error opening netlink socket: %s\n", strerror(errno));
-		return rc;
+static void cgre_handle_signals(void)
+{
+	if (term_signal_pending)
+		cgre_catch_term(term_signal_pending);
+
+	if (reload_rules_pending) {
+		reload_rules_pending = 0;
+
+		pthread_rwlock_wrlock(&rules_lock);
+		cgre_flash_rules(SIGUSR2);
+		pthread_rwlock_unlock(&rules_lock);
 	}
 
-	my_nla.nl_family = AF_NETLINK;
-	my_nla.nl_groups = CN_IDX_PROC;
-	my_nla.nl_pid = getpid();
-	my_nla.nl_pad = 0;
+	if (reload_templates_pending) {
+		reload_templates_pending = 0;
 
-	if (bind(sk_nl, (struct sockaddr *)&my_nla, sizeof(my_nla)) < 0) {
-		flog(LOG_ERR, "Error: error binding netlink socket: %s\n", strerror(errno));
-		goto close_and_exit;
+		pthread_rwlock_wrlock(&rules_lock);
+		cgre_flash_templates(SIGUSR1);
+		pthread_rwlock_unlock(&rules_lock);
+	}
+}
+
+/*
+ * Enlarge the netlink receive buffer, so that bursts of events don't
+ * overflow it. SO_RCVBUFFORCE needs CAP_NET_ADMIN, without it the size
+ * is capped by net.core.rmem_max.
+ */
+static void cgre_set_netlink_rcvbuf(int sk_nl)
+{
+	socklen_t len = sizeof(netlink_rcvbuf);
+	int size = netlink_rcvbuf;
+
+	if (!netlink_rcvbuf)
+		return;
+
+	if (setsockopt(sk_nl, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0 &&
+	    setsockopt(sk_nl, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0) {
+		flog(LOG_WARNING, "Warning: failed to set the netlink receive buffer size: %s\n",
+		     strerror(errno));
+		return;
 	}
 
+	if (getsockopt(sk_nl, SOL_SOCKET, SO_RCVBUF, &size, &len) == 0)
+		flog(LOG_DEBUG, "Netlink receive buffer size: %d bytes\n", size);
+}
+
+/* Send a proc connector control message */
+static int cgre_send_proc_cn_msg(int sk_nl, const void *data, size_t len)
+{
+	struct nlmsghdr *nl_hdr;
+	struct cn_msg *cn_hdr;
+	char buff[BUFF_SIZE];
+
+	memset(buff, 0, sizeof(buff));
 	nl_hdr = (struct nlmsghdr *)buff;
 	cn_hdr = (struct cn_msg *)NLMSG_DATA(nl_hdr);
-	mcop_msg = (enum proc_cn_mcast_op *)&cn_hdr->data[0];
-	flog(LOG_DEBUG, "Sending proc connector: PROC_CN_MCAST_LISTEN...\n");
-	memset(buff, 0, sizeof(buff));
-	*mcop_msg = PROC_CN_MCAST_LISTEN;
+	memcpy(cn_hdr->data, data, len);
 
 	/* fill the netlink header */
-	nl_hdr->nlmsg_len = SEND_MESSAGE_LEN;
+	nl_hdr->nlmsg_len = NLMSG_LENGTH(sizeof(struct cn_msg) + len);
 	nl_hdr->nlmsg_type = NLMSG_DONE;
 	nl_hdr->nlmsg_flags = 0;
 	nl_hdr->nlmsg_seq = 0;
@@ -706,17 +1146,196 @@ static int cgre_create_netlink_socket_process_msg(void)
 	cn_hdr->id.val = CN_VAL_PROC;
 	cn_hdr->seq = 0;
 	cn_hdr->ack = 0;
-	cn_hdr->len = sizeof(enum proc_cn_mcast_op);
+	cn_hdr->len = len;
 	flog(LOG_DEBUG, "Sending netlink message len=%d, cn_msg len=%d\n", nl_hdr->nlmsg_len,
 	     (int) sizeof(struct cn_msg));
 
 	if (send(sk_nl, nl_hdr, nl_hdr->nlmsg_len, 0) != nl_hdr->nlmsg_len) {
 		flog(LOG_ERR, "Error: failed to send netlink message (mcast ctl op): %s\n",
 		     strerror(errno));
-		goto close_and_exit;
+		return -1;
 	}
 	flog(LOG_DEBUG, "Message sent\n");
 
+	return 0;
+}
+
+/*
+ * Tell whether the kernel sends only the requested events. The kernel
+ * doesn't acknowledge such a subscription, its filter drops the ack, so
+ * fork a child that calls setsid() and exits: the SID event must not
+ * show up before the EXIT one. The events read meanwhile are discarded.
+ *	@return 1 if the kernel filters the events, 0 otherwise
+ */
+static int cgre_probe_proc_filter(int sk_nl)
+{
+	struct timespec start, now;
+	struct proc_event *ev;
+	struct nlmsghdr *nlh;
+	struct cn_msg *cn_hdr;
+	char buff[BUFF_SIZE];
+	struct pollfd pfd;
+	int filtered = 0;
+	int timeout;
+	ssize_t len;
+	pid_t child;
+
+	child = fork();
+	if (child < 0) {
+		flog(LOG_WARNING, "Warning: failed to fork: %s\n", strerror(errno));
+		return 0;
+	}
+	if (child == 0) {
+		setsid();
+		_exit(0);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pfd.fd = sk_nl;
+	pfd.events = POLLIN;
+
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		timeout = CGRE_FILTER_PROBE_TIMEOUT - ((now.tv_sec - start.tv_sec) * 1000 +
+						       (now.tv_nsec - start.tv_nsec) / 1000000);
+		if (timeout <= 0)
+			break;
+
+		if (poll(&pfd, 1, timeout) < 0 && errno != EINTR)
+			break;
+
+		len = recv(sk_nl, buff, sizeof(buff), MSG_DONTWAIT);
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ||
+			    errno == ENOBUFS)
+				continue;
+			break;
+		}
+
+		nlh = (struct nlmsghdr *)buff;
+		if (!NLMSG_OK(nlh, len) || nlh->nlmsg_type == NLMSG_ERROR ||
+		    nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*cn_hdr) + sizeof(*ev)))
+			continue;
+
+		cn_hdr = NLMSG_DATA(nlh);
+		ev = (struct proc_event *)cn_hdr->data;
+		if (ev->what == PROC_EVENT_SID && ev->event_data.sid.process_pid == child)
+			break;
+
+		if (ev->what == PROC_EVENT_EXIT && ev->event_data.exit.process_pid == child) {
+			filtered = 1;
+			break;
+		}
+	}
+
+	waitpid(child, NULL, 0);
+
+	return filtered;
+}
+
+/*
+ * Drop the events the daemon doesn't need before they are queued to the
+ * socket, on the kernels that can't filter them. The proc connector
+ * events are in host byte order, the classic BPF loads in network byte
+ * order, hence the htonl(). Every event type is a single bit.
+ */
+static int cgre_attach_netlink_filter(int sk_nl)
+{
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, NLMSG_HDRLEN + offsetof(struct cn_msg, data) +
+			 offsetof(struct proc_event, what)),
+		/* the acknowledgments */
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PROC_EVENT_NONE, 1, 0),
+		BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, htonl(CGRE_PROC_EVENTS), 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+	struct sock_fprog prog = {
+		.len = ARRAY_SIZE(code),
+		.filter = code,
+	};
+
+	if (setsockopt(sk_nl, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+		flog(LOG_WARNING, "Warning: failed to attach the netlink socket filter: %s\n",
+		     strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Subscribe to the process events. Ask the kernel to send only the events
+ * the daemon needs; the kernels before 6.6 ignore the request, then
+ * subscribe to all the events and let a socket filter drop the others. If
+ * that fails too, cgre_handle_msg() drops them.
+ */
+static int cgre_subscribe_proc_events(int sk_nl)
+{
+	enum proc_cn_mcast_op op = PROC_CN_MCAST_LISTEN;
+	struct cgre_proc_input input;
+
+	flog(LOG_DEBUG, "Sending proc connector: PROC_CN_MCAST_LISTEN...\n");
+
+	memset(&input, 0, sizeof(input));
+	input.mcast_op = PROC_CN_MCAST_LISTEN;
+	input.event_type = CGRE_PROC_EVENTS;
+	if (cgre_send_proc_cn_msg(sk_nl, &input, sizeof(input)))
+		return -1;
+
+	if (cgre_probe_proc_filter(sk_nl)) {
+		flog(LOG_INFO, "The kernel filters the process events\n");
+		netlink_filtered = true;
+		return 0;
+	}
+
+	flog(LOG_INFO, "The kernel can't filter the process events, using a socket filter\n");
+	if (cgre_send_proc_cn_msg(sk_nl, &op, sizeof(op)))
+		return -1;
+
+	if (cgre_attach_netlink_filter(sk_nl) == 0)
+		netlink_filtered = true;
+
+	return 0;
+}
+
+static int cgre_create_netlink_socket_process_msg(void)
+{
+	struct epoll_event events[2], ev;
+	int sk_nl = -1, sk_unix = -1;
+	sigset_t sigset, waitset;
+	struct sockaddr_nl my_nla;
+	struct sockaddr_un saddr;
+	int epfd = -1;
+	int rc = -1;
+	int cnt, i;
+
+	/*
+	 * Create an endpoint for communication. Use the kernel user interface
+	 * device (PF_NETLINK) which is a datagram oriented service (SOCK_DGRAM).
+	 * The protocol used is the connector protocol (NETLINK_CONNECTOR)
+	 */
+	sk_nl = socket(PF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+	if (sk_nl == -1) {
+		flog(LOG_ERR, "Error: error opening netlink socket: %s\n", strerror(errno));
+		return rc;
+	}
+
+	cgre_set_netlink_rcvbuf(sk_nl);
+
+	my_nla.nl_family = AF_NETLINK;
+	my_nla.nl_groups = CN_IDX_PROC;
+	my_nla.nl_pid = getpid();
+	my_nla.nl_pad = 0;
+
+	if (bind(sk_nl, (struct sockaddr *)&my_nla, sizeof(my_nla)) < 0) {
+		flog(LOG_ERR, "Error: error binding netlink socket: %s\n", strerror(errno));
+		goto close_and_exit;
+	}
+
+	if (cgre_subscribe_proc_events(sk_nl))
+		goto close_and_exit;
+
 	/* Setup Unix domain socket. */
 	sk_unix = socket(PF_UNIX, SOCK_STREAM, 0);
 	if (sk_unix < 0) {
@@ -758,40 +1377,67 @@ static int cgre_create_netlink_socket_process_msg(void)
 		goto close_and_exit;
 	}
 
-	FD_ZERO(&readfds);
-	FD_SET(sk_nl, &readfds);
-	FD_SET(sk_unix, &readfds);
-	if (sk_nl < sk_unix)
-		sk_max = sk_unix;
-	else
-		sk_max = sk_nl;
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		flog(LOG_ERR, "Error creating epoll instance: %s\n", strerror(errno));
+		goto close_and_exit;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = sk_nl;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, sk_nl, &ev) < 0) {
+		flog(LOG_ERR, "Error adding netlink socket to epoll: %s\n", strerror(errno));
+		goto close_and_exit;
+	}
 
+	ev.data.fd = sk_unix;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, sk_unix, &ev) < 0) {
+		flog(LOG_ERR, "Error adding UNIX socket to epoll: %s\n", strerror(errno));
+		goto close_and_exit;
+	}
+
+	/*
+	 * The signals are blocked except while waiting for events, so that
+	 * a signal flagged while handling events can't be missed before
+	 * the wait.
+	 */
 	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGUSR1);
 	sigaddset(&sigset, SIGUSR2);
+	sigaddset(&sigset, SIGINT);
+	sigaddset(&sigset, SIGTERM);
+	sigprocmask(SIG_BLOCK, &sigset, &waitset);
+	sigdelset(&waitset, SIGUSR1);
+	sigdelset(&waitset, SIGUSR2);
+	sigdelset(&waitset, SIGINT);
+	sigdelset(&waitset, SIGTERM);
+
 	for (;;) {
-		/*
-		 * For avoiding the deadlock and "Interrupted system call"
-		 * error, restrict the effective range of SIGUSR2 signal.
-		 */
-		sigprocmask(SIG_UNBLOCK, &sigset, NULL);
-		sigprocmask(SIG_BLOCK, &sigset, NULL);
+		cgre_handle_signals();
+
+		cnt = epoll_pwait(epfd, events, 2, -1, &waitset);
+		if (cnt < 0) {
+			if (errno == EINTR)
+				continue;
 
-		memcpy(&fds, &readfds, sizeof(fd_set));
-		if (select(sk_max + 1, &fds, NULL, NULL, NULL) < 0) {
-			flog(LOG_ERR, "Selecting error: %s\n", strerror(errno));
+			flog(LOG_ERR, "Polling error: %s\n", strerror(errno));
 			goto close_and_exit;
 		}
 
-		if (FD_ISSET(sk_nl, &fds)) {
-			if (cgre_receive_netlink_msg(sk_nl))
-				break;
+		for (i = 0; i < cnt; i++) {
+			if (events[i].data.fd == sk_nl) {
+				if (cgre_receive_netlink_msg(sk_nl))
+					goto close_and_exit;
+			} else {
+				cgre_receive_unix_domain_msg(sk_unix);
+			}
 		}
-
-		if (FD_ISSET(sk_unix, &fds))
-			cgre_receive_unix_domain_msg(sk_unix);
 	}
 
 close_and_exit:
+	if (epfd >= 0)
+		close(epfd);
 	if (sk_nl >= 0)
 		close(sk_nl);
 	if (sk_unix >= 0)
@@ -931,7 +1577,7 @@ int cgre_start_daemon(const char *logp, const int logf, const unsigned char daem
 }
 
 /**
- * Catch the SIGUSR2 signal and reload the rules configuration.
+ * Reload the rules configuration, on SIGUSR2.
  * This function makes use of the logfile and flog() to print the new rules.
  *	@param signum The signal that we caught (always SIGUSR2)
  */
@@ -959,7 +1605,7 @@ void cgre_flash_rules(int signum)
 }
 
 /**
- * Catch the SIGUSR1 signal and reload the rules configuration.
+ * Reload the templates configuration, on SIGUSR1.
  * This function makes use of the logfile and flog() to print the new rules.
  *	@param signum The signal that we caught (always SIGUSR1)
  */
@@ -978,7 +1624,7 @@ void cgre_flash_templates(int signum)
 }
 
 /**
- * Catch the SIGTERM and SIGINT signals so that we can exit gracefully.
+ * Exit gracefully on SIGTERM and SIGINT.
  * Before exiting, this function makes use of the logfile and flog().
  *	@param signum The signal that we caught (SIGTERM, SIGINT)
  */
@@ -987,8 +1633,11 @@ void cgre_catch_term(int signum)
 	/* Current time */
 	time_t tm = time(0);
 
+	cgre_log_netlink_stats(LOG_INFO);
 	flog(LOG_INFO, "Stopped CGroup Rules Engine Daemon at %s\n", ctime(&tm));
 
+	cgroup_unpublish_cached_rules();
+
 	/* Close the log file, if we opened one */
 	if (logfile && logfile != stdout)
 		fclose(logfile);
@@ -1051,6 +1700,9 @@ int main(int argc, char *argv[])
 	/* For catching signals */
 	struct sigaction sa;
 
+	/* Statistics of the scan of the running processes */
+	struct cgroup_sweep_stats stats;
+
 	/* Should we daemonize? */
 	unsigned char daemon = 1;
 
@@ -1060,8 +1712,12 @@ int main(int argc, char *argv[])
 	struct passwd *pw;
 	struct group *gr;
 
+	char *endptr;
+	long workers_arg;
+	long rcvbuf;
+
 	/* Command line arguments */
-	const char *short_options = "hvqf:s::ndQu:g:";
+	const char *short_options = "hvqf:s::ndQu:g:b:w:";
 	struct option long_options[] = {
 		{"help",	       no_argument, NULL, 'h'},
 		{"verbose",	       no_argument, NULL, 'v'},
@@ -1073,6 +1729,8 @@ int main(int argc, char *argv[])
 		{"nolog",	       no_argument, NULL, 'Q'},
 		{"socket-user",  required_argument, NULL, 'u'},
 		{"socket-group", required_argument, NULL, 'g'},
+		{"rcvbuf",	 required_argument, NULL, 'b'},
+		{"workers",	 required_argument, NULL, 'w'},
 		{NULL, 0, NULL, 0}
 	};
 
@@ -1172,6 +1830,28 @@ int main(int argc, char *argv[])
 			flog(LOG_DEBUG, "Using socket group %s id %d\n", optarg,
 			     (int)socket_group);
 			break;
+		case 'b': /* --rcvbuf */
+			errno = 0;
+			rcvbuf = strtol(optarg, &endptr, 10);
+			if (errno || *endptr || endptr == optarg || rcvbuf < 0 ||
+			    rcvbuf > INT_MAX) {
+				usage(stderr, "Invalid receive buffer size %s", optarg);
+				ret = 2;
+				goto finished;
+			}
+			netlink_rcvbuf = rcvbuf;
+			break;
+		case 'w': /* --workers */
+			errno = 0;
+			workers_arg = strtol(optarg, &endptr, 10);
+			if (errno || *endptr || endptr == optarg || workers_arg < 0 ||
+			    workers_arg > CGRE_MAX_WORKERS) {
+				usage(stderr, "Invalid number of workers %s", optarg);
+				ret = 2;
+				goto finished;
+			}
+			worker_cnt = workers_arg;
+			break;
 		default:
 			usage(stderr, "");
 			ret = 2;
@@ -1203,7 +1883,8 @@ int main(int argc, char *argv[])
 	/* then read CGCONFIG_CONF_DIR directory for additional config files */
 	cgroup_string_list_add_directory(&template_files, CGCONFIG_CONF_DIR, argv[0]);
 
-	ret = cgroup_init_rules_cache();
+	/* The short-lived processes match against the rules the daemon loaded */
+	ret = cgroup_publish_cached_rules();
 	if (ret != 0) {
 		fprintf(stderr, "Error: libcgroup failed to initialize rules");
 		fprintf(stderr, "cache from %s. %s\n", CGRULES_CONF_FILE, cgroup_strerror(ret));
@@ -1234,7 +1915,7 @@ int main(int argc, char *argv[])
 	 * reception of a SIGUSR2 signal.
 	 */
 	memset(&sa, 0, sizeof(sa));
-	sa.sa_handler = &cgre_flash_rules;
+	sa.sa_handler = &cgre_catch_signal;
 	sigemptyset(&sa.sa_mask);
 	ret = sigaction(SIGUSR2, &sa, NULL);
 	if (ret) {
@@ -1247,7 +1928,6 @@ int main(int argc, char *argv[])
 	 * Set up the signal handler to reload templates cache upon
 	 * reception of a SIGUSR1 signal.
 	 */
-	sa.sa_handler = &cgre_flash_templates;
 	ret = sigaction(SIGUSR1, &sa, NULL);
 	if (ret) {
 		flog(LOG_ERR, "Failed to set up signal handler for SIGUSR1. Error: %s\n",
@@ -1259,7 +1939,6 @@ int main(int argc, char *argv[])
 	 * Set up the signal handler to catch SIGINT and SIGTERM so that
 	 * we can exit gracefully
 	 */
-	sa.sa_handler = &cgre_catch_term;
 	ret = sigaction(SIGINT, &sa, NULL);
 	ret |= sigaction(SIGTERM, &sa, NULL);
 	if (ret) {
@@ -1271,10 +1950,19 @@ int main(int argc, char *argv[])
 	if (logfile && loglevel >= LOG_INFO)
 		cgroup_print_rules_config(logfile);
 
-	/* Scan for running applications with rules */
-	ret = cgroup_change_all_cgroups();
+	if (worker_cnt < 0)
+		worker_cnt = min(max(sysconf(_SC_NPROCESSORS_ONLN), 1), CGRE_DEFAULT_WORKERS_MAX);
+
+	/* Scan for running applications with rules, on as many threads as workers */
+	ret = cgroup_change_all_cgroups2(CGFLAG_USECACHE | CGFLAG_USE_TEMPLATE_CACHE,
+					 max(worker_cnt, 1), &stats);
 	if (ret)
 		flog(LOG_WARNING, "Failed to initialize running tasks.\n");
+	flog(LOG_INFO, "Classified %lu running processes in %llu ms on %d threads\n",
+	     stats.procs, stats.elapsed_us / 1000, stats.threads);
+
+	/* Classify the events on a pool of workers */
+	cgre_start_workers();
 
 	flog(LOG_INFO, "Started the CGroup Rules Engine Daemon.\n");
 
@@ -1282,6 +1970,7 @@ int main(int argc, char *argv[])
 	ret =  cgre_create_netlink_socket_process_msg();
 
 finished:
+	cgroup_unpublish_cached_rules();
 	cgroup_string_list_free(&template_files);
 
 finished_without_temp_files:
@@ -29,7 +29,7 @@ extern "C" {
 #endif
 
 /* The following ten macros are all for the Netlink code. */
-#define SEND_MESSAGE_LEN (NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op)))
+#define SEND_MESSAGE_LEN (NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof(struct cgre_proc_input)))
 #define RECV_MESSAGE_LEN (NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof(struct proc_event)))
 
 #define SEND_MESSAGE_SIZE (NLMSG_SPACE(SEND_MESSAGE_LEN))
@@ -41,6 +41,38 @@ extern "C" {
 #define PROC_CN_MCAST_LISTEN (1)
 #define PROC_CN_MCAST_IGNORE (2)
 
+/*
+ * PROC_CN_MCAST_LISTEN request with a mask of the events to send, the
+ * struct proc_input of the kernels since 6.6. Older kernels ignore it.
+ */
+struct cgre_proc_input {
+	enum proc_cn_mcast_op mcast_op;
+	__u32 event_type;
+};
+
+/* The process events the daemon needs */
+#define CGRE_PROC_EVENTS	(PROC_EVENT_FORK | PROC_EVENT_EXEC | PROC_EVENT_UID | \
+				 PROC_EVENT_GID | PROC_EVENT_EXIT)
+
+/* Time to wait for the events of the filtering probe, in ms */
+#define CGRE_FILTER_PROBE_TIMEOUT	(250)
+
+/* Datagrams read from the netlink socket by one recvmmsg() call */
+#define CGRE_RECV_BATCH		(64)
+
+/* Batches drained from the netlink socket before the other sockets are served */
+#define CGRE_RECV_BATCHES_MAX	(16)
+
+/* Default receive buffer size of the netlink socket, in bytes */
+#define CGRE_DEFAULT_RCVBUF	(4 * 1024 * 1024)
+
+/* Events queued per classification worker, a power of two */
+#define CGRE_QUEUE_SIZE		(4096)
+
+/* Default and maximum number of classification workers */
+#define CGRE_DEFAULT_WORKERS_MAX	(8)
+#define CGRE_MAX_WORKERS	(256)
+
 /**
  * Prints the usage information for this program and, optionally,
  * an error message. This function uses vfprintf.
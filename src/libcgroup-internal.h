@@ -32,7 +32,7 @@ extern "C" {
 
 #define CG_CONTROL_VALUE_MAX	4096	/* Maximum length of a value */
 
-#define CG_NV_MAX		100
+#define CG_NV_MAX		100	/* Growth step of the name/value vectors */
 #define CG_CONTROLLER_MAX	100
 #define CG_OPTIONS_MAX		100
 
@@ -62,6 +62,10 @@ extern "C" {
 
 #define CGRULES_CONF_FILE		"/etc/cgrules.conf"
 #define CGRULES_CONF_DIR		"/etc/cgrules.d"
+/* Compiled cache of the rules, see rules-cache.c */
+#define CGRULES_CACHE_FILE		"/var/cache/libcgroup/cgrules.cache"
+/* Shared memory segment of the rules loaded by cgrulesengd */
+#define CGRULES_SHM_NAME		"/libcgroup-cgrules"
 #define CGRULES_MAX_FIELDS_PER_LINE	3
 
 #define CGRP_BUFFER_LEN	(5 * FILENAME_MAX)
@@ -95,9 +99,15 @@ extern "C" {
 
 #define ARRAY_SIZE(x)	(sizeof(x) / sizeof((x)[0]))
 
+/*
+ * Name/value pair of a controller setting. The values owned by a
+ * cgroup_controller have an interned name (see cgroup_intern_name()), that
+ * is shared and must not be modified or freed, and a heap allocated value
+ * sized to its content. Both are always valid strings.
+ */
 struct control_value {
-	char name[FILENAME_MAX];
-	char value[CG_CONTROL_VALUE_MAX];
+	char *name;
+	char *value;
 
 	/* cgget uses this field for values that span multiple lines */
 	char *multiline_value;
@@ -113,16 +123,25 @@ struct control_value {
 
 struct cgroup_controller {
 	char name[CONTROL_NAMELEN_MAX];
-	struct control_value *values[CG_NV_MAX];
+	struct control_value **values;	/* growable, values_alloc entries */
 	struct cgroup *cgroup;
 	int index;
+	int values_alloc;
 	enum cg_version_t version;
+	/*
+	 * Open addressing index of values[] by name, slots hold the values[]
+	 * index + 1. Only built once there are enough values to make it
+	 * worthwhile, see cgroup_find_value().
+	 */
+	int *values_hash;
+	int values_hash_size;
 };
 
 struct cgroup {
 	char name[FILENAME_MAX];
-	struct cgroup_controller *controller[CG_CONTROLLER_MAX];
+	struct cgroup_controller **controller;	/* growable, controller_alloc entries */
 	int index;
+	int controller_alloc;
 	uid_t tasks_uid;
 	gid_t tasks_gid;
 	mode_t task_fperm;
@@ -177,6 +196,80 @@ struct cgroup_rule_list {
 	int len;
 };
 
+/*
+ * Rule positions keyed by UID or GID, in compressed sparse row form. The
+ * positions of keys[i] are pos[start[i]] up to pos[start[i + 1]], sorted.
+ */
+struct cgroup_rule_csr {
+	unsigned int *keys;
+	int *start;
+	int *pos;
+	int key_cnt;
+};
+
+/* Index of a rule list, built by cgroup_build_rule_index() */
+struct cgroup_rule_index {
+	/* The rules of the list, indexed by their position */
+	struct cgroup_rule **rules;
+	int rule_cnt;
+	/* UID rules and the members of @group rules */
+	struct cgroup_rule_csr uid;
+	/* @group rules */
+	struct cgroup_rule_csr gid;
+	/* '*' rules */
+	int *wild;
+	int wild_cnt;
+};
+
+/* A file a compiled rules cache is built from */
+struct cg_rules_cache_source {
+	char *name;
+	struct stat st;
+	/* The file doesn't exist */
+	bool missing;
+};
+
+struct cg_rules_cache_sources {
+	struct cg_rules_cache_source *src;
+	int cnt;
+};
+
+/* A process of cgroup_change_cgroups_batch() and a destination of its rule */
+struct cg_batch_entry {
+	struct cgroup_rule *rule;
+	/* The destination of the rule, substituted for the process */
+	char *dest;
+	pid_t pid;
+	/* Position in the batch, the processes are written in that order */
+	int pos;
+};
+
+struct cg_batch {
+	struct cg_batch_entry *entries;
+	int cnt;
+	int max;
+};
+
+/* Counters of the work done to move tasks between cgroups */
+struct cg_attach_stats {
+	/* PIDs and TIDs written to a tasks, cgroup.procs or cgroup.threads file */
+	unsigned long writes;
+	/* cgroup.subtree_control files read to check that a controller is enabled */
+	unsigned long subtree_reads;
+};
+
+/* A compiled rules cache mapped by cg_rules_cache_open() */
+struct cg_rules_cache {
+	void *map;
+	size_t size;
+	/* map is a private copy of the shared image, not a mapping */
+	bool copy;
+	const struct cg_rules_cache_hdr *hdr;
+	const struct cg_rules_cache_src *srcs;
+	const struct cg_rules_cache_rule *rules;
+	const char *strs;
+};
+
 /* The walk_tree handle */
 struct cgroup_tree_handle {
 	FTS *fts;
@@ -242,6 +335,19 @@ struct cgroup *create_cgroup_from_name_value_pairs(const char *name,
 						struct control_value *name_value, int nv_number);
 void init_cgroup_table(struct cgroup *cgrps, size_t count);
 
+/* FNV-1a hash of a NUL terminated string, for the internal lookup tables */
+static inline unsigned int cg_hash_string(const char *str)
+{
+	unsigned int hash = 2166136261u;
+
+	while (*str) {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
 /*
  * Main mounting structures
  *
@@ -350,6 +456,30 @@ int cgroup_build_tasks_procs_path(char * const path, size_t path_sz, const char
  */
 char *cg_build_path_locked(const char *setting, char *path, const char *controller);
 
+/**
+ * Precompute the per-controller path prefixes used by cg_build_path_locked().
+ * Must be called again whenever cg_mount_table or systemd_default_cgroup
+ * changes.  On failure cg_build_path_locked() falls back to building the
+ * prefix on every call.
+ *
+ * @return 0 on success, ECGOTHER if the prefixes could not be allocated
+ *
+ * @note The cg_mount_table_lock must be held for writing
+ */
+int cg_build_path_prefix_table(void);
+
+/**
+ * Drop the prefixes built by cg_build_path_prefix_table().
+ *
+ * @note The cg_mount_table_lock must be held for writing
+ */
+void cg_free_path_prefix_table(void);
+
+/**
+ * Same as cg_build_path_prefix_table(), but takes cg_mount_table_lock.
+ */
+int cg_refresh_path_prefix_table(void);
+
 /**
  * Given a cgroup controller and a setting within it, populate the setting's value
  *
@@ -363,6 +493,181 @@ char *cg_build_path_locked(const char *setting, char *path, const char *controll
 int cgroup_fill_cgc(struct dirent *ctrl_dir, struct cgroup *cgrp, struct cgroup_controller *cgc,
 		    int cg_index);
 
+/**
+ * The directory of a cgroup in the hierarchy of one controller.  Its control
+ * files are opened and stat()ed relative to the descriptor, so that the path
+ * of the cgroup is resolved once rather than for every file.
+ */
+struct cg_dir {
+	/* O_PATH descriptor of the directory, -1 when closed */
+	int fd;
+	/* Path of the directory, for the log messages */
+	char path[FILENAME_MAX];
+};
+
+/* The cgroup_handle_open() handle */
+struct cgroup_handle {
+	struct cg_dir dir;
+	/* The files opened by cgroup_handle_add_file(), by index */
+	int *fds;
+	int fd_cnt;
+	int fd_max;
+};
+
+/* A slot of an open addressing hash table of keys */
+struct cg_key_slot {
+	/* The key, not zero-terminated, NULL for an empty slot */
+	const char *name;
+	size_t len;
+	unsigned int hash;
+	uint32_t id;
+};
+
+struct cg_key_table {
+	struct cg_key_slot *slots;
+	/* A power of two, or 0 before the first key */
+	unsigned int size;
+	unsigned int cnt;
+};
+
+#define CG_STAT_KEY_MAX	256	/* Maximum length of a nested key */
+
+/* The cgroup_stat_parser_new() parser */
+struct cgroup_stat_parser {
+	/* The key names by id, and the table to look up their ids */
+	struct cg_key_table keys;
+	char **key_names;
+	uint32_t key_cnt;
+	uint32_t key_max;
+	/* The values of the last parsed file */
+	struct cgroup_stat_value *values;
+	int value_cnt;
+	int value_max;
+	/* The content of the last read file */
+	char *buf;
+	size_t buf_size;
+};
+
+/**
+ * Open a cgroup directory
+ *
+ * @param dir The handle to initialize
+ * @param path Path of the directory, as built by cg_build_path()
+ * @return 0 on success, ECGOTHER with last_errno set on failure
+ */
+int cg_dir_open(struct cg_dir * const dir, const char * const path);
+
+/**
+ * List a cgroup directory opened with cg_dir_open()
+ *
+ * @return A directory stream to be closed with closedir(), NULL with errno set
+ *	on failure
+ */
+DIR *cg_dir_opendir(const struct cg_dir * const dir);
+
+/**
+ * Close a cgroup directory.  Closing a closed handle does nothing.
+ */
+void cg_dir_close(struct cg_dir * const dir);
+
+/**
+ * Same as cgroup_fill_cgc(), with the setting relative to the directory of
+ * the cgroup
+ *
+ * @param dir Directory of cgrp in the hierarchy of cg_mount_table[cg_index]
+ *
+ * @note The cg_mount_table_lock must be held prior to calling this function
+ */
+int cgroup_fill_cgc_at(const struct cg_dir * const dir, struct dirent *ctrl_dir,
+		       struct cgroup *cgrp, struct cgroup_controller *cgc, int cg_index);
+
+/**
+ * Record the files the rules are parsed from: conf_file, conf_dir and the
+ * files in it.  Called before the files are parsed, a file changed meanwhile
+ * invalidates the cache written afterwards.
+ *
+ * @return 0 on success, srcs to be freed with cg_rules_cache_free_sources()
+ */
+int cg_rules_cache_stat_sources(const char * const conf_file, const char * const conf_dir,
+				struct cg_rules_cache_sources * const srcs);
+
+void cg_rules_cache_free_sources(struct cg_rules_cache_sources * const srcs);
+
+/**
+ * Compile the rules parsed from srcs into the image of a cache.  Only their
+ * user field is kept, not the UID and GID it was resolved to.
+ *
+ * @return 0 on success, the image to be freed by the caller, ECGOTHER with
+ *	last_errno set on failure
+ */
+int cg_rules_cache_build(const struct cgroup_rule_list * const lst,
+			 const struct cg_rules_cache_sources * const srcs, void ** const image,
+			 size_t * const size);
+
+/**
+ * Write the image of a cache to path, replacing it atomically
+ *
+ * @return 0 on success, ECGOTHER with last_errno set on failure
+ */
+int cg_rules_cache_write(const char * const path, const void * const image, size_t size);
+
+/**
+ * Map a compiled rules cache and check it is still up to date
+ *
+ * @return 0 on success, the cache to be closed with cg_rules_cache_close(),
+ *	ECGFAIL if the cache is stale or invalid, ECGOTHER if it can't be read
+ */
+int cg_rules_cache_open(const char * const path, struct cg_rules_cache * const cache);
+
+void cg_rules_cache_close(struct cg_rules_cache * const cache);
+
+/**
+ * Publish the image of a cache in CGRULES_SHM_NAME, creating the segment on
+ * the first call.  The calls must be serialized.
+ *
+ * @return 0 on success, ECGOTHER with last_errno set on failure
+ */
+int cg_rules_shm_publish(const void * const image, size_t size);
+
+/* Remove the segment published by cg_rules_shm_publish() */
+void cg_rules_shm_unpublish(void);
+
+/* Whether a segment is published, by this process or another one */
+bool cg_rules_shm_published(void);
+
+/**
+ * Copy the image published in CGRULES_SHM_NAME and check it like
+ * cg_rules_cache_open() does
+ *
+ * @return 0 on success, the cache to be closed with cg_rules_cache_close(),
+ *	ECGFAIL if the image is stale, invalid or kept being rewritten,
+ *	ECGOTHER if no image is published
+ */
+int cg_rules_shm_open(struct cg_rules_cache * const cache);
+
+/* Number of rules in an open cache */
+int cg_rules_cache_rule_cnt(const struct cg_rules_cache * const cache);
+
+/* The user field of the rule at index, without copying it */
+const char *cg_rules_cache_rule_username(const struct cg_rules_cache * const cache, int index);
+
+/* The process name of the rule at index, NULL if it has none */
+const char *cg_rules_cache_rule_procname(const struct cg_rules_cache * const cache, int index);
+
+/* A copy of the rule at index, its UID and GID unresolved, freed like the parsed rules */
+struct cgroup_rule *cg_rules_cache_rule(const struct cg_rules_cache * const cache, int index);
+
+/**
+ * Read a control file relative to a cgroup directory, without its trailing
+ * newline
+ *
+ * @param dir_fd Directory of the cgroup
+ * @param name Name of the control file
+ * @param value Buffer of CG_CONTROL_VALUE_MAX bytes for the value
+ * @return 0 on success, ECGROUPVALUENOTEXIST if the file can't be opened
+ */
+int cg_rd_ctrl_file_at(int dir_fd, const char *name, char *value);
+
 /**
  * Given a controller name, test if it's mounted
  *
@@ -391,6 +696,72 @@ int cgroup_copy_controller_values(struct cgroup_controller * const dst,
  */
 int cgroup_remove_value(struct cgroup_controller * const controller, const char * const name);
 
+/**
+ * Return the interned copy of a setting name. Interned names are shared by
+ * all the control values and live until the process exits.
+ *
+ * @param name The name to intern
+ * @return The interned name, NULL if it could not be allocated
+ */
+const char *cgroup_intern_name(const char * const name);
+
+/**
+ * Allocate a control value. The name is interned and the value is copied.
+ *
+ * @param name Setting name
+ * @param value Setting value, NULL for an empty value
+ * @return The new control value, NULL if it could not be allocated
+ */
+struct control_value *cgroup_alloc_value(const char * const name, const char * const value);
+
+/**
+ * Replace the value of a control value, without touching the dirty flag.
+ *
+ * @param cv Control value to update
+ * @param value New value
+ * @return 0 on success, ECGOTHER if the value could not be allocated
+ */
+int cgroup_update_value(struct control_value * const cv, const char * const value);
+
+/**
+ * Free a control value allocated by cgroup_alloc_value().
+ */
+void cgroup_free_value(struct control_value *value);
+
+/**
+ * Append a control value to a controller, growing the values vector as
+ * needed. The controller takes the ownership of the value.
+ *
+ * @return 0 on success, ECGOTHER if the vector could not be grown
+ */
+int cgroup_append_value(struct cgroup_controller * const controller,
+			struct control_value * const cv);
+
+/**
+ * Find a value of a controller by name.
+ *
+ * @param controller Controller to search
+ * @param name Setting name
+ * @return The index of the value in controller->values[], -1 if not found
+ */
+int cgroup_find_value(const struct cgroup_controller * const controller,
+		      const char * const name);
+
+/**
+ * Rebuild the name index of a controller. Must be called after reordering
+ * controller->values[] directly.
+ */
+void cgroup_reindex_values(struct cgroup_controller * const controller);
+
+/**
+ * Append a controller to a cgroup, growing the controller vector as
+ * needed. The cgroup takes the ownership of the controller.
+ *
+ * @return 0 on success, ECGOTHER if the vector could not be grown
+ */
+int cgroup_append_controller(struct cgroup * const cgroup,
+			     struct cgroup_controller * const controller);
+
 /**
  * Free the specified controller from the group.
  * @param ctrl
@@ -425,6 +796,28 @@ int cgroupv2_subtree_control(const char *path, const char *ctrl_name, bool enabl
 int cgroupv2_get_subtree_control(const char *path,  const char *ctrl_name, bool * const enabled);
 int cgroupv2_controller_enabled(const char * const cg_name, const char * const ctrl_name);
 int get_next_rule_field(char *rule, char *field, size_t field_len, bool expect_quotes);
+int cgroup_build_rule_index(const struct cgroup_rule_list * const lst,
+			    struct cgroup_rule_index * const idx);
+void cgroup_free_rule_index(struct cgroup_rule_index * const idx);
+struct cgroup_rule *cgroup_find_rule_in_index(const struct cgroup_rule_index * const idx,
+					      uid_t uid, gid_t gid, pid_t pid,
+					      const char *procname, const char *base);
+struct cgroup_rule *cgroup_find_rule_in_list(struct cgroup_rule *rule, uid_t uid, gid_t gid,
+					     pid_t pid, const char *procname, const char *base);
+
+int cgroup_config_group_parents(const struct cgroup * const groups, int cnt,
+				int * const parents);
+int cgroup_config_create_groups(struct cgroup * const groups, int cnt, int jobs);
+
+extern struct cgroup_rule_list rl;
+
+int cg_batch_apply(struct cg_batch * const batch, int flags);
+int cg_sweep_match(const pid_t * const pids, int pid_cnt, int threads,
+		   struct cg_batch * const batch, struct cgroup_sweep_stats * const stats);
+
+extern struct cg_attach_stats cg_attach_stats;
+
+extern int cg_clone3_unsupported;
 
 #endif /* UNIT_TEST */
 
@@ -135,4 +135,10 @@ cdef extern from "libcgroup.h":
 
     int cgroup_attach_thread_tid(cgroup * cgroup, pid_t tid)
 
+    cdef enum cgroup_attach_flags:
+        CGROUP_ATTACH_PROCS
+
+    int cgroup_attach_tasks(cgroup *cgroup, const pid_t *pids, size_t n, int flags,
+                            int *per_pid_err)
+
 # vim: set et ts=4 sw=4:
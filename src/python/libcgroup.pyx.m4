@@ -61,7 +61,7 @@ class Controller:
     def __init__(self, name):
         self.name = name
         # self.settings maps to
-        # struct control_value *values[CG_NV_MAX];
+        # struct control_value **values;
         self.settings = dict()
 
     def __str__(self):
@@ -502,6 +502,63 @@ cdef class Cgroup:
         if ret is not 0:
             raise RuntimeError("cgroup_attach_task failed: {}".`format'(ret))
 
+    def attach_tasks(self, pids, root_cgroup=False, attach_procs=False):
+        """Attach a list of processes to a cgroup
+
+        Arguments:
+        pids - list of the pids to be attached
+        root_cgroup - if True, then the pids will be attached to the root cgroup
+        attach_procs - if True, the pids will be written in cgroup.procs and
+                       all their threads moved
+
+        Return:
+        Returns a dictionary of the pids that couldn't be attached, with
+        the errno of their failure
+
+        Description:
+        Invokes the libcgroup C function, cgroup_attach_tasks().  The
+        cgroup files are opened once for all the pids.
+
+        Note:
+        * Writes to the cgroup sysfs
+        """
+        cdef pid_t *c_pids
+        cdef int *c_errs
+        cdef int flags = 0
+
+        failed = dict()
+        cnt = `len'(pids)
+
+        c_pids = <pid_t *>malloc(max(cnt, 1) * sizeof(pid_t))
+        c_errs = <int *>malloc(max(cnt, 1) * sizeof(int))
+        if c_pids is NULL or c_errs is NULL:
+            free(c_pids)
+            free(c_errs)
+            raise MemoryError()
+
+        for i in range(0, cnt):
+            c_pids[i] = pids[i]
+
+        if attach_procs:
+            flags = cgroup.CGROUP_ATTACH_PROCS
+
+        if root_cgroup:
+            ret = cgroup.cgroup_attach_tasks(NULL, c_pids, cnt, flags, c_errs)
+        else:
+            ret = cgroup.cgroup_attach_tasks(self._cgp, c_pids, cnt, flags, c_errs)
+
+        for i in range(0, cnt):
+            if c_errs[i] != 0:
+                failed[pids[i]] = c_errs[i]
+
+        free(c_pids)
+        free(c_errs)
+
+        if ret is not 0 and `len'(failed) == 0:
+            raise RuntimeError("cgroup_attach_tasks failed: {}".`format'(ret))
+
+        return failed
+
     def set_uid_gid(self, tasks_uid, tasks_gid, ctrl_uid, ctrl_gid):
         """Set the desired owning uid/gid for the tasks file and the entire cgroup hierarchy
 
@@ -0,0 +1,868 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/**
+ * Compiled cache of the cgrules configuration files
+ *
+ * The rules parsed from CGRULES_CONF_FILE and CGRULES_CONF_DIR are written
+ * to a file that is mapped read-only by the processes looking up a rule,
+ * instead of parsing the configuration again.  The file records the device,
+ * inode, size and times of the configuration files, a cache that doesn't
+ * match them anymore is not used.  The user and group names of the rules are
+ * cached as written, the rules of the names that don't exist included, and
+ * resolved through NSS when the cache is loaded, so the cache doesn't depend
+ * on where the users and groups come from.
+ *
+ * The file is in the native byte order: a header, the source files, the
+ * rules and a pool of NUL terminated strings the other parts point into.
+ *
+ * cgrulesengd also publishes the image of the rules it loaded in the shared
+ * memory segment CGRULES_SHM_NAME, so that the short-lived processes don't
+ * parse them at all while the daemon runs.  The daemon rewrites the image in
+ * place under a sequence counter, odd while it writes, and a reader copies
+ * the image until it reads the same even counter before and after the copy.
+ * The copy is then checked like the file.
+ */
+
+#include <libcgroup-internal.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#define CG_RULES_CACHE_MAGIC		"CGRULES\0"
+#define CG_RULES_CACHE_VERSION		2
+/* String offset of a NULL string */
+#define CG_RULES_CACHE_NONE		UINT32_MAX
+
+#define CG_RULES_SHM_MAGIC		"CGRULSHM"
+#define CG_RULES_SHM_VERSION		1
+/* Copies of the shared image a reader tries before it parses the files */
+#define CG_RULES_SHM_RETRIES		64
+
+struct cg_rules_cache_hdr {
+	char magic[8];
+	uint32_t version;
+	/* Size of the header and of a rule, to catch a change of layout */
+	uint32_t hdr_size;
+	uint32_t rule_size;
+	uint32_t checksum;
+	/* Size of the whole file */
+	uint64_t size;
+	uint64_t src_off;
+	uint64_t rule_off;
+	uint64_t str_off;
+	uint32_t src_cnt;
+	uint32_t rule_cnt;
+	uint32_t str_size;
+	uint32_t pad;
+};
+
+/* Header of the shared memory segment, the image of the rules follows it */
+struct cg_rules_shm_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t pad;
+	/* Odd while the image is rewritten */
+	uint64_t seq;
+	uint64_t size;
+};
+
+struct cg_rules_cache_src {
+	uint64_t dev;
+	uint64_t ino;
+	int64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	int64_t ctime_sec;
+	int64_t ctime_nsec;
+	uint32_t name;
+	/* The file didn't exist */
+	uint32_t missing;
+};
+
+struct cg_rules_cache_rule {
+	uint32_t is_ignore;
+	/* The user field as written, the names are resolved on load */
+	uint32_t username;
+	uint32_t procname;
+	uint32_t destination;
+	uint32_t controllers[MAX_MNT_ELEMENTS];
+};
+
+/* FNV-1a hash of the file after the header */
+static uint32_t cg_rules_cache_checksum(const void * const buf, size_t len)
+{
+	const unsigned char *p = buf;
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		hash = (hash ^ p[i]) * 16777619u;
+
+	return hash;
+}
+
+static void cg_rules_cache_fill_src(struct cg_rules_cache_src * const src,
+				    const struct stat * const st)
+{
+	src->dev = st->st_dev;
+	src->ino = st->st_ino;
+	src->size = st->st_size;
+	src->mtime_sec = st->st_mtim.tv_sec;
+	src->mtime_nsec = st->st_mtim.tv_nsec;
+	src->ctime_sec = st->st_ctim.tv_sec;
+	src->ctime_nsec = st->st_ctim.tv_nsec;
+}
+
+static int cg_rules_cache_add_source(struct cg_rules_cache_sources * const srcs,
+				     const char * const name)
+{
+	struct cg_rules_cache_source *src;
+	void *tmp;
+
+	tmp = realloc(srcs->src, (srcs->cnt + 1) * sizeof(*srcs->src));
+	if (!tmp) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+	srcs->src = tmp;
+
+	src = &srcs->src[srcs->cnt];
+	memset(src, 0, sizeof(*src));
+
+	src->name = strdup(name);
+	if (!src->name) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+	srcs->cnt++;
+
+	if (stat(name, &src->st)) {
+		if (errno != ENOENT) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+		src->missing = true;
+	}
+
+	return 0;
+}
+
+int cg_rules_cache_stat_sources(const char * const conf_file, const char * const conf_dir,
+				struct cg_rules_cache_sources * const srcs)
+{
+	char path[FILENAME_MAX];
+	struct dirent *item;
+	int ret;
+	DIR *d;
+
+	memset(srcs, 0, sizeof(*srcs));
+
+	ret = cg_rules_cache_add_source(srcs, conf_file);
+	if (ret)
+		goto err;
+
+	/* A file added to or removed from the directory changes its times */
+	ret = cg_rules_cache_add_source(srcs, conf_dir);
+	if (ret)
+		goto err;
+
+	d = opendir(conf_dir);
+	if (!d)
+		return 0;
+
+	/* The files cgroup_parse_rules() reads */
+	while ((item = readdir(d)) != NULL) {
+		if (item->d_type != DT_REG && item->d_type != DT_LNK)
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", conf_dir, item->d_name);
+		ret = cg_rules_cache_add_source(srcs, path);
+		if (ret)
+			break;
+	}
+	closedir(d);
+
+	if (!ret)
+		return 0;
+err:
+	cg_rules_cache_free_sources(srcs);
+
+	return ret;
+}
+
+void cg_rules_cache_free_sources(struct cg_rules_cache_sources * const srcs)
+{
+	int i;
+
+	for (i = 0; i < srcs->cnt; i++)
+		free(srcs->src[i].name);
+	free(srcs->src);
+	memset(srcs, 0, sizeof(*srcs));
+}
+
+/* The string pool of a cache being written */
+struct cg_rules_cache_pool {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+static int cg_rules_cache_pool_add(struct cg_rules_cache_pool * const pool, const char * const str,
+				   size_t len, uint32_t * const off)
+{
+	size_t size;
+	void *tmp;
+
+	if (pool->len + len + 1 >= CG_RULES_CACHE_NONE)
+		return ECGFAIL;
+
+	if (pool->len + len + 1 > pool->size) {
+		size = max(pool->size * 2, pool->len + len + 1);
+		size = max(size, (size_t)4096);
+
+		tmp = realloc(pool->buf, size);
+		if (!tmp) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+		pool->buf = tmp;
+		pool->size = size;
+	}
+
+	memcpy(pool->buf + pool->len, str, len);
+	pool->buf[pool->len + len] = '\0';
+	*off = pool->len;
+	pool->len += len + 1;
+
+	return 0;
+}
+
+static int cg_rules_cache_pool_str(struct cg_rules_cache_pool * const pool, const char * const str,
+				   uint32_t * const off)
+{
+	if (!str) {
+		*off = CG_RULES_CACHE_NONE;
+		return 0;
+	}
+
+	return cg_rules_cache_pool_add(pool, str, strlen(str), off);
+}
+
+int cg_rules_cache_build(const struct cgroup_rule_list * const lst,
+			 const struct cg_rules_cache_sources * const srcs, void ** const image,
+			 size_t * const size)
+{
+	struct cg_rules_cache_pool pool = { 0 };
+	struct cg_rules_cache_rule *rules = NULL;
+	struct cg_rules_cache_src *src = NULL;
+	struct cg_rules_cache_hdr hdr = { 0 };
+	const struct cgroup_rule *rule;
+	int rule_cnt = 0;
+	int ret = 0;
+	size_t off;
+	int i, j;
+	char *buf;
+
+	for (rule = lst->head; rule; rule = rule->next)
+		rule_cnt++;
+
+	src = calloc(srcs->cnt + 1, sizeof(*src));
+	rules = calloc(rule_cnt + 1, sizeof(*rules));
+	if (!src || !rules) {
+		last_errno = errno;
+		ret = ECGOTHER;
+		goto out;
+	}
+
+	for (i = 0; i < srcs->cnt; i++) {
+		ret = cg_rules_cache_pool_str(&pool, srcs->src[i].name, &src[i].name);
+		if (ret)
+			goto out;
+
+		src[i].missing = srcs->src[i].missing;
+		if (!src[i].missing)
+			cg_rules_cache_fill_src(&src[i], &srcs->src[i].st);
+	}
+
+	for (i = 0, rule = lst->head; rule; i++, rule = rule->next) {
+		rules[i].is_ignore = rule->is_ignore;
+
+		ret = cg_rules_cache_pool_str(&pool, rule->username, &rules[i].username);
+		if (!ret)
+			ret = cg_rules_cache_pool_str(&pool, rule->procname, &rules[i].procname);
+		if (!ret)
+			ret = cg_rules_cache_pool_str(&pool, rule->destination,
+						      &rules[i].destination);
+
+		for (j = 0; !ret && j < MAX_MNT_ELEMENTS; j++)
+			ret = cg_rules_cache_pool_str(&pool, rule->controllers[j],
+						      &rules[i].controllers[j]);
+		if (ret)
+			goto out;
+	}
+
+	memcpy(hdr.magic, CG_RULES_CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.version = CG_RULES_CACHE_VERSION;
+	hdr.hdr_size = sizeof(hdr);
+	hdr.rule_size = sizeof(*rules);
+	hdr.src_off = sizeof(hdr);
+	hdr.src_cnt = srcs->cnt;
+	hdr.rule_off = hdr.src_off + srcs->cnt * sizeof(*src);
+	hdr.rule_cnt = rule_cnt;
+	hdr.str_off = hdr.rule_off + rule_cnt * sizeof(*rules);
+	hdr.str_size = pool.len;
+	hdr.size = hdr.str_off + pool.len;
+
+	buf = malloc(hdr.size);
+	if (!buf) {
+		last_errno = errno;
+		ret = ECGOTHER;
+		goto out;
+	}
+
+	off = sizeof(hdr);
+	memcpy(buf + off, src, srcs->cnt * sizeof(*src));
+	off += srcs->cnt * sizeof(*src);
+	memcpy(buf + off, rules, rule_cnt * sizeof(*rules));
+	off += rule_cnt * sizeof(*rules);
+	memcpy(buf + off, pool.buf, pool.len);
+
+	hdr.checksum = cg_rules_cache_checksum(buf + sizeof(hdr), hdr.size - sizeof(hdr));
+	memcpy(buf, &hdr, sizeof(hdr));
+
+	*image = buf;
+	*size = hdr.size;
+
+out:
+	free(pool.buf);
+	free(rules);
+	free(src);
+
+	return ret;
+}
+
+int cg_rules_cache_write(const char * const path, const void * const image, size_t size)
+{
+	char tmp_path[FILENAME_MAX];
+	char dir_path[FILENAME_MAX];
+	size_t off;
+	int ret;
+	int fd;
+
+	snprintf(dir_path, sizeof(dir_path), "%s", path);
+	if (mkdir(dirname(dir_path), 0755) && errno != EEXIST)
+		cgroup_dbg("cannot create the directory of %s: %s\n", path, strerror(errno));
+
+	/* The readers map either the old file or the new one, never a partial one */
+	snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+	fd = mkstemp(tmp_path);
+	if (fd < 0) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+
+	ret = 0;
+	for (off = 0; off < size; ) {
+		ssize_t len = write(fd, (const char *)image + off, size - off);
+
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			last_errno = errno;
+			ret = ECGOTHER;
+			break;
+		}
+		off += len;
+	}
+
+	if (!ret && (fchmod(fd, 0644) || fsync(fd))) {
+		last_errno = errno;
+		ret = ECGOTHER;
+	}
+	close(fd);
+
+	if (!ret && rename(tmp_path, path)) {
+		last_errno = errno;
+		ret = ECGOTHER;
+	}
+	if (ret)
+		unlink(tmp_path);
+	else
+		cgroup_dbg("wrote %s\n", path);
+
+	return ret;
+}
+
+static const char *cg_rules_cache_str(const struct cg_rules_cache * const cache, uint32_t off)
+{
+	if (off == CG_RULES_CACHE_NONE)
+		return NULL;
+
+	return cache->strs + off;
+}
+
+/* Whether a source file is still the one the cache was built from */
+static bool cg_rules_cache_src_valid(const struct cg_rules_cache * const cache,
+				     const struct cg_rules_cache_src * const src)
+{
+	struct cg_rules_cache_src cur = { 0 };
+	struct stat st;
+
+	if (stat(cg_rules_cache_str(cache, src->name), &st))
+		return src->missing && errno == ENOENT;
+	if (src->missing)
+		return false;
+
+	cg_rules_cache_fill_src(&cur, &st);
+
+	return cur.dev == src->dev && cur.ino == src->ino && cur.size == src->size &&
+	       cur.mtime_sec == src->mtime_sec && cur.mtime_nsec == src->mtime_nsec &&
+	       cur.ctime_sec == src->ctime_sec && cur.ctime_nsec == src->ctime_nsec;
+}
+
+static bool cg_rules_cache_str_valid(const struct cg_rules_cache * const cache, uint32_t off,
+				     bool none)
+{
+	if (off == CG_RULES_CACHE_NONE)
+		return none;
+
+	return off < cache->hdr->str_size;
+}
+
+/* Check the layout of a mapped cache, any offset in it is then in bounds */
+static bool cg_rules_cache_valid(const struct cg_rules_cache * const cache)
+{
+	const struct cg_rules_cache_hdr *hdr = cache->hdr;
+	const struct cg_rules_cache_rule *rule;
+	int i, j;
+
+	if (cache->size < sizeof(*hdr) || memcmp(hdr->magic, CG_RULES_CACHE_MAGIC,
+						  sizeof(hdr->magic)))
+		return false;
+
+	if (hdr->version != CG_RULES_CACHE_VERSION || hdr->hdr_size != sizeof(*hdr) ||
+	    hdr->rule_size != sizeof(*rule) || hdr->size != cache->size)
+		return false;
+
+	if (hdr->src_off != sizeof(*hdr) ||
+	    hdr->rule_off != hdr->src_off + (uint64_t)hdr->src_cnt * sizeof(*cache->srcs) ||
+	    hdr->str_off != hdr->rule_off + (uint64_t)hdr->rule_cnt * sizeof(*rule) ||
+	    hdr->size != hdr->str_off + hdr->str_size)
+		return false;
+
+	/* The last string of the pool is terminated */
+	if (hdr->str_size && cache->strs[hdr->str_size - 1] != '\0')
+		return false;
+
+	if (cg_rules_cache_checksum((const char *)cache->map + sizeof(*hdr),
+				    cache->size - sizeof(*hdr)) != hdr->checksum)
+		return false;
+
+	for (i = 0; i < (int)hdr->src_cnt; i++) {
+		if (!cg_rules_cache_str_valid(cache, cache->srcs[i].name, false))
+			return false;
+	}
+
+	for (i = 0; i < (int)hdr->rule_cnt; i++) {
+		rule = &cache->rules[i];
+
+		if (!cg_rules_cache_str_valid(cache, rule->username, false) ||
+		    !cg_rules_cache_str_valid(cache, rule->procname, true) ||
+		    !cg_rules_cache_str_valid(cache, rule->destination, false))
+			return false;
+
+		for (j = 0; j < MAX_MNT_ELEMENTS; j++) {
+			if (!cg_rules_cache_str_valid(cache, rule->controllers[j], true))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+/* Point the cache at the parts of its image and check it is still up to date */
+static int cg_rules_cache_load(struct cg_rules_cache * const cache, const char * const name)
+{
+	int i;
+
+	if (cache->size < sizeof(*cache->hdr)) {
+		cgroup_dbg("ignoring %s: invalid cache\n", name);
+		return ECGFAIL;
+	}
+
+	cache->hdr = cache->map;
+	cache->srcs = (const void *)((const char *)cache->map + cache->hdr->src_off);
+	cache->rules = (const void *)((const char *)cache->map + cache->hdr->rule_off);
+	cache->strs = (const char *)cache->map + cache->hdr->str_off;
+
+	if (!cg_rules_cache_valid(cache)) {
+		cgroup_dbg("ignoring %s: invalid cache\n", name);
+		return ECGFAIL;
+	}
+
+	for (i = 0; i < (int)cache->hdr->src_cnt; i++) {
+		if (!cg_rules_cache_src_valid(cache, &cache->srcs[i])) {
+			cgroup_dbg("ignoring %s: %s changed\n", name,
+				   cg_rules_cache_str(cache, cache->srcs[i].name));
+			return ECGFAIL;
+		}
+	}
+
+	return 0;
+}
+
+int cg_rules_cache_open(const char * const path, struct cg_rules_cache * const cache)
+{
+	struct stat st;
+	int ret = 0;
+	int fd;
+
+	memset(cache, 0, sizeof(*cache));
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+
+	if (fstat(fd, &st)) {
+		last_errno = errno;
+		ret = ECGOTHER;
+		goto out;
+	}
+
+	/* The rules decide where the processes of every user go */
+	if ((st.st_uid != 0 && st.st_uid != geteuid()) || (st.st_mode & (S_IWGRP | S_IWOTH)) ||
+	    !S_ISREG(st.st_mode) || st.st_size == 0) {
+		cgroup_dbg("ignoring %s: not a regular file owned by root\n", path);
+		ret = ECGFAIL;
+		goto out;
+	}
+
+	cache->size = st.st_size;
+	cache->map = mmap(NULL, cache->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (cache->map == MAP_FAILED) {
+		last_errno = errno;
+		cache->map = NULL;
+		ret = ECGOTHER;
+		goto out;
+	}
+
+	ret = cg_rules_cache_load(cache, path);
+
+out:
+	close(fd);
+	if (ret)
+		cg_rules_cache_close(cache);
+
+	return ret;
+}
+
+void cg_rules_cache_close(struct cg_rules_cache * const cache)
+{
+	if (cache->copy)
+		free(cache->map);
+	else if (cache->map)
+		munmap(cache->map, cache->size);
+	memset(cache, 0, sizeof(*cache));
+}
+
+int cg_rules_cache_rule_cnt(const struct cg_rules_cache * const cache)
+{
+	return cache->hdr->rule_cnt;
+}
+
+const char *cg_rules_cache_rule_username(const struct cg_rules_cache * const cache, int index)
+{
+	return cg_rules_cache_str(cache, cache->rules[index].username);
+}
+
+const char *cg_rules_cache_rule_procname(const struct cg_rules_cache * const cache, int index)
+{
+	return cg_rules_cache_str(cache, cache->rules[index].procname);
+}
+
+struct cgroup_rule *cg_rules_cache_rule(const struct cg_rules_cache * const cache, int index)
+{
+	const struct cg_rules_cache_rule *crule = &cache->rules[index];
+	struct cgroup_rule *rule;
+	const char *str;
+	int i;
+
+	rule = calloc(1, sizeof(*rule));
+	if (!rule) {
+		last_errno = errno;
+		return NULL;
+	}
+
+	rule->uid = CGRULE_INVALID;
+	rule->gid = CGRULE_INVALID;
+	rule->is_ignore = crule->is_ignore;
+	snprintf(rule->username, sizeof(rule->username), "%s",
+		 cg_rules_cache_str(cache, crule->username));
+	snprintf(rule->destination, sizeof(rule->destination), "%s",
+		 cg_rules_cache_str(cache, crule->destination));
+
+	str = cg_rules_cache_str(cache, crule->procname);
+	if (str) {
+		rule->procname = strdup(str);
+		if (!rule->procname)
+			goto err;
+	}
+
+	for (i = 0; i < MAX_MNT_ELEMENTS; i++) {
+		str = cg_rules_cache_str(cache, crule->controllers[i]);
+		if (!str)
+			break;
+
+		rule->controllers[i] = strdup(str);
+		if (!rule->controllers[i])
+			goto err;
+	}
+
+	return rule;
+
+err:
+	last_errno = errno;
+	for (i = 0; i < MAX_MNT_ELEMENTS; i++)
+		free(rule->controllers[i]);
+	free(rule->procname);
+	free(rule);
+
+	return NULL;
+}
+
+/* The segment published by this process, serialized by the caller */
+static int cg_rules_shm_fd = -1;
+static void *cg_rules_shm_map;
+static size_t cg_rules_shm_len;
+
+static int cg_rules_shm_create(void)
+{
+	int fd;
+
+	fd = shm_open(CGRULES_SHM_NAME, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd < 0 && errno == EEXIST) {
+		/* Left by a daemon that didn't exit cleanly, or not ours at all */
+		shm_unlink(CGRULES_SHM_NAME);
+		fd = shm_open(CGRULES_SHM_NAME, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	}
+	if (fd < 0) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+
+	/* Regardless of the umask */
+	if (fchmod(fd, 0644)) {
+		last_errno = errno;
+		close(fd);
+		shm_unlink(CGRULES_SHM_NAME);
+		return ECGOTHER;
+	}
+
+	cg_rules_shm_fd = fd;
+
+	return 0;
+}
+
+/* Grow the segment to hold len bytes; the readers remap it when they see it grew */
+static int cg_rules_shm_grow(size_t len)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	void *map;
+
+	len = (len * 2 + page_size - 1) & ~(page_size - 1);
+
+	if (ftruncate(cg_rules_shm_fd, len)) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, cg_rules_shm_fd, 0);
+	if (map == MAP_FAILED) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+
+	if (cg_rules_shm_map)
+		munmap(cg_rules_shm_map, cg_rules_shm_len);
+	cg_rules_shm_map = map;
+	cg_rules_shm_len = len;
+
+	return 0;
+}
+
+int cg_rules_shm_publish(const void * const image, size_t size)
+{
+	struct cg_rules_shm_hdr *hdr;
+	uint64_t seq;
+	int ret;
+
+	if (cg_rules_shm_fd < 0) {
+		ret = cg_rules_shm_create();
+		if (ret)
+			return ret;
+	}
+
+	if (sizeof(*hdr) + size > cg_rules_shm_len) {
+		hdr = cg_rules_shm_map;
+		/* Make the readers of the old size retry before it grows */
+		if (hdr)
+			__atomic_store_n(&hdr->seq, hdr->seq + 1, __ATOMIC_RELAXED);
+
+		ret = cg_rules_shm_grow(sizeof(*hdr) + size);
+		if (ret) {
+			cg_rules_shm_unpublish();
+			return ret;
+		}
+	}
+
+	hdr = cg_rules_shm_map;
+	seq = hdr->seq | 1;
+
+	__atomic_store_n(&hdr->seq, seq, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	memcpy(hdr->magic, CG_RULES_SHM_MAGIC, sizeof(hdr->magic));
+	hdr->version = CG_RULES_SHM_VERSION;
+	hdr->size = size;
+	memcpy(hdr + 1, image, size);
+
+	__atomic_store_n(&hdr->seq, seq + 1, __ATOMIC_RELEASE);
+
+	cgroup_dbg("published %zu bytes of rules in %s\n", size, CGRULES_SHM_NAME);
+
+	return 0;
+}
+
+void cg_rules_shm_unpublish(void)
+{
+	if (cg_rules_shm_fd < 0)
+		return;
+
+	shm_unlink(CGRULES_SHM_NAME);
+	if (cg_rules_shm_map)
+		munmap(cg_rules_shm_map, cg_rules_shm_len);
+	close(cg_rules_shm_fd);
+
+	cg_rules_shm_fd = -1;
+	cg_rules_shm_map = NULL;
+	cg_rules_shm_len = 0;
+}
+
+bool cg_rules_shm_published(void)
+{
+	int fd;
+
+	fd = shm_open(CGRULES_SHM_NAME, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0)
+		return false;
+	close(fd);
+
+	return true;
+}
+
+/* Copy a consistent image out of a segment mapped len bytes long */
+static int cg_rules_shm_copy(const struct cg_rules_shm_hdr * const hdr, size_t len,
+			     struct cg_rules_cache * const cache)
+{
+	uint64_t seq, size;
+
+	seq = __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE);
+	if (seq & 1)
+		return ECGFAIL;
+
+	size = hdr->size;
+	if (memcmp(hdr->magic, CG_RULES_SHM_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != CG_RULES_SHM_VERSION || size > len - sizeof(*hdr))
+		goto retry;
+
+	cache->map = malloc(size ? size : 1);
+	if (!cache->map) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+	memcpy(cache->map, hdr + 1, size);
+	cache->size = size;
+	cache->copy = true;
+
+retry:
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&hdr->seq, __ATOMIC_RELAXED) == seq && cache->map)
+		return 0;
+
+	cg_rules_cache_close(cache);
+
+	return ECGFAIL;
+}
+
+int cg_rules_shm_open(struct cg_rules_cache * const cache)
+{
+	void *map = NULL;
+	size_t len = 0;
+	struct stat st;
+	int ret = 0;
+	int fd, i;
+
+	memset(cache, 0, sizeof(*cache));
+
+	fd = shm_open(CGRULES_SHM_NAME, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+
+	for (i = 0; i < CG_RULES_SHM_RETRIES; i++) {
+		if (fstat(fd, &st)) {
+			last_errno = errno;
+			ret = ECGOTHER;
+			break;
+		}
+
+		/* Published by root, like the cache file */
+		if (st.st_uid != 0 || (st.st_mode & (S_IWGRP | S_IWOTH)) ||
+		    st.st_size < (off_t)sizeof(struct cg_rules_shm_hdr)) {
+			cgroup_dbg("ignoring %s: not published by root\n", CGRULES_SHM_NAME);
+			ret = ECGFAIL;
+			break;
+		}
+
+		/* The daemon grew the segment */
+		if ((size_t)st.st_size != len) {
+			if (map)
+				munmap(map, len);
+			len = st.st_size;
+			map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+			if (map == MAP_FAILED) {
+				last_errno = errno;
+				map = NULL;
+				ret = ECGOTHER;
+				break;
+			}
+		}
+
+		ret = cg_rules_shm_copy(map, len, cache);
+		if (ret != ECGFAIL)
+			break;
+
+		sched_yield();
+	}
+
+	if (map)
+		munmap(map, len);
+	close(fd);
+
+	if (!ret)
+		ret = cg_rules_cache_load(cache, CGRULES_SHM_NAME);
+	if (ret)
+		cg_rules_cache_close(cache);
+
+	return ret;
+}
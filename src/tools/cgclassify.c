@@ -52,12 +52,19 @@ static void usage(int status, const char *program_name)
 
 	info("Usage: %s [[-g] <controllers>:<path>] ", program_name);
 	info("[--sticky | --cancel-sticky] <list of pids>\n");
+	info("       %s [[-g] <controllers>:<path>] [--sticky | --cancel-sticky] ", program_name);
+	info("--batch <list of pids>\n");
+	info("       %s --all\n", program_name);
 	info("Move running task(s) to given cgroups\n");
 	info("  -h, --help			Display this help\n");
 	info("  -g <controllers>:<path>	Control group to be used as target\n");
 	info("  --cancel-sticky		cgred daemon change pidlist and children tasks\n");
 	info("  --sticky			cgred daemon does not change ");
 	info("pidlist and children tasks\n");
+	info("  --batch			Parse the rules once, or open the ");
+	info("target cgroup once, and move the tasks to each cgroup together\n");
+	info("  --all				Move all the running tasks as per ");
+	info("the rules, implies --batch\n");
 #ifdef WITH_SYSTEMD
 	info("  -b				Ignore default systemd delegate hierarchy\n");
 	info("  -r				Replace the default idle_thread spawned ");
@@ -88,6 +95,68 @@ static int change_group_path(pid_t pid, struct cgroup_group_spec *cgrp_list[])
 	return 0;
 }
 
+/*
+ * Change the group of the pids as specified on command line, all of them at
+ * once: the files of each group are opened once and the whole processes are
+ * moved.
+ */
+static int change_group_path_batch(pid_t *pids, int pid_cnt,
+				   struct cgroup_group_spec *cgrp_list[])
+{
+	struct cgroup *cgrp;
+	int error, i, j;
+	int *pid_errs;
+	int ret = 0;
+
+	pid_errs = calloc(pid_cnt, sizeof(*pid_errs));
+	if (!pid_errs) {
+		err("Error: out of memory\n");
+		return -1;
+	}
+
+	for (i = 0; i < CG_HIER_MAX; i++) {
+		if (!cgrp_list[i])
+			break;
+
+		cgrp = cgroup_new_cgroup(cgrp_list[i]->path);
+		if (!cgrp) {
+			err("Error: can't create cgroup %s\n", cgrp_list[i]->path);
+			ret = -1;
+			continue;
+		}
+
+		error = 0;
+		for (j = 0; !error && cgrp_list[i]->controllers[j]; j++) {
+			/* "*" means all the mounted controllers */
+			if (strcmp(cgrp_list[i]->controllers[j], "*") == 0)
+				error = cgroup_add_all_controllers(cgrp);
+			else if (!cgroup_add_controller(cgrp, cgrp_list[i]->controllers[j]))
+				error = ECGROUPNOTALLOWED;
+		}
+
+		if (!error)
+			error = cgroup_attach_tasks(cgrp, pids, pid_cnt, CGROUP_ATTACH_PROCS,
+						    pid_errs);
+		cgroup_free(&cgrp);
+		if (!error)
+			continue;
+
+		ret = -1;
+		for (j = 0; error == ECGOTHER && j < pid_cnt; j++) {
+			if (pid_errs[j])
+				err("Error changing group of pid %d: %s\n", pids[j],
+				    strerror(pid_errs[j]));
+		}
+		if (error != ECGOTHER)
+			err("Error changing group to %s: %s\n", cgrp_list[i]->path,
+			    cgroup_strerror(error));
+	}
+
+	free(pid_errs);
+
+	return ret;
+}
+
 /*
  * Change process group as specified in cgrules.conf.
  */
@@ -99,14 +168,9 @@ static int change_group_based_on_rule(pid_t pid)
 	gid_t egid;
 
 	/* Put pid into right cgroup as per rules in /etc/cgrules.conf */
-	if (cgroup_get_uid_gid_from_procfs(pid, &euid, &egid)) {
-		err("Error in determining euid/egid of pid %d\n", pid);
-		goto out;
-	}
-
-	ret = cgroup_get_procname_from_procfs(pid, &procname);
+	ret = cgroup_get_proc_identity(pid, &euid, &egid, &procname);
 	if (ret) {
-		err("Error in determining process name of pid %d\n", pid);
+		err("Error in determining euid/egid and process name of pid %d\n", pid);
 		goto out;
 	}
 
@@ -125,9 +189,28 @@ out:
 	return ret;
 }
 
+/*
+ * Change the groups of the pids as specified in cgrules.conf, all of them at
+ * once, or of all the running processes when pids is NULL.
+ */
+static int change_group_batch(pid_t *pids, int pid_cnt)
+{
+	int ret;
+
+	ret = cgroup_change_cgroups_batch(pids, pid_cnt, 0);
+	if (ret) {
+		err("Error: change of cgroups failed: %s\n", cgroup_strerror(ret));
+		return -1;
+	}
+
+	return 0;
+}
+
 static struct option longopts[] = {
 	{"sticky",		no_argument, NULL, 's'},
 	{"cancel-sticky",	no_argument, NULL, 'u'},
+	{"batch",		no_argument, NULL, 'B'},
+	{"all",			no_argument, NULL, 'a'},
 	{"help",		no_argument, NULL, 'h'},
 	{0, 0, 0, 0}
 };
@@ -143,8 +226,12 @@ int main(int argc, char *argv[])
 	int cgrp_specified = 0;
 	pid_t scope_pid = -1;
 	int replace_idle = 0;
+	pid_t *pids = NULL;
+	int pid_cnt = 0;
+	int batch = 0;
 	int flag = 0;
 	char *endptr;
+	int all = 0;
 	pid_t pid;
 	int c;
 
@@ -185,6 +272,13 @@ int main(int argc, char *argv[])
 		case 'u':
 			flag |= CGROUP_DAEMON_CANCEL_UNCHANGE_PROCESS;
 			break;
+		case 'B':
+			batch = 1;
+			break;
+		case 'a':
+			all = 1;
+			batch = 1;
+			break;
 		default:
 			usage(1, argv[0]);
 			exit(EXIT_BADARGS);
@@ -192,6 +286,17 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (batch && replace_idle) {
+		err("%s: --batch and --all can't be used with -r\n", argv[0]);
+		exit(EXIT_BADARGS);
+	}
+
+	if (all && (flag || cgrp_specified || optind < argc)) {
+		err("%s: --all takes no pid and can't be used with -g or the sticky options\n",
+		    argv[0]);
+		exit(EXIT_BADARGS);
+	}
+
 	/* Initialize libcg */
 	ret = cgroup_init();
 	if (ret) {
@@ -204,6 +309,17 @@ int main(int argc, char *argv[])
 		cgroup_set_default_systemd_cgroup();
 #endif
 
+	if (all)
+		return change_group_batch(NULL, 0) ? 1 : 0;
+
+	if (batch) {
+		pids = calloc(argc - optind + 1, sizeof(*pids));
+		if (!pids) {
+			err("%s: out of memory\n", argv[0]);
+			return 1;
+		}
+	}
+
 	for (i = optind; i < argc; i++) {
 		pid = (pid_t) strtol(argv[i], &endptr, 10);
 		if (endptr[0] != '\0') {
@@ -218,6 +334,12 @@ int main(int argc, char *argv[])
 		if (ret)
 			exit_code = 1;
 
+		/* The processes of a batch are moved after the loop */
+		if (batch) {
+			pids[pid_cnt++] = pid;
+			continue;
+		}
+
 		if (replace_idle && !skip_replace_idle) {
 			ret = find_scope_pid(pid, 1);
 			if (ret) {
@@ -256,6 +378,16 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (batch && pid_cnt) {
+		if (cgrp_specified)
+			ret = change_group_path_batch(pids, pid_cnt, cgrp_list);
+		else
+			ret = change_group_batch(pids, pid_cnt);
+		if (ret)
+			exit_code = 1;
+	}
+	free(pids);
+
 	return exit_code;
 
 err:
@@ -26,9 +26,26 @@
 #include <getopt.h>
 #include <stdio.h>
 #include <errno.h>
+#include <time.h>
 
 static struct cgroup_string_list cfg_files;
 
+static void print_reload_op(const struct cgroup_reload_op *op, void *arg)
+{
+	switch (op->type) {
+	case CGROUP_RELOAD_CREATE:
+		info("create %s\n", op->cgroup);
+		break;
+	case CGROUP_RELOAD_SET:
+		info("set %s:%s %s: %s -> %s\n", op->controller, op->cgroup, op->name,
+		     op->old_value ? op->old_value : "(unreadable)", op->value);
+		break;
+	case CGROUP_RELOAD_DELETE:
+		info("delete %s:%s\n", op->controller, op->cgroup);
+		break;
+	}
+}
+
 static void usage(int status, char *progname)
 {
 	if (status != 0) {
@@ -37,16 +54,25 @@ static void usage(int status, char *progname)
 	}
 
 	info("Usage: %s [-h] [-f mode] [-d mode] [-s mode] ", progname);
-	info("[-t <tuid>:<tgid>] [-a <agid>:<auid>] [-l FILE] [-L DIR] ...\n");
+	info("[-t <tuid>:<tgid>] [-a <agid>:<auid>] [-j N] [-r] [-n] [-p] ");
+	info("[-l FILE] [-L DIR] ...\n");
 	info("Parse and load the specified cgroups configuration file\n");
 	info("  -a <tuid>:<tgid>		Default owner of groups ");
 	info("files and directories\n");
 	info("  -d, --dperm=mode		Default group directory permissions\n");
 	info("  -f, --fperm=mode		Default group file permissions\n");
 	info("  -h, --help			Display this help\n");
+	info("  -j, --jobs=N			Create the groups with N threads, 0 for ");
+	info("the number of CPUs\n");
 	info("  -l, --load=FILE		Parse and load the cgroups configuration file\n");
 	info("  -L, --load-directory=DIR	Parse and load the cgroups ");
 	info("configuration files from a directory\n");
+	info("  -n, --dry-run			Print the operations of a reload ");
+	info("without doing them\n");
+	info("  -p, --prune			Delete the subgroups of the groups of ");
+	info("the files they don't define, on reload\n");
+	info("  -r, --reload			Only create the missing groups and write ");
+	info("the changed settings\n");
 	info("  -s, --tperm=mode		Default tasks file permissions\n");
 	info("  -t <tuid>:<tgid>		Default owner of the tasks file\n");
 }
@@ -62,6 +88,10 @@ int main(int argc, char *argv[])
 		{"dperm",		required_argument, NULL, 'd'},
 		{"fperm",		required_argument, NULL, 'f' },
 		{"tperm",		required_argument, NULL, 's' },
+		{"jobs",		required_argument, NULL, 'j' },
+		{"reload",		no_argument,	   NULL, 'r' },
+		{"dry-run",		no_argument,	   NULL, 'n' },
+		{"prune",		no_argument,	   NULL, 'p' },
 		{0, 0, 0, 0}
 	};
 
@@ -74,6 +104,12 @@ int main(int argc, char *argv[])
 	struct cgroup *default_cgrp = NULL;
 	int filem_change = 0;
 	int dirm_change = 0;
+	struct timespec start, end;
+	char *endptr = NULL;
+	int reload_flags = 0;
+	int reload = 0;
+	int jobs = 1;
+	int timed = 0;
 	int ret, error = 0;
 	int c, i;
 
@@ -93,7 +129,7 @@ int main(int argc, char *argv[])
 	if (error)
 		goto err;
 
-	while ((c = getopt_long(argc, argv, "hl:L:t:a:d:f:s:", options, NULL)) > 0) {
+	while ((c = getopt_long(argc, argv, "hl:L:t:a:d:f:s:j:rnp", options, NULL)) > 0) {
 		switch (c) {
 		case 'h':
 			usage(0, argv[0]);
@@ -139,6 +175,25 @@ int main(int argc, char *argv[])
 			if (error)
 				goto err;
 			break;
+		case 'j':
+			timed = 1;
+			jobs = (int)strtol(optarg, &endptr, 10);
+			if (endptr == optarg || *endptr != '\0' || jobs < 0) {
+				err("%s: invalid number of jobs: %s\n", argv[0], optarg);
+				error = EXIT_BADARGS;
+				goto err;
+			}
+			break;
+		case 'r':
+			reload = 1;
+			break;
+		case 'n':
+			reload = 1;
+			reload_flags |= CGFLAG_RELOAD_DRY_RUN;
+			break;
+		case 'p':
+			reload_flags |= CGFLAG_RELOAD_PRUNE;
+			break;
 		default:
 			usage(1, argv[0]);
 			error = EXIT_BADARGS;
@@ -152,6 +207,12 @@ int main(int argc, char *argv[])
 		goto err;
 	}
 
+	if ((reload_flags & CGFLAG_RELOAD_PRUNE) && !reload) {
+		err("%s: \"-p\" requires \"-r\" or \"-n\" to be provided\n", argv[0]);
+		error = EXIT_BADARGS;
+		goto err;
+	}
+
 	/* set default permissions */
 	default_cgrp = cgroup_new_cgroup("default");
 	if (!default_cgrp) {
@@ -176,8 +237,28 @@ int main(int argc, char *argv[])
 		goto free_cgroup;
 	}
 
+	/* The groups are pruned against all the files, they are reloaded at once */
+	if (reload) {
+		ret = cgroup_config_reload_configs((const char * const *)cfg_files.items,
+						   cfg_files.count, reload_flags,
+						   print_reload_op, NULL, &i);
+		if (ret && i >= 0)
+			err("%s; error loading %s: %s\n", argv[0], cfg_files.items[i],
+			    cgroup_strerror(ret));
+		else if (ret)
+			err("%s; error pruning the groups: %s\n", argv[0], cgroup_strerror(ret));
+		error = ret;
+		goto free_cgroup;
+	}
+
 	for (i = 0; i < cfg_files.count; i++) {
-		ret = cgroup_config_load_config(cfg_files.items[i]);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		ret = cgroup_config_load_config2(cfg_files.items[i], jobs);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if (timed)
+			info("%s: loaded %s in %.3f ms\n", argv[0], cfg_files.items[i],
+			     (end.tv_sec - start.tv_sec) * 1e3 +
+			     (end.tv_nsec - start.tv_nsec) / 1e6);
 		if (ret) {
 			err("%s; error loading %s: %s\n", argv[0], cfg_files.items[i],
 			    cgroup_strerror(ret));
@@ -37,9 +37,12 @@
 #define SYSTEMD_IDLE_THREAD	"libcgroup_systemd_idle_thread"
 
 static pid_t find_scope_pid(pid_t pid);
-static int write_systemd_unified(const char * const scope_name);
+static int write_systemd_unified(const char * const scope_name, pid_t pid);
 static int is_scope_parsed(const char * const path);
 
+/* The program run by cgexec */
+static pid_t child_pid = -1;
+
 static struct option longopts[] = {
 	{"sticky",	no_argument, NULL, 's'},
 	{"help",	no_argument, NULL, 'h'},
@@ -67,14 +70,183 @@ static void usage(int status, const char *program_name)
 #endif
 }
 
+/*
+ * Replace the idle_thread of the systemd scope the program is in with the
+ * program, before it runs
+ */
+static int replace_idle_thread(pid_t pid, void *arg)
+{
+	pid_t scope_pid;
+
+	scope_pid = find_scope_pid(pid);
+	if (scope_pid == -1)
+		return ECGFAIL;
+
+	if (kill(scope_pid, SIGTERM)) {
+		err("Failed to kill pid %u:%s\n", scope_pid, strerror(errno));
+		return ECGFAIL;
+	}
+
+	return 0;
+}
+
+/* The signals of the terminal reach the program already, it is in our process group */
+static void forward_signal(int signum, siginfo_t *info, void *ucontext)
+{
+	if (info->si_code != SI_KERNEL)
+		kill(child_pid, signum);
+}
+
+/* Wait for the program, and exit with its status */
+static int wait_child(pid_t pid)
+{
+	static const int forwarded[] = {
+		SIGTERM, SIGHUP, SIGINT, SIGQUIT, SIGUSR1, SIGUSR2, SIGTSTP, SIGCONT, SIGWINCH
+	};
+	struct sigaction sa;
+	int status, i;
+
+	child_pid = pid;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = forward_signal;
+	sa.sa_flags = SA_SIGINFO;
+	for (i = 0; i < ARRAY_SIZE(forwarded); i++)
+		sigaction(forwarded[i], &sa, NULL);
+
+	while (1) {
+		if (waitpid(pid, &status, WUNTRACED) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			err("wait for pid %u failed:%s\n", pid, strerror(errno));
+			return -1;
+		}
+
+		/* Stop with the program, SIGCONT is forwarded to it */
+		if (WIFSTOPPED(status)) {
+			raise(SIGSTOP);
+			continue;
+		}
+
+		break;
+	}
+
+	if (WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+
+	return WEXITSTATUS(status);
+}
+
+/*
+ * Run the program in a child created in its control group with
+ * CLONE_INTO_CGROUP, which is killed if cgexec is.  Returns its exit status,
+ * or ECGROUPUNSUPP if it can't be created there.
+ */
+static int spawn_program(char *argv[], struct cgroup_spawn_opts * const opts, int replace_idle)
+{
+	pid_t pid;
+	int ret;
+
+	opts->spawn_flags = CGROUP_SPAWN_CLONE_ONLY;
+	opts->pdeathsig = SIGKILL;
+	if (replace_idle)
+		opts->prepare = replace_idle_thread;
+
+	ret = cgroup_spawn(argv[0], argv, opts, &pid, NULL);
+	if (ret == ECGROUPUNSUPP)
+		return ret;
+
+	/* Like a shell that can't run the program */
+	if (ret == ECGOTHER) {
+		err("exec failed:%s\n", strerror(cgroup_get_last_errno()));
+		return 127;
+	}
+
+	if (ret) {
+		err("cgroup change of group failed\n");
+		return ret;
+	}
+
+	return wait_child(pid);
+}
+
+/* Move cgexec to the control groups of the program, and run it */
+static int exec_program(char *argv[], const struct cgroup_spawn_opts * const opts,
+			int replace_idle)
+{
+	pid_t scope_pid = -1;
+	int child_status = 0;
+	pid_t pid;
+	int i, ret;
+
+	pid = getpid();
+
+	if (opts->dests) {
+		for (i = 0; i < opts->dest_cnt; i++) {
+			ret = cgroup_change_cgroup_path(opts->dests[i].path, pid,
+							opts->dests[i].controllers);
+			if (ret) {
+				err("cgroup change of group failed\n");
+				return ret;
+			}
+		}
+	} else {
+		/* Change the cgroup by determining the rules based on uid */
+		ret = cgroup_change_cgroup_flags(opts->uid, opts->gid, argv[0], pid, 0);
+		if (ret) {
+			err("cgroup change of group failed\n");
+			return ret;
+		}
+	}
+
+	if (!replace_idle) {
+		/* Now exec the new process */
+		execvp(argv[0], argv);
+		err("exec failed:%s", strerror(errno));
+		return -1;
+	}
+
+	scope_pid = find_scope_pid(pid);
+	if (scope_pid == -1)
+		return -1;
+
+	pid = fork();
+	if (pid == -1) {
+		err("Fork failed for pid %u:%s\n", pid, strerror(errno));
+		return -1;
+	}
+
+	/* child process kills the spawned idle_thread */
+	if (pid == 0) {
+		ret = kill(scope_pid, SIGTERM);
+		if (ret) {
+			err("Failed to kill pid %u:%s\n", scope_pid, strerror(errno));
+			exit(1);
+		}
+
+		exit(0);
+	}
+
+	wait(&child_status);
+	if (WEXITSTATUS(child_status))
+		return -1;
+
+	/* Now exec the new process */
+	execvp(argv[0], argv);
+	err("exec failed:%s", strerror(errno));
+
+	return -1;
+}
+
 int main(int argc, char *argv[])
 {
 	struct cgroup_group_spec *cgrp_list[CG_HIER_MAX];
 #ifdef WITH_SYSTEMD
 	int ignore_default_systemd_delegate_slice = 0;
 #endif
-	pid_t scope_pid = -1;
-	int child_status = 0;
+	struct cgroup_spawn_dest dests[CG_HIER_MAX];
+	struct cgroup_spawn_opts opts;
 	int replace_idle = 0;
 	int cg_specified = 0;
 	int flag_child = 0;
@@ -145,7 +317,8 @@ int main(int argc, char *argv[])
 	gid = getgid();
 	pid = getpid();
 
-	ret = cgroup_register_unchanged_process(pid, flag_child);
+	/* The program is cgexec, or its next child when spawned */
+	ret = cgroup_register_unchanged_process(pid, flag_child | CGROUP_DAEMON_UNCHANGE_SPAWNED);
 	if (ret) {
 		err("registration of process failed\n");
 		return ret;
@@ -167,69 +340,33 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
+	memset(&opts, 0, sizeof(opts));
 	if (cg_specified) {
 		/*
 		 * User has specified the list of control group
 		 * and controllers
 		 */
-		for (i = 0; i < CG_HIER_MAX; i++) {
-			if (!cgrp_list[i])
-				break;
-
-			ret = cgroup_change_cgroup_path(cgrp_list[i]->path, pid,
-				(const char *const*) cgrp_list[i]->controllers);
-			if (ret) {
-				err("cgroup change of group failed\n");
-				return ret;
-			}
+		for (i = 0; i < CG_HIER_MAX && cgrp_list[i]; i++) {
+			dests[i].path = cgrp_list[i]->path;
+			dests[i].controllers = (const char * const *)cgrp_list[i]->controllers;
 		}
+		opts.dests = dests;
+		opts.dest_cnt = i;
 	} else {
-
 		/* Change the cgroup by determining the rules based on uid */
-		ret = cgroup_change_cgroup_flags(uid, gid, argv[optind], pid, 0);
-		if (ret) {
-			err("cgroup change of group failed\n");
-			return ret;
-		}
+		opts.uid = uid;
+		opts.gid = gid;
 	}
 
-	if (!replace_idle) {
-		/* Now exec the new process */
-		execvp(argv[optind], &argv[optind]);
-		err("exec failed:%s", strerror(errno));
-		return -1;
-	}
-
-	scope_pid = find_scope_pid(pid);
-	if (scope_pid == -1)
-		return -1;
-
-	pid = fork();
-	if (pid == -1) {
-		err("Fork failed for pid %u:%s\n", pid, strerror(errno));
-		return -1;
-	}
-
-	/* child process kills the spawned idle_thread */
-	if (pid == 0) {
-		ret = kill(scope_pid, SIGTERM);
-		if (ret) {
-			err("Failed to kill pid %u:%s\n", scope_pid, strerror(errno));
-			exit(1);
-		}
-
-		exit(0);
-	}
-
-	wait(&child_status);
-	if (WEXITSTATUS(child_status))
-		return -1;
-
-	/* Now exec the new process */
-	execvp(argv[optind], &argv[optind]);
-	err("exec failed:%s", strerror(errno));
+	/*
+	 * The program is created in its control group on cgroup v2, else
+	 * cgexec moves itself there and runs it
+	 */
+	ret = spawn_program(&argv[optind], &opts, replace_idle);
+	if (ret == ECGROUPUNSUPP)
+		ret = exec_program(&argv[optind], &opts, replace_idle);
 
-	return -1;
+	return ret;
 }
 
 static pid_t search_systemd_idle_thread_task(pid_t pids[], size_t size)
@@ -382,7 +519,7 @@ static pid_t find_scope_pid(pid_t pid)
 
 	/* This is true for cgroup v1 (legacy/hybrid) */
 	if (found_systemd_cgrp) {
-		ret = write_systemd_unified(scope_name);
+		ret = write_systemd_unified(scope_name, pid);
 		if (ret)
 			scope_pid = -1;
 	}
@@ -437,13 +574,12 @@ out:
 		fclose(proc_mount_f);
 }
 
-static int write_systemd_unified(const char * const scope_name)
+static int write_systemd_unified(const char * const scope_name, pid_t pid)
 {
 	char cgrp_procs_path[FILENAME_MAX * 2 + 25];
 	FILE *cgrp_systemd_path_f = NULL;
 	FILE *cgrp_unified_path_f = NULL;
 	char *cgrp_name = NULL;
-	pid_t pid;
 
 	/* construct the systemd cgroup path, by parsing /proc/mounts */
 	find_mnt_point("name=systemd ", &cgrp_name);
@@ -486,8 +622,6 @@ static int write_systemd_unified(const char * const scope_name)
 		}
 	}
 
-	pid = getpid();
-
 	fprintf(cgrp_systemd_path_f, "%d", pid);
 	fflush(cgrp_systemd_path_f);
 	fclose(cgrp_systemd_path_f);
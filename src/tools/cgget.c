@@ -564,7 +564,13 @@ static int get_cv_value(struct control_value * const cv, const char * const cgrp
 	/* remove the newline character */
 	tmp_line[strcspn(tmp_line, "\n")] = '\0';
 
-	strncpy(cv->value, tmp_line, CG_CONTROL_VALUE_MAX - 1);
+	tmp = strdup(tmp_line);
+	if (tmp == NULL)
+		goto read_end;
+
+	free(cv->value);
+	cv->value = tmp;
+
 	cv->multiline_value = strdup(cv->value);
 	if (cv->multiline_value == NULL)
 		goto read_end;
@@ -633,6 +639,7 @@ static int fill_empty_controller(struct cgroup * const cgrp, struct cgroup_contr
 #endif
 	struct dirent *ctrl_dir = NULL;
 	int i, mnt_path_len, ret = 0;
+	struct cg_dir cgrp_dir = { .fd = -1 };
 	bool found_mount = false;
 	DIR *dir = NULL;
 
@@ -691,7 +698,12 @@ static int fill_empty_controller(struct cgroup * const cgrp, struct cgroup_contr
 	if (!cg_build_path_locked(cgrp->name, cgrp_ctrl_path, cg_mount_table[i].name))
 		goto out;
 
-	dir = opendir(cgrp_ctrl_path);
+	if (cg_dir_open(&cgrp_dir, cgrp_ctrl_path)) {
+		ret = ECGOTHER;
+		goto out;
+	}
+
+	dir = cg_dir_opendir(&cgrp_dir);
 	if (!dir) {
 		ret = ECGOTHER;
 		goto out;
@@ -702,7 +714,7 @@ static int fill_empty_controller(struct cgroup * const cgrp, struct cgroup_contr
 		if (ctrl_dir->d_type != DT_REG)
 			continue;
 
-		ret = cgroup_fill_cgc(ctrl_dir, cgrp, cgc, i);
+		ret = cgroup_fill_cgc_at(&cgrp_dir, ctrl_dir, cgrp, cgc, i);
 		if (ret == ECGFAIL)
 			goto out;
 
@@ -725,6 +737,7 @@ static int fill_empty_controller(struct cgroup * const cgrp, struct cgroup_contr
 out:
 	if (dir)
 		closedir(dir);
+	cg_dir_close(&cgrp_dir);
 
 	pthread_rwlock_unlock(&cg_mount_table_lock);
 
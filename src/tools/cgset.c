@@ -374,6 +374,9 @@ STATIC int parse_r_flag(const char * const program_name, const char * const name
 	char *copy = NULL, *buf = NULL;
 	int ret = 0;
 
+	name_value->name = NULL;
+	name_value->value = NULL;
+
 	buf = strchr(name_value_str, '=');
 	if (buf == NULL) {
 		err("%s: wrong parameter of option -r: %s\n", program_name, optarg);
@@ -396,8 +399,12 @@ STATIC int parse_r_flag(const char * const program_name, const char * const name
 		goto err;
 	}
 
-	strncpy(name_value->name, buf, FILENAME_MAX);
-	name_value->name[FILENAME_MAX-1] = '\0';
+	name_value->name = strdup(buf);
+	if (name_value->name == NULL) {
+		err("%s: not enough memory\n", program_name);
+		ret = -1;
+		goto err;
+	}
 
 	buf = strchr(name_value_str, '=');
 	/*
@@ -412,13 +419,22 @@ STATIC int parse_r_flag(const char * const program_name, const char * const name
 		goto err;
 	}
 
-	strncpy(name_value->value, buf, CG_CONTROL_VALUE_MAX);
-	name_value->value[CG_CONTROL_VALUE_MAX-1] = '\0';
+	name_value->value = strdup(buf);
+	if (name_value->value == NULL) {
+		err("%s: not enough memory\n", program_name);
+		ret = -1;
+		goto err;
+	}
 
 err:
 	if (copy)
 		free(copy);
 
+	if (ret) {
+		free(name_value->name);
+		name_value->name = NULL;
+	}
+
 	return ret;
 }
 
@@ -436,8 +452,9 @@ static int add_subtree_control_name_value(struct control_value *name_value)
 		return ECGFAIL;
 	}
 
-	snprintf(cgrp_subtree_ctrl_val->name, FILENAME_MAX, "%s", name_value->name);
-	snprintf(cgrp_subtree_ctrl_val->value, CG_CONTROL_VALUE_MAX, "%s", name_value->value);
+	/* the caller clears name_value, take over its name and value */
+	cgrp_subtree_ctrl_val->name = name_value->name;
+	cgrp_subtree_ctrl_val->value = name_value->value;
 
 	return 0;
 }
@@ -457,7 +474,7 @@ int main(int argc, char *argv[])
 	struct cgroup *src_cgroup = NULL;
 
 	int ret = 0;
-	int c;
+	int c, i;
 
 	program_name = argv[0];
 
@@ -610,8 +627,20 @@ int main(int argc, char *argv[])
 err:
 	cgroup_free(&src_cgroup);
 	cgroup_free(&subtree_cgrp);
+
+	for (i = 0; i < nv_number; i++) {
+		free(name_value[i].name);
+		free(name_value[i].value);
+	}
 	free(name_value);
 
+	if (cgrp_subtree_ctrl_val) {
+		free(cgrp_subtree_ctrl_val->name);
+		free(cgrp_subtree_ctrl_val->value);
+		free(cgrp_subtree_ctrl_val);
+		cgrp_subtree_ctrl_val = NULL;
+	}
+
 	return ret;
 }
 #endif /* !UNIT_TEST */
@@ -561,7 +561,13 @@ static int get_cv_value(struct control_value * const cv, const char * const cgrp
 	/* remove the newline character */
 	tmp_line[strcspn(tmp_line, "\n")] = '\0';
 
-	strncpy(cv->value, tmp_line, CG_CONTROL_VALUE_MAX - 1);
+	tmp = strdup(tmp_line);
+	if (tmp == NULL)
+		goto read_end;
+
+	free(cv->value);
+	cv->value = tmp;
+
 	cv->multiline_value = strdup(cv->value);
 	if (cv->multiline_value == NULL)
 		goto read_end;
@@ -627,6 +633,7 @@ static int fill_empty_controller(struct cgroup * const cg, struct cgroup_control
 #endif
 	struct dirent *ctrl_dir = NULL;
 	int i, mnt_path_len, ret = 0;
+	struct cg_dir cgrp_dir = { .fd = -1 };
 	bool found_mount = false;
 	DIR *dir = NULL;
 
@@ -688,7 +695,12 @@ static int fill_empty_controller(struct cgroup * const cg, struct cgroup_control
 	if (!cg_build_path_locked(cg->name, cgrp_ctrl_path, cg_mount_table[i].name))
 		goto out;
 
-	dir = opendir(cgrp_ctrl_path);
+	if (cg_dir_open(&cgrp_dir, cgrp_ctrl_path)) {
+		ret = ECGOTHER;
+		goto out;
+	}
+
+	dir = cg_dir_opendir(&cgrp_dir);
 	if (!dir) {
 		ret = ECGOTHER;
 		goto out;
@@ -699,7 +711,7 @@ static int fill_empty_controller(struct cgroup * const cg, struct cgroup_control
 		if (ctrl_dir->d_type != DT_REG)
 			continue;
 
-		ret = cgroup_fill_cgc(ctrl_dir, cg, cgc, i);
+		ret = cgroup_fill_cgc_at(&cgrp_dir, ctrl_dir, cg, cgc, i);
 		if (ret == ECGFAIL)
 			goto out;
 
@@ -721,6 +733,7 @@ static int fill_empty_controller(struct cgroup * const cg, struct cgroup_control
 out:
 	if (dir)
 		closedir(dir);
+	cg_dir_close(&cgrp_dir);
 
 	pthread_rwlock_unlock(&cg_mount_table_lock);
 
@@ -14,6 +14,7 @@
 #include <libcgroup-internal.h>
 
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -32,6 +33,251 @@ static void init_cgroup(struct cgroup *cgroup)
 	cgroup->tasks_uid = NO_UID_GID;
 }
 
+/* Interned setting names, see cgroup_intern_name() */
+static pthread_mutex_t cg_intern_lock = PTHREAD_MUTEX_INITIALIZER;
+static const char **cg_intern_table;
+static size_t cg_intern_size;		/* power of two */
+static size_t cg_intern_cnt;
+
+static int cg_intern_grow(void)
+{
+	size_t new_size, i, slot;
+	const char **table;
+
+	new_size = cg_intern_size ? cg_intern_size * 2 : 256;
+	table = calloc(new_size, sizeof(*table));
+	if (!table)
+		return ECGOTHER;
+
+	for (i = 0; i < cg_intern_size; i++) {
+		if (!cg_intern_table[i])
+			continue;
+
+		slot = cg_hash_string(cg_intern_table[i]) & (new_size - 1);
+		while (table[slot])
+			slot = (slot + 1) & (new_size - 1);
+		table[slot] = cg_intern_table[i];
+	}
+
+	free(cg_intern_table);
+	cg_intern_table = table;
+	cg_intern_size = new_size;
+
+	return 0;
+}
+
+const char *cgroup_intern_name(const char * const name)
+{
+	const char *interned = NULL;
+	size_t slot;
+
+	pthread_mutex_lock(&cg_intern_lock);
+
+	/* keep the load factor at or below 1/2 */
+	if ((cg_intern_cnt + 1) * 2 > cg_intern_size && cg_intern_grow())
+		goto out;
+
+	slot = cg_hash_string(name) & (cg_intern_size - 1);
+	while (cg_intern_table[slot]) {
+		if (strcmp(cg_intern_table[slot], name) == 0) {
+			interned = cg_intern_table[slot];
+			goto out;
+		}
+		slot = (slot + 1) & (cg_intern_size - 1);
+	}
+
+	interned = strdup(name);
+	if (!interned) {
+		last_errno = errno;
+		goto out;
+	}
+
+	cg_intern_table[slot] = interned;
+	cg_intern_cnt++;
+
+out:
+	pthread_mutex_unlock(&cg_intern_lock);
+
+	return interned;
+}
+
+/*
+ * Make room for one more pointer in a growable vector. One extra slot is
+ * kept zeroed, so the vector stays NULL terminated.
+ */
+static int cg_vector_reserve(void ***vec, int *alloc, int used)
+{
+	int new_alloc;
+	void **tmp;
+
+	if (used + 1 < *alloc)
+		return 0;
+
+	new_alloc = *alloc ? *alloc * 2 : 8;
+	tmp = realloc(*vec, new_alloc * sizeof(void *));
+	if (!tmp) {
+		last_errno = errno;
+		return ECGOTHER;
+	}
+
+	memset(tmp + *alloc, 0, (new_alloc - *alloc) * sizeof(void *));
+	*vec = tmp;
+	*alloc = new_alloc;
+
+	return 0;
+}
+
+/* Below this many values a linear scan is cheaper than the name index */
+#define CG_VALUE_INDEX_MIN	8
+
+static void cg_value_index_insert(struct cgroup_controller * const controller, int idx)
+{
+	unsigned int mask = controller->values_hash_size - 1;
+	unsigned int slot;
+
+	slot = cg_hash_string(controller->values[idx]->name) & mask;
+	while (controller->values_hash[slot])
+		slot = (slot + 1) & mask;
+
+	controller->values_hash[slot] = idx + 1;
+}
+
+void cgroup_reindex_values(struct cgroup_controller * const controller)
+{
+	int size = controller->values_hash_size;
+	int i;
+
+	if (controller->index < CG_VALUE_INDEX_MIN) {
+		free(controller->values_hash);
+		controller->values_hash = NULL;
+		controller->values_hash_size = 0;
+		return;
+	}
+
+	/* keep the load factor at or below 1/2 */
+	if (!size || controller->index * 2 > size) {
+		for (size = 16; size < controller->index * 4; size *= 2)
+			;
+
+		free(controller->values_hash);
+		controller->values_hash = malloc(size * sizeof(int));
+		if (!controller->values_hash) {
+			/* not fatal, cgroup_find_value() falls back to a linear scan */
+			controller->values_hash_size = 0;
+			return;
+		}
+		controller->values_hash_size = size;
+	}
+
+	memset(controller->values_hash, 0, size * sizeof(int));
+	for (i = 0; i < controller->index; i++)
+		cg_value_index_insert(controller, i);
+}
+
+int cgroup_find_value(const struct cgroup_controller * const controller,
+		      const char * const name)
+{
+	unsigned int mask, slot;
+	int i;
+
+	if (!controller->values_hash_size) {
+		for (i = 0; i < controller->index; i++) {
+			if (strcmp(controller->values[i]->name, name) == 0)
+				return i;
+		}
+		return -1;
+	}
+
+	mask = controller->values_hash_size - 1;
+	slot = cg_hash_string(name) & mask;
+	while (controller->values_hash[slot]) {
+		i = controller->values_hash[slot] - 1;
+		if (strcmp(controller->values[i]->name, name) == 0)
+			return i;
+		slot = (slot + 1) & mask;
+	}
+
+	return -1;
+}
+
+int cgroup_append_value(struct cgroup_controller * const controller,
+			struct control_value * const cv)
+{
+	int ret;
+
+	ret = cg_vector_reserve((void ***)&controller->values, &controller->values_alloc,
+				controller->index);
+	if (ret)
+		return ret;
+
+	controller->values[controller->index++] = cv;
+
+	if (controller->values_hash_size && controller->index * 2 <= controller->values_hash_size)
+		cg_value_index_insert(controller, controller->index - 1);
+	else if (controller->index >= CG_VALUE_INDEX_MIN)
+		cgroup_reindex_values(controller);
+
+	return 0;
+}
+
+int cgroup_append_controller(struct cgroup * const cgroup,
+			     struct cgroup_controller * const controller)
+{
+	int ret;
+
+	ret = cg_vector_reserve((void ***)&cgroup->controller, &cgroup->controller_alloc,
+				cgroup->index);
+	if (ret)
+		return ret;
+
+	cgroup->controller[cgroup->index++] = controller;
+
+	return 0;
+}
+
+struct control_value *cgroup_alloc_value(const char * const name, const char * const value)
+{
+	struct control_value *cv;
+
+	cv = calloc(1, sizeof(struct control_value));
+	if (!cv) {
+		last_errno = errno;
+		return NULL;
+	}
+
+	/* the interned names are never modified, see struct control_value */
+	cv->name = (char *)cgroup_intern_name(name);
+	cv->value = strdup(value ? value : "");
+	if (!cv->name || !cv->value) {
+		last_errno = errno;
+		free(cv->value);
+		free(cv);
+		return NULL;
+	}
+
+	return cv;
+}
+
+int cgroup_update_value(struct control_value * const cv, const char * const value)
+{
+	size_t len = strlen(value);
+	char *tmp;
+
+	/* shrinking values are rewritten in place */
+	if (len > strlen(cv->value)) {
+		tmp = realloc(cv->value, len + 1);
+		if (!tmp) {
+			last_errno = errno;
+			return ECGOTHER;
+		}
+		cv->value = tmp;
+	}
+
+	memcpy(cv->value, value, len + 1);
+
+	return 0;
+}
+
 void init_cgroup_table(struct cgroup *cgroups, size_t count)
 {
 	size_t i;
@@ -66,10 +312,6 @@ struct cgroup_controller *cgroup_add_controller(struct cgroup *cgroup, const cha
 	if (!cgroup || !name)
 		return NULL;
 
-	/* Still not sure how to handle the failure here. */
-	if (cgroup->index >= CG_CONTROLLER_MAX)
-		return NULL;
-
 	/* Still not sure how to handle the failure here. */
 	for (i = 0; i < cgroup->index; i++) {
 		if (strncmp(name, cgroup->controller[i]->name, CONTROL_NAMELEN_MAX) == 0)
@@ -102,8 +344,10 @@ struct cgroup_controller *cgroup_add_controller(struct cgroup *cgroup, const cha
 		}
 	}
 
-	cgroup->controller[cgroup->index] = controller;
-	cgroup->index++;
+	if (cgroup_append_controller(cgroup, controller)) {
+		free(controller);
+		return NULL;
+	}
 
 	return controller;
 }
@@ -219,13 +463,15 @@ out:
 	return ret;
 }
 
-static void cgroup_free_value(struct control_value *value)
+void cgroup_free_value(struct control_value *value)
 {
 	if (value->multiline_value)
 		free(value->multiline_value);
 	if (value->prev_name)
 		free(value->prev_name);
 
+	/* value->name is interned */
+	free(value->value);
 	free(value);
 }
 
@@ -237,6 +483,8 @@ void cgroup_free_controller(struct cgroup_controller *ctrl)
 		cgroup_free_value(ctrl->values[i]);
 	ctrl->index = 0;
 
+	free(ctrl->values_hash);
+	free(ctrl->values);
 	free(ctrl);
 }
 
@@ -251,6 +499,10 @@ void cgroup_free_controllers(struct cgroup *cgroup)
 		cgroup_free_controller(cgroup->controller[i]);
 
 	cgroup->index = 0;
+
+	free(cgroup->controller);
+	cgroup->controller = NULL;
+	cgroup->controller_alloc = 0;
 }
 
 void cgroup_free(struct cgroup **cgroup)
@@ -269,42 +521,31 @@ void cgroup_free(struct cgroup **cgroup)
 int cgroup_add_value_string(struct cgroup_controller *controller, const char *name,
 			    const char *value)
 {
-	int i;
 	struct control_value *cntl_value;
 
 	if (!controller || !name)
 		return ECGINVAL;
 
-	if (controller->index >= CG_NV_MAX)
-		return ECGMAXVALUESEXCEEDED;
+	if (cgroup_find_value(controller, name) >= 0)
+		return ECGVALUEEXISTS;
 
-	for (i = 0; i < controller->index && i < CG_NV_MAX; i++) {
-		if (!strcmp(controller->values[i]->name, name))
-			return ECGVALUEEXISTS;
+	if (value && strlen(value) >= CG_CONTROL_VALUE_MAX) {
+		fprintf(stderr, "value exceeds the maximum of %d characters\n",
+			CG_CONTROL_VALUE_MAX - 1);
+		return ECGCONFIGPARSEFAIL;
 	}
 
-	cntl_value = calloc(1, sizeof(struct control_value));
+	cntl_value = cgroup_alloc_value(name, value);
 	if (!cntl_value)
 		return ECGCONTROLLERCREATEFAILED;
 
-	strncpy(cntl_value->name, name, sizeof(cntl_value->name));
-	cntl_value->name[sizeof(cntl_value->name)-1] = '\0';
-
-	if (value) {
-		if (strlen(value) >= sizeof(cntl_value->value)) {
-			fprintf(stderr, "value exceeds the maximum of %ld characters\n",
-				sizeof(cntl_value->value) - 1);
-			free(cntl_value);
-			return ECGCONFIGPARSEFAIL;
-		}
-
-		strncpy(cntl_value->value, value, sizeof(cntl_value->value));
-		cntl_value->value[sizeof(cntl_value->value)-1] = '\0';
+	if (value)
 		cntl_value->dirty = true;
-	}
 
-	controller->values[controller->index] = cntl_value;
-	controller->index++;
+	if (cgroup_append_value(controller, cntl_value)) {
+		cgroup_free_value(cntl_value);
+		return ECGCONTROLLERCREATEFAILED;
+	}
 
 	return 0;
 }
@@ -368,23 +609,27 @@ int cgroup_remove_value(struct cgroup_controller * const controller, const char
 {
 	int i;
 
-	for (i = 0; i < controller->index; i++) {
-		if (strcmp(controller->values[i]->name, name) == 0) {
-			cgroup_free_value(controller->values[i]);
-
-			if (i == (controller->index - 1)) {
-				/* This is the last entry in the table. There's nothing to move */
-				controller->index--;
-			} else {
-				memmove(&controller->values[i],	&controller->values[i + 1],
-				sizeof(struct control_value *) * (controller->index - i - 1));
-				controller->index--;
-			}
-			return 0;
-		}
+	i = cgroup_find_value(controller, name);
+	if (i < 0)
+		return ECGROUPNOTEXIST;
+
+	cgroup_free_value(controller->values[i]);
+
+	if (i == (controller->index - 1)) {
+		/* This is the last entry in the table. There's nothing to move */
+		controller->index--;
+	} else {
+		memmove(&controller->values[i],	&controller->values[i + 1],
+			sizeof(struct control_value *) * (controller->index - i - 1));
+		controller->index--;
 	}
+	controller->values[controller->index] = NULL;
+
+	/* the following values moved, their slots are stale */
+	if (controller->values_hash_size)
+		cgroup_reindex_values(controller);
 
-	return ECGROUPNOTEXIST;
+	return 0;
 }
 
 int cgroup_compare_controllers(struct cgroup_controller *cgca, struct cgroup_controller *cgcb)
@@ -404,7 +649,8 @@ int cgroup_compare_controllers(struct cgroup_controller *cgca, struct cgroup_con
 		struct control_value *cva = cgca->values[i];
 		struct control_value *cvb = cgcb->values[i];
 
-		if (strcmp(cva->name, cvb->name))
+		/* interned names, equal names are the same pointer */
+		if (cva->name != cvb->name && strcmp(cva->name, cvb->name))
 			return ECGCONTROLLERNOTEQUAL;
 
 		if (strcmp(cva->value, cvb->value))
@@ -516,20 +762,15 @@ int cgroup_get_value_string(struct cgroup_controller *controller, const char *na
 	if (!controller || !name || !value)
 		return ECGINVAL;
 
-	for (i = 0; i < controller->index; i++) {
-		struct control_value *val = controller->values[i];
-
-		if (!strcmp(val->name, name)) {
-			*value = strdup(val->value);
-
-			if (!*value)
-				return ECGOTHER;
+	i = cgroup_find_value(controller, name);
+	if (i < 0)
+		return ECGROUPVALUENOTEXIST;
 
-			return 0;
-		}
-	}
+	*value = strdup(controller->values[i]->value);
+	if (!*value)
+		return ECGOTHER;
 
-	return ECGROUPVALUENOTEXIST;
+	return 0;
 
 }
 
@@ -541,18 +782,16 @@ int cgroup_set_value_string(struct cgroup_controller *controller, const char *na
 	if (!controller || !name || !value)
 		return ECGINVAL;
 
-	for (i = 0; i < controller->index; i++) {
-		struct control_value *val = controller->values[i];
+	i = cgroup_find_value(controller, name);
+	if (i < 0)
+		return cgroup_add_value_string(controller, name, value);
 
-		if (!strcmp(val->name, name)) {
-			strncpy(val->value, value, CG_CONTROL_VALUE_MAX);
-			val->value[sizeof(val->value)-1] = '\0';
-			val->dirty = true;
-			return 0;
-		}
-	}
+	if (cgroup_update_value(controller->values[i], value))
+		return ECGOTHER;
+
+	controller->values[i]->dirty = true;
 
-	return cgroup_add_value_string(controller, name, value);
+	return 0;
 }
 
 int cgroup_get_value_int64(struct cgroup_controller *controller, const char *name, int64_t *value)
@@ -562,42 +801,39 @@ int cgroup_get_value_int64(struct cgroup_controller *controller, const char *nam
 	if (!controller || !name || !value)
 		return ECGINVAL;
 
-	for (i = 0; i < controller->index; i++) {
-		struct control_value *val = controller->values[i];
-
-		if (!strcmp(val->name, name)) {
-			if (sscanf(val->value, "%" SCNd64, value) != 1)
-				return ECGINVAL;
+	i = cgroup_find_value(controller, name);
+	if (i < 0)
+		return ECGROUPVALUENOTEXIST;
 
-			return 0;
-		}
-	}
+	if (sscanf(controller->values[i]->value, "%" SCNd64, value) != 1)
+		return ECGINVAL;
 
-	return ECGROUPVALUENOTEXIST;
+	return 0;
 }
 
 int cgroup_set_value_int64(struct cgroup_controller *controller, const char *name, int64_t value)
 {
+	char buf[32];
 	int ret;
 	int i;
 
 	if (!controller || !name)
 		return ECGINVAL;
 
-	for (i = 0; i < controller->index; i++) {
-		struct control_value *val = controller->values[i];
+	i = cgroup_find_value(controller, name);
+	if (i < 0)
+		return cgroup_add_value_int64(controller, name, value);
 
-		if (!strcmp(val->name, name)) {
-			ret = snprintf(val->value, sizeof(val->value), "%" PRId64, value);
-			if (ret >= sizeof(val->value))
-				return ECGINVAL;
+	ret = snprintf(buf, sizeof(buf), "%" PRId64, value);
+	if (ret >= sizeof(buf))
+		return ECGINVAL;
 
-			val->dirty = true;
-			return 0;
-		}
-	}
+	if (cgroup_update_value(controller->values[i], buf))
+		return ECGOTHER;
+
+	controller->values[i]->dirty = true;
 
-	return cgroup_add_value_int64(controller, name, value);
+	return 0;
 }
 
 int cgroup_get_value_uint64(struct cgroup_controller *controller, const char *name,
@@ -608,100 +844,82 @@ int cgroup_get_value_uint64(struct cgroup_controller *controller, const char *na
 	if (!controller || !name || !value)
 		return ECGINVAL;
 
-	for (i = 0; i < controller->index; i++) {
-		struct control_value *val = controller->values[i];
-
-		if (!strcmp(val->name, name)) {
-			if (sscanf(val->value, "%" SCNu64, value) != 1)
-				return ECGINVAL;
+	i = cgroup_find_value(controller, name);
+	if (i < 0)
+		return ECGROUPVALUENOTEXIST;
 
-			return 0;
-		}
-	}
+	if (sscanf(controller->values[i]->value, "%" SCNu64, value) != 1)
+		return ECGINVAL;
 
-	return ECGROUPVALUENOTEXIST;
+	return 0;
 }
 
 int cgroup_set_value_uint64(struct cgroup_controller *controller, const char *name,
 			    u_int64_t value)
 {
+	char buf[32];
 	int ret;
 	int i;
 
 	if (!controller || !name)
 		return ECGINVAL;
 
-	for (i = 0; i < controller->index; i++) {
-		struct control_value *val = controller->values[i];
+	i = cgroup_find_value(controller, name);
+	if (i < 0)
+		return cgroup_add_value_uint64(controller, name, value);
 
-		if (!strcmp(val->name, name)) {
-			ret = snprintf(val->value, sizeof(val->value), "%" PRIu64, value);
-			if (ret >= sizeof(val->value))
-				return ECGINVAL;
+	ret = snprintf(buf, sizeof(buf), "%" PRIu64, value);
+	if (ret >= sizeof(buf))
+		return ECGINVAL;
 
-			val->dirty = true;
-			return 0;
-		}
-	}
+	if (cgroup_update_value(controller->values[i], buf))
+		return ECGOTHER;
+
+	controller->values[i]->dirty = true;
 
-	return cgroup_add_value_uint64(controller, name, value);
+	return 0;
 }
 
 int cgroup_get_value_bool(struct cgroup_controller *controller, const char *name, bool *value)
 {
+	int cgc_val;
 	int i;
 
 	if (!controller || !name || !value)
 		return ECGINVAL;
 
-	for (i = 0; i < controller->index; i++) {
-		struct control_value *val = controller->values[i];
-
-		if (!strcmp(val->name, name)) {
-			int cgc_val;
-
-			if (sscanf(val->value, "%d", &cgc_val) != 1)
-				return ECGINVAL;
+	i = cgroup_find_value(controller, name);
+	if (i < 0)
+		return ECGROUPVALUENOTEXIST;
 
-			if (cgc_val)
-				*value = true;
-			else
-				*value = false;
+	if (sscanf(controller->values[i]->value, "%d", &cgc_val) != 1)
+		return ECGINVAL;
 
-			return 0;
-		}
-	}
+	if (cgc_val)
+		*value = true;
+	else
+		*value = false;
 
-	return ECGROUPVALUENOTEXIST;
+	return 0;
 }
 
 int cgroup_set_value_bool(struct cgroup_controller *controller, const char *name, bool value)
 {
-	int ret;
 	int i;
 
 	if (!controller || !name)
 		return ECGINVAL;
 
-	for (i = 0; i < controller->index; i++) {
-		struct control_value *val = controller->values[i];
-
-		if (!strcmp(val->name, name)) {
-			if (value)
-				ret = snprintf(val->value, sizeof(val->value), "1");
-			else
-				ret = snprintf(val->value, sizeof(val->value), "0");
+	i = cgroup_find_value(controller, name);
+	if (i < 0)
+		return cgroup_add_value_bool(controller, name, value);
 
-			if (ret >= sizeof(val->value))
-				return ECGINVAL;
+	if (cgroup_update_value(controller->values[i], value ? "1" : "0"))
+		return ECGOTHER;
 
-			val->dirty = true;
-			return 0;
+	controller->values[i]->dirty = true;
 
-		}
-	}
-
-	return cgroup_add_value_bool(controller, name, value);
+	return 0;
 }
 
 struct cgroup *create_cgroup_from_name_value_pairs(const char *name,
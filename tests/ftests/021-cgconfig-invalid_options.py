@@ -64,6 +64,18 @@ def test(config):
     else:
         result = consts.TEST_FAILED
         cause = 'Test case erroneously passed'
+        return result, cause
+
+    # -p only applies to a reload
+    try:
+        Cgroup.configparser(config, load_file=CONFIG_FILE_NAME, prune=True)
+    except RunError as re:
+        if re.ret != 129:
+            result = consts.TEST_FAILED
+            cause = 'Expected return code of 129 but received {}'.format(re.ret)
+    else:
+        result = consts.TEST_FAILED
+        cause = 'cgconfigparser -p erroneously passed without -r'
 
     return result, cause
 
@@ -0,0 +1,116 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: LGPL-2.1-only
+#
+# Attach a list of tasks to a cgroup via cgroup_attach_tasks()
+#
+
+from cgroup import Cgroup as CgroupCli
+from libcgroup import Cgroup, Version
+from cgroup import CgroupVersion
+import ftests
+import consts
+import errno
+import sys
+import os
+
+CGNAME = '094cgattachtasks'
+CONTROLLER = 'cpu'
+PROCESSES = 3
+
+# Greater than the largest pid_max, the kernel can't find such a task
+INVALID_PID = 4194305
+
+
+def prereqs(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    if config.args.container:
+        result = consts.TEST_SKIPPED
+        cause = 'This test cannot be run within a container'
+
+    return result, cause
+
+
+def get_version():
+    if CgroupVersion.get_version(CONTROLLER) == CgroupVersion.CGROUP_V1:
+        return Version.CGROUP_V1
+    return Version.CGROUP_V2
+
+
+def setup(config):
+    cg = Cgroup(CGNAME, get_version())
+    cg.add_controller(CONTROLLER)
+    cg.create()
+
+
+def test(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    child_pids = list()
+    for i in range(0, PROCESSES):
+        child_pids.append(config.process.create_process(config))
+
+    cg = Cgroup(CGNAME, get_version())
+    cg.add_controller(CONTROLLER)
+    failed = cg.attach_tasks(child_pids + [INVALID_PID], attach_procs=True)
+
+    if failed != {INVALID_PID: errno.ESRCH}:
+        result = consts.TEST_FAILED
+        cause = 'Unexpected failures {}'.format(failed)
+        return result, cause
+
+    pids = CgroupCli.get_pids_in_cgroup(config, CGNAME, CONTROLLER)
+    for child_pid in child_pids:
+        if child_pid not in pids:
+            result = consts.TEST_FAILED
+            cause = 'Could not find pid {} in cgroup {}'.format(child_pid, CGNAME)
+            return result, cause
+
+    # now let's attach the child processes back to the root cgroup
+    failed = cg.attach_tasks(child_pids, root_cgroup=True, attach_procs=True)
+    if len(failed) != 0:
+        result = consts.TEST_FAILED
+        cause = 'Unexpected failures {}'.format(failed)
+        return result, cause
+
+    pids = CgroupCli.get_pids_in_cgroup(config, CGNAME, CONTROLLER)
+    if len(pids) != 0:
+        result = consts.TEST_FAILED
+        cause = 'pids {} were erroneously found in cgroup {}'.format(pids, CGNAME)
+
+    return result, cause
+
+
+def teardown(config, result):
+    cg = Cgroup(CGNAME, get_version())
+    cg.add_controller(CONTROLLER)
+    try:
+        cg.delete()
+    except RuntimeError:
+        pass
+
+
+def main(config):
+    [result, cause] = prereqs(config)
+    if result != consts.TEST_PASSED:
+        return [result, cause]
+
+    try:
+        result = consts.TEST_FAILED
+        setup(config)
+        [result, cause] = test(config)
+    finally:
+        teardown(config, result)
+
+    return [result, cause]
+
+
+if __name__ == '__main__':
+    config = ftests.parse_args()
+    # this test was invoked directly.  run only it
+    config.args.num = int(os.path.basename(__file__).split('-')[0])
+    sys.exit(ftests.main(config))
+
+# vim: set et ts=4 sw=4:
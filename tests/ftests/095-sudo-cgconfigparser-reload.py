@@ -0,0 +1,183 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: LGPL-2.1-only
+#
+# cgconfigparser -r, -n and -p test: reload the configuration files of a
+# directory over the groups in place
+#
+
+from cgroup import Cgroup, CgroupVersion
+import consts
+import ftests
+import shutil
+import sys
+import os
+
+CONTROLLER = 'memory'
+CGNAME = '095cgconfig'
+
+# Declared groups, a/b is only the ancestor of a declared group. other is
+# declared by the second file, with the setting of the other version.
+DECLARED = [CGNAME, CGNAME + '/a', CGNAME + '/a/b/c', CGNAME + '/other']
+ANCESTORS = [CGNAME + '/a/b']
+STRAYS = [CGNAME + '/stray', CGNAME + '/a/stray', CGNAME + '/a/stray/sub',
+          CGNAME + '/a/b/stray']
+
+CONFIG_DIR = os.path.join(os.getcwd(), '095cgconfig.d')
+
+
+def prereqs(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    if config.args.container:
+        result = consts.TEST_SKIPPED
+        cause = 'This test cannot be run within a container'
+
+    return result, cause
+
+
+def limit_setting(other_version=False):
+    v1 = CgroupVersion.get_version(CONTROLLER) == CgroupVersion.CGROUP_V1
+    if v1 != other_version:
+        return 'memory.limit_in_bytes'
+    return 'memory.max'
+
+
+def setup(config):
+    # the kernel reports the sizes in bytes
+    config_file = """group {0} {{
+    {1} {{
+        {2} = 1G;
+    }}
+}}
+group {0}/a {{
+    {1} {{
+        {2} = 512M;
+    }}
+}}
+group {0}/a/b/c {{
+    {1} {{
+    }}
+}}""".format(CGNAME, CONTROLLER, limit_setting())
+
+    # the groups are pruned against both files, not one after the other
+    other_file = """group {0}/other {{
+    {1} {{
+        {2} = 128M;
+    }}
+}}""".format(CGNAME, CONTROLLER, limit_setting(other_version=True))
+
+    os.mkdir(CONFIG_DIR)
+    for name, content in (('1.conf', config_file), ('2.conf', other_file)):
+        f = open(os.path.join(CONFIG_DIR, name), 'w')
+        f.write(content)
+        f.close()
+
+    Cgroup.configparser(config, load_dir=CONFIG_DIR)
+
+
+def exists(cgname):
+    return os.path.isdir(os.path.join(Cgroup.get_controller_mount_point(CONTROLLER), cgname))
+
+
+def validate(config, limit, other_limit, strays):
+    Cgroup.get_and_validate(config, CGNAME, limit_setting(), '1073741824')
+    Cgroup.get_and_validate(config, CGNAME + '/a', limit_setting(), limit)
+    Cgroup.get_and_validate(config, CGNAME + '/other', limit_setting(), other_limit)
+
+    for cgname in DECLARED + ANCESTORS:
+        if not exists(cgname):
+            return 'Group {} was deleted'.format(cgname)
+
+    for cgname in STRAYS:
+        if exists(cgname) != strays:
+            return 'Group {} exists: {}, expected {}'.format(
+                   cgname, not strays, strays)
+
+    return None
+
+
+def test(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    # an unchanged configuration is a no-op
+    out = Cgroup.configparser(config, load_dir=CONFIG_DIR, reload=True,
+                              prune=True)
+    if out:
+        result = consts.TEST_FAILED
+        cause = 'Unexpected operations on an unchanged config:\n{}'.format(out)
+        return result, cause
+
+    Cgroup.set(config, CGNAME + '/a', limit_setting(), '256M')
+    Cgroup.set(config, CGNAME + '/other', limit_setting(), '64M')
+    for cgname in STRAYS:
+        Cgroup.create(config, CONTROLLER, cgname)
+
+    # a dry run prints the operations and leaves the groups alone
+    out = Cgroup.configparser(config, load_dir=CONFIG_DIR, dry_run=True,
+                              prune=True)
+    expected = ['set {}:{}/a {}: 268435456 -> 512M'.format(CONTROLLER, CGNAME,
+                                                           limit_setting())]
+    # only the converted setting is written
+    expected += ['set {}:{}/other {}: 67108864 -> 128M'.format(CONTROLLER, CGNAME,
+                                                              limit_setting())]
+    expected += ['delete {}:{}'.format(CONTROLLER, cgname)
+                 for cgname in STRAYS if not cgname.endswith('/sub')]
+    if sorted(out.splitlines()) != sorted(expected):
+        result = consts.TEST_FAILED
+        cause = 'Expected the operations:\n{}\nbut received:\n{}'.format(
+                '\n'.join(expected), out)
+        return result, cause
+
+    cause = validate(config, '268435456', '67108864', True)
+    if cause:
+        return consts.TEST_FAILED, 'Dry run: ' + cause
+
+    out = Cgroup.configparser(config, load_dir=CONFIG_DIR, reload=True,
+                              prune=True)
+    if sorted(out.splitlines()) != sorted(expected):
+        result = consts.TEST_FAILED
+        cause = 'Expected the operations:\n{}\nbut received:\n{}'.format(
+                '\n'.join(expected), out)
+        return result, cause
+
+    cause = validate(config, '536870912', '134217728', False)
+    if cause:
+        return consts.TEST_FAILED, 'Reload: ' + cause
+
+    out = Cgroup.configparser(config, load_dir=CONFIG_DIR, reload=True,
+                              prune=True)
+    if out:
+        result = consts.TEST_FAILED
+        cause = 'Unexpected operations on a reloaded config:\n{}'.format(out)
+
+    return result, cause
+
+
+def teardown(config):
+    Cgroup.delete(config, CONTROLLER, CGNAME, recursive=True)
+    shutil.rmtree(CONFIG_DIR)
+
+
+def main(config):
+    [result, cause] = prereqs(config)
+    if result != consts.TEST_PASSED:
+        return [result, cause]
+
+    try:
+        setup(config)
+        [result, cause] = test(config)
+    finally:
+        teardown(config)
+
+    return [result, cause]
+
+
+if __name__ == '__main__':
+    config = ftests.parse_args()
+    # this test was invoked directly.  run only it
+    config.args.num = int(os.path.basename(__file__).split('-')[0])
+    sys.exit(ftests.main(config))
+
+# vim: set et ts=4 sw=4:
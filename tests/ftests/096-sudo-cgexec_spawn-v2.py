@@ -0,0 +1,106 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: LGPL-2.1-only
+#
+# cgexec test on cgroup v2, where the command is created in its control
+# group by a child of cgexec
+#
+
+from cgroup import Cgroup, CgroupVersion
+from run import RunError
+import consts
+import ftests
+import sys
+import os
+
+CONTROLLER = 'cpu'
+CGNAME = '096cgexec'
+
+
+def prereqs(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    if config.args.container:
+        result = consts.TEST_SKIPPED
+        cause = 'This test cannot be run within a container'
+        return result, cause
+
+    if CgroupVersion.get_version(CONTROLLER) != CgroupVersion.CGROUP_V2:
+        result = consts.TEST_SKIPPED
+        cause = 'This test requires cgroup v2'
+
+    return result, cause
+
+
+def setup(config):
+    Cgroup.create(config, CONTROLLER, CGNAME)
+
+
+def exit_status(config, cmdline):
+    try:
+        Cgroup.cgexec(config, CONTROLLER, CGNAME, cmdline)
+    except RunError as re:
+        return re.ret
+
+    return 0
+
+
+def test(config):
+    result = consts.TEST_PASSED
+    cause = None
+
+    # the first thing the command does is to read its control group, then
+    # the one of its parent, cgexec, which stays where it was started
+    out = Cgroup.cgexec(config, CONTROLLER, CGNAME,
+                        "sh -c 'grep ^0:: /proc/$$/cgroup; grep ^0:: /proc/$PPID/cgroup'")
+    lines = out.splitlines()
+    if len(lines) != 2 or not lines[0].endswith('/' + CGNAME):
+        result = consts.TEST_FAILED
+        cause = 'The command did not start in {}:\n{}'.format(CGNAME, out)
+        return result, cause
+
+    if lines[1].endswith('/' + CGNAME):
+        result = consts.TEST_FAILED
+        cause = 'cgexec was moved to {} instead of spawning the command'.format(CGNAME)
+        return result, cause
+
+    ret = exit_status(config, "sh -c 'exit 7'")
+    if ret != 7:
+        result = consts.TEST_FAILED
+        cause = 'cgexec exited with {}, expected the exit status 7 of the command'.format(ret)
+        return result, cause
+
+    ret = exit_status(config, '/nonexistent')
+    if ret != 127:
+        result = consts.TEST_FAILED
+        cause = 'cgexec exited with {} for a command that does not exist, expected 127'.format(
+                ret)
+
+    return result, cause
+
+
+def teardown(config):
+    Cgroup.delete(config, CONTROLLER, CGNAME)
+
+
+def main(config):
+    [result, cause] = prereqs(config)
+    if result != consts.TEST_PASSED:
+        return [result, cause]
+
+    try:
+        setup(config)
+        [result, cause] = test(config)
+    finally:
+        teardown(config)
+
+    return [result, cause]
+
+
+if __name__ == '__main__':
+    config = ftests.parse_args()
+    # this test was invoked directly.  run only it
+    config.args.num = int(os.path.basename(__file__).split('-')[0])
+    sys.exit(ftests.main(config))
+
+# vim: set et ts=4 sw=4:
@@ -736,7 +736,8 @@ class Cgroup(object):
     @staticmethod
     def configparser(config, load_file=None, load_dir=None, dflt_usr=None,
                      dflt_grp=None, dperm=None, fperm=None, cghelp=False,
-                     tperm=None, tasks_usr=None, tasks_grp=None):
+                     tperm=None, tasks_usr=None, tasks_grp=None, reload=False,
+                     dry_run=False, prune=False):
         """cgconfigparser equivalent method
 
         Returns:
@@ -752,6 +753,10 @@ class Cgroup(object):
         cgconfigparser -l conf_file -s mode -t usr:grp           020
         cgconfigparser -h                                        021
         cgconfigparser -l improper_conf_file                     021
+        cgconfigparser -p -l conf_file                           021
+        cgconfigparser -r -L conf_dir                            095
+        cgconfigparser -n -p -L conf_dir                         095
+        cgconfigparser -r -p -L conf_dir                         095
         """
         cmd = list()
 
@@ -790,6 +795,15 @@ class Cgroup(object):
             cmd.append('-t')
             cmd.append('{}:{}'.format(tasks_usr, tasks_grp))
 
+        if reload:
+            cmd.append('-r')
+
+        if dry_run:
+            cmd.append('-n')
+
+        if prune:
+            cmd.append('-p')
+
         if config.args.container:
             return config.container.run(cmd)
         else:
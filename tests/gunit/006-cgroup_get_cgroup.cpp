@@ -136,6 +136,10 @@ class CgroupGetCgroupTest : public ::testing::Test {
 
 			CreateNames(NAMES[i], VALUES[i], CONTROLLERS[i]);
 		}
+
+		/* the path prefixes cached by cgroup_init() are stale now */
+		ret = cg_build_path_prefix_table();
+		ASSERT_EQ(ret, 0);
 	}
 
 	/*
@@ -156,6 +160,8 @@ class CgroupGetCgroupTest : public ::testing::Test {
 	{
 		int ret = 0;
 
+		cg_free_path_prefix_table();
+
 		ret = rmrf(PARENT_DIR);
 		ASSERT_EQ(ret, 0);
 	}
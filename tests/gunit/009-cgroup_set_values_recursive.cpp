@@ -89,22 +89,18 @@ TEST_F(SetValuesRecursiveTest, SuccessfulSetValues)
 	ASSERT_GT(ret, 0);
 
 	for (i = 0; i < NAMES_CNT; i++) {
-		ctrlr.values[i] = (struct control_value *)calloc(1,
-					sizeof(struct control_value));
-		ASSERT_NE(ctrlr.values[i], nullptr);
+		struct control_value *cv;
 
-		strncpy(ctrlr.values[i]->name, NAMES[i], FILENAME_MAX - 1);
-		ctrlr.values[i]->name[FILENAME_MAX - 1] = '\0';
-
-		strncpy(ctrlr.values[i]->value, VALUES[i],
-			CG_CONTROL_VALUE_MAX - 1);
-		ctrlr.values[i]->value[CG_CONTROL_VALUE_MAX - 1] = '\0';
+		cv = cgroup_alloc_value(NAMES[i], VALUES[i]);
+		ASSERT_NE(cv, nullptr);
 
 		if (i == 0)
-			ctrlr.values[i]->dirty = true;
+			cv->dirty = true;
 		else
-			ctrlr.values[i]->dirty = false;
-		ctrlr.index++;
+			cv->dirty = false;
+
+		ret = cgroup_append_value(&ctrlr, cv);
+		ASSERT_EQ(ret, 0);
 	}
 
 	ret = cgroup_set_values_recursive(PARENT_DIR, &ctrlr, false);
@@ -126,8 +122,9 @@ TEST_F(SetValuesRecursiveTest, SuccessfulSetValues)
 	}
 
 	for (i = 0; i < ctrlr.index; i++) {
-		free(ctrlr.values[i]);
+		cgroup_free_value(ctrlr.values[i]);
 		ctrlr.values[i] = nullptr;
 	}
 	ctrlr.index = 0;
+	free(ctrlr.values);
 }
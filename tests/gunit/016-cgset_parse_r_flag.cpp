@@ -36,4 +36,7 @@ TEST_F(CgsetParseRFlagTest, EqualCharInValue)
 
 	ASSERT_STREQ(name_value.name, NAME);
 	ASSERT_STREQ(name_value.value, VALUE);
+
+	free(name_value.name);
+	free(name_value.value);
 }
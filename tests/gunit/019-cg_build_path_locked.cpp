@@ -0,0 +1,176 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/**
+ * libcgroup googletest and microbenchmark for the cg_build_path_locked()
+ * prefix table
+ */
+
+#include <time.h>
+
+#include "gtest/gtest.h"
+
+#include "libcgroup-internal.h"
+
+static const int ENTRY_CNT = 13;
+static const int BENCH_LOOPS = 200000;
+
+static char NAMESPACE3[] = "ns3";
+static char NAMESPACE7[] = "ns7";
+
+static const char * const NAMES[] = {
+	NULL,
+	"",
+	"/",
+	"cg1",
+	"cg1/",
+	"/cg1",
+	"/cg1/cg2/cg3",
+	"user.slice/user-1000.slice",
+};
+static const int NAMES_CNT = sizeof(NAMES) / sizeof(NAMES[0]);
+
+class BuildPathLockedTest : public ::testing::Test {
+	protected:
+
+	/**
+	 * Populate a mount table that looks like a cgroup v1 system, with
+	 * a couple of namespaces and the last entry mounted as cgroup v2.
+	 */
+	void SetUp() override {
+		int i, ret;
+
+		memset(&cg_mount_table, 0, sizeof(cg_mount_table));
+		memset(cg_namespace_table, 0,
+			CG_CONTROLLER_MAX * sizeof(cg_namespace_table[0]));
+		memset(cg_cgroup_v2_mount_path, 0, sizeof(cg_cgroup_v2_mount_path));
+
+		for (i = 0; i < ENTRY_CNT; i++) {
+			snprintf(cg_mount_table[i].name, CONTROL_NAMELEN_MAX,
+				 "controller%d", i);
+			cg_mount_table[i].index = i;
+			cg_mount_table[i].version = CGROUP_V1;
+
+			ret = snprintf(cg_mount_table[i].mount.path, FILENAME_MAX,
+				 "/sys/fs/cgroup/%s", cg_mount_table[i].name);
+			ASSERT_LT(ret, (int)sizeof(cg_mount_table[i].mount.path));
+		}
+
+		cg_mount_table[ENTRY_CNT - 1].version = CGROUP_V2;
+		snprintf(cg_cgroup_v2_mount_path, FILENAME_MAX, "/sys/fs/cgroup/unified");
+
+		cg_namespace_table[3] = NAMESPACE3;
+		cg_namespace_table[7] = NAMESPACE7;
+	}
+
+	void TearDown() override {
+		cg_free_path_prefix_table();
+
+		memset(&cg_mount_table, 0, sizeof(cg_mount_table));
+		memset(cg_namespace_table, 0,
+			CG_CONTROLLER_MAX * sizeof(cg_namespace_table[0]));
+		memset(cg_cgroup_v2_mount_path, 0, sizeof(cg_cgroup_v2_mount_path));
+	}
+
+	/* Build the path of every name for every controller */
+	void BuildAll(std::vector<std::string>& paths)
+	{
+		char path[FILENAME_MAX];
+		char type[CONTROL_NAMELEN_MAX];
+		char *out;
+		int i, j;
+
+		for (i = -1; i <= ENTRY_CNT; i++) {
+			for (j = 0; j < NAMES_CNT; j++) {
+				if (i < 0)
+					out = cg_build_path_locked(NAMES[j], path, NULL);
+				else if (i == ENTRY_CNT)
+					out = cg_build_path_locked(NAMES[j], path,
+								   CGRP_FILE_PREFIX);
+				else {
+					snprintf(type, sizeof(type), "controller%d", i);
+					out = cg_build_path_locked(NAMES[j], path, type);
+				}
+
+				paths.push_back(out ? std::string(out) : std::string("(null)"));
+			}
+		}
+	}
+
+	/* Average time of a cg_build_path_locked() call, in nanoseconds */
+	double Bench(void)
+	{
+		struct timespec start, end;
+		char path[FILENAME_MAX];
+		int i;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < BENCH_LOOPS; i++)
+			cg_build_path_locked(NAMES[i % NAMES_CNT], path,
+					     cg_mount_table[i % ENTRY_CNT].name);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		return ((end.tv_sec - start.tv_sec) * 1e9 +
+			(end.tv_nsec - start.tv_nsec)) / BENCH_LOOPS;
+	}
+};
+
+TEST_F(BuildPathLockedTest, PrefixTableMatchesSlowPath)
+{
+	std::vector<std::string> slow, fast;
+	size_t i;
+	int ret;
+
+	BuildAll(slow);
+
+	ret = cg_build_path_prefix_table();
+	ASSERT_EQ(ret, 0);
+
+	BuildAll(fast);
+
+	ASSERT_EQ(slow.size(), fast.size());
+	for (i = 0; i < slow.size(); i++)
+		ASSERT_STREQ(slow[i].c_str(), fast[i].c_str());
+}
+
+TEST_F(BuildPathLockedTest, PrefixTableLookups)
+{
+	char path[FILENAME_MAX];
+	char *out;
+	int ret;
+
+	ret = cg_build_path_prefix_table();
+	ASSERT_EQ(ret, 0);
+
+	out = cg_build_path_locked("cg1", path, "controller3");
+	ASSERT_STREQ(out, "/sys/fs/cgroup/controller3/ns3/cg1/");
+
+	out = cg_build_path_locked(NULL, path, CGRP_FILE_PREFIX);
+	ASSERT_STREQ(out, "/sys/fs/cgroup/controller12/");
+
+	out = cg_build_path_locked("cg1", path, NULL);
+	ASSERT_STREQ(out, "/sys/fs/cgroup/unified/cg1/");
+
+	out = cg_build_path_locked("cg1", path, "controller13");
+	ASSERT_EQ(out, nullptr);
+}
+
+/*
+ * The timings are only reported, in the output and in the XML report of
+ * --gtest_output, they are not compared.
+ */
+TEST_F(BuildPathLockedTest, PrefixTableBenchmark)
+{
+	double slow_ns, fast_ns;
+	int ret;
+
+	slow_ns = Bench();
+
+	ret = cg_build_path_prefix_table();
+	ASSERT_EQ(ret, 0);
+
+	fast_ns = Bench();
+
+	printf("cg_build_path_locked(): %.1f ns/call without the prefix table, "
+	       "%.1f ns/call with it\n", slow_ns, fast_ns);
+	RecordProperty("slow_ns", (int)slow_ns);
+	RecordProperty("fast_ns", (int)fast_ns);
+}
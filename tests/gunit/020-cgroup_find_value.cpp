@@ -0,0 +1,132 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/**
+ * libcgroup googletest for the controller value name index
+ */
+
+#include "gtest/gtest.h"
+
+#include "libcgroup-internal.h"
+
+static const int VALUES_CNT = 64;
+
+class CgroupFindValueTest : public ::testing::Test {
+	protected:
+
+	struct cgroup *cgrp = NULL;
+	struct cgroup_controller *cgc = NULL;
+
+	void SetUp() override {
+		char name[FILENAME_MAX], value[32];
+		int i, ret;
+
+		cgrp = cgroup_new_cgroup("test020");
+		ASSERT_NE(cgrp, nullptr);
+
+		/* the "cgroup" controller doesn't need a mounted hierarchy */
+		cgc = cgroup_add_controller(cgrp, CGRP_FILE_PREFIX);
+		ASSERT_NE(cgc, nullptr);
+
+		for (i = 0; i < VALUES_CNT; i++) {
+			snprintf(name, sizeof(name), "cgroup.setting%d", i);
+			snprintf(value, sizeof(value), "%d", i);
+
+			ret = cgroup_add_value_string(cgc, name, value);
+			ASSERT_EQ(ret, 0);
+		}
+	}
+
+	void TearDown() override {
+		cgroup_free(&cgrp);
+	}
+};
+
+TEST_F(CgroupFindValueTest, InsertionOrder)
+{
+	char name[FILENAME_MAX];
+	int i;
+
+	ASSERT_EQ(cgroup_get_value_name_count(cgc), VALUES_CNT);
+	ASSERT_GT(cgc->values_hash_size, 0);
+
+	for (i = 0; i < VALUES_CNT; i++) {
+		snprintf(name, sizeof(name), "cgroup.setting%d", i);
+		ASSERT_STREQ(cgroup_get_value_name(cgc, i), name);
+		ASSERT_EQ(cgroup_find_value(cgc, name), i);
+	}
+
+	ASSERT_EQ(cgroup_find_value(cgc, "cgroup.missing"), -1);
+}
+
+TEST_F(CgroupFindValueTest, DuplicateAndSet)
+{
+	int64_t val;
+	int ret;
+
+	ret = cgroup_add_value_string(cgc, "cgroup.setting10", "1");
+	ASSERT_EQ(ret, ECGVALUEEXISTS);
+
+	ret = cgroup_set_value_int64(cgc, "cgroup.setting10", 12345678901LL);
+	ASSERT_EQ(ret, 0);
+	ret = cgroup_get_value_int64(cgc, "cgroup.setting10", &val);
+	ASSERT_EQ(ret, 0);
+	ASSERT_EQ(val, 12345678901LL);
+
+	/* a set of a new name appends it */
+	ret = cgroup_set_value_int64(cgc, "cgroup.new", 7);
+	ASSERT_EQ(ret, 0);
+	ASSERT_EQ(cgroup_find_value(cgc, "cgroup.new"), VALUES_CNT);
+}
+
+TEST_F(CgroupFindValueTest, RemoveKeepsOrder)
+{
+	char name[FILENAME_MAX];
+	char *value;
+	int i, ret;
+
+	for (i = 0; i < VALUES_CNT; i += 2) {
+		snprintf(name, sizeof(name), "cgroup.setting%d", i);
+		ret = cgroup_remove_value(cgc, name);
+		ASSERT_EQ(ret, 0);
+	}
+
+	ASSERT_EQ(cgroup_get_value_name_count(cgc), VALUES_CNT / 2);
+
+	for (i = 0; i < VALUES_CNT; i++) {
+		snprintf(name, sizeof(name), "cgroup.setting%d", i);
+		if (i % 2 == 0) {
+			ASSERT_EQ(cgroup_find_value(cgc, name), -1);
+			continue;
+		}
+
+		ASSERT_EQ(cgroup_find_value(cgc, name), i / 2);
+
+		ret = cgroup_get_value_string(cgc, name, &value);
+		ASSERT_EQ(ret, 0);
+		ASSERT_EQ(atoi(value), i);
+		free(value);
+	}
+}
+
+TEST_F(CgroupFindValueTest, CopyAndCompare)
+{
+	struct cgroup_controller *copy;
+	struct cgroup *cgrp_copy;
+	int ret;
+
+	cgrp_copy = cgroup_new_cgroup("test020");
+	ASSERT_NE(cgrp_copy, nullptr);
+
+	ret = cgroup_copy_cgroup(cgrp_copy, cgrp);
+	ASSERT_EQ(ret, 0);
+
+	copy = cgroup_get_controller(cgrp_copy, CGRP_FILE_PREFIX);
+	ASSERT_NE(copy, nullptr);
+	ASSERT_EQ(cgroup_find_value(copy, "cgroup.setting42"), 42);
+	ASSERT_EQ(cgroup_compare_controllers(cgc, copy), 0);
+
+	ret = cgroup_set_value_string(copy, "cgroup.setting42", "x");
+	ASSERT_EQ(ret, 0);
+	ASSERT_EQ(cgroup_compare_controllers(cgc, copy), ECGCONTROLLERNOTEQUAL);
+
+	cgroup_free(&cgrp_copy);
+}
@@ -0,0 +1,293 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/**
+ * libcgroup googletest and microbenchmark for the compiled rules index
+ */
+
+#include <time.h>
+
+#include "gtest/gtest.h"
+
+#include "libcgroup-internal.h"
+
+static const int RULES_CNT = 10000;
+static const int LOOKUPS_CNT = 1000;
+static const int LIST_BENCH_LOOPS = 20;
+static const int INDEX_BENCH_LOOPS = 20000;
+
+static const uid_t UID_BASE = 1000;
+static const int UID_CNT = 500;
+static const gid_t GID_BASE = 5000;
+static const int GID_CNT = 20;
+
+class CgroupRuleIndexTest : public ::testing::Test {
+	protected:
+
+	struct cgroup_rule_list lst = { NULL, NULL, 0 };
+	struct cgroup_rule_index idx = { 0 };
+
+	struct cgroup_rule *AddRule(const char * const username, uid_t uid, gid_t gid,
+				    const char * const procname)
+	{
+		struct cgroup_rule *rule;
+
+		rule = (struct cgroup_rule *)calloc(1, sizeof(*rule));
+		if (!rule)
+			return NULL;
+
+		snprintf(rule->username, sizeof(rule->username), "%s", username);
+		snprintf(rule->destination, sizeof(rule->destination), "dest%d", lst.len);
+		rule->uid = uid;
+		rule->gid = gid;
+		if (procname)
+			rule->procname = strdup(procname);
+
+		if (!lst.head)
+			lst.head = rule;
+		else
+			lst.tail->next = rule;
+		lst.tail = rule;
+		lst.len++;
+
+		return rule;
+	}
+
+	/*
+	 * Build a rule set that looks like a large cgrules.d directory: mostly
+	 * per user rules with and without process names, some @group rules,
+	 * "%" continuations and a few wildcard rules. Group names don't exist,
+	 * so the @group rules can only match by GID. Ignore rules are left out
+	 * as they read /proc/<pid>/cgroup.
+	 */
+	void BuildSyntheticRules(void)
+	{
+		char name[LOGIN_NAME_MAX], proc[32];
+		uid_t uid;
+		gid_t gid;
+		int i;
+
+		for (i = 0; lst.len < RULES_CNT; i++) {
+			uid = UID_BASE + (i * 7) % UID_CNT;
+			snprintf(name, sizeof(name), "user%d", uid);
+
+			switch (i % 10) {
+			case 0:
+			case 1:
+			case 2:
+				snprintf(proc, sizeof(proc), "proc%d", i % 97);
+				ASSERT_NE(AddRule(name, uid, CGRULE_INVALID, proc), nullptr);
+				break;
+			case 3:
+				snprintf(proc, sizeof(proc), "/usr/bin/proc%d", i % 89);
+				ASSERT_NE(AddRule(name, uid, CGRULE_INVALID, proc), nullptr);
+				break;
+			case 4:
+				snprintf(proc, sizeof(proc), "proc%d*", i % 13);
+				ASSERT_NE(AddRule(name, uid, CGRULE_INVALID, proc), nullptr);
+				break;
+			case 5:
+				ASSERT_NE(AddRule(name, uid, CGRULE_INVALID, NULL), nullptr);
+				ASSERT_NE(AddRule("%", uid, CGRULE_INVALID, NULL), nullptr);
+				break;
+			case 6:
+				if (i % 500 == 6) {
+					gid = GID_BASE + (i / 500) % GID_CNT;
+					snprintf(name, sizeof(name), "@nosuchgroup%d", gid);
+					snprintf(proc, sizeof(proc), "proc%d", i % 97);
+					ASSERT_NE(AddRule(name, CGRULE_INVALID, gid, proc),
+						  nullptr);
+					break;
+				}
+				/* fall through */
+			case 7:
+			case 8:
+				snprintf(proc, sizeof(proc), "daemon%d", i % 31);
+				ASSERT_NE(AddRule(name, uid, CGRULE_INVALID, proc), nullptr);
+				break;
+			case 9:
+				if (i % 1000 == 9) {
+					snprintf(proc, sizeof(proc), "proc%d", i % 97);
+					ASSERT_NE(AddRule("*", CGRULE_WILD, CGRULE_WILD, proc),
+						  nullptr);
+				} else {
+					ASSERT_NE(AddRule(name, uid, CGRULE_INVALID, "sshd"),
+						  nullptr);
+				}
+				break;
+			}
+		}
+
+		/* The catch all rule */
+		ASSERT_NE(AddRule("*", CGRULE_WILD, CGRULE_WILD, NULL), nullptr);
+	}
+
+	void TearDown() override
+	{
+		struct cgroup_rule *rule;
+
+		cgroup_free_rule_index(&idx);
+
+		while (lst.head) {
+			rule = lst.head;
+			lst.head = rule->next;
+			free(rule->procname);
+			free(rule);
+		}
+	}
+};
+
+struct lookup {
+	uid_t uid;
+	gid_t gid;
+	char procname[32];
+	const char *base;
+};
+
+static void build_lookups(std::vector<struct lookup>& lookups)
+{
+	struct lookup l;
+	int i;
+
+	srand(21);
+
+	for (i = 0; i < LOOKUPS_CNT; i++) {
+		memset(&l, 0, sizeof(l));
+
+		/* a few UIDs and GIDs out of the rules' range */
+		l.uid = UID_BASE - 10 + rand() % (UID_CNT + 20);
+		l.gid = GID_BASE - 10 + rand() % (GID_CNT + 20);
+
+		switch (rand() % 5) {
+		case 0:
+			snprintf(l.procname, sizeof(l.procname), "proc%d", rand() % 100);
+			break;
+		case 1:
+			snprintf(l.procname, sizeof(l.procname), "/usr/bin/proc%d",
+				 rand() % 100);
+			break;
+		case 2:
+			snprintf(l.procname, sizeof(l.procname), "/usr/sbin/daemon%d",
+				 rand() % 40);
+			break;
+		case 3:
+			snprintf(l.procname, sizeof(l.procname), "unknown%d", rand() % 10);
+			break;
+		case 4:
+			/* lookups without a process name */
+			break;
+		}
+
+		lookups.push_back(l);
+	}
+
+	for (i = 0; i < LOOKUPS_CNT; i++) {
+		if (!lookups[i].procname[0])
+			continue;
+
+		lookups[i].base = strrchr(lookups[i].procname, '/');
+		if (lookups[i].base)
+			lookups[i].base++;
+		else
+			lookups[i].base = lookups[i].procname;
+	}
+}
+
+static const char *lookup_procname(const struct lookup& l)
+{
+	return l.procname[0] ? l.procname : NULL;
+}
+
+TEST_F(CgroupRuleIndexTest, FirstMatchAndContinuations)
+{
+	struct cgroup_rule *r1, *r3, *r4, *r5;
+	int ret;
+
+	r1 = AddRule("@grp", CGRULE_INVALID, 100, "foo");
+	ASSERT_NE(AddRule("%", CGRULE_INVALID, 100, NULL), nullptr);
+	r3 = AddRule("user", 1000, CGRULE_INVALID, "/usr/bin/bar");
+	r4 = AddRule("user", 1000, CGRULE_INVALID, NULL);
+	r5 = AddRule("*", CGRULE_WILD, CGRULE_WILD, NULL);
+
+	ret = cgroup_build_rule_index(&lst, &idx);
+	ASSERT_EQ(ret, 0);
+	ASSERT_EQ(idx.rule_cnt, 5);
+
+	/* the GID rule comes first */
+	ASSERT_EQ(cgroup_find_rule_in_index(&idx, 1000, 100, 0, "foo", "foo"), r1);
+	/* the basename of a rule doesn't match, the full path does */
+	ASSERT_EQ(cgroup_find_rule_in_index(&idx, 1000, 100, 0, "bar", "bar"), r4);
+	ASSERT_EQ(cgroup_find_rule_in_index(&idx, 1000, 100, 0, "/usr/bin/bar", "bar"), r3);
+	/* the "%" continuation never matches on its own */
+	ASSERT_EQ(cgroup_find_rule_in_index(&idx, 1001, 100, 0, "baz", "baz"), r5);
+	ASSERT_EQ(cgroup_find_rule_in_index(&idx, 1000, 101, 0, NULL, NULL), r3);
+}
+
+TEST_F(CgroupRuleIndexTest, IndexMatchesListWalk)
+{
+	std::vector<struct lookup> lookups;
+	struct cgroup_rule *list_rule, *idx_rule;
+	int i, ret;
+
+	BuildSyntheticRules();
+	build_lookups(lookups);
+
+	ret = cgroup_build_rule_index(&lst, &idx);
+	ASSERT_EQ(ret, 0);
+	ASSERT_EQ(idx.rule_cnt, lst.len);
+
+	for (i = 0; i < LOOKUPS_CNT; i++) {
+		list_rule = cgroup_find_rule_in_list(lst.head, lookups[i].uid, lookups[i].gid,
+						     0, lookup_procname(lookups[i]),
+						     lookups[i].base);
+		idx_rule = cgroup_find_rule_in_index(&idx, lookups[i].uid, lookups[i].gid,
+						     0, lookup_procname(lookups[i]),
+						     lookups[i].base);
+		ASSERT_EQ(list_rule, idx_rule) << "uid " << lookups[i].uid <<
+			" gid " << lookups[i].gid << " procname " << lookups[i].procname;
+	}
+}
+
+static double elapsed_ns(const struct timespec& start, const struct timespec& end)
+{
+	return (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+}
+
+/* The timings are reported, not compared */
+TEST_F(CgroupRuleIndexTest, IndexBenchmark)
+{
+	std::vector<struct lookup> lookups;
+	struct timespec start, end;
+	double list_ns, idx_ns;
+	int i, ret;
+
+	BuildSyntheticRules();
+	build_lookups(lookups);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = cgroup_build_rule_index(&lst, &idx);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ASSERT_EQ(ret, 0);
+
+	printf("cgroup_build_rule_index(): %.1f us for %d rules\n",
+	       elapsed_ns(start, end) / 1000, lst.len);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < LIST_BENCH_LOOPS; i++)
+		cgroup_find_rule_in_list(lst.head, lookups[i].uid, lookups[i].gid, 0,
+					 lookup_procname(lookups[i]), lookups[i].base);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	list_ns = elapsed_ns(start, end) / LIST_BENCH_LOOPS;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < INDEX_BENCH_LOOPS; i++)
+		cgroup_find_rule_in_index(&idx, lookups[i % LOOKUPS_CNT].uid,
+					  lookups[i % LOOKUPS_CNT].gid, 0,
+					  lookup_procname(lookups[i % LOOKUPS_CNT]),
+					  lookups[i % LOOKUPS_CNT].base);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	idx_ns = elapsed_ns(start, end) / INDEX_BENCH_LOOPS;
+
+	printf("rule lookup over %d rules: %.1f ns/call walking the list, "
+	       "%.1f ns/call with the index\n", lst.len, list_ns, idx_ns);
+	RecordProperty("list_ns", (int)list_ns);
+	RecordProperty("index_ns", (int)idx_ns);
+}
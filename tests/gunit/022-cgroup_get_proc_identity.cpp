@@ -0,0 +1,296 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/**
+ * libcgroup googletest for cgroup_get_proc_identity(), and the system calls it
+ * saves over the procfs functions
+ */
+
+#include <sys/types.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+
+#include "gtest/gtest.h"
+
+#include "libcgroup-internal.h"
+
+static const char * const SCRIPT = "test022.sh";
+
+class ProcIdentityTest : public ::testing::Test {
+	protected:
+
+	pid_t child = -1;
+
+	/* Exec path in a child process, wait until its name is comm */
+	void Spawn(const char * const path, const char * const comm)
+	{
+		char name[32];
+		char proc[FILENAME_MAX];
+		ssize_t len;
+		int fd, i;
+
+		child = fork();
+		ASSERT_GE(child, 0);
+		if (child == 0) {
+			execl(path, path, NULL);
+			_exit(1);
+		}
+
+		snprintf(proc, sizeof(proc), "/proc/%d/comm", child);
+		for (i = 0; i < 1000; i++) {
+			fd = open(proc, O_RDONLY);
+			ASSERT_GE(fd, 0);
+			len = read(fd, name, sizeof(name) - 1);
+			close(fd);
+
+			if (len > 0 && !strncmp(name, comm, strlen(comm)))
+				return;
+			usleep(1000);
+		}
+		FAIL() << "child " << child << " didn't exec " << path;
+	}
+
+	/* Compare with cgroup_get_uid_gid_from_procfs() and cgroup_get_procname_from_procfs() */
+	void ExpectSameAsProcfs(pid_t pid)
+	{
+		char *procname = NULL, *procname2 = NULL;
+		uid_t euid, euid2;
+		gid_t egid, egid2;
+		int ret, ret2;
+
+		ret = cgroup_get_uid_gid_from_procfs(pid, &euid, &egid);
+		if (!ret)
+			ret = cgroup_get_procname_from_procfs(pid, &procname);
+		ret2 = cgroup_get_proc_identity(pid, &euid2, &egid2, &procname2);
+
+		/* the process may have exited in between */
+		if (ret == ECGROUPNOTEXIST || ret2 == ECGROUPNOTEXIST)
+			goto out;
+
+		EXPECT_EQ(ret, ret2) << "pid " << pid;
+		if (ret || ret2)
+			goto out;
+
+		EXPECT_EQ(euid, euid2) << "pid " << pid;
+		EXPECT_EQ(egid, egid2) << "pid " << pid;
+		EXPECT_STREQ(procname, procname2) << "pid " << pid;
+
+	out:
+		free(procname);
+		free(procname2);
+	}
+
+	/*
+	 * Run work in a traced child and count its system calls, *cnt is -1
+	 * when the child can't be traced
+	 */
+	void CountSyscalls(void (*work)(void), long *cnt)
+	{
+		int status, sig = 0;
+		long stops = 0;
+
+		*cnt = -1;
+
+		child = fork();
+		ASSERT_GE(child, 0);
+		if (child == 0) {
+			if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0)
+				_exit(1);
+			raise(SIGSTOP);
+			work();
+			_exit(0);
+		}
+
+		ASSERT_EQ(waitpid(child, &status, 0), child);
+		if (!WIFSTOPPED(status)) {
+			child = -1;
+			return;
+		}
+		ASSERT_EQ(ptrace(PTRACE_SETOPTIONS, child, NULL,
+				 PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL), 0);
+
+		while (1) {
+			ASSERT_EQ(ptrace(PTRACE_SYSCALL, child, NULL, sig), 0);
+			ASSERT_EQ(waitpid(child, &status, 0), child);
+			if (WIFEXITED(status) || WIFSIGNALED(status))
+				break;
+
+			sig = 0;
+			if (WSTOPSIG(status) == (SIGTRAP | 0x80))
+				stops++;
+			else
+				sig = WSTOPSIG(status);
+		}
+		child = -1;
+
+		ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+		/* a stop at the entry and at the exit, but exit_group() never returns */
+		*cnt = (stops + 1) / 2;
+	}
+
+	void TearDown() override
+	{
+		if (child > 0) {
+			kill(child, SIGKILL);
+			waitpid(child, NULL, 0);
+		}
+
+		unlink(SCRIPT);
+	}
+};
+
+TEST_F(ProcIdentityTest, Self)
+{
+	char *procname = NULL;
+	char exe[FILENAME_MAX];
+	uid_t euid;
+	gid_t egid;
+	ssize_t len;
+	int ret;
+
+	len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+	ASSERT_GT(len, 0);
+	exe[len] = '\0';
+
+	ret = cgroup_get_proc_identity(getpid(), &euid, &egid, &procname);
+	ASSERT_EQ(ret, 0);
+	ASSERT_EQ(euid, geteuid());
+	ASSERT_EQ(egid, getegid());
+	ASSERT_STREQ(procname, exe);
+	free(procname);
+
+	/* the outputs are optional */
+	ret = cgroup_get_proc_identity(getpid(), NULL, NULL, NULL);
+	ASSERT_EQ(ret, 0);
+	ret = cgroup_get_proc_identity(getpid(), &euid, NULL, NULL);
+	ASSERT_EQ(ret, 0);
+	ASSERT_EQ(euid, geteuid());
+}
+
+TEST_F(ProcIdentityTest, NoSuchProcess)
+{
+	char *procname = NULL;
+	uid_t euid;
+	gid_t egid;
+	pid_t pid;
+	int ret;
+
+	pid = fork();
+	ASSERT_GE(pid, 0);
+	if (pid == 0)
+		_exit(0);
+	ASSERT_EQ(waitpid(pid, NULL, 0), pid);
+
+	ret = cgroup_get_proc_identity(pid, &euid, &egid, &procname);
+	ASSERT_EQ(ret, ECGROUPNOTEXIST);
+	ASSERT_EQ(procname, nullptr);
+}
+
+TEST_F(ProcIdentityTest, Script)
+{
+	char *procname = NULL;
+	char path[FILENAME_MAX];
+	char *real;
+	FILE *f;
+	int ret;
+
+	f = fopen(SCRIPT, "w");
+	ASSERT_NE(f, nullptr);
+	fprintf(f, "#!/bin/sh\nsleep 5\n");
+	fclose(f);
+	ASSERT_EQ(chmod(SCRIPT, 0755), 0);
+
+	/*
+	 * /proc/<pid>/exe is the shell, the script name is taken from the
+	 * relative path on the command line
+	 */
+	snprintf(path, sizeof(path), "./%s", SCRIPT);
+	Spawn(path, SCRIPT);
+
+	real = realpath(SCRIPT, NULL);
+	ASSERT_NE(real, nullptr);
+
+	ret = cgroup_get_proc_identity(child, NULL, NULL, &procname);
+	ASSERT_EQ(ret, 0);
+	EXPECT_STREQ(procname, real);
+
+	ExpectSameAsProcfs(child);
+
+	free(procname);
+	free(real);
+}
+
+TEST_F(ProcIdentityTest, SameAsProcfsForAllProcesses)
+{
+	struct dirent *dent;
+	DIR *dir;
+	int pid;
+
+	dir = opendir("/proc");
+	ASSERT_NE(dir, nullptr);
+
+	while ((dent = readdir(dir)) != NULL) {
+		if (sscanf(dent->d_name, "%d", &pid) != 1)
+			continue;
+
+		ExpectSameAsProcfs(pid);
+	}
+
+	closedir(dir);
+}
+
+static void no_work(void)
+{
+}
+
+static void procfs_work(void)
+{
+	char *procname;
+	uid_t euid;
+	gid_t egid;
+
+	if (cgroup_get_uid_gid_from_procfs(getpid(), &euid, &egid) ||
+	    cgroup_get_procname_from_procfs(getpid(), &procname))
+		_exit(1);
+	free(procname);
+}
+
+static void identity_work(void)
+{
+	char *procname;
+	uid_t euid;
+	gid_t egid;
+
+	if (cgroup_get_proc_identity(getpid(), &euid, &egid, &procname))
+		_exit(1);
+	free(procname);
+}
+
+/*
+ * The system calls are counted with ptrace(), they don't vary between runs
+ * the way timings do.
+ */
+TEST_F(ProcIdentityTest, SyscallCount)
+{
+	long base, procfs, identity;
+
+	CountSyscalls(no_work, &base);
+	if (base < 0)
+		GTEST_SKIP() << "ptrace() is unavailable";
+	CountSyscalls(procfs_work, &procfs);
+	CountSyscalls(identity_work, &identity);
+	ASSERT_GE(procfs, base);
+	ASSERT_GE(identity, base);
+
+	procfs -= base;
+	identity -= base;
+
+	printf("process identity: %ld system calls with the procfs functions, "
+	       "%ld with cgroup_get_proc_identity()\n", procfs, identity);
+	RecordProperty("procfs_syscalls", (int)procfs);
+	RecordProperty("identity_syscalls", (int)identity);
+
+	EXPECT_LT(identity, procfs);
+}
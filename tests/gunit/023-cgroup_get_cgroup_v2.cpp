@@ -0,0 +1,207 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/**
+ * libcgroup googletest for the single pass cgroup v2 path of
+ * cgroup_get_cgroup()
+ */
+
+#include <bits/stdc++.h>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include <ftw.h>
+
+#include "gtest/gtest.h"
+#include "libcgroup-internal.h"
+
+static const char * const PARENT_DIR = "test023cgroup";
+static const char * const CG_NAME = "v2cg";
+static const mode_t MODE = S_IRWXU | S_IRWXG | S_IRWXO;
+
+static const uid_t CONTROL_UID = 1234;
+static const gid_t CONTROL_GID = 5678;
+
+/* cpuset is mounted but not enabled in the cgroup */
+static const char * const CONTROLLERS[] = {
+	"cpuset",
+	"cpu",
+	"io",
+	"memory",
+	"pids",
+};
+static const int CONTROLLERS_CNT = ARRAY_SIZE(CONTROLLERS);
+
+static const char * const ENABLED = "cpu io memory pids\n";
+
+static const char * const FILES[][2] = {
+	{"cgroup.procs", "1\n2\n"},
+	{"cgroup.type", "domain\n"},
+	{"cpu.weight", "100\n"},
+	{"cpu.weight.nice", "0\n"},
+	{"cpu.max", "max 100000\n"},
+	{"cpuset.cpus", "0-3\n"},
+	{"io.max", ""},
+	{"memory.max", "max\n"},
+	{"memory.high", "1073741824\n"},
+	{"memory.stat", "anon 0\nfile 0\n"},
+	{"pids.max", "100\n"},
+	{"iocost", "no dot\n"},
+};
+static const int FILES_CNT = ARRAY_SIZE(FILES);
+
+class CgroupGetCgroupV2Test : public ::testing::Test {
+	protected:
+
+	void SetUp() override
+	{
+		char path[FILENAME_MAX];
+		int i, ret;
+
+		ret = cgroup_init();
+		ASSERT_EQ(ret, 0);
+
+		ret = mkdir(PARENT_DIR, MODE);
+		ASSERT_EQ(ret, 0);
+
+		snprintf(path, sizeof(path), "%s/%s", PARENT_DIR, CG_NAME);
+		ret = mkdir(path, MODE);
+		ASSERT_EQ(ret, 0);
+
+		/* Every v2 controller is mounted on the same directory */
+		memset(&cg_mount_table, 0, sizeof(cg_mount_table));
+		memset(&cg_namespace_table, 0, sizeof(cg_namespace_table));
+
+		for (i = 0; i < CONTROLLERS_CNT; i++) {
+			snprintf(cg_mount_table[i].name, CONTROL_NAMELEN_MAX, "%s",
+				 CONTROLLERS[i]);
+			snprintf(cg_mount_table[i].mount.path, FILENAME_MAX, "%s", PARENT_DIR);
+			cg_mount_table[i].version = CGROUP_V2;
+		}
+
+		CreateFile(CGV2_CONTROLLERS_FILE, ENABLED);
+		for (i = 0; i < FILES_CNT; i++)
+			CreateFile(FILES[i][0], FILES[i][1]);
+
+		ret = cg_build_path_prefix_table();
+		ASSERT_EQ(ret, 0);
+	}
+
+	void CreateFile(const char * const name, const char * const value)
+	{
+		char path[FILENAME_MAX];
+		FILE *f;
+
+		snprintf(path, sizeof(path), "%s/%s/%s", PARENT_DIR, CG_NAME, name);
+		f = fopen(path, "w");
+		ASSERT_NE(f, nullptr);
+		fprintf(f, "%s", value);
+		fclose(f);
+
+		ASSERT_EQ(chown(path, CONTROL_UID, CONTROL_GID), 0);
+	}
+
+	static int unlink_cb(const char *fpath, const struct stat *sb, int typeflag,
+			     struct FTW *ftwbuf)
+	{
+		return remove(fpath);
+	}
+
+	void TearDown() override
+	{
+		cg_free_path_prefix_table();
+
+		ASSERT_EQ(nftw(PARENT_DIR, unlink_cb, 64, FTW_DEPTH | FTW_PHYS), 0);
+	}
+};
+
+static void vectorize_cgrp(const struct cgroup * const cgrp, vector<string>& cgrp_vec)
+{
+	int i, j;
+
+	for (i = 0; i < cgrp->index; i++) {
+		for (j = 0; j < cgrp->controller[i]->index; j++) {
+			ASSERT_FALSE(cgrp->controller[i]->values[j]->dirty);
+			cgrp_vec.push_back(string(cgrp->controller[i]->name) + "+" +
+					   cgrp->controller[i]->values[j]->name + "+" +
+					   cgrp->controller[i]->values[j]->value);
+		}
+	}
+
+	sort(cgrp_vec.begin(), cgrp_vec.end());
+}
+
+TEST_F(CgroupGetCgroupV2Test, EnabledControllers)
+{
+	vector<string> cgrp_vec, test_vec = {
+		"cpu+cpu.max+max 100000",
+		"cpu+cpu.weight+100",
+		"cpu+cpu.weight.nice+0",
+		"io+io.max+",
+		"memory+memory.high+1073741824",
+		"memory+memory.max+max",
+		"memory+memory.stat+anon 0\nfile 0",
+		"pids+pids.max+100",
+	};
+	struct cgroup *cgrp;
+	int ret;
+
+	cgrp = cgroup_new_cgroup(CG_NAME);
+	ASSERT_NE(cgrp, nullptr);
+
+	ret = cgroup_get_cgroup(cgrp);
+	ASSERT_EQ(ret, 0);
+
+	/* the controllers are in the mount table order */
+	ASSERT_EQ(cgrp->index, 4);
+	ASSERT_STREQ(cgrp->controller[0]->name, "cpu");
+	ASSERT_STREQ(cgrp->controller[1]->name, "io");
+	ASSERT_STREQ(cgrp->controller[2]->name, "memory");
+	ASSERT_STREQ(cgrp->controller[3]->name, "pids");
+
+	vectorize_cgrp(cgrp, cgrp_vec);
+	ASSERT_EQ(cgrp_vec, test_vec);
+
+	ASSERT_EQ(cgrp->control_uid, CONTROL_UID);
+	ASSERT_EQ(cgrp->control_gid, CONTROL_GID);
+
+	cgroup_free(&cgrp);
+}
+
+TEST_F(CgroupGetCgroupV2Test, RequestedControllers)
+{
+	vector<string> cgrp_vec, test_vec = {
+		"cpuset+cpuset.cpus+0-3",
+		"pids+pids.max+100",
+	};
+	struct cgroup *cgrp;
+	int ret;
+
+	cgrp = cgroup_new_cgroup(CG_NAME);
+	ASSERT_NE(cgrp, nullptr);
+
+	/* a controller that isn't enabled is read when it is asked for */
+	ASSERT_NE(cgroup_add_controller(cgrp, "cpuset"), nullptr);
+	ASSERT_NE(cgroup_add_controller(cgrp, "pids"), nullptr);
+
+	ret = cgroup_get_cgroup(cgrp);
+	ASSERT_EQ(ret, 0);
+
+	vectorize_cgrp(cgrp, cgrp_vec);
+	ASSERT_EQ(cgrp_vec, test_vec);
+
+	cgroup_free(&cgrp);
+}
+
+TEST_F(CgroupGetCgroupV2Test, NoSuchCgroup)
+{
+	struct cgroup *cgrp;
+	int ret;
+
+	cgrp = cgroup_new_cgroup("nosuchcg");
+	ASSERT_NE(cgrp, nullptr);
+
+	ret = cgroup_get_cgroup(cgrp);
+	ASSERT_EQ(ret, ECGROUPNOTEXIST);
+
+	cgroup_free(&cgrp);
+}
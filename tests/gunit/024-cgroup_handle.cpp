@@ -0,0 +1,134 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/**
+ * libcgroup googletest for the cgroup_handle functions
+ */
+
+#include <ftw.h>
+
+#include "gtest/gtest.h"
+
+#include "libcgroup-internal.h"
+
+static const char * const PARENT_DIR = "test024cgroup";
+static const char * const CG_NAME = "pollcg";
+static const mode_t MODE = S_IRWXU | S_IRWXG | S_IRWXO;
+
+class CgroupHandleTest : public ::testing::Test {
+	protected:
+
+	struct cgroup_handle *handle = NULL;
+
+	void SetUp() override
+	{
+		char path[FILENAME_MAX];
+		int ret;
+
+		ret = cgroup_init();
+		ASSERT_EQ(ret, 0);
+
+		ret = mkdir(PARENT_DIR, MODE);
+		ASSERT_EQ(ret, 0);
+
+		snprintf(path, sizeof(path), "%s/%s", PARENT_DIR, CG_NAME);
+		ret = mkdir(path, MODE);
+		ASSERT_EQ(ret, 0);
+
+		memset(&cg_mount_table, 0, sizeof(cg_mount_table));
+		memset(&cg_namespace_table, 0, sizeof(cg_namespace_table));
+
+		snprintf(cg_mount_table[0].name, CONTROL_NAMELEN_MAX, "memory");
+		snprintf(cg_mount_table[0].mount.path, FILENAME_MAX, "%s", PARENT_DIR);
+		cg_mount_table[0].version = CGROUP_V2;
+
+		ret = cg_build_path_prefix_table();
+		ASSERT_EQ(ret, 0);
+
+		WriteFile("memory.current", "4096\n");
+		WriteFile("memory.stat", "anon 0\nfile 4096\n");
+	}
+
+	void WriteFile(const char * const name, const char * const value)
+	{
+		char path[FILENAME_MAX];
+		FILE *f;
+
+		snprintf(path, sizeof(path), "%s/%s/%s", PARENT_DIR, CG_NAME, name);
+		f = fopen(path, "w");
+		ASSERT_NE(f, nullptr);
+		fprintf(f, "%s", value);
+		fclose(f);
+	}
+
+	static int unlink_cb(const char *fpath, const struct stat *sb, int typeflag,
+			     struct FTW *ftwbuf)
+	{
+		return remove(fpath);
+	}
+
+	void TearDown() override
+	{
+		cgroup_handle_close(&handle);
+		cg_free_path_prefix_table();
+
+		ASSERT_EQ(nftw(PARENT_DIR, unlink_cb, 64, FTW_DEPTH | FTW_PHYS), 0);
+	}
+};
+
+TEST_F(CgroupHandleTest, ReadFiles)
+{
+	int current, stat, len;
+	char buf[64];
+	int ret;
+
+	ret = cgroup_handle_open("memory", CG_NAME, &handle);
+	ASSERT_EQ(ret, 0);
+
+	ret = cgroup_handle_add_file(handle, "memory.current", &current);
+	ASSERT_EQ(ret, 0);
+	ret = cgroup_handle_add_file(handle, "memory.stat", &stat);
+	ASSERT_EQ(ret, 0);
+	ASSERT_NE(current, stat);
+
+	ret = cgroup_handle_read_file(handle, current, buf, sizeof(buf), &len);
+	ASSERT_EQ(ret, 0);
+	ASSERT_STREQ(buf, "4096\n");
+	ASSERT_EQ(len, 5);
+
+	ret = cgroup_handle_read_file(handle, stat, buf, sizeof(buf), NULL);
+	ASSERT_EQ(ret, 0);
+	ASSERT_STREQ(buf, "anon 0\nfile 4096\n");
+
+	/* the file is read again from the beginning */
+	WriteFile("memory.current", "8192\n");
+	ret = cgroup_handle_read_file(handle, current, buf, sizeof(buf), &len);
+	ASSERT_EQ(ret, 0);
+	ASSERT_STREQ(buf, "8192\n");
+
+	/* a longer content is truncated */
+	ret = cgroup_handle_read_file(handle, stat, buf, 8, &len);
+	ASSERT_EQ(ret, 0);
+	ASSERT_STREQ(buf, "anon 0\n");
+	ASSERT_EQ(len, 7);
+
+	ret = cgroup_handle_read_file(handle, stat + 1, buf, sizeof(buf), NULL);
+	ASSERT_EQ(ret, ECGINVAL);
+
+	cgroup_handle_close(&handle);
+	ASSERT_EQ(handle, nullptr);
+}
+
+TEST_F(CgroupHandleTest, Errors)
+{
+	int index;
+	int ret;
+
+	ret = cgroup_handle_open("memory", "nosuchcg", &handle);
+	ASSERT_EQ(ret, ECGROUPNOTEXIST);
+	ASSERT_EQ(handle, nullptr);
+
+	ret = cgroup_handle_open("memory", CG_NAME, &handle);
+	ASSERT_EQ(ret, 0);
+
+	ret = cgroup_handle_add_file(handle, "memory.nosuchfile", &index);
+	ASSERT_EQ(ret, ECGROUPVALUENOTEXIST);
+}
@@ -0,0 +1,338 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/**
+ * libcgroup googletest and microbenchmark for cgroup_snapshot_subtree()
+ */
+
+#include <map>
+#include <set>
+#include <string>
+using namespace std;
+
+#include <ftw.h>
+#include <time.h>
+
+#include "gtest/gtest.h"
+
+#include "libcgroup-internal.h"
+
+static const char * const PARENT_DIR = "test025cgroup";
+static const char * const BASE = "snapcg";
+static const mode_t MODE = S_IRWXU | S_IRWXG | S_IRWXO;
+
+/* The benchmark tree has 1 + BENCH_WIDTH + BENCH_WIDTH^2 groups */
+static const int BENCH_WIDTH = 100;
+
+static const char * const FILES[] = {
+	"memory.current",
+	"memory.stat",
+	"io.stat",
+	NULL,
+};
+
+typedef map<string, set<string>> snapshot_map;
+
+class CgroupSnapshotTest : public ::testing::Test {
+	protected:
+
+	struct cgroup_snapshot *snap = NULL;
+
+	void SetUp() override
+	{
+		int ret;
+
+		ret = cgroup_init();
+		ASSERT_EQ(ret, 0);
+
+		ret = mkdir(PARENT_DIR, MODE);
+		ASSERT_EQ(ret, 0);
+
+		memset(&cg_mount_table, 0, sizeof(cg_mount_table));
+		memset(&cg_namespace_table, 0, sizeof(cg_namespace_table));
+
+		snprintf(cg_mount_table[0].name, CONTROL_NAMELEN_MAX, "memory");
+		snprintf(cg_mount_table[0].mount.path, FILENAME_MAX, "%s", PARENT_DIR);
+		cg_mount_table[0].version = CGROUP_V2;
+
+		ret = cg_build_path_prefix_table();
+		ASSERT_EQ(ret, 0);
+	}
+
+	void CreateGroup(const string& name, int n)
+	{
+		string path = string(PARENT_DIR) + "/" + name;
+
+		ASSERT_EQ(mkdir(path.c_str(), MODE), 0);
+
+		WriteFile(path + "/memory.current", to_string(n * 4096) + "\n");
+		WriteFile(path + "/memory.stat", "anon " + to_string(n) + "\nfile 0\n"
+			  "workingset_refault_anon 7\n");
+		WriteFile(path + "/io.stat", "8:0 rbytes=" + to_string(n) +
+			  " wbytes=2 rios=3 wios=4 dbytes=0 dios=0\n");
+		/* not read */
+		WriteFile(path + "/memory.max", "max\n");
+	}
+
+	/*
+	 * Creating thousands of small files is slow on some filesystems, the
+	 * files of the benchmark groups are links to the files of the base
+	 */
+	void LinkGroup(const string& name)
+	{
+		string path = string(PARENT_DIR) + "/" + name;
+		string base = string(PARENT_DIR) + "/" + BASE;
+		int i;
+
+		ASSERT_EQ(mkdir(path.c_str(), MODE), 0);
+
+		for (i = 0; FILES[i]; i++)
+			ASSERT_EQ(link((base + "/" + FILES[i]).c_str(),
+				       (path + "/" + FILES[i]).c_str()), 0);
+	}
+
+	void WriteFile(const string& path, const string& value)
+	{
+		FILE *f;
+
+		f = fopen(path.c_str(), "w");
+		ASSERT_NE(f, nullptr);
+		fprintf(f, "%s", value.c_str());
+		fclose(f);
+	}
+
+	static int unlink_cb(const char *fpath, const struct stat *sb, int typeflag,
+			     struct FTW *ftwbuf)
+	{
+		return remove(fpath);
+	}
+
+	void TearDown() override
+	{
+		cgroup_snapshot_free(&snap);
+		cg_free_path_prefix_table();
+
+		ASSERT_EQ(nftw(PARENT_DIR, unlink_cb, 64, FTW_DEPTH | FTW_PHYS), 0);
+	}
+};
+
+static void map_snapshot(const struct cgroup_snapshot * const snap, snapshot_map& snap_map)
+{
+	int i;
+
+	for (i = 0; i < snap->record_cnt; i++) {
+		ASSERT_LT(snap->records[i].cgroup, (uint32_t)snap->cgroup_cnt);
+		ASSERT_LT(snap->records[i].key, (uint32_t)snap->key_cnt);
+		/* the records are ordered by group */
+		if (i > 0)
+			ASSERT_LE(snap->records[i - 1].cgroup, snap->records[i].cgroup);
+
+		snap_map[snap->cgroups[snap->records[i].cgroup]].insert(
+			string(snap->keys[snap->records[i].key]) + "=" +
+			to_string(snap->records[i].value));
+	}
+}
+
+TEST_F(CgroupSnapshotTest, ReadSubtree)
+{
+	snapshot_map snap_map, snap_map2;
+	int ret, i;
+
+	CreateGroup(BASE, 1);
+	CreateGroup(string(BASE) + "/a", 2);
+	CreateGroup(string(BASE) + "/a/b", 3);
+	CreateGroup(string(BASE) + "/c", 4);
+	/* a group without the files */
+	ASSERT_EQ(mkdir((string(PARENT_DIR) + "/" + BASE + "/d").c_str(), MODE), 0);
+	/* a value that isn't a number and a maximum */
+	WriteFile(string(PARENT_DIR) + "/" + BASE + "/c/memory.current", "max\n");
+	WriteFile(string(PARENT_DIR) + "/" + BASE + "/c/memory.stat", "anon -1\nfile 1.5\n");
+
+	ret = cgroup_snapshot_subtree("memory", BASE, FILES, 1, &snap);
+	ASSERT_EQ(ret, 0);
+
+	ASSERT_EQ(snap->cgroup_cnt, 5);
+	ASSERT_STREQ(snap->cgroups[0], BASE);
+	/* every group is before its children */
+	for (i = 0; i < snap->cgroup_cnt; i++) {
+		if (!strcmp(snap->cgroups[i], "snapcg/a/b"))
+			break;
+		ASSERT_STRNE(snap->cgroups[i], "snapcg/a/b");
+	}
+	for (i = 0; i < snap->cgroup_cnt; i++)
+		if (!strcmp(snap->cgroups[i], "snapcg/a"))
+			break;
+	ASSERT_LT(i, snap->cgroup_cnt);
+	ASSERT_STREQ(snap->cgroups[i + 1], "snapcg/a/b");
+
+	map_snapshot(snap, snap_map);
+
+	ASSERT_EQ(snap_map["snapcg/a/b"], set<string>({
+		"memory.current=12288",
+		"memory.stat:anon=3",
+		"memory.stat:file=0",
+		"memory.stat:workingset_refault_anon=7",
+		"io.stat:8:0:rbytes=3",
+		"io.stat:8:0:wbytes=2",
+		"io.stat:8:0:rios=3",
+		"io.stat:8:0:wios=4",
+		"io.stat:8:0:dbytes=0",
+		"io.stat:8:0:dios=0",
+	}));
+	ASSERT_EQ(snap_map["snapcg/c"], set<string>({
+		"memory.current=18446744073709551615",
+		"io.stat:8:0:rbytes=4",
+		"io.stat:8:0:wbytes=2",
+		"io.stat:8:0:rios=3",
+		"io.stat:8:0:wios=4",
+		"io.stat:8:0:dbytes=0",
+		"io.stat:8:0:dios=0",
+	}));
+	ASSERT_EQ(snap_map.count("snapcg/d"), 0);
+	ASSERT_EQ(snap_map.size(), 4);
+
+	/* the keys are interned */
+	ASSERT_EQ(snap->key_cnt, 10);
+
+	cgroup_snapshot_free(&snap);
+	ASSERT_EQ(snap, nullptr);
+
+	/* the workers get the same values */
+	for (i = 0; i < 50; i++)
+		CreateGroup(string(BASE) + "/c/" + to_string(i), i);
+
+	ret = cgroup_snapshot_subtree("memory", BASE, FILES, 1, &snap);
+	ASSERT_EQ(ret, 0);
+	snap_map.clear();
+	map_snapshot(snap, snap_map);
+	cgroup_snapshot_free(&snap);
+
+	ret = cgroup_snapshot_subtree("memory", BASE, FILES, 4, &snap);
+	ASSERT_EQ(ret, 0);
+	ASSERT_EQ(snap->cgroup_cnt, 55);
+	map_snapshot(snap, snap_map2);
+
+	ASSERT_EQ(snap_map, snap_map2);
+}
+
+TEST_F(CgroupSnapshotTest, NoSuchCgroup)
+{
+	int ret;
+
+	ret = cgroup_snapshot_subtree("memory", "nosuchcg", FILES, 0, &snap);
+	ASSERT_EQ(ret, ECGROUPNOTEXIST);
+	ASSERT_EQ(snap, nullptr);
+}
+
+TEST_F(CgroupSnapshotTest, ReadError)
+{
+	string path = string(PARENT_DIR) + "/" + BASE + "/a/io.stat";
+	int ret;
+
+	CreateGroup(BASE, 1);
+	CreateGroup(string(BASE) + "/a", 2);
+
+	/* Only a removed group is skipped, not a file that can't be read */
+	ASSERT_EQ(unlink(path.c_str()), 0);
+	ASSERT_EQ(mkdir(path.c_str(), MODE), 0);
+
+	ret = cgroup_snapshot_subtree("memory", BASE, FILES, 1, &snap);
+	ASSERT_EQ(ret, ECGOTHER);
+	ASSERT_EQ(cgroup_get_last_errno(), EISDIR);
+	ASSERT_EQ(snap, nullptr);
+}
+
+static double elapsed_ms(const struct timespec& start, const struct timespec& end)
+{
+	return (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+/* Read the files of every group with cgroup_walk_tree_*() and cgroup_read_*() */
+static int iterate_subtree(void)
+{
+	struct cgroup_file_info info;
+	struct cgroup_stat stat;
+	void *handle, *value_handle;
+	int base_level, ret, i;
+	const char *path;
+	char buf[4096];
+	int values = 0;
+
+	ret = cgroup_walk_tree_begin("memory", BASE, 0, &handle, &info, &base_level);
+	while (ret == 0) {
+		if (info.type != CGROUP_FILE_TYPE_DIR)
+			goto next;
+
+		path = info.full_path + strlen(PARENT_DIR);
+		path += strspn(path, "/");
+
+		for (i = 0; FILES[i]; i++) {
+			if (!strcmp(FILES[i], "memory.stat")) {
+				ret = cgroup_read_stats_begin("memory", path, &value_handle, &stat);
+				while (ret == 0) {
+					strtoull(stat.value, NULL, 10);
+					values++;
+					ret = cgroup_read_stats_next(&value_handle, &stat);
+				}
+				cgroup_read_stats_end(&value_handle);
+			} else {
+				ret = cgroup_read_value_begin("memory", path, FILES[i],
+							      &value_handle, buf, sizeof(buf));
+				while (ret == 0) {
+					strtoull(buf, NULL, 10);
+					values++;
+					ret = cgroup_read_value_next(&value_handle, buf,
+								     sizeof(buf));
+				}
+				cgroup_read_value_end(&value_handle);
+			}
+		}
+next:
+		ret = cgroup_walk_tree_next(0, &handle, &info, base_level);
+	}
+	cgroup_walk_tree_end(&handle);
+
+	return values;
+}
+
+/* The timings are reported, not compared */
+TEST_F(CgroupSnapshotTest, Benchmark)
+{
+	double iter_ms, snap1_ms, snap_ms;
+	struct timespec start, end;
+	int i, j, values, ret;
+	string name;
+
+	CreateGroup(BASE, 1);
+	for (i = 0; i < BENCH_WIDTH; i++) {
+		name = string(BASE) + "/" + to_string(i);
+		LinkGroup(name);
+		for (j = 0; j < BENCH_WIDTH; j++)
+			LinkGroup(name + "/" + to_string(j));
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	values = iterate_subtree();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	iter_ms = elapsed_ms(start, end);
+	ASSERT_GT(values, 0);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = cgroup_snapshot_subtree("memory", BASE, FILES, 1, &snap);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	snap1_ms = elapsed_ms(start, end);
+	ASSERT_EQ(ret, 0);
+	ASSERT_EQ(snap->cgroup_cnt, 1 + BENCH_WIDTH + BENCH_WIDTH * BENCH_WIDTH);
+	cgroup_snapshot_free(&snap);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = cgroup_snapshot_subtree("memory", BASE, FILES, 0, &snap);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	snap_ms = elapsed_ms(start, end);
+	ASSERT_EQ(ret, 0);
+
+	printf("%d groups: %.1f ms with the iterators, %.1f ms with "
+	       "cgroup_snapshot_subtree() on 1 thread, %.1f ms on the default threads\n",
+	       snap->cgroup_cnt, iter_ms, snap1_ms, snap_ms);
+	RecordProperty("iterators_ms", (int)iter_ms);
+	RecordProperty("snapshot_1_thread_ms", (int)snap1_ms);
+	RecordProperty("snapshot_ms", (int)snap_ms);
+}
@@ -0,0 +1,257 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/**
+ * libcgroup googletest for the cgroup_stat_parser functions
+ */
+
+#include <string>
+#include <vector>
+using namespace std;
+
+#include <ftw.h>
+
+#include "gtest/gtest.h"
+
+#include "libcgroup-internal.h"
+
+static const char * const PARENT_DIR = "test026cgroup";
+static const char * const CG_NAME = "statcg";
+static const mode_t MODE = S_IRWXU | S_IRWXG | S_IRWXO;
+
+static const char * const MEMORY_STAT =
+	"anon 4096\n"
+	"file 8192\n"
+	"kernel_stack 16384\n"
+	"pgfault 123456789012\n";
+
+class CgroupStatParserTest : public ::testing::Test {
+	protected:
+
+	struct cgroup_stat_parser *parser = NULL;
+
+	void SetUp() override
+	{
+		char path[FILENAME_MAX];
+		int ret;
+
+		ret = cgroup_init();
+		ASSERT_EQ(ret, 0);
+
+		ret = mkdir(PARENT_DIR, MODE);
+		ASSERT_EQ(ret, 0);
+
+		snprintf(path, sizeof(path), "%s/%s", PARENT_DIR, CG_NAME);
+		ret = mkdir(path, MODE);
+		ASSERT_EQ(ret, 0);
+
+		memset(&cg_mount_table, 0, sizeof(cg_mount_table));
+		memset(&cg_namespace_table, 0, sizeof(cg_namespace_table));
+
+		snprintf(cg_mount_table[0].name, CONTROL_NAMELEN_MAX, "memory");
+		snprintf(cg_mount_table[0].mount.path, FILENAME_MAX, "%s", PARENT_DIR);
+		cg_mount_table[0].version = CGROUP_V2;
+
+		ret = cg_build_path_prefix_table();
+		ASSERT_EQ(ret, 0);
+
+		ret = cgroup_stat_parser_new(&parser);
+		ASSERT_EQ(ret, 0);
+	}
+
+	void WriteFile(const char * const name, const string& value)
+	{
+		char path[FILENAME_MAX];
+		FILE *f;
+
+		snprintf(path, sizeof(path), "%s/%s/%s", PARENT_DIR, CG_NAME, name);
+		f = fopen(path, "w");
+		ASSERT_NE(f, nullptr);
+		fprintf(f, "%s", value.c_str());
+		fclose(f);
+	}
+
+	/* The values as "<key>=<type>:<value>" */
+	vector<string> Parse(const string& content)
+	{
+		const struct cgroup_stat_value *values;
+		vector<string> vec;
+		int ret, cnt, i;
+
+		ret = cgroup_stat_parse(parser, content.data(), content.size(), &values, &cnt);
+		EXPECT_EQ(ret, 0);
+		if (ret)
+			return vec;
+
+		for (i = 0; i < cnt; i++)
+			vec.push_back(string(cgroup_stat_parser_key_name(parser, values[i].key)) +
+				      "=" + to_string(values[i].type) + ":" +
+				      to_string(values[i].value));
+
+		return vec;
+	}
+
+	static int unlink_cb(const char *fpath, const struct stat *sb, int typeflag,
+			     struct FTW *ftwbuf)
+	{
+		return remove(fpath);
+	}
+
+	void TearDown() override
+	{
+		cgroup_stat_parser_free(&parser);
+		ASSERT_EQ(parser, nullptr);
+		cg_free_path_prefix_table();
+
+		ASSERT_EQ(nftw(PARENT_DIR, unlink_cb, 64, FTW_DEPTH | FTW_PHYS), 0);
+	}
+};
+
+TEST_F(CgroupStatParserTest, FlatKeyed)
+{
+	ASSERT_EQ(Parse(MEMORY_STAT), vector<string>({
+		"anon=0:4096",
+		"file=0:8192",
+		"kernel_stack=0:16384",
+		"pgfault=0:123456789012",
+	}));
+
+	/* a last line without a newline, blank lines and values to leave out */
+	ASSERT_EQ(Parse("anon -1\n\nfile 1x\n zswap\t7 \nfile 18446744073709551616\nshmem 5"),
+		  vector<string>({
+		"zswap=0:7",
+		"shmem=0:5",
+	}));
+}
+
+TEST_F(CgroupStatParserTest, NestedKeyed)
+{
+	ASSERT_EQ(Parse("8:0 rbytes=4096 wbytes=0 rios=max\n"
+			"8:16 rbytes=1 dios=2\n"), vector<string>({
+		"8:0:rbytes=0:4096",
+		"8:0:wbytes=0:0",
+		"8:0:rios=1:18446744073709551615",
+		"8:16:rbytes=0:1",
+		"8:16:dios=0:2",
+	}));
+
+	/* memory.pressure */
+	ASSERT_EQ(Parse("some avg10=0.25 avg60=1.5 avg300=12.345 total=1234\n"
+			"full avg10=0.00 avg60=0.00 avg300=0.00 total=0\n"), vector<string>({
+		"some:avg10=2:25",
+		"some:avg60=2:150",
+		"some:avg300=2:1234",
+		"some:total=0:1234",
+		"full:avg10=2:0",
+		"full:avg60=2:0",
+		"full:avg300=2:0",
+		"full:total=0:0",
+	}));
+}
+
+TEST_F(CgroupStatParserTest, SingleValue)
+{
+	ASSERT_EQ(Parse("1073741824\n"), vector<string>({"=0:1073741824"}));
+	ASSERT_EQ(Parse("max\n"), vector<string>({"=1:18446744073709551615"}));
+	ASSERT_EQ(Parse("domain\n"), vector<string>());
+	ASSERT_EQ(Parse(""), vector<string>());
+}
+
+TEST_F(CgroupStatParserTest, InternedKeys)
+{
+	const struct cgroup_stat_value *values;
+	uint32_t anon, file, key;
+	int ret, cnt;
+
+	/* the ids can be looked up before the keys are seen */
+	ret = cgroup_stat_parser_key(parser, "file", &file);
+	ASSERT_EQ(ret, 0);
+	ret = cgroup_stat_parser_key(parser, "anon", &anon);
+	ASSERT_EQ(ret, 0);
+	ASSERT_NE(anon, file);
+	ASSERT_STREQ(cgroup_stat_parser_key_name(parser, file), "file");
+	ASSERT_EQ(cgroup_stat_parser_key_name(parser, 1000), nullptr);
+
+	ret = cgroup_stat_parse(parser, MEMORY_STAT, strlen(MEMORY_STAT), &values, &cnt);
+	ASSERT_EQ(ret, 0);
+	ASSERT_EQ(cnt, 4);
+	ASSERT_EQ(values[0].key, anon);
+	ASSERT_EQ(values[1].key, file);
+
+	/* parsing again returns the same ids without adding keys */
+	ret = cgroup_stat_parse(parser, MEMORY_STAT, strlen(MEMORY_STAT), &values, &cnt);
+	ASSERT_EQ(ret, 0);
+	ASSERT_EQ(values[0].key, anon);
+	ASSERT_EQ(parser->key_cnt, 4);
+
+	ret = cgroup_stat_parser_key(parser, "pgfault", &key);
+	ASSERT_EQ(ret, 0);
+	ASSERT_EQ(values[3].key, key);
+
+	ret = cgroup_stat_parse(NULL, MEMORY_STAT, strlen(MEMORY_STAT), &values, &cnt);
+	ASSERT_EQ(ret, ECGINVAL);
+}
+
+TEST_F(CgroupStatParserTest, ReadFile)
+{
+	const struct cgroup_stat_value *values;
+	struct cgroup_handle *handle;
+	string content;
+	int ret, cnt, i;
+	int index;
+
+	/* a file larger than CG_CONTROL_VALUE_MAX */
+	for (i = 0; i < 1000; i++)
+		content += "key_" + to_string(i) + " " + to_string(i) + "\n";
+	ASSERT_GT(content.size(), CG_CONTROL_VALUE_MAX);
+	WriteFile("memory.stat", content);
+
+	ret = cgroup_stat_read(parser, "memory", CG_NAME, "memory.stat", &values, &cnt);
+	ASSERT_EQ(ret, 0);
+	ASSERT_EQ(cnt, 1000);
+	for (i = 0; i < cnt; i++) {
+		ASSERT_EQ(values[i].value, (uint64_t)i);
+		ASSERT_EQ(string(cgroup_stat_parser_key_name(parser, values[i].key)),
+			  "key_" + to_string(i));
+	}
+
+	ret = cgroup_stat_read(parser, "memory", CG_NAME, "memory.nosuchfile", &values, &cnt);
+	ASSERT_EQ(ret, ECGROUPVALUENOTEXIST);
+
+	ret = cgroup_handle_open("memory", CG_NAME, &handle);
+	ASSERT_EQ(ret, 0);
+	ret = cgroup_handle_add_file(handle, "memory.stat", &index);
+	ASSERT_EQ(ret, 0);
+
+	WriteFile("memory.stat", MEMORY_STAT);
+	ret = cgroup_handle_read_stat(handle, index, parser, &values, &cnt);
+	ASSERT_EQ(ret, 0);
+	ASSERT_EQ(cnt, 4);
+	ASSERT_STREQ(cgroup_stat_parser_key_name(parser, values[3].key), "pgfault");
+	ASSERT_EQ(values[3].value, 123456789012ULL);
+
+	cgroup_handle_close(&handle);
+}
+
+TEST_F(CgroupStatParserTest, LargeFile)
+{
+	const struct cgroup_stat_value *values;
+	string content;
+	int i, j, ret, cnt;
+
+	/* about the size of memory.stat of a recent kernel */
+	for (i = 0; i < 60; i++)
+		content += "memory_stat_key_" + to_string(i) + " " + to_string(i * 4096) + "\n";
+	WriteFile("memory.stat", content);
+
+	/* the second read finds the keys interned by the first */
+	for (j = 0; j < 2; j++) {
+		ret = cgroup_stat_read(parser, "memory", CG_NAME, "memory.stat", &values, &cnt);
+		ASSERT_EQ(ret, 0);
+		ASSERT_EQ(cnt, 60);
+
+		for (i = 0; i < cnt; i++) {
+			ASSERT_EQ(string(cgroup_stat_parser_key_name(parser, values[i].key)),
+				  "memory_stat_key_" + to_string(i));
+			ASSERT_EQ(values[i].value, (uint64_t)i * 4096);
+		}
+	}
+}
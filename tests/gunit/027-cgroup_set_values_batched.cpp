@@ -0,0 +1,224 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/**
+ * libcgroup googletest for the batched writes of cgroup_set_values_recursive(),
+ * which writes all the settings of a controller relative to one descriptor of
+ * the cgroup directory
+ */
+
+#include <string>
+#include <vector>
+using namespace std;
+
+#include <ftw.h>
+
+#include "gtest/gtest.h"
+
+#include "libcgroup-internal.h"
+
+static const char * const PARENT_DIR = "test027cgroup/";
+static const mode_t MODE = S_IRWXU | S_IRWXG | S_IRWXO;
+
+/* Groups writes GROUPS groups of FILES settings */
+static const int GROUPS = 50;
+static const int FILES = 15;
+
+static const char * const SETTINGS[][2] = {
+	{"memory.limit_in_bytes", "1073741824"},
+	{"memory.memsw.limit_in_bytes", "2147483648\n"},
+	{"memory.soft_limit_in_bytes", "536870912"},
+	/* read-only, it's left alone */
+	{"memory.usage_in_bytes", "4096"},
+	{"memory.swappiness", "10"},
+};
+static const int SETTINGS_CNT = ARRAY_SIZE(SETTINGS);
+
+class SetValuesBatchedTest : public ::testing::Test {
+	protected:
+
+	struct cgroup_controller ctrlr = {0};
+
+	void SetUp() override
+	{
+		int ret, i;
+
+		ret = mkdir(PARENT_DIR, MODE);
+		ASSERT_EQ(ret, 0);
+
+		for (i = 0; i < SETTINGS_CNT; i++)
+			CreateFile(PARENT_DIR, SETTINGS[i][0]);
+		ASSERT_EQ(chmod((string(PARENT_DIR) + SETTINGS[3][0]).c_str(), 0444), 0);
+
+		snprintf(ctrlr.name, CONTROL_NAMELEN_MAX, "memory");
+	}
+
+	void CreateFile(const string& dir, const string& name)
+	{
+		FILE *f;
+
+		f = fopen((dir + name).c_str(), "w");
+		ASSERT_NE(f, nullptr);
+		fclose(f);
+	}
+
+	string ReadFile(const string& path)
+	{
+		char buf[256] = { 0 };
+		FILE *f;
+
+		f = fopen(path.c_str(), "r");
+		EXPECT_NE(f, nullptr);
+		if (!f)
+			return "";
+		fread(buf, 1, sizeof(buf) - 1, f);
+		fclose(f);
+
+		return buf;
+	}
+
+	void AddValue(const char * const name, const char * const value, bool dirty)
+	{
+		struct control_value *cv;
+
+		cv = cgroup_alloc_value(name, value);
+		ASSERT_NE(cv, nullptr);
+		cv->dirty = dirty;
+
+		ASSERT_EQ(cgroup_append_value(&ctrlr, cv), 0);
+	}
+
+	void FreeValues(void)
+	{
+		int i;
+
+		for (i = 0; i < ctrlr.index; i++)
+			cgroup_free_value(ctrlr.values[i]);
+		free(ctrlr.values);
+		ctrlr.values = NULL;
+		ctrlr.index = 0;
+		ctrlr.values_alloc = 0;
+		free(ctrlr.values_hash);
+		ctrlr.values_hash = NULL;
+		ctrlr.values_hash_size = 0;
+	}
+
+	static int unlink_cb(const char *fpath, const struct stat *sb, int typeflag,
+			     struct FTW *ftwbuf)
+	{
+		return remove(fpath);
+	}
+
+	void TearDown() override
+	{
+		FreeValues();
+
+		ASSERT_EQ(nftw(PARENT_DIR, unlink_cb, 64, FTW_DEPTH | FTW_PHYS), 0);
+	}
+};
+
+TEST_F(SetValuesBatchedTest, WriteSettings)
+{
+	int ret, i;
+
+	for (i = 0; i < SETTINGS_CNT; i++)
+		AddValue(SETTINGS[i][0], SETTINGS[i][1], i != 2);
+
+	/* only the dirty settings */
+	ret = cgroup_set_values_recursive(PARENT_DIR, &ctrlr, true);
+	ASSERT_EQ(ret, 0);
+
+	ASSERT_EQ(ReadFile(string(PARENT_DIR) + SETTINGS[0][0]), "1073741824");
+	/* the trailing newline isn't written */
+	ASSERT_EQ(ReadFile(string(PARENT_DIR) + SETTINGS[1][0]), "2147483648");
+	ASSERT_EQ(ReadFile(string(PARENT_DIR) + SETTINGS[2][0]), "");
+	ASSERT_EQ(ReadFile(string(PARENT_DIR) + SETTINGS[3][0]), "");
+	ASSERT_EQ(ReadFile(string(PARENT_DIR) + SETTINGS[4][0]), "10");
+
+	ASSERT_FALSE(ctrlr.values[0]->dirty);
+	ASSERT_FALSE(ctrlr.values[4]->dirty);
+	/* the read-only setting isn't written */
+	ASSERT_TRUE(ctrlr.values[3]->dirty);
+
+	ret = cgroup_set_values_recursive(PARENT_DIR, &ctrlr, false);
+	ASSERT_EQ(ret, 0);
+	ASSERT_EQ(ReadFile(string(PARENT_DIR) + SETTINGS[2][0]), "536870912");
+}
+
+TEST_F(SetValuesBatchedTest, MissingSetting)
+{
+	int ret;
+
+	AddValue(SETTINGS[0][0], SETTINGS[0][1], true);
+	AddValue("memory.nosuchfile", "1", true);
+	AddValue(SETTINGS[4][0], SETTINGS[4][1], true);
+
+	ret = cgroup_set_values_recursive(PARENT_DIR, &ctrlr, false);
+	ASSERT_EQ(ret, ECGROUPVALUENOTEXIST);
+	ASSERT_EQ(cgroup_get_last_errno(), ENOENT);
+
+	/* the settings before the missing one are written */
+	ASSERT_FALSE(ctrlr.values[0]->dirty);
+	ASSERT_TRUE(ctrlr.values[2]->dirty);
+	ASSERT_EQ(ReadFile(string(PARENT_DIR) + SETTINGS[4][0]), "");
+
+	FreeValues();
+
+	ret = cgroup_set_values_recursive("test027nosuchdir/", &ctrlr, false);
+	ASSERT_EQ(ret, 0);
+	AddValue(SETTINGS[0][0], SETTINGS[0][1], true);
+	ret = cgroup_set_values_recursive("test027nosuchdir/", &ctrlr, false);
+	ASSERT_EQ(ret, ECGROUPVALUENOTEXIST);
+}
+
+TEST_F(SetValuesBatchedTest, ManySettings)
+{
+	char name[32], value[32];
+	int ret, i;
+
+	for (i = 0; i < 200; i++) {
+		snprintf(name, sizeof(name), "memory.setting%d", i);
+		snprintf(value, sizeof(value), "%d", i * 3);
+		CreateFile(PARENT_DIR, name);
+		AddValue(name, value, true);
+	}
+
+	ret = cgroup_set_values_recursive(PARENT_DIR, &ctrlr, false);
+	ASSERT_EQ(ret, 0);
+
+	for (i = 0; i < 200; i++) {
+		snprintf(name, sizeof(name), "memory.setting%d", i);
+		ASSERT_EQ(ReadFile(string(PARENT_DIR) + name), to_string(i * 3));
+		ASSERT_FALSE(ctrlr.values[i]->dirty);
+	}
+}
+
+TEST_F(SetValuesBatchedTest, Groups)
+{
+	char name[32], value[32];
+	vector<string> dirs;
+	int ret, i, j;
+
+	for (i = 0; i < GROUPS; i++) {
+		dirs.push_back(string(PARENT_DIR) + to_string(i) + "/");
+		ASSERT_EQ(mkdir(dirs[i].c_str(), MODE), 0);
+		for (j = 0; j < FILES; j++) {
+			snprintf(name, sizeof(name), "memory.setting%d", j);
+			CreateFile(dirs[i], name);
+		}
+	}
+
+	for (j = 0; j < FILES; j++) {
+		snprintf(name, sizeof(name), "memory.setting%d", j);
+		snprintf(value, sizeof(value), "%d", j * 4096);
+		AddValue(name, value, true);
+	}
+
+	for (i = 0; i < GROUPS; i++) {
+		ret = cgroup_set_values_recursive(dirs[i].c_str(), &ctrlr, false);
+		ASSERT_EQ(ret, 0);
+	}
+
+	for (i = 0; i < GROUPS; i++) {
+		for (j = 0; j < FILES; j++)
+			ASSERT_EQ(ReadFile(dirs[i] + ctrlr.values[j]->name), to_string(j * 4096));
+	}
+}
@@ -0,0 +1,196 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/**
+ * libcgroup googletest for cgroup_config_group_parents() and
+ * cgroup_config_create_groups()
+ */
+
+#include <algorithm>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include <ftw.h>
+
+#include "gtest/gtest.h"
+
+#include "libcgroup-internal.h"
+
+class ConfigGroupParentsTest : public ::testing::Test {
+	protected:
+
+	vector<int> Parents(const vector<string>& names)
+	{
+		vector<struct cgroup> groups(names.size());
+		vector<int> parents(names.size());
+		size_t i;
+		int ret;
+
+		for (i = 0; i < names.size(); i++)
+			snprintf(groups[i].name, FILENAME_MAX, "%s", names[i].c_str());
+
+		ret = cgroup_config_group_parents(groups.data(), groups.size(), parents.data());
+		EXPECT_EQ(ret, 0);
+
+		return parents;
+	}
+};
+
+TEST_F(ConfigGroupParentsTest, Ancestors)
+{
+	ASSERT_EQ(Parents({"a", "a/b", "a/b/c", "d", "a/e"}),
+		  vector<int>({-1, 0, 1, -1, 0}));
+
+	/* the children before their parent in the config */
+	ASSERT_EQ(Parents({"a/b/c", "a/b", "a"}), vector<int>({1, 2, -1}));
+
+	/* the closest ancestor in the config */
+	ASSERT_EQ(Parents({"x/y/z", "x", "x/y2/z"}), vector<int>({1, -1, 1}));
+}
+
+TEST_F(ConfigGroupParentsTest, Names)
+{
+	/* the root group, leading and repeated slashes */
+	ASSERT_EQ(Parents({"a", ".", "/b", "a//c", "/"}), vector<int>({4, -1, 4, 0, 1}));
+
+	/* a name that is a prefix of another group isn't its ancestor */
+	ASSERT_EQ(Parents({"ab", "a", "a/b", "ab/c", "a-b/c"}),
+		  vector<int>({-1, -1, 1, 0, -1}));
+}
+
+TEST_F(ConfigGroupParentsTest, Duplicates)
+{
+	/*
+	 * a group defined twice is created in the order of the config, its
+	 * children after its last definition
+	 */
+	ASSERT_EQ(Parents({"a", "a/b", "a", "a/b"}), vector<int>({-1, 2, 0, 1}));
+
+	ASSERT_EQ(Parents({}), vector<int>({}));
+}
+
+static const char * const PARENT_DIR = "test028cgroup";
+static const mode_t MODE = S_IRWXU | S_IRWXG | S_IRWXO;
+
+class ConfigCreateGroupsTest : public ::testing::Test {
+	protected:
+
+	char v2_mount_path[FILENAME_MAX];
+	vector<struct cgroup> groups;
+
+	void SetUp() override
+	{
+		ASSERT_EQ(cgroup_init(), 0);
+
+		ASSERT_EQ(mkdir(PARENT_DIR, MODE), 0);
+
+		/* The groups have no controller, they are created in the v2 hierarchy */
+		memset(&cg_mount_table, 0, sizeof(cg_mount_table));
+		memset(&cg_namespace_table, 0, sizeof(cg_namespace_table));
+		memcpy(v2_mount_path, cg_cgroup_v2_mount_path, sizeof(v2_mount_path));
+		snprintf(cg_cgroup_v2_mount_path, FILENAME_MAX, "%s", PARENT_DIR);
+		ASSERT_EQ(cg_build_path_prefix_table(), 0);
+	}
+
+	void Groups(const vector<string>& names)
+	{
+		size_t i;
+
+		groups.resize(names.size());
+		memset(groups.data(), 0, groups.size() * sizeof(struct cgroup));
+		init_cgroup_table(groups.data(), groups.size());
+
+		for (i = 0; i < names.size(); i++)
+			snprintf(groups[i].name, FILENAME_MAX, "%s", names[i].c_str());
+	}
+
+	static vector<string> dirs;
+
+	static int list_cb(const char *fpath, const struct stat *sb, int typeflag,
+			   struct FTW *ftwbuf)
+	{
+		if (typeflag == FTW_D && ftwbuf->level > 0)
+			dirs.push_back(fpath + strlen(PARENT_DIR) + 1);
+
+		return 0;
+	}
+
+	/* The directories of the hierarchy, sorted */
+	static vector<string> ListDirs(void)
+	{
+		dirs.clear();
+		EXPECT_EQ(nftw(PARENT_DIR, list_cb, 64, FTW_PHYS), 0);
+		sort(dirs.begin(), dirs.end());
+
+		return dirs;
+	}
+
+	static int unlink_cb(const char *fpath, const struct stat *sb, int typeflag,
+			     struct FTW *ftwbuf)
+	{
+		if (ftwbuf->level == 0)
+			return 0;
+
+		return remove(fpath);
+	}
+
+	/* Empty the hierarchy */
+	void Reset(void)
+	{
+		groups.clear();
+		ASSERT_EQ(nftw(PARENT_DIR, unlink_cb, 64, FTW_DEPTH | FTW_PHYS), 0);
+	}
+
+	void TearDown() override
+	{
+		Reset();
+
+		memcpy(cg_cgroup_v2_mount_path, v2_mount_path, sizeof(v2_mount_path));
+		cg_free_path_prefix_table();
+
+		ASSERT_EQ(rmdir(PARENT_DIR), 0);
+	}
+};
+
+vector<string> ConfigCreateGroupsTest::dirs;
+
+TEST_F(ConfigCreateGroupsTest, Jobs)
+{
+	vector<string> names = {"a", "a/b", "d", "a/b/c", "d/e", "a/f", "d/e/g", "h"};
+	vector<string> expected;
+	int jobs;
+
+	for (jobs = 1; jobs <= 4; jobs++) {
+		Groups(names);
+		ASSERT_EQ(cgroup_config_create_groups(groups.data(), groups.size(), jobs), 0);
+
+		if (jobs == 1)
+			expected = ListDirs();
+		else
+			ASSERT_EQ(ListDirs(), expected);
+
+		Reset();
+	}
+
+	sort(names.begin(), names.end());
+	ASSERT_EQ(expected, names);
+}
+
+TEST_F(ConfigCreateGroupsTest, Rollback)
+{
+	string path = string(PARENT_DIR) + "/x";
+	FILE *f;
+	int jobs;
+
+	for (jobs = 1; jobs <= 4; jobs++) {
+		/* x/y can't be created under a regular file */
+		f = fopen(path.c_str(), "w");
+		ASSERT_NE(f, nullptr);
+		fclose(f);
+
+		Groups({"a", "a/b", "c", "x/y", "c/d"});
+		ASSERT_NE(cgroup_config_create_groups(groups.data(), groups.size(), jobs), 0);
+		ASSERT_EQ(ListDirs(), vector<string>({}));
+
+		Reset();
+	}
+}
@@ -0,0 +1,290 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/**
+ * libcgroup googletest for the compiled cache of the rules
+ */
+
+#include <string>
+using namespace std;
+
+#include <ftw.h>
+
+#include "gtest/gtest.h"
+
+#include "libcgroup-internal.h"
+
+static const char * const PARENT_DIR = "test029rules";
+static const char * const CONF_FILE = "test029rules/cgrules.conf";
+static const char * const CONF_DIR = "test029rules/cgrules.d";
+static const char * const CACHE_FILE = "test029rules/cache/cgrules.cache";
+static const mode_t MODE = S_IRWXU | S_IRWXG | S_IRWXO;
+
+static const int RULES_CNT = 100;
+
+class RulesCacheTest : public ::testing::Test {
+	protected:
+
+	struct cgroup_rule_list lst = { NULL, NULL, 0 };
+	struct cg_rules_cache_sources srcs = { 0 };
+	struct cg_rules_cache cache = { 0 };
+
+	void SetUp() override
+	{
+		ASSERT_EQ(mkdir(PARENT_DIR, MODE), 0);
+		ASSERT_EQ(mkdir(CONF_DIR, MODE), 0);
+
+		WriteFile(CONF_FILE, "* cpu /\n");
+		WriteFile(string(CONF_DIR) + "/10-users.conf", "root cpu root\n");
+	}
+
+	void WriteFile(const string& path, const string& value)
+	{
+		FILE *f;
+
+		f = fopen(path.c_str(), "w");
+		ASSERT_NE(f, nullptr);
+		fprintf(f, "%s", value.c_str());
+		fclose(f);
+	}
+
+	struct cgroup_rule *AddRule(const char * const username, uid_t uid, gid_t gid,
+				    const char * const procname)
+	{
+		struct cgroup_rule *rule;
+
+		rule = (struct cgroup_rule *)calloc(1, sizeof(*rule));
+		if (!rule)
+			return NULL;
+
+		snprintf(rule->username, sizeof(rule->username), "%s", username);
+		snprintf(rule->destination, sizeof(rule->destination), "dest%d", lst.len);
+		rule->uid = uid;
+		rule->gid = gid;
+		if (procname)
+			rule->procname = strdup(procname);
+		rule->controllers[0] = strdup("cpu");
+		rule->controllers[1] = strdup("memory");
+
+		if (!lst.head)
+			lst.head = rule;
+		else
+			lst.tail->next = rule;
+		lst.tail = rule;
+		lst.len++;
+
+		return rule;
+	}
+
+	void FreeRule(struct cgroup_rule *rule)
+	{
+		int i;
+
+		for (i = 0; i < MAX_MNT_ELEMENTS; i++)
+			free(rule->controllers[i]);
+		free(rule->procname);
+		free(rule);
+	}
+
+	void BuildCache(void **image, size_t *size)
+	{
+		ASSERT_EQ(cg_rules_cache_stat_sources(CONF_FILE, CONF_DIR, &srcs), 0);
+		ASSERT_EQ(cg_rules_cache_build(&lst, &srcs, image, size), 0);
+		cg_rules_cache_free_sources(&srcs);
+	}
+
+	void WriteCache(void)
+	{
+		void *image = NULL;
+		size_t size;
+
+		BuildCache(&image, &size);
+		ASSERT_EQ(cg_rules_cache_write(CACHE_FILE, image, size), 0);
+		free(image);
+	}
+
+	static int unlink_cb(const char *fpath, const struct stat *sb, int typeflag,
+			     struct FTW *ftwbuf)
+	{
+		return remove(fpath);
+	}
+
+	void TearDown() override
+	{
+		struct cgroup_rule *rule;
+
+		cg_rules_cache_close(&cache);
+		cg_rules_cache_free_sources(&srcs);
+		cg_rules_shm_unpublish();
+
+		while (lst.head) {
+			rule = lst.head;
+			lst.head = rule->next;
+			FreeRule(rule);
+		}
+
+		ASSERT_EQ(nftw(PARENT_DIR, unlink_cb, 64, FTW_DEPTH | FTW_PHYS), 0);
+	}
+};
+
+TEST_F(RulesCacheTest, RoundTrip)
+{
+	const struct cgroup_rule *orig;
+	struct cgroup_rule *rule;
+	int i, j;
+
+	for (i = 0; i < RULES_CNT; i++) {
+		switch (i % 4) {
+		case 0:
+			ASSERT_NE(AddRule("user", 1000 + i, CGRULE_INVALID, NULL), nullptr);
+			break;
+		case 1:
+			ASSERT_NE(AddRule("user:proc", 1000 + i, CGRULE_INVALID, "proc"),
+				  nullptr);
+			break;
+		case 2:
+			ASSERT_NE(AddRule("@nosuchgroup029", CGRULE_INVALID, 2000 + i, NULL),
+				  nullptr);
+			break;
+		case 3:
+			ASSERT_NE(AddRule("%", CGRULE_INVALID, 2000 + i - 1, NULL), nullptr);
+			lst.tail->is_ignore = CGRULE_OPT_IGNORE;
+			break;
+		}
+	}
+
+	WriteCache();
+
+	ASSERT_EQ(cg_rules_cache_open(CACHE_FILE, &cache), 0);
+	ASSERT_EQ(cg_rules_cache_rule_cnt(&cache), RULES_CNT);
+
+	for (i = 0, orig = lst.head; orig; i++, orig = orig->next) {
+		ASSERT_STREQ(cg_rules_cache_rule_username(&cache, i), orig->username);
+
+		if (orig->procname)
+			ASSERT_STREQ(cg_rules_cache_rule_procname(&cache, i), orig->procname);
+		else
+			ASSERT_EQ(cg_rules_cache_rule_procname(&cache, i), nullptr);
+
+		/* the names are resolved by the caller, the group doesn't even exist */
+		rule = cg_rules_cache_rule(&cache, i);
+		ASSERT_NE(rule, nullptr);
+		ASSERT_EQ(rule->uid, CGRULE_INVALID);
+		ASSERT_EQ(rule->gid, CGRULE_INVALID);
+		ASSERT_STREQ(rule->username, orig->username);
+		ASSERT_STREQ(rule->destination, orig->destination);
+		ASSERT_EQ(rule->is_ignore, orig->is_ignore);
+		for (j = 0; j < MAX_MNT_ELEMENTS; j++) {
+			if (orig->controllers[j])
+				ASSERT_STREQ(rule->controllers[j], orig->controllers[j]);
+			else
+				ASSERT_EQ(rule->controllers[j], nullptr);
+		}
+		FreeRule(rule);
+	}
+}
+
+TEST_F(RulesCacheTest, Stale)
+{
+	ASSERT_NE(AddRule("*", CGRULE_WILD, CGRULE_WILD, NULL), nullptr);
+
+	WriteCache();
+	ASSERT_EQ(cg_rules_cache_open(CACHE_FILE, &cache), 0);
+	cg_rules_cache_close(&cache);
+
+	/* a file edited */
+	WriteFile(CONF_FILE, "* cpu,memory /\n");
+	ASSERT_EQ(cg_rules_cache_open(CACHE_FILE, &cache), ECGFAIL);
+
+	WriteCache();
+	ASSERT_EQ(cg_rules_cache_open(CACHE_FILE, &cache), 0);
+	cg_rules_cache_close(&cache);
+
+	/* a file added to the directory */
+	WriteFile(string(CONF_DIR) + "/20-more.conf", "@root cpu root\n");
+	ASSERT_EQ(cg_rules_cache_open(CACHE_FILE, &cache), ECGFAIL);
+
+	WriteCache();
+	ASSERT_EQ(cg_rules_cache_open(CACHE_FILE, &cache), 0);
+	cg_rules_cache_close(&cache);
+
+	/* a file removed */
+	ASSERT_EQ(unlink((string(CONF_DIR) + "/10-users.conf").c_str()), 0);
+	ASSERT_EQ(cg_rules_cache_open(CACHE_FILE, &cache), ECGFAIL);
+}
+
+TEST_F(RulesCacheTest, Invalid)
+{
+	struct stat st;
+	FILE *f;
+	int c;
+
+	ASSERT_NE(AddRule("*", CGRULE_WILD, CGRULE_WILD, NULL), nullptr);
+
+	ASSERT_EQ(cg_rules_cache_open(CACHE_FILE, &cache), ECGOTHER);
+
+	WriteCache();
+	ASSERT_EQ(stat(CACHE_FILE, &st), 0);
+
+	/* writable by others */
+	ASSERT_EQ(chmod(CACHE_FILE, 0666), 0);
+	ASSERT_EQ(cg_rules_cache_open(CACHE_FILE, &cache), ECGFAIL);
+	ASSERT_EQ(chmod(CACHE_FILE, 0644), 0);
+
+	/* a byte of the strings changed */
+	f = fopen(CACHE_FILE, "r+");
+	ASSERT_NE(f, nullptr);
+	ASSERT_EQ(fseek(f, st.st_size - 2, SEEK_SET), 0);
+	c = fgetc(f);
+	ASSERT_EQ(fseek(f, st.st_size - 2, SEEK_SET), 0);
+	fputc(c ^ 1, f);
+	fclose(f);
+	ASSERT_EQ(cg_rules_cache_open(CACHE_FILE, &cache), ECGFAIL);
+
+	/* truncated */
+	WriteCache();
+	ASSERT_EQ(truncate(CACHE_FILE, st.st_size / 2), 0);
+	ASSERT_EQ(cg_rules_cache_open(CACHE_FILE, &cache), ECGFAIL);
+}
+
+TEST_F(RulesCacheTest, SharedImage)
+{
+	struct cgroup_rule *rule;
+	void *image = NULL;
+	size_t size;
+	int i;
+
+	/* The segment is trusted only if root published it */
+	if (geteuid() != 0)
+		GTEST_SKIP() << "requires root";
+
+	ASSERT_NE(AddRule("*", CGRULE_WILD, CGRULE_WILD, NULL), nullptr);
+	BuildCache(&image, &size);
+	ASSERT_EQ(cg_rules_shm_publish(image, size), 0);
+	free(image);
+
+	ASSERT_EQ(cg_rules_shm_open(&cache), 0);
+	ASSERT_EQ(cg_rules_cache_rule_cnt(&cache), 1);
+	cg_rules_cache_close(&cache);
+
+	/* Published again in place, then in a larger segment */
+	for (i = 0; i < 1000; i++)
+		ASSERT_NE(AddRule("user", 1000 + i, CGRULE_INVALID, "proc"), nullptr);
+	BuildCache(&image, &size);
+	ASSERT_EQ(cg_rules_shm_publish(image, size), 0);
+	free(image);
+
+	ASSERT_EQ(cg_rules_shm_open(&cache), 0);
+	ASSERT_EQ(cg_rules_cache_rule_cnt(&cache), 1001);
+	rule = cg_rules_cache_rule(&cache, 1000);
+	ASSERT_NE(rule, nullptr);
+	ASSERT_STREQ(rule->username, "user");
+	ASSERT_STREQ(rule->procname, "proc");
+	FreeRule(rule);
+	cg_rules_cache_close(&cache);
+
+	/* Stale like the file */
+	WriteFile(CONF_FILE, "* cpu,memory /\n");
+	ASSERT_EQ(cg_rules_shm_open(&cache), ECGFAIL);
+
+	cg_rules_shm_unpublish();
+	ASSERT_EQ(cg_rules_shm_open(&cache), ECGOTHER);
+}
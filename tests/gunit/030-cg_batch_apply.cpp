@@ -0,0 +1,270 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/**
+ * libcgroup googletest for the batched moves of cgroup_change_cgroups_batch()
+ */
+
+#include <string>
+using namespace std;
+
+#include <ftw.h>
+
+#include "gtest/gtest.h"
+
+#include "libcgroup-internal.h"
+
+static const char * const PARENT_DIR = "test030cgroup";
+static const mode_t MODE = S_IRWXU | S_IRWXG | S_IRWXO;
+
+static const char * const CONTROLLERS[] = { "cpu", "memory" };
+static const int CONTROLLERS_CNT = ARRAY_SIZE(CONTROLLERS);
+
+class BatchApplyTest : public ::testing::Test {
+	protected:
+
+	struct cg_batch batch = { 0 };
+	struct cgroup_rule rules[3];
+
+	void SetUp() override
+	{
+		char path[FILENAME_MAX];
+		int ret, i;
+
+		ret = cgroup_init();
+		ASSERT_EQ(ret, 0);
+
+		ASSERT_EQ(mkdir(PARENT_DIR, MODE), 0);
+
+		memset(&cg_mount_table, 0, sizeof(cg_mount_table));
+		memset(&cg_namespace_table, 0, sizeof(cg_namespace_table));
+
+		for (i = 0; i < CONTROLLERS_CNT; i++) {
+			snprintf(path, sizeof(path), "%s/%s", PARENT_DIR, CONTROLLERS[i]);
+			ASSERT_EQ(mkdir(path, MODE), 0);
+
+			snprintf(cg_mount_table[i].name, CONTROL_NAMELEN_MAX, "%s", CONTROLLERS[i]);
+			snprintf(cg_mount_table[i].mount.path, FILENAME_MAX, "%s", path);
+			cg_mount_table[i].version = CGROUP_V1;
+
+			CreateGroup(CONTROLLERS[i], "a");
+		}
+		CreateGroup("cpu", "b");
+
+		ASSERT_EQ(cg_build_path_prefix_table(), 0);
+
+		memset(rules, 0, sizeof(rules));
+		SetRule(&rules[0], "a", "cpu", NULL);
+		SetRule(&rules[1], "a", "memory", NULL);
+		SetRule(&rules[2], "b", "cpu", NULL);
+	}
+
+	void CreateGroup(const char * const controller, const char * const name)
+	{
+		char path[FILENAME_MAX];
+		FILE *f;
+
+		snprintf(path, sizeof(path), "%s/%s/%s", PARENT_DIR, controller, name);
+		ASSERT_EQ(mkdir(path, MODE), 0);
+
+		strncat(path, "/cgroup.procs", sizeof(path) - strlen(path) - 1);
+		f = fopen(path, "w");
+		ASSERT_NE(f, nullptr);
+		fclose(f);
+	}
+
+	/* The file gets each PID written back to back, the kernel reads one per write */
+	string ReadProcs(const char * const controller, const char * const name)
+	{
+		char path[FILENAME_MAX];
+		char buf[256] = { 0 };
+		FILE *f;
+
+		snprintf(path, sizeof(path), "%s/%s/%s/cgroup.procs", PARENT_DIR, controller,
+			 name);
+		f = fopen(path, "r");
+		EXPECT_NE(f, nullptr);
+		if (!f)
+			return "";
+		fread(buf, 1, sizeof(buf) - 1, f);
+		fclose(f);
+
+		return buf;
+	}
+
+	void SetRule(struct cgroup_rule *rule, const char * const dest,
+		     const char * const ctrl0, const char * const ctrl1)
+	{
+		snprintf(rule->destination, sizeof(rule->destination), "%s", dest);
+		rule->controllers[0] = ctrl0 ? strdup(ctrl0) : NULL;
+		rule->controllers[1] = ctrl1 ? strdup(ctrl1) : NULL;
+	}
+
+	void AddEntry(struct cgroup_rule *rule, const char * const dest, pid_t pid)
+	{
+		struct cg_batch_entry *entries;
+
+		entries = (struct cg_batch_entry *)realloc(batch.entries,
+							   (batch.cnt + 1) * sizeof(*entries));
+		ASSERT_NE(entries, nullptr);
+		batch.entries = entries;
+
+		entries[batch.cnt].rule = rule;
+		entries[batch.cnt].dest = strdup(dest);
+		entries[batch.cnt].pid = pid;
+		entries[batch.cnt].pos = batch.cnt;
+		batch.cnt++;
+	}
+
+	static int unlink_cb(const char *fpath, const struct stat *sb, int typeflag,
+			     struct FTW *ftwbuf)
+	{
+		return remove(fpath);
+	}
+
+	void TearDown() override
+	{
+		int i, j;
+
+		for (i = 0; i < batch.cnt; i++)
+			free(batch.entries[i].dest);
+		free(batch.entries);
+
+		for (i = 0; i < (int)ARRAY_SIZE(rules); i++) {
+			for (j = 0; j < MAX_MNT_ELEMENTS; j++)
+				free(rules[i].controllers[j]);
+		}
+
+		cg_free_path_prefix_table();
+
+		ASSERT_EQ(nftw(PARENT_DIR, unlink_cb, 64, FTW_DEPTH | FTW_PHYS), 0);
+	}
+};
+
+TEST_F(BatchApplyTest, GroupByDestination)
+{
+	AddEntry(&rules[0], "a", 1003);
+	AddEntry(&rules[2], "b", 1001);
+	AddEntry(&rules[1], "a", 1004);
+	AddEntry(&rules[0], "a", 1002);
+	AddEntry(&rules[2], "b", 1005);
+
+	ASSERT_EQ(cg_batch_apply(&batch, 0), 0);
+
+	/* In the order of the batch, the same destination in another hierarchy apart */
+	ASSERT_EQ(ReadProcs("cpu", "a"), "10031002");
+	ASSERT_EQ(ReadProcs("memory", "a"), "1004");
+	ASSERT_EQ(ReadProcs("cpu", "b"), "10011005");
+}
+
+TEST_F(BatchApplyTest, Controllers)
+{
+	struct cgroup_rule both;
+
+	/* Both hierarchies of a rule */
+	memset(&both, 0, sizeof(both));
+	SetRule(&both, "a", "cpu", "memory");
+
+	AddEntry(&both, "a", 1001);
+	AddEntry(&both, "a", 1002);
+
+	ASSERT_EQ(cg_batch_apply(&batch, 0), 0);
+	ASSERT_EQ(ReadProcs("cpu", "a"), "10011002");
+	ASSERT_EQ(ReadProcs("memory", "a"), "10011002");
+
+	free(both.controllers[0]);
+	free(both.controllers[1]);
+}
+
+TEST_F(BatchApplyTest, MissingGroup)
+{
+	struct cgroup_rule missing;
+
+	memset(&missing, 0, sizeof(missing));
+	SetRule(&missing, "nosuchgroup", "cpu", NULL);
+
+	AddEntry(&missing, "nosuchgroup", 1001);
+	AddEntry(&rules[2], "b", 1002);
+
+	/* The other destinations are still written */
+	ASSERT_EQ(cg_batch_apply(&batch, 0), ECGROUPNOTEXIST);
+	ASSERT_EQ(ReadProcs("cpu", "b"), "1002");
+
+	free(missing.controllers[0]);
+}
+
+TEST_F(BatchApplyTest, SweepMatch)
+{
+	struct cgroup_sweep_stats stats;
+	pid_t pids[301];
+	int ret, i;
+
+	for (i = 0; i < 300; i++)
+		pids[i] = getpid();
+	/* Greater than the largest pid_max, like a process that exited */
+	pids[300] = 4194305;
+
+	/* The rules of the test process */
+	snprintf(rules[0].username, sizeof(rules[0].username), "test030");
+	rules[0].uid = geteuid();
+	rules[0].gid = CGRULE_INVALID;
+	rl.head = rl.tail = &rules[0];
+	rl.len = 1;
+
+	/* Five chunks of PIDs, enough for four threads */
+	memset(&stats, 0, sizeof(stats));
+	ret = cg_sweep_match(pids, 301, 4, &batch, &stats);
+	memset(&rl, 0, sizeof(rl));
+	ASSERT_EQ(ret, 0);
+	ASSERT_EQ(stats.threads, 4);
+	ASSERT_EQ(stats.procs, 300UL);
+	ASSERT_EQ(batch.cnt, 300);
+	for (i = 0; i < batch.cnt; i++) {
+		ASSERT_EQ(batch.entries[i].pos, i);
+		ASSERT_EQ(batch.entries[i].pid, getpid());
+		ASSERT_EQ(batch.entries[i].rule, &rules[0]);
+		ASSERT_STREQ(batch.entries[i].dest, "a");
+	}
+
+	for (i = 0; i < batch.cnt; i++)
+		free(batch.entries[i].dest);
+	free(batch.entries);
+	memset(&batch, 0, sizeof(batch));
+
+	/* No more threads than chunks */
+	memset(&stats, 0, sizeof(stats));
+	ASSERT_EQ(cg_sweep_match(&pids[299], 2, 0, &batch, &stats), 0);
+	ASSERT_EQ(stats.threads, 1);
+	ASSERT_EQ(stats.procs, 1UL);
+	/* No rule matches without rules */
+	ASSERT_EQ(batch.cnt, 0);
+}
+
+TEST_F(BatchApplyTest, SweepKernelThreads)
+{
+	struct cgroup_sweep_stats stats;
+	pid_t pids[2] = { getpid(), 2 };
+	char buf[64] = { 0 };
+	FILE *f;
+
+	/* kthreadd is only seen from the initial PID namespace */
+	f = fopen("/proc/2/stat", "r");
+	if (!f || !fgets(buf, sizeof(buf), f) || !strstr(buf, "(kthreadd)")) {
+		if (f)
+			fclose(f);
+		GTEST_SKIP() << "kthreadd isn't visible";
+	}
+	fclose(f);
+
+	/* A catch-all rule */
+	snprintf(rules[0].username, sizeof(rules[0].username), "*");
+	rules[0].uid = CGRULE_WILD;
+	rules[0].gid = CGRULE_WILD;
+	rl.head = rl.tail = &rules[0];
+	rl.len = 1;
+
+	memset(&stats, 0, sizeof(stats));
+	ASSERT_EQ(cg_sweep_match(pids, 2, 1, &batch, &stats), 0);
+	memset(&rl, 0, sizeof(rl));
+	ASSERT_EQ(stats.procs, 2UL);
+	ASSERT_EQ(batch.cnt, 1);
+	ASSERT_EQ(batch.entries[0].pid, getpid());
+}
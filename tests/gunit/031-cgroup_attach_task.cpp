@@ -0,0 +1,245 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/**
+ * libcgroup googletest for the number of writes done by
+ * cgroup_change_cgroup_path(), cgroup_attach_task_pid() and cgroup_attach_tasks()
+ */
+
+#include <string>
+#include <thread>
+#include <mutex>
+using namespace std;
+
+#include <dirent.h>
+#include <ftw.h>
+
+#include "gtest/gtest.h"
+
+#include "libcgroup-internal.h"
+
+static const char * const PARENT_DIR = "test031cgroup";
+static const mode_t MODE = S_IRWXU | S_IRWXG | S_IRWXO;
+
+static const char * const CONTROLLERS[] = { "cpu", "memory", NULL };
+
+class AttachTaskTest : public ::testing::Test {
+	protected:
+
+	char v2_mount_path[FILENAME_MAX];
+	thread *sleeper = nullptr;
+	mutex lock;
+
+	void SetUp() override
+	{
+		ASSERT_EQ(cgroup_init(), 0);
+
+		ASSERT_EQ(mkdir(PARENT_DIR, MODE), 0);
+
+		memset(&cg_mount_table, 0, sizeof(cg_mount_table));
+		memset(&cg_namespace_table, 0, sizeof(cg_namespace_table));
+		memcpy(v2_mount_path, cg_cgroup_v2_mount_path, sizeof(v2_mount_path));
+
+		/* A second thread, written on its own to a tasks file */
+		lock.lock();
+		sleeper = new thread([this] { lock.lock(); lock.unlock(); });
+	}
+
+	/* Mount the controller on PARENT_DIR/dir */
+	void Mount(int i, const char * const name, const char * const dir,
+		   enum cg_version_t version)
+	{
+		char path[FILENAME_MAX];
+
+		snprintf(path, sizeof(path), "%s/%s", PARENT_DIR, dir);
+		mkdir(path, MODE);
+
+		snprintf(cg_mount_table[i].name, CONTROL_NAMELEN_MAX, "%s", name);
+		snprintf(cg_mount_table[i].mount.path, FILENAME_MAX, "%s", path);
+		cg_mount_table[i].version = version;
+
+		if (version == CGROUP_V2)
+			snprintf(cg_cgroup_v2_mount_path, FILENAME_MAX, "%s", path);
+	}
+
+	void CreateFile(const char * const dir, const char * const name,
+			const char * const content)
+	{
+		char path[FILENAME_MAX];
+		FILE *f;
+
+		snprintf(path, sizeof(path), "%s/%s/%s", PARENT_DIR, dir, name);
+		f = fopen(path, "w");
+		ASSERT_NE(f, nullptr);
+		fputs(content, f);
+		fclose(f);
+	}
+
+	void CreateGroup(const char * const dir, const char * const name,
+			 const char * const type)
+	{
+		char path[FILENAME_MAX];
+
+		snprintf(path, sizeof(path), "%s/%s/%s", PARENT_DIR, dir, name);
+		ASSERT_EQ(mkdir(path, MODE), 0);
+
+		snprintf(path, sizeof(path), "%s/%s", dir, name);
+		CreateFile(path, "tasks", "");
+		CreateFile(path, "cgroup.procs", "");
+		CreateFile(path, "cgroup.threads", "");
+		if (type)
+			CreateFile(path, "cgroup.type", type);
+	}
+
+	int ThreadCount(void)
+	{
+		struct dirent *ent;
+		int cnt = 0;
+		DIR *dir;
+
+		dir = opendir("/proc/self/task");
+		EXPECT_NE(dir, nullptr);
+		if (!dir)
+			return 0;
+		while ((ent = readdir(dir)) != NULL)
+			cnt += ent->d_name[0] != '.';
+		closedir(dir);
+
+		return cnt;
+	}
+
+	int Change(const char * const dest)
+	{
+		memset(&cg_attach_stats, 0, sizeof(cg_attach_stats));
+		EXPECT_EQ(cg_build_path_prefix_table(), 0);
+
+		return cgroup_change_cgroup_path(dest, getpid(), CONTROLLERS);
+	}
+
+	static int unlink_cb(const char *fpath, const struct stat *sb, int typeflag,
+			     struct FTW *ftwbuf)
+	{
+		return remove(fpath);
+	}
+
+	void TearDown() override
+	{
+		lock.unlock();
+		sleeper->join();
+		delete sleeper;
+
+		memcpy(cg_cgroup_v2_mount_path, v2_mount_path, sizeof(v2_mount_path));
+		cg_free_path_prefix_table();
+
+		ASSERT_EQ(nftw(PARENT_DIR, unlink_cb, 64, FTW_DEPTH | FTW_PHYS), 0);
+	}
+};
+
+TEST_F(AttachTaskTest, V1)
+{
+	Mount(0, "cpu", "cpu", CGROUP_V1);
+	Mount(1, "memory", "memory", CGROUP_V1);
+	CreateGroup("cpu", "a", NULL);
+	CreateGroup("memory", "a", NULL);
+
+	/* Every thread to the tasks file of each hierarchy */
+	ASSERT_EQ(Change("a"), 0);
+	ASSERT_GE(ThreadCount(), 2);
+	ASSERT_EQ(cg_attach_stats.writes, 2UL * ThreadCount());
+	ASSERT_EQ(cg_attach_stats.subtree_reads, 0UL);
+}
+
+TEST_F(AttachTaskTest, V1Comounted)
+{
+	Mount(0, "cpu", "cpu,memory", CGROUP_V1);
+	Mount(1, "memory", "cpu,memory", CGROUP_V1);
+	CreateGroup("cpu,memory", "a", NULL);
+
+	/* The controllers share the tasks file of the hierarchy */
+	ASSERT_EQ(Change("a"), 0);
+	ASSERT_EQ(cg_attach_stats.writes, (unsigned long)ThreadCount());
+}
+
+TEST_F(AttachTaskTest, V2)
+{
+	Mount(0, "cpu", "unified", CGROUP_V2);
+	Mount(1, "memory", "unified", CGROUP_V2);
+	CreateFile("unified", "cgroup.subtree_control", "cpu memory\n");
+	CreateGroup("unified", "a", "domain\n");
+
+	/* cgroup.procs moves the threads with the process */
+	ASSERT_EQ(Change("a"), 0);
+	ASSERT_EQ(cg_attach_stats.writes, 1UL);
+	ASSERT_EQ(cg_attach_stats.subtree_reads, 1UL);
+
+	memset(&cg_attach_stats, 0, sizeof(cg_attach_stats));
+	ASSERT_EQ(cgroup_attach_task_pid(NULL, getpid()), 0);
+	ASSERT_EQ(cg_attach_stats.writes, 1UL);
+}
+
+TEST_F(AttachTaskTest, V2Threaded)
+{
+	Mount(0, "cpu", "unified", CGROUP_V2);
+	Mount(1, "memory", "unified", CGROUP_V2);
+	CreateFile("unified", "cgroup.subtree_control", "cpu memory\n");
+	CreateGroup("unified", "a", "threaded\n");
+
+	/* cgroup.threads moves one thread */
+	ASSERT_EQ(Change("a"), 0);
+	ASSERT_EQ(cg_attach_stats.writes, (unsigned long)ThreadCount());
+	ASSERT_EQ(cg_attach_stats.subtree_reads, 1UL);
+}
+
+TEST_F(AttachTaskTest, V2NotEnabled)
+{
+	Mount(0, "cpu", "unified", CGROUP_V2);
+	Mount(1, "memory", "unified", CGROUP_V2);
+	/* A controller name within another one isn't enabled */
+	CreateFile("unified", "cgroup.subtree_control", "cpu xmemory\n");
+	CreateGroup("unified", "a", "domain\n");
+
+	ASSERT_EQ(Change("a"), ECGROUPNOTMOUNTED);
+	ASSERT_EQ(cg_attach_stats.writes, 0UL);
+}
+
+TEST_F(AttachTaskTest, AttachTasks)
+{
+	const pid_t pids[] = { 1001, 1002, 1003 };
+	struct cgroup *cgrp;
+	int errs[3];
+	char buf[32];
+	FILE *f;
+
+	Mount(0, "cpu", "cpu", CGROUP_V1);
+	Mount(1, "memory", "memory", CGROUP_V1);
+	CreateGroup("cpu", "a", NULL);
+	CreateGroup("memory", "a", NULL);
+	ASSERT_EQ(cg_build_path_prefix_table(), 0);
+
+	cgrp = cgroup_new_cgroup("a");
+	ASSERT_NE(cgrp, nullptr);
+	ASSERT_NE(cgroup_add_controller(cgrp, "cpu"), nullptr);
+	ASSERT_NE(cgroup_add_controller(cgrp, "memory"), nullptr);
+
+	/* One open of each cgroup.procs, the PIDs back to back */
+	memset(&cg_attach_stats, 0, sizeof(cg_attach_stats));
+	ASSERT_EQ(cgroup_attach_tasks(cgrp, pids, 3, CGROUP_ATTACH_PROCS, errs), 0);
+	ASSERT_EQ(cg_attach_stats.writes, 6UL);
+	ASSERT_EQ(errs[0] | errs[1] | errs[2], 0);
+
+	f = fopen((string(PARENT_DIR) + "/memory/a/cgroup.procs").c_str(), "r");
+	ASSERT_NE(f, nullptr);
+	ASSERT_NE(fgets(buf, sizeof(buf), f), nullptr);
+	fclose(f);
+	ASSERT_STREQ(buf, "100110021003");
+	cgroup_free(&cgrp);
+
+	/* Every PID fails with the group */
+	cgrp = cgroup_new_cgroup("nosuchgroup");
+	ASSERT_NE(cgrp, nullptr);
+	ASSERT_NE(cgroup_add_controller(cgrp, "cpu"), nullptr);
+	ASSERT_EQ(cgroup_attach_tasks(cgrp, pids, 3, 0, errs), ECGROUPNOTEXIST);
+	ASSERT_EQ(errs[0], ENOENT);
+	ASSERT_EQ(errs[2], ENOENT);
+	cgroup_free(&cgrp);
+
+	ASSERT_EQ(cgroup_attach_tasks(NULL, NULL, 1, 0, NULL), ECGINVAL);
+}
@@ -0,0 +1,287 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/**
+ * libcgroup googletest for cgroup_spawn() on cgroup v1, where the child is
+ * moved before it runs the program, and on a fake cgroup v2 hierarchy
+ */
+
+#include <string>
+using namespace std;
+
+#include <ftw.h>
+#include <limits.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include <linux/sched.h>
+
+#include "gtest/gtest.h"
+
+#include "libcgroup-internal.h"
+
+static const char * const PARENT_DIR = "test032cgroup";
+static const mode_t MODE = S_IRWXU | S_IRWXG | S_IRWXO;
+
+static const char * const CONTROLLERS[] = { "cpu", NULL };
+
+class SpawnTest : public ::testing::Test {
+	protected:
+
+	struct cgroup_spawn_dest dest;
+	struct cgroup_spawn_opts opts;
+
+	void SetUp() override
+	{
+		char path[FILENAME_MAX];
+		FILE *f;
+
+		ASSERT_EQ(cgroup_init(), 0);
+
+		ASSERT_EQ(mkdir(PARENT_DIR, MODE), 0);
+		snprintf(path, sizeof(path), "%s/cpu", PARENT_DIR);
+		ASSERT_EQ(mkdir(path, MODE), 0);
+		snprintf(path, sizeof(path), "%s/cpu/a", PARENT_DIR);
+		ASSERT_EQ(mkdir(path, MODE), 0);
+		snprintf(path, sizeof(path), "%s/cpu/a/tasks", PARENT_DIR);
+		f = fopen(path, "w");
+		ASSERT_NE(f, nullptr);
+		fclose(f);
+
+		memset(&cg_mount_table, 0, sizeof(cg_mount_table));
+		memset(&cg_namespace_table, 0, sizeof(cg_namespace_table));
+		snprintf(cg_mount_table[0].name, CONTROL_NAMELEN_MAX, "cpu");
+		snprintf(cg_mount_table[0].mount.path, FILENAME_MAX, "%s/cpu", PARENT_DIR);
+		cg_mount_table[0].version = CGROUP_V1;
+		ASSERT_EQ(cg_build_path_prefix_table(), 0);
+
+		dest.path = "a";
+		dest.controllers = CONTROLLERS;
+
+		memset(&opts, 0, sizeof(opts));
+		opts.dests = &dest;
+		opts.dest_cnt = 1;
+	}
+
+	/* The file gets each TID written back to back */
+	static string ReadTasks(void)
+	{
+		char buf[64] = { 0 };
+		string path;
+		FILE *f;
+
+		path = string(PARENT_DIR) + "/cpu/a/tasks";
+		f = fopen(path.c_str(), "r");
+		if (!f)
+			return "";
+		fread(buf, 1, sizeof(buf) - 1, f);
+		fclose(f);
+
+		return buf;
+	}
+
+	static int Prepare(pid_t pid, void *arg)
+	{
+		/* The child is in its control group already */
+		*(string *)arg = ReadTasks();
+
+		return 0;
+	}
+
+	static int PrepareFail(pid_t pid, void *arg)
+	{
+		return ECGFAIL;
+	}
+
+	static int unlink_cb(const char *fpath, const struct stat *sb, int typeflag,
+			     struct FTW *ftwbuf)
+	{
+		return remove(fpath);
+	}
+
+	void TearDown() override
+	{
+		cg_free_path_prefix_table();
+		cg_clone3_unsupported = 0;
+
+		ASSERT_EQ(nftw(PARENT_DIR, unlink_cb, 64, FTW_DEPTH | FTW_PHYS), 0);
+	}
+};
+
+TEST_F(SpawnTest, MoveBeforeExec)
+{
+	char *argv[] = { (char *)"sh", (char *)"-c", (char *)"exit 3", NULL };
+	string tasks;
+	int status;
+	int pidfd;
+	pid_t pid;
+
+	opts.prepare = Prepare;
+	opts.arg = &tasks;
+
+	ASSERT_EQ(cgroup_spawn("sh", argv, &opts, &pid, &pidfd), 0);
+	ASSERT_EQ(tasks, to_string(pid));
+
+	ASSERT_EQ(waitpid(pid, &status, 0), pid);
+	ASSERT_TRUE(WIFEXITED(status));
+	ASSERT_EQ(WEXITSTATUS(status), 3);
+	if (pidfd >= 0)
+		close(pidfd);
+}
+
+TEST_F(SpawnTest, Fork)
+{
+	char *argv[] = { (char *)"true", NULL };
+	int status;
+	pid_t pid;
+
+	/* A kernel without clone3() */
+	cg_clone3_unsupported = 1;
+
+	ASSERT_EQ(cgroup_spawn("true", argv, &opts, &pid, NULL), 0);
+	ASSERT_EQ(ReadTasks(), to_string(pid));
+	ASSERT_EQ(waitpid(pid, &status, 0), pid);
+	ASSERT_EQ(WEXITSTATUS(status), 0);
+}
+
+TEST_F(SpawnTest, Errors)
+{
+	char *argv[] = { (char *)"true", NULL };
+	pid_t pid;
+
+	/* The child has been reaped each time */
+	ASSERT_EQ(cgroup_spawn("/nonexistent", argv, &opts, &pid, NULL), ECGOTHER);
+	ASSERT_EQ(cgroup_get_last_errno(), ENOENT);
+	ASSERT_EQ(waitpid(-1, NULL, WNOHANG), -1);
+
+	opts.prepare = PrepareFail;
+	ASSERT_EQ(cgroup_spawn("true", argv, &opts, &pid, NULL), ECGFAIL);
+	ASSERT_EQ(waitpid(-1, NULL, WNOHANG), -1);
+	opts.prepare = NULL;
+
+	dest.path = "nosuchgroup";
+	ASSERT_EQ(cgroup_spawn("true", argv, &opts, &pid, NULL), ECGROUPNOTEXIST);
+	ASSERT_EQ(waitpid(-1, NULL, WNOHANG), -1);
+
+	ASSERT_EQ(cgroup_spawn("true", argv, NULL, &pid, NULL), ECGINVAL);
+}
+
+TEST_F(SpawnTest, CloneOnly)
+{
+	char *argv[] = { (char *)"true", NULL };
+	pid_t pid;
+
+	/* The child would be moved on cgroup v1 */
+	opts.spawn_flags = CGROUP_SPAWN_CLONE_ONLY;
+	ASSERT_EQ(cgroup_spawn("true", argv, &opts, &pid, NULL), ECGROUPUNSUPP);
+	ASSERT_EQ(waitpid(-1, NULL, WNOHANG), -1);
+	ASSERT_EQ(ReadTasks(), "");
+
+	cg_clone3_unsupported = 1;
+	ASSERT_EQ(cgroup_spawn("true", argv, &opts, &pid, NULL), ECGROUPUNSUPP);
+	ASSERT_EQ(waitpid(-1, NULL, WNOHANG), -1);
+}
+
+/*
+ * Whether clone3() takes CLONE_INTO_CGROUP: it then refuses a descriptor that
+ * isn't open, older kernels or a seccomp filter refuse the call or the flag
+ */
+static bool clone_into_cgroup_supported(void)
+{
+#ifdef CLONE_INTO_CGROUP
+	struct clone_args args;
+	pid_t pid;
+
+	memset(&args, 0, sizeof(args));
+	args.flags = CLONE_INTO_CGROUP;
+	args.exit_signal = SIGCHLD;
+	args.cgroup = INT_MAX;
+
+	pid = syscall(__NR_clone3, &args, sizeof(args));
+	if (pid == 0)
+		_exit(0);
+	if (pid > 0) {
+		waitpid(pid, NULL, 0);
+		return false;
+	}
+
+	return errno == EBADF;
+#else
+	return false;
+#endif
+}
+
+TEST_F(SpawnTest, CloneIntoCgroup)
+{
+	char *argv[] = { (char *)"true", NULL };
+	char path[FILENAME_MAX];
+	pid_t pid;
+	FILE *f;
+
+	if (!clone_into_cgroup_supported())
+		GTEST_SKIP() << "clone3() with CLONE_INTO_CGROUP is unavailable";
+
+	snprintf(path, sizeof(path), "%s/v2", PARENT_DIR);
+	ASSERT_EQ(mkdir(path, MODE), 0);
+	snprintf(path, sizeof(path), "%s/v2/a", PARENT_DIR);
+	ASSERT_EQ(mkdir(path, MODE), 0);
+	snprintf(path, sizeof(path), "%s/v2/cgroup.subtree_control", PARENT_DIR);
+	f = fopen(path, "w");
+	ASSERT_NE(f, nullptr);
+	fprintf(f, "cpu\n");
+	fclose(f);
+	snprintf(path, sizeof(path), "%s/v2/a/cgroup.procs", PARENT_DIR);
+	f = fopen(path, "w");
+	ASSERT_NE(f, nullptr);
+	fclose(f);
+
+	cg_free_path_prefix_table();
+	snprintf(cg_mount_table[0].mount.path, FILENAME_MAX, "%s/v2", PARENT_DIR);
+	cg_mount_table[0].version = CGROUP_V2;
+	ASSERT_EQ(cg_build_path_prefix_table(), 0);
+
+	/*
+	 * clone3() got the directory of the control group, which it refuses
+	 * as it isn't a real one.  The error of the control group doesn't
+	 * turn clone3() off.
+	 */
+	ASSERT_EQ(cgroup_spawn("true", argv, &opts, &pid, NULL), ECGROUPNOTALLOWED);
+	ASSERT_EQ(cgroup_get_last_errno(), EBADF);
+	ASSERT_EQ(waitpid(-1, NULL, WNOHANG), -1);
+	ASSERT_EQ(cg_clone3_unsupported, 0);
+}
+
+TEST_F(SpawnTest, ParentDeathSignal)
+{
+	char *argv[] = { (char *)"sleep", (char *)"10", NULL };
+	pid_t parent, pid;
+	int status;
+	int fds[2];
+
+	/* The child of the exiting parent is reparented to the test */
+	ASSERT_EQ(prctl(PR_SET_CHILD_SUBREAPER, 1), 0);
+	ASSERT_EQ(pipe(fds), 0);
+
+	opts.pdeathsig = SIGKILL;
+
+	parent = fork();
+	ASSERT_GE(parent, 0);
+	if (parent == 0) {
+		if (cgroup_spawn("sleep", argv, &opts, &pid, NULL) ||
+		    write(fds[1], &pid, sizeof(pid)) != sizeof(pid))
+			_exit(1);
+		_exit(0);
+	}
+
+	ASSERT_EQ(read(fds[0], &pid, sizeof(pid)), sizeof(pid));
+	close(fds[0]);
+	close(fds[1]);
+
+	ASSERT_EQ(waitpid(parent, &status, 0), parent);
+	ASSERT_EQ(WEXITSTATUS(status), 0);
+
+	ASSERT_EQ(waitpid(pid, &status, 0), pid);
+	ASSERT_TRUE(WIFSIGNALED(status));
+	ASSERT_EQ(WTERMSIG(status), SIGKILL);
+
+	ASSERT_EQ(prctl(PR_SET_CHILD_SUBREAPER, 0), 0);
+}